@@ -10,12 +10,14 @@
 #include <mutex>
 #include <condition_variable>
 #include <variant>
+#include <algorithm>
 
 template <typename T, size_t Capacity>
 class BlockingRingbuffer
 {
 	std::vector<T> ringBuffer;
 	size_t tailIndex = 0;
+	size_t capacity = Capacity;
 	std::mutex mutex;
 	std::condition_variable readySignal;
 	bool eof = false;
@@ -28,18 +30,31 @@ public:
 		return ringBuffer.size() - tailIndex;
 	}
 
-	void enqueue(T&& val) noexcept(noexcept(T(std::move(std::declval<T>()))))
+	/** Limit the number of queued elements to less than the default @em Capacity.
+	 * Must be called before the first element is enqueued. */
+	void setCapacity(size_t c) noexcept
 	{
+		std::lock_guard lock(mutex);
+		capacity = std::max(std::min(c, Capacity), size_t(1));
+	}
+
+	/** Add an element. If the buffer is full, the oldest element is discarded.
+	 * @return true if an element was discarded */
+	bool enqueue(T&& val) noexcept(noexcept(T(std::move(std::declval<T>()))))
+	{
+		bool discarded = false;
 		{
 			std::lock_guard lock(mutex);
 			ringBuffer.push_back(std::move(val));
-			if (size() > Capacity)
+			if (size() > capacity)
 			{
 				T discard = std::move(ringBuffer[tailIndex]);
 				++tailIndex;
+				discarded = true;
 			}
 		}
 		readySignal.notify_all();
+		return discarded;
 	}
 
 	std::variant<T, EndOfBuffer> dequeue() noexcept
@@ -62,6 +77,21 @@ public:
 		return val;
 	}
 
+	/** Discard all queued elements, e.g. those left after EOF.
+	 * @return the number of discarded elements */
+	size_t clear() noexcept
+	{
+		std::vector<T> discarded;
+		size_t count;
+		{
+			std::lock_guard lock(mutex);
+			count = size();
+			discarded.swap(ringBuffer);
+			tailIndex = 0;
+		}
+		return count;
+	}
+
 	void signalEOF() noexcept
 	{
 		{
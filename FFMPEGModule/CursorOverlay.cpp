@@ -0,0 +1,253 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#include "CursorOverlay.hpp"
+#include "VAAPICompositor.hpp" // createHardwareSource
+#include <algorithm> // min, max
+#include <cstdint>
+#include <cstring> // memset
+
+extern "C"
+{
+#include <libavutil/opt.h>
+#include <libavutil/hwcontext.h>
+#include <libavfilter/buffersrc.h>
+#include <libavfilter/buffersink.h>
+}
+
+namespace ffmpeg
+{
+
+static constexpr size_t BYTES_PER_PIXEL = 4;
+
+CursorOverlay::CursorOverlay(Rect sourceSize, Rect targetSize, AVBufferRef* vaapiDevice)
+: sourceSize(sourceSize),
+  targetSize(targetSize),
+  vaapiDevice(av_buffer_ref(vaapiDevice)),
+  surfaces{},
+  currentSurface(0),
+  filterGraph{},
+  mainSrcContext{},
+  cursorSrcContext{},
+  filterSinkContext{},
+  graphFramesContext{}
+{
+	if (!this->vaapiDevice)
+		throw LibAVException(AVERROR(ENOMEM), "Referencing the VAAPI device failed");
+}
+
+CursorOverlay::~CursorOverlay() noexcept
+{
+	if (filterGraph)
+		avfilter_graph_free(&filterGraph);
+	av_buffer_unref(&vaapiDevice);
+}
+
+void CursorOverlay::createSurfaces()
+{
+	AVBufferRef* hwFramesContext = av_hwframe_ctx_alloc(vaapiDevice);
+	if (!hwFramesContext)
+		throw LibAVException(AVERROR(ENOMEM), "Allocating the cursor frame pool failed");
+	auto hwCtx = reinterpret_cast<AVHWFramesContext*>(hwFramesContext->data);
+	hwCtx->format = AV_PIX_FMT_VAAPI;
+	hwCtx->sw_format = AV_PIX_FMT_BGRA;
+	hwCtx->width = targetSize.w;
+	hwCtx->height = targetSize.h;
+	int ret = av_hwframe_ctx_init(hwFramesContext);
+	if (ret < 0)
+	{
+		av_buffer_unref(&hwFramesContext);
+		throw LibAVException(ret, "Initializing the cursor frame pool failed");
+	}
+
+	// premultiplied transparent black
+	auto transparent = AVFrame_Heap(av_frame_alloc());
+	if (!transparent)
+	{
+		av_buffer_unref(&hwFramesContext);
+		throw LibAVException(AVERROR(ENOMEM), "Allocating the cursor surface content failed");
+	}
+	transparent->format = AV_PIX_FMT_BGRA;
+	transparent->width = targetSize.w;
+	transparent->height = targetSize.h;
+	ret = av_frame_get_buffer(transparent.get(), 0);
+	if (ret < 0)
+	{
+		av_buffer_unref(&hwFramesContext);
+		throw LibAVException(ret, "Allocating the cursor surface content failed");
+	}
+	std::memset(transparent->data[0], 0, transparent->linesize[0] * targetSize.h);
+
+	for (CursorSurface& surface : surfaces)
+	{
+		auto frame = AVFrame_Heap(av_frame_alloc());
+		ret = frame ? av_hwframe_get_buffer(hwFramesContext, frame.get(), 0) : AVERROR(ENOMEM);
+		if (ret >= 0)
+			ret = av_hwframe_transfer_data(frame.get(), transparent.get(), 0);
+		if (ret < 0)
+		{
+			av_buffer_unref(&hwFramesContext);
+			throw LibAVException(ret, "Allocating the cursor surface failed");
+		}
+		surface = {std::move(frame), {}, 0, 0, 0};
+	}
+	// the frames keep their own reference to the pool
+	av_buffer_unref(&hwFramesContext);
+}
+
+void CursorOverlay::drawOnSurface(CursorSurface& surface, const common::CursorImage& image, int64_t left, int64_t top)
+{
+	auto mapped = AVFrame_Heap(av_frame_alloc());
+	if (!mapped)
+		throw LibAVException(AVERROR(ENOMEM), "Allocating the cursor surface mapping failed");
+	mapped->format = AV_PIX_FMT_BGRA;
+	// also read, so drivers that can't map the surface directly copy its content instead of leaving it undefined
+	int ret = av_hwframe_map(mapped.get(), surface.frame.get(), AV_HWFRAME_MAP_READ | AV_HWFRAME_MAP_WRITE);
+	if (ret < 0)
+		throw LibAVException(ret, "Mapping the cursor surface failed");
+	uint8_t* pixels = mapped->data[0];
+	auto stride = static_cast<size_t>(mapped->linesize[0]);
+
+	// erase the cursor that was drawn before
+	const Area& old = surface.drawn;
+	for (unsigned int y = 0; y < old.h; ++y)
+		std::memset(pixels + (old.y + y) * stride + old.x * BYTES_PER_PIXEL, 0, old.w * BYTES_PER_PIXEL);
+	surface.drawn = {};
+
+	int64_t x0 = std::max<int64_t>(left, 0);
+	int64_t y0 = std::max<int64_t>(top, 0);
+	int64_t x1 = std::min<int64_t>(left + image.width, targetSize.w);
+	int64_t y1 = std::min<int64_t>(top + image.height, targetSize.h);
+	if (x1 > x0 && y1 > y0)
+	{
+		// the surface is transparent around the cursor, so its premultiplied pixels are copied instead of blended
+		bool swapRB = image.format == common::PixelFormat::RGBA || image.format == common::PixelFormat::RGBX;
+		bool opaque = image.format == common::PixelFormat::BGRX || image.format == common::PixelFormat::RGBX;
+		size_t imageStride = image.width * BYTES_PER_PIXEL;
+		for (int64_t y = y0; y < y1; ++y)
+		{
+			const uint8_t* src = image.pixels.get() + (y - top) * imageStride + (x0 - left) * BYTES_PER_PIXEL;
+			uint8_t* dst = pixels + y * stride + x0 * BYTES_PER_PIXEL;
+			for (int64_t x = x0; x < x1; ++x, src += BYTES_PER_PIXEL, dst += BYTES_PER_PIXEL)
+			{
+				dst[0] = swapRB ? src[2] : src[0];
+				dst[1] = src[1];
+				dst[2] = swapRB ? src[0] : src[2];
+				dst[3] = opaque ? 255 : src[3];
+			}
+		}
+		surface.drawn = {static_cast<unsigned int>(x0), static_cast<unsigned int>(y0),
+		                 static_cast<unsigned int>(x1 - x0), static_cast<unsigned int>(y1 - y0)};
+	}
+	surface.serial = image.serial;
+	surface.left = left;
+	surface.top = top;
+}
+
+void CursorOverlay::createFilterGraph(const AVFrame& main)
+{
+	if (filterGraph)
+		avfilter_graph_free(&filterGraph);
+	filterGraph = avfilter_graph_alloc();
+	if (!filterGraph)
+		throw LibAVException(AVERROR(ENOMEM), "Failed to allocate filter graph");
+
+	mainSrcContext = createHardwareSource(filterGraph, "main", targetSize, main.hw_frames_ctx);
+	cursorSrcContext = createHardwareSource(filterGraph, "cursor", targetSize, surfaces[0].frame->hw_frames_ctx);
+	int ret = avfilter_graph_create_filter(&filterSinkContext, avfilter_get_by_name("buffersink"), "out",
+	                                       nullptr, nullptr, filterGraph);
+	if (ret < 0)
+		throw LibAVException(ret, "Failed to create filter graph output");
+	AVPixelFormat allowedOutputPixFormats[] = { AV_PIX_FMT_VAAPI, AV_PIX_FMT_NONE };
+	ret = av_opt_set_int_list(filterSinkContext, "pix_fmts", allowedOutputPixFormats, AV_PIX_FMT_NONE, AV_OPT_SEARCH_CHILDREN);
+	if (ret < 0)
+		throw LibAVException(ret, "Failed to set output pixel format");
+
+	AVFilterInOut* cursorOutput = avfilter_inout_alloc();
+	cursorOutput->name = av_strdup("cursor");
+	cursorOutput->filter_ctx = cursorSrcContext;
+	cursorOutput->pad_idx = 0;
+	cursorOutput->next = nullptr;
+	AVFilterInOut* outputs = avfilter_inout_alloc();
+	outputs->name = av_strdup("main");
+	outputs->filter_ctx = mainSrcContext;
+	outputs->pad_idx = 0;
+	outputs->next = cursorOutput;
+
+	AVFilterInOut* graphInputs = avfilter_inout_alloc();
+	graphInputs->name = av_strdup("out");
+	graphInputs->filter_ctx = filterSinkContext;
+	graphInputs->pad_idx = 0;
+	graphInputs->next = nullptr;
+
+	// the cursor surface covers the whole frame, so the position never changes
+	ret = avfilter_graph_parse_ptr(filterGraph, "[main][cursor]overlay_vaapi=x=0:y=0[out]", &graphInputs, &outputs,
+	                               nullptr);
+	avfilter_inout_free(&graphInputs);
+	avfilter_inout_free(&outputs);
+	if (ret < 0)
+		throw LibAVException(ret, "Failed to parse filter graph");
+
+	ret = avfilter_graph_config(filterGraph, nullptr);
+	if (ret < 0)
+		throw LibAVException(ret, "Failed to configure filter graph");
+
+	graphFramesContext = main.hw_frames_ctx->data;
+}
+
+AVFrame_Heap CursorOverlay::drawCursor(AVFrame_Heap frame)
+{
+	const Cursor* cursor = getCursor(*frame);
+	if (!cursor || !cursor->visible || !cursor->image || !frame->hw_frames_ctx)
+		return frame;
+	const common::CursorImage& image = *cursor->image;
+
+	// the top left corner of the image on the scaled frame, at even coordinates like the chroma planes of NV12
+	int64_t left = ((int64_t(cursor->x) - cursor->hotspotX) * targetSize.w / sourceSize.w) & ~int64_t(1);
+	int64_t top = ((int64_t(cursor->y) - cursor->hotspotY) * targetSize.h / sourceSize.h) & ~int64_t(1);
+	if (left >= int64_t(targetSize.w) || top >= int64_t(targetSize.h)
+	    || left + image.width <= 0 || top + image.height <= 0)
+		return frame;
+
+	if (!surfaces[0].frame)
+		createSurfaces();
+	auto isDrawnOn = [&] (const CursorSurface& s)
+	{
+		return s.drawn.w > 0 && s.serial == image.serial && s.left == left && s.top == top;
+	};
+	if (!isDrawnOn(surfaces[currentSurface]))
+	{
+		// the previous frame might still be read from the current surface, so draw on the other one
+		currentSurface ^= 1;
+		if (!isDrawnOn(surfaces[currentSurface]))
+			drawOnSurface(surfaces[currentSurface], image, left, top);
+	}
+	AVFrame* cursorFrame = surfaces[currentSurface].frame.get();
+
+	if (!filterGraph || graphFramesContext != frame->hw_frames_ctx->data)
+		createFilterGraph(*frame);
+
+	// both inputs get the same timestamp, so the overlay outputs exactly one frame
+	cursorFrame->pts = frame->pts;
+	int err = av_buffersrc_add_frame_flags(mainSrcContext, frame.get(), AV_BUFFERSRC_FLAG_KEEP_REF);
+	if (err)
+		throw LibAVException(err, "Inserting frame into filter failed");
+	err = av_buffersrc_add_frame_flags(cursorSrcContext, cursorFrame, AV_BUFFERSRC_FLAG_KEEP_REF);
+	if (err)
+		throw LibAVException(err, "Inserting cursor into filter failed");
+
+	auto output = AVFrame_Heap(av_frame_alloc());
+	err = av_buffersink_get_frame(filterSinkContext, output.get());
+	if (err == AVERROR(EAGAIN))
+	{
+		// encode the frame without the cursor rather than dropping it
+		return frame;
+	}
+	if (err < 0)
+		throw LibAVException(err, "Extracting frame from filter failed");
+	return output;
+}
+
+}
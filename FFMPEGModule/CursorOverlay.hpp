@@ -0,0 +1,85 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#ifndef SCREENCAPTURE_CURSOROVERLAY_HPP
+#define SCREENCAPTURE_CURSOROVERLAY_HPP
+
+#include "libavcommon.hpp"
+
+extern "C"
+{
+#include <libavfilter/avfilter.h>
+}
+
+namespace ffmpeg
+{
+
+/** Draw the cursor attached to a scaled VAAPI frame (see getCursor()) on the GPU with an overlay_vaapi filter.
+ *
+ * The filter overlays a transparent surface of the frame size, so its graph is configured only once. Moving the cursor
+ * or changing its image only rewrites the pixels under the old and the new cursor position in that surface, which is
+ * mapped for this. Two surfaces are used alternately, so a surface is not written while the GPU may still be reading
+ * it for the previous frame. The position is scaled like the frame, the image keeps its size. */
+class SCW_EXPORT CursorOverlay
+{
+	/** An area of a cursor surface in pixels */
+	struct Area
+	{
+		unsigned int x;
+		unsigned int y;
+		unsigned int w;
+		unsigned int h;
+	};
+
+	struct CursorSurface
+	{
+		AVFrame_Heap frame;
+		/** the part of the surface that is not transparent */
+		Area drawn;
+		/** what is drawn there, to skip rewriting an unchanged cursor */
+		uint64_t serial;
+		int64_t left;
+		int64_t top;
+	};
+
+	Rect sourceSize;
+	Rect targetSize;
+	AVBufferRef* vaapiDevice;
+
+	CursorSurface surfaces[2];
+	/** the surface that was overlaid last */
+	size_t currentSurface;
+
+	AVFilterGraph* filterGraph;
+	AVFilterContext* mainSrcContext;
+	AVFilterContext* cursorSrcContext;
+	AVFilterContext* filterSinkContext;
+	/** the frame pool that the filter graph has been configured for */
+	const void* graphFramesContext;
+
+	void createSurfaces();
+	void drawOnSurface(CursorSurface& surface, const common::CursorImage& image, int64_t left, int64_t top);
+	void createFilterGraph(const AVFrame& main);
+
+public:
+	/** @param sourceSize the size of the frames that the cursor position refers to
+	 * @param targetSize the size of the scaled frames that the cursor is drawn on
+	 * @param vaapiDevice the VAAPI device of the frames */
+	CursorOverlay(Rect sourceSize, Rect targetSize, AVBufferRef* vaapiDevice);
+
+	CursorOverlay(const CursorOverlay&) = delete;
+	CursorOverlay& operator=(const CursorOverlay&) = delete;
+	~CursorOverlay() noexcept;
+
+	/** Draw the frame's cursor on it.
+	 * This function is NOT thread-safe.
+	 * @param frame a VAAPI frame of the target size
+	 * @return a new frame with the cursor, or the given frame if it has no visible cursor */
+	AVFrame_Heap drawCursor(AVFrame_Heap frame);
+};
+
+}
+
+#endif //SCREENCAPTURE_CURSOROVERLAY_HPP
@@ -4,6 +4,8 @@
    SPDX-License-Identifier: GPL-3.0-or-later
 *******************************************************************************/
 #include "FFmpegOutput.hpp"
+#include "../trace.hpp"
+#include <algorithm> // min
 #include <cstdio>
 #include <cstdarg>
 #include <chrono>
@@ -35,40 +37,246 @@ LibAVException::LibAVException(int errorCode, const char* messageFmtStr, ...)
 }
 
 FFmpegOutput::FFmpegOutput(std::unique_ptr<ThreadedVAAPIScaler> scaler,
+                           std::unique_ptr<ThreadedVAAPICompositor> compositor,
+                           std::unique_ptr<CursorOverlay> cursorOverlay,
                            std::unique_ptr<ThreadedVAAPIEncoder> encoder,
-                           std::unique_ptr<Muxer> muxer) noexcept
+                           std::unique_ptr<Muxer> muxer,
+                           PacketSink packetSink,
+                           std::shared_ptr<stats::PipelineStats> pipelineStats,
+                           CropRegion crop, bool cropByScaler) noexcept
 : muxer(std::move(muxer)),
   encoder(std::move(encoder)),
   scaler(std::move(scaler)),
-  lastPts{}
+  compositor(std::move(compositor)),
+  cursorOverlay(std::move(cursorOverlay)),
+  pipelineStats(std::move(pipelineStats)),
+  lastPts{},
+  crop(crop),
+  cropByScaler(cropByScaler)
 {
-	this->encoder->setFrameProcessedCallback([muxer = this->muxer.get()](AVPacket& p)
+	if (this->scaler)
+		this->scaler->setStats(this->pipelineStats, stats::Stage::SCALE);
+	if (this->compositor)
+		this->compositor->setStats(this->pipelineStats, stats::Stage::SCALE);
+	this->encoder->setStats(this->pipelineStats, stats::Stage::ENCODE);
+
+	this->encoder->setFrameProcessedCallback([muxer = this->muxer.get(), sink = std::move(packetSink),
+	                                          ps = this->pipelineStats.get(),
+	                                          bitrateWindowStart = int64_t(AV_NOPTS_VALUE),
+	                                          bitrateWindowBytes = uint64_t(0)](AVPacket& p) mutable
 	{
-		muxer->writePacket(p);
+		ps->framesEncoded.fetch_add(1, std::memory_order_relaxed);
+		ps->bytesEncoded.fetch_add(p.size, std::memory_order_relaxed);
+		// the bitrate is measured in stream time over windows of one second (the codec time base is microseconds)
+		if (bitrateWindowStart == AV_NOPTS_VALUE || p.pts < bitrateWindowStart)
+			bitrateWindowStart = p.pts;
+		bitrateWindowBytes += p.size;
+		int64_t windowLength = p.pts - bitrateWindowStart;
+		if (windowLength >= 1000000)
+		{
+			ps->encoderBitrate.store(bitrateWindowBytes * 8 * 1000000 / windowLength, std::memory_order_relaxed);
+			bitrateWindowStart = p.pts;
+			bitrateWindowBytes = 0;
+		}
+
+		if (sink)
+		{
+			// only reference the encoded data, the muxer below takes over the packet itself
+			AVPacket_Heap ref(av_packet_alloc());
+			if (!ref)
+				throw LibAVException(AVERROR(ENOMEM), "Allocating a packet reference failed");
+			int r = av_packet_ref(ref.get(), &p);
+			if (r < 0)
+				throw LibAVException(r, "Referencing encoded packet failed");
+			sink(std::move(ref));
+		}
+		if (muxer)
+		{
+			stats::StageTimer timer(ps, stats::Stage::MUX);
+			trace::Scope traceScope("mux", p.pts);
+			ps->bytesMuxed.fetch_add(p.size, std::memory_order_relaxed);
+			muxer->writePacket(p);
+		}
 	});
 
-	this->scaler->setFrameProcessedCallback([encoder = this->encoder.get()](AVFrame_Heap f)
+	auto scalingDone = [encoder = this->encoder.get(), overlay = this->cursorOverlay.get(),
+	                    ps = this->pipelineStats.get()](AVFrame_Heap f)
 	{
+		ps->framesScaled.fetch_add(1, std::memory_order_relaxed);
+		if (overlay)
+			f = overlay->drawCursor(std::move(f));
 		encoder->processFrame(std::move(f));
-	});
+	};
+	if (this->scaler)
+		this->scaler->setFrameProcessedCallback(scalingDone);
+	if (this->compositor)
+		this->compositor->setFrameProcessedCallback(scalingDone);
 }
 
 void FFmpegOutput::pushFrame(AVFrame_Heap frame)
 {
-	if (muxer->requiresStrictMonotonicTimestamps())
+	if (compositor)
+	{
+		pushFrame(0, std::move(frame));
+		return;
+	}
+	if (muxer && muxer->requiresStrictMonotonicTimestamps())
 	{
+		if (lastPts >= frame->pts && !frame->buf[0]) [[unlikely]]
+		{
+			// a cursor update is no captured frame, so it is not counted as a drop. The next frame shows the cursor.
+			return;
+		}
 		if (lastPts >= frame->pts) [[unlikely]]
 		{
 			av_log(nullptr, AV_LOG_DEBUG, "Dropping frame with non-strictly monotonic timestamp:"
 			                              "pts = %" PRIi64 ", previous pts: %" PRIi64 "\n",
 			       frame->pts, lastPts);
+			pipelineStats->drop(stats::DropReason::NON_MONOTONIC_TIMESTAMP);
+			trace::instant("drop: non-monotonic timestamp", frame->pts);
 			return;
 		}
 		lastPts = frame->pts;
 	}
+	trace::Scope traceScope("submit", frame->pts);
+	if (!cropFrame(*frame)) [[unlikely]]
+	{
+		av_log(nullptr, AV_LOG_WARNING, "Dropping %dx%d frame, the crop region at %u,%u lies outside of it\n",
+		       frame->width, frame->height, crop.x, crop.y);
+		trace::instant("drop: crop outside of frame", frame->pts);
+		return;
+	}
 	scaler->processFrame(std::move(frame));
 }
 
+void FFmpegOutput::pushFrame(size_t input, AVFrame_Heap frame)
+{
+	if (!compositor)
+	{
+		if (input != 0)
+			throw LibAVException(AVERROR(EINVAL), "Frame for input %zu, but the output has no canvas", input);
+		pushFrame(std::move(frame));
+		return;
+	}
+	// the compositor keeps the canvas timestamps increasing, so the inputs need no check
+	trace::Scope traceScope("submit", frame->pts);
+	frame->opaque = reinterpret_cast<void*>(static_cast<uintptr_t>(input));
+	compositor->processFrame(std::move(frame));
+}
+
+/** marks the opaque_ref buffers that hold a cursor */
+static const char cursorTag = 0;
+
+void attachCursor(AVFrame& frame, Cursor cursor)
+{
+	auto c = new Cursor(std::move(cursor));
+	auto deleter = [](void*, uint8_t* data)
+	{
+		delete reinterpret_cast<Cursor*>(data);
+	};
+	AVBufferRef* ref = av_buffer_create(reinterpret_cast<uint8_t*>(c), sizeof(Cursor), deleter,
+	                                    const_cast<char*>(&cursorTag), AV_BUFFER_FLAG_READONLY);
+	if (!ref)
+	{
+		delete c;
+		throw LibAVException(AVERROR(ENOMEM), "Attaching the cursor to a frame failed");
+	}
+	av_buffer_unref(&frame.opaque_ref);
+	frame.opaque_ref = ref;
+}
+
+const Cursor* getCursor(const AVFrame& frame) noexcept
+{
+	if (!frame.opaque_ref || av_buffer_get_opaque(frame.opaque_ref) != &cursorTag)
+		return nullptr;
+	return reinterpret_cast<const Cursor*>(frame.opaque_ref->data);
+}
+
+/** Attach the cursor of a captured frame, if it has one. Frames without cursor metadata stay as they are. */
+static void attachFrameCursor(AVFrame& f, const Cursor& cursor) noexcept
+{
+	if (!cursor.visible)
+		return;
+	try
+	{
+		attachCursor(f, cursor);
+	}
+	catch (const std::exception&)
+	{
+		// the frame is encoded without the cursor then
+	}
+}
+
+void FFmpegOutput::pushCursor(const Cursor& cursor, nanoseconds pts)
+{
+	pushCursor(0, cursor, pts);
+}
+
+void FFmpegOutput::pushCursor(size_t input, const Cursor& cursor, nanoseconds pts)
+{
+	if (!cursorOverlay)
+		return;
+	// a frame without pixels repeats the last one in the scaler or compositor
+	auto frame = AVFrame_Heap(av_frame_alloc());
+	if (!frame)
+		throw LibAVException(AVERROR(ENOMEM), "Allocating a cursor update failed");
+	frame->pts = duration_cast<microseconds>(pts).count();
+	attachCursor(*frame, cursor);
+	pushFrame(input, std::move(frame));
+}
+
+/** Set the crop fields of the frame, so the scaler only scales the cropped region. Invalid regions are ignored. */
+static void setFrameCrop(AVFrame& f, const common::CropRegion& crop) noexcept
+{
+	if (crop.size.w == 0 || crop.size.h == 0
+	    || uint64_t(crop.x) + crop.size.w > uint64_t(f.width) || uint64_t(crop.y) + crop.size.h > uint64_t(f.height))
+		return;
+	f.crop_left = crop.x;
+	f.crop_top = crop.y;
+	f.crop_right = f.width - crop.x - crop.size.w;
+	f.crop_bottom = f.height - crop.y - crop.size.h;
+}
+
+bool FFmpegOutput::cropFrame(AVFrame& frame) const
+{
+	if (crop.size.w == 0 || crop.size.h == 0)
+		return true;
+	CropRegion clipped = crop;
+	// frames without pixels only update the cursor and have no size to check
+	if (frame.buf[0])
+	{
+		// the stream may have been renegotiated to a smaller size than the one the crop region was checked against
+		auto width = static_cast<unsigned int>(frame.width);
+		auto height = static_cast<unsigned int>(frame.height);
+		if (crop.x >= width || crop.y >= height)
+			return false;
+		clipped.size.w = std::min(crop.size.w, width - crop.x);
+		clipped.size.h = std::min(crop.size.h, height - crop.y);
+	}
+	frame.crop_left = frame.crop_top = frame.crop_right = frame.crop_bottom = 0;
+	if (cropByScaler)
+	{
+		// the GPU reads only the region while scaling, and moves the cursor with it
+		setFrameCrop(frame, clipped);
+		return true;
+	}
+	if (frame.buf[0])
+	{
+		// all supported pixel formats have 4 bytes per pixel
+		frame.data[0] += clipped.y * frame.linesize[0] + clipped.x * 4;
+		frame.width = static_cast<int>(clipped.size.w);
+		frame.height = static_cast<int>(clipped.size.h);
+	}
+	if (const Cursor* cursor = getCursor(frame))
+	{
+		Cursor moved = *cursor;
+		moved.x -= static_cast<int32_t>(clipped.x);
+		moved.y -= static_cast<int32_t>(clipped.y);
+		attachCursor(frame, std::move(moved));
+	}
+	return true;
+}
+
 AVFrame* wrapInAVFrame(std::unique_ptr<MemoryFrame> frame) noexcept
 {
 	auto f = av_frame_alloc();
@@ -78,6 +286,8 @@ AVFrame* wrapInAVFrame(std::unique_ptr<MemoryFrame> frame) noexcept
 	f->data[0] = static_cast<uint8_t*>(frame->memory) + frame->offset;
 	f->linesize[0] = frame->stride;
 	f->pts = duration_cast<microseconds>(frame->pts).count();
+	setFrameCrop(*f, frame->crop);
+	attachFrameCursor(*f, frame->cursor);
 
 	// custom deleter frees the MemoryFrame which owns the memory of this AVFrame
 	auto frameDeleter = [](void* u, uint8_t*)
@@ -101,16 +311,19 @@ AVFrame* wrapInAVFrame(std::unique_ptr<DmaBufFrame> frame) noexcept
 
 	// copy over the information about the DRM PRIME file descriptor and the frame properties
 	auto* d = new AVDRMFrameDescriptor;
-	d->nb_objects = 1;
-	d->objects[0].fd = frame->drmObject.fd;
-	d->objects[0].size = frame->drmObject.totalSize;
-	d->objects[0].format_modifier = frame->drmObject.modifier;
+	d->nb_objects = static_cast<int>(frame->objectCount);
+	for (uint32_t i = 0; i < frame->objectCount; ++i)
+	{
+		d->objects[i].fd = frame->drmObjects[i].fd;
+		d->objects[i].size = frame->drmObjects[i].totalSize;
+		d->objects[i].format_modifier = frame->drmObjects[i].modifier;
+	}
 	d->nb_layers = 1;
 	d->layers[0].format = frame->drmFormat;
 	d->layers[0].nb_planes = frame->planeCount;
 	for (uint32_t i = 0; i < d->layers[0].nb_planes; ++i)
 	{
-		d->layers[0].planes[i].object_index = 0;
+		d->layers[0].planes[i].object_index = static_cast<int>(frame->planes[i].objectIndex);
 		d->layers[0].planes[i].offset = frame->planes[i].offset;
 		d->layers[0].planes[i].pitch = frame->planes[i].pitch;
 	}
@@ -122,6 +335,8 @@ AVFrame* wrapInAVFrame(std::unique_ptr<DmaBufFrame> frame) noexcept
 	f->width = frame->width;
 	f->height = frame->height;
 	f->pts = duration_cast<microseconds>(frame->pts).count();
+	setFrameCrop(*f, frame->crop);
+	attachFrameCursor(*f, frame->cursor);
 
 	// custom deleter frees the DmaBufFrame which owns the file descriptor of this AVFrame
 	auto frameDeleter = [](void* userData, uint8_t* bufData)
@@ -158,11 +373,44 @@ FFmpegOutput::Builder::Builder(Rect sourceSize, PixelFormat sourceFormat, bool i
 : sourceSize(sourceSize),
   sourceFormat(sourceFormat),
   isSourceDrmPrime(isDrmPrime),
-  targetSize(sourceSize),
+  targetSize{},
   codecOptions{},
   codec(Codec::H264),
-  hwDevicePath("/dev/dri/renderD128")
+  lowLatency(false),
+  hwDevicePath("/dev/dri/renderD128"),
+  canvasFramerate(60),
+  drawCursor(false),
+  crop{}
+{
+}
+
+FFmpegOutput::Builder::Builder(const Builder& o)
+: sourceSize(o.sourceSize),
+  sourceFormat(o.sourceFormat),
+  isSourceDrmPrime(o.isSourceDrmPrime),
+  targetSize(o.targetSize),
+  codecOptions{},
+  codec(o.codec),
+  lowLatency(o.lowLatency),
+  outputFormat(o.outputFormat),
+  outputPath(o.outputPath),
+  hwDevicePath(o.hwDevicePath),
+  packetSink(o.packetSink),
+  pipelineStats(o.pipelineStats),
+  scalerThreadConfig(o.scalerThreadConfig),
+  encoderThreadConfig(o.encoderThreadConfig),
+  canvasInputs(o.canvasInputs),
+  canvasFramerate(o.canvasFramerate),
+  drawCursor(o.drawCursor),
+  crop(o.crop)
 {
+	int ret = av_dict_copy(&codecOptions, o.codecOptions, 0);
+	if (ret < 0)
+	{
+		// the destructor does not run for a constructor that throws
+		av_dict_free(&codecOptions);
+		throw LibAVException(ret, "Copying the codec options failed");
+	}
 }
 
 FFmpegOutput::Builder::~Builder() noexcept
@@ -177,22 +425,57 @@ FFmpegOutput FFmpegOutput::Builder::build()
 		throw LibAVException(AVERROR(EINVAL),
 		                     "Source frame dimensions must not be zero, got %ux%u", sourceSize.w, sourceSize.h);
 	}
-	if (targetSize.w == 0 || targetSize.h == 0)
+	bool isCropped = crop.size.w != 0 || crop.size.h != 0;
+	if (isCropped && (crop.size.w == 0 || crop.size.h == 0
+	                  || uint64_t(crop.x) + crop.size.w > sourceSize.w || uint64_t(crop.y) + crop.size.h > sourceSize.h))
+	{
+		throw LibAVException(AVERROR(EINVAL), "Crop region of %ux%u at %u,%u is empty or exceeds the %ux%u source",
+		                     crop.size.w, crop.size.h, crop.x, crop.y, sourceSize.w, sourceSize.h);
+	}
+	if (isCropped && !canvasInputs.empty())
+	{
+		throw LibAVException(AVERROR(EINVAL), "Cropping is not supported with a canvas");
+	}
+	// memory frames are cropped before the scaler, DRM PRIME frames by it
+	Rect scalerSize = isCropped && !isSourceDrmPrime ? crop.size : sourceSize;
+	Rect encodedSize = targetSize;
+	if (targetSize.w == 0 && targetSize.h == 0)
+		encodedSize = isCropped ? crop.size : sourceSize;
+	if (encodedSize.w == 0 || encodedSize.h == 0)
 	{
 		throw LibAVException(AVERROR(EINVAL),
 		                     "Scaled frame dimensions must not be zero, got %ux%u", targetSize.w, targetSize.h);
 	}
-	if (outputFormat.empty() && outputPath.empty())
+	if (outputFormat.empty() && outputPath.empty() && !packetSink)
 	{
-		throw LibAVException(AVERROR(EINVAL), "Neither output format nor output path specified");
+		throw LibAVException(AVERROR(EINVAL), "Neither output format nor output path nor packet sink specified");
 	}
 	if (hwDevicePath.empty())
 	{
 		throw LibAVException(AVERROR(EINVAL), "No hardware device path specified");
 	}
+	for (const CanvasInput& in : canvasInputs)
+	{
+		if (in.size.w == 0 || in.size.h == 0 || in.x >= sourceSize.w || in.y >= sourceSize.h)
+		{
+			throw LibAVException(AVERROR(EINVAL), "Canvas input of %ux%u at %u,%u is empty or outside of the %ux%u canvas",
+			                     in.size.w, in.size.h, in.x, in.y, sourceSize.w, sourceSize.h);
+		}
+	}
 
 	initFFmpeg();
 
+	if (lowLatency)
+	{
+		// only set these if the user did not choose other values
+		// no B-frames, so frames don't wait for future reference frames
+		av_dict_set(&codecOptions, "bf", "0", AV_DICT_DONT_OVERWRITE);
+		// don't queue multiple frames inside the VAAPI encoder
+		av_dict_set(&codecOptions, "async_depth", "1", AV_DICT_DONT_OVERWRITE);
+		// multiple slices can be encoded and decoded in parallel
+		av_dict_set(&codecOptions, "slices", "4", AV_DICT_DONT_OVERWRITE);
+	}
+
 	int r;
 	AVBufferRef* drmDevice {};
 	AVBufferRef* vaapiDevice {};
@@ -207,18 +490,56 @@ FFmpegOutput FFmpegOutput::Builder::build()
 		if (r < 0)
 			throw LibAVException(r, "Creating a VAAPI device from DRM node failed");
 
-		auto encoder = std::make_unique<ThreadedVAAPIEncoder>(targetSize.w, targetSize.h, &codecOptions, vaapiDevice, codec);
+		auto encoder = std::make_unique<ThreadedVAAPIEncoder>(encodedSize.w, encodedSize.h, &codecOptions, vaapiDevice, codec);
+
+		std::unique_ptr<Muxer> muxer;
+		if (!outputFormat.empty() || !outputPath.empty())
+		{
+			muxer = std::make_unique<Muxer>(outputPath,
+					outputFormat, encoder->unwrap().getCodecContext());
+		}
 
-		auto muxer = std::make_unique<Muxer>(outputPath,
-				outputFormat, encoder->unwrap().getCodecContext());
+		std::unique_ptr<ThreadedVAAPIScaler> scaler;
+		std::unique_ptr<ThreadedVAAPICompositor> compositor;
+		if (canvasInputs.empty())
+		{
+			scaler = std::make_unique<ThreadedVAAPIScaler>(scalerSize,
+					pixelFormat2AV(sourceFormat), encodedSize,
+					drmDevice, vaapiDevice, isSourceDrmPrime);
+			if (lowLatency)
+				scaler->setQueueCapacity(1);
+			if (scalerThreadConfig)
+				scaler->setThreadConfig(*scalerThreadConfig);
+		}
+		else
+		{
+			compositor = std::make_unique<ThreadedVAAPICompositor>(sourceSize, canvasInputs, encodedSize,
+					canvasFramerate, drmDevice, vaapiDevice);
+			if (lowLatency)
+				compositor->setQueueCapacity(1);
+			if (scalerThreadConfig)
+				compositor->setThreadConfig(*scalerThreadConfig);
+		}
 
-		auto scaler = std::make_unique<ThreadedVAAPIScaler>(sourceSize,
-				pixelFormat2AV(sourceFormat), targetSize,
-				drmDevice, vaapiDevice, isSourceDrmPrime);
+		if (lowLatency)
+			encoder->setQueueCapacity(1);
+		if (encoderThreadConfig)
+			encoder->setThreadConfig(*encoderThreadConfig);
+
+		std::unique_ptr<CursorOverlay> cursorOverlay;
+		if (drawCursor)
+		{
+			// cursor positions refer to the scaler's source size, which is the canvas with several inputs
+			cursorOverlay = std::make_unique<CursorOverlay>(scalerSize, encodedSize, vaapiDevice);
+			if (scaler)
+				scaler->unwrap().setKeepLastFrame(true);
+		}
 
 		av_buffer_unref(&vaapiDevice);
 		av_buffer_unref(&drmDevice);
-		return FFmpegOutput(std::move(scaler), std::move(encoder), std::move(muxer));
+		auto outputStats = pipelineStats ? pipelineStats : stats::PipelineStats::create();
+		return FFmpegOutput(std::move(scaler), std::move(compositor), std::move(cursorOverlay), std::move(encoder),
+		                    std::move(muxer), packetSink, std::move(outputStats), crop, isSourceDrmPrime);
 	}
 	catch (...)
 	{
@@ -228,4 +549,200 @@ FFmpegOutput FFmpegOutput::Builder::build()
 	}
 }
 
-}
\ No newline at end of file
+std::future<FFmpegOutput> FFmpegOutput::Builder::buildAsync()
+{
+	// the copy keeps its own codec options, which are consumed by build() on the other thread
+	return std::async(std::launch::async, [builder = Builder(*this)] () mutable
+	{
+		common::setCurrentThreadName("scw-build");
+		return builder.build();
+	});
+}
+
+}
+
+
+// C interface
+#include <module-ffmpeg.h>
+
+static constexpr inline ffmpeg::PixelFormat fromCFormat(::PixelFormat format)
+{
+	switch (format)
+	{
+		case PixelFormat::BGRA:
+			return ffmpeg::PixelFormat::BGRA;
+		case PixelFormat::RGBA:
+			return ffmpeg::PixelFormat::RGBA;
+		case PixelFormat::BGRX:
+			return ffmpeg::PixelFormat::BGRX;
+		case PixelFormat::RGBX:
+			return ffmpeg::PixelFormat::RGBX;
+	}
+	return ffmpeg::PixelFormat::BGRA;
+}
+
+static void releasePacket(void* opaque) noexcept
+{
+	auto p = static_cast<AVPacket*>(opaque);
+	av_packet_free(&p);
+}
+
+struct FFmpegOutput
+{
+	std::unique_ptr<ffmpeg::FFmpegOutput> cppOutput;
+	common::CursorFromC cursorConverter;
+};
+
+struct FFmpegOutput* FFmpegOutput_create(const struct FFmpegOutput_Options* options)
+{
+	try
+	{
+		ffmpeg::Rect sourceSize = {options->sourceSize.w, options->sourceSize.h};
+		auto builder = ffmpeg::FFmpegOutput::Builder(sourceSize, fromCFormat(options->sourceFormat), options->isDmaBuf);
+		if (options->targetSize.w != 0 && options->targetSize.h != 0)
+			builder.withScaling(ffmpeg::Rect{options->targetSize.w, options->targetSize.h});
+		if (options->hwDevicePath)
+			builder.withHWDevice(options->hwDevicePath);
+		if (options->outputFormat)
+			builder.withOutputFormat(options->outputFormat);
+		if (options->outputPath)
+			builder.withOutputPath(options->outputPath);
+		if (options->packetCallback)
+		{
+			builder.withPacketSink([cb = options->packetCallback, userData = options->packetCallbackUserData]
+			                       (ffmpeg::AVPacket_Heap p)
+			{
+				auto c_packet = static_cast<EncodedPacket*>(calloc(1, sizeof(EncodedPacket)));
+				if (!c_packet)
+					throw ffmpeg::LibAVException(AVERROR(ENOMEM), "Allocating an encoded packet failed");
+				c_packet->data = p->data;
+				c_packet->size = p->size;
+				c_packet->pts = p->pts;
+				c_packet->dts = p->dts;
+				c_packet->isKeyframe = (p->flags & AV_PKT_FLAG_KEY) != 0;
+
+				c_packet->opaque = p.release();
+				c_packet->release = &releasePacket;
+				cb(c_packet, userData);
+			});
+		}
+		if (options->statsName)
+			builder.withStats(stats::PipelineStats::find(options->statsName));
+		builder.withCursorOverlay(options->drawCursor);
+		if (options->crop.width != 0 || options->crop.height != 0)
+			builder.withCrop({options->crop.x, options->crop.y, {options->crop.width, options->crop.height}});
+		return new FFmpegOutput {
+			std::make_unique<ffmpeg::FFmpegOutput>(builder.build()),
+			{}
+		};
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return nullptr;
+	}
+}
+
+void FFmpegOutput_free(struct FFmpegOutput* output)
+{
+	delete output;
+}
+
+int FFmpegOutput_getExtradata(struct FFmpegOutput* output, const uint8_t** data, size_t* size)
+{
+	const AVCodecContext* codecContext = output->cppOutput->getCodecContext();
+	if (!codecContext->extradata)
+		return -1;
+	*data = codecContext->extradata;
+	*size = codecContext->extradata_size;
+	return 0;
+}
+
+int FFmpegOutput_pushMemoryFrame(struct FFmpegOutput* output, struct MemoryFrame* c_frame)
+{
+	try
+	{
+		auto frame = std::make_unique<common::MemoryFrame>();
+		frame->width = c_frame->width;
+		frame->height = c_frame->height;
+		frame->pts = nanoseconds(c_frame->pts);
+		frame->format = fromCFormat(c_frame->format);
+		frame->memory = c_frame->memory;
+		frame->stride = c_frame->stride;
+		frame->size = c_frame->size;
+		frame->offset = c_frame->offset;
+		frame->fd = c_frame->fd;
+		frame->fdOffset = c_frame->fdOffset;
+		frame->isSealed = c_frame->isSealed;
+		frame->crop = {c_frame->crop.x, c_frame->crop.y, {c_frame->crop.width, c_frame->crop.height}};
+		frame->cursor = output->cursorConverter.convert(c_frame->cursor);
+		frame->onFrameDone = [c_frame]()
+		{
+			freeMemoryFrame(c_frame);
+		};
+		output->cppOutput->pushFrame(ffmpeg::AVFrame_Heap(ffmpeg::wrapInAVFrame(std::move(frame))));
+		return 0;
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return -1;
+	}
+}
+
+int FFmpegOutput_pushDmaBufFrame(struct FFmpegOutput* output, struct DmaBufFrame* c_frame)
+{
+	try
+	{
+		auto frame = std::make_unique<common::DmaBufFrame>();
+		frame->width = c_frame->width;
+		frame->height = c_frame->height;
+		frame->pts = nanoseconds(c_frame->pts);
+		frame->drmFormat = c_frame->drmFormat;
+		if (c_frame->objectCount == 0 || c_frame->objectCount > 4 || c_frame->planeCount > 4)
+			throw ffmpeg::LibAVException(AVERROR(EINVAL), "DMA-BUF frame with %u objects and %u planes",
+			                             c_frame->objectCount, c_frame->planeCount);
+		frame->objectCount = c_frame->objectCount;
+		for (uint32_t i = 0; i < 4; ++i)
+		{
+			const auto& o = c_frame->drmObjects[i];
+			frame->drmObjects[i] = {o.fd, o.totalSize, o.modifier};
+		}
+		frame->planeCount = c_frame->planeCount;
+		for (uint32_t i = 0; i < 4; ++i)
+		{
+			const auto& p = c_frame->planes[i];
+			if (i < c_frame->planeCount && p.objectIndex >= c_frame->objectCount)
+				throw ffmpeg::LibAVException(AVERROR(EINVAL), "DMA-BUF plane %u refers to missing object %u",
+				                             i, p.objectIndex);
+			frame->planes[i] = {p.objectIndex, p.offset, p.pitch};
+		}
+		frame->crop = {c_frame->crop.x, c_frame->crop.y, {c_frame->crop.width, c_frame->crop.height}};
+		frame->cursor = output->cursorConverter.convert(c_frame->cursor);
+		frame->onFrameDone = [c_frame]()
+		{
+			freeDmaBufFrame(c_frame);
+		};
+		output->cppOutput->pushFrame(ffmpeg::AVFrame_Heap(ffmpeg::wrapInAVFrame(std::move(frame))));
+		return 0;
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return -1;
+	}
+}
+
+int FFmpegOutput_pushCursor(struct FFmpegOutput* output, const struct FrameCursor* cursor, int64_t pts)
+{
+	try
+	{
+		output->cppOutput->pushCursor(output->cursorConverter.convert(*cursor), nanoseconds(pts));
+		return 0;
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return -1;
+	}
+}
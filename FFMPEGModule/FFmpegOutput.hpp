@@ -10,28 +10,85 @@
 #include "libavcommon.hpp"
 #include "VAAPIEncoder.hpp"
 #include "VAAPIScaler.hpp"
+#include "VAAPICompositor.hpp"
+#include "CursorOverlay.hpp"
 #include "Muxer.hpp"
+#include "../stats.hpp"
 #include <string>
 #include <memory>
+#include <future>
+#include <optional>
 
 namespace ffmpeg
 {
 
+/** Receives every encoded packet of a FFmpegOutput.
+ * The packet references the encoder's buffer without copying it, and stays valid as long as you keep it.
+ * Timestamps are in the time base of the codec context (see FFmpegOutput::getCodecContext()).
+ * The sink is called on the encoder thread, so it should return quickly. */
+using PacketSink = std::function<void(AVPacket_Heap)>;
+
 class FFmpegOutput
 {
 	std::unique_ptr<Muxer> muxer;
 	std::unique_ptr<ThreadedVAAPIEncoder> encoder;
 	std::unique_ptr<ThreadedVAAPIScaler> scaler;
+	/** replaces the scaler when the output composes a canvas of several inputs */
+	std::unique_ptr<ThreadedVAAPICompositor> compositor;
+	/** draws the cursor on the scaled frames, on the thread of the scaler or compositor */
+	std::unique_ptr<CursorOverlay> cursorOverlay;
+	std::shared_ptr<stats::PipelineStats> pipelineStats;
 	int64_t lastPts;
+	/** the region of the frames to encode (see Builder::withCrop()), or 0x0 for all of it */
+	CropRegion crop;
+	/** DRM PRIME frames are cropped by the scaler, memory frames before they are uploaded */
+	bool cropByScaler;
 
 	FFmpegOutput(
 			std::unique_ptr<ThreadedVAAPIScaler> scaler,
+			std::unique_ptr<ThreadedVAAPICompositor> compositor,
+			std::unique_ptr<CursorOverlay> cursorOverlay,
 	        std::unique_ptr<ThreadedVAAPIEncoder> encoder,
-	        std::unique_ptr<Muxer> muxer) noexcept;
+	        std::unique_ptr<Muxer> muxer,
+	        PacketSink packetSink,
+	        std::shared_ptr<stats::PipelineStats> pipelineStats,
+	        CropRegion crop, bool cropByScaler) noexcept;
+
+	/** Crop the frame to the crop region, clipped to the frame.
+	 * @return false if the region lies outside of the frame, which should be dropped then */
+	bool cropFrame(AVFrame& frame) const;
 
 public:
+	/** Scale and encode a frame. With a canvas (see Builder::withCanvas()), this is a frame of the first input. */
 	SCW_EXPORT void pushFrame(AVFrame_Heap frame);
 
+	/** Compose the frame of one input into the canvas, and encode the canvas if the next one is due.
+	 * See Builder::withCanvas().
+	 * Unlike with pushFrame(AVFrame_Heap), the timestamps of different inputs may interleave, the canvas timestamps
+	 * are kept increasing. */
+	SCW_EXPORT void pushFrame(size_t input, AVFrame_Heap frame);
+
+	/** Encode the last frame again with a new cursor, e.g. from a pw::event::CursorMoved.
+	 * This does nothing unless the cursor is drawn, see Builder::withCursorOverlay(). The timestamp must be newer than
+	 * the last frame's, like that of a frame. */
+	SCW_EXPORT void pushCursor(const Cursor& cursor, std::chrono::nanoseconds pts);
+
+	/** Like pushCursor(const Cursor&, std::chrono::nanoseconds), for one input of a canvas */
+	SCW_EXPORT void pushCursor(size_t input, const Cursor& cursor, std::chrono::nanoseconds pts);
+
+	/** Get the opened encoder's context. It describes the encoded stream, e.g. its dimensions, time base and
+	 * the codec extradata (like H.264 SPS/PPS), which is available before the first packet is encoded. */
+	SCW_EXPORT const AVCodecContext* getCodecContext() const noexcept
+	{
+		return encoder->unwrap().getCodecContext();
+	}
+
+	/** Get the statistics this output counts its frames, packets and stage times in */
+	SCW_EXPORT const std::shared_ptr<stats::PipelineStats>& getStats() const noexcept
+	{
+		return pipelineStats;
+	}
+
 
 	class Builder
 	{
@@ -41,9 +98,18 @@ public:
 		Rect targetSize;
 		AVDictionary* codecOptions;
 		Codec codec;
+		bool lowLatency;
 		std::string outputFormat;
 		std::string outputPath;
 		std::string hwDevicePath;
+		PacketSink packetSink;
+		std::shared_ptr<stats::PipelineStats> pipelineStats;
+		std::optional<ThreadConfig> scalerThreadConfig;
+		std::optional<ThreadConfig> encoderThreadConfig;
+		std::vector<CanvasInput> canvasInputs;
+		unsigned int canvasFramerate;
+		bool drawCursor;
+		CropRegion crop;
 
 	public:
 		/** Create a builder first to create a FFmpegOutput object in a stepwise fashion.
@@ -56,6 +122,10 @@ public:
 		 */
 		SCW_EXPORT Builder(Rect sourceSize, PixelFormat sourceFormat, bool isDrmPrime) noexcept;
 
+		/** @throw std::bad_alloc or LibAVException if the options could not be copied */
+		SCW_EXPORT Builder(const Builder& o);
+		Builder& operator=(const Builder&) = delete;
+
 		SCW_EXPORT ~Builder() noexcept;
 
 		/** Encode on the device at this path.
@@ -68,7 +138,8 @@ public:
 			return *this;
 		}
 
-		/** Scale frames to the given size before encoding
+		/** Scale frames to the given size before encoding. By default, the frames keep the source size, or the size of
+		 * the region given to withCrop().
 		 * @param scaledSize The rectangle which specifies the width and height the scaled frames should have. Must each be larger than zero. */
 		SCW_EXPORT Builder& withScaling(Rect scaledSize) noexcept
 		{
@@ -96,6 +167,20 @@ public:
 			return *this;
 		}
 
+		/** Configure the pipeline for minimal latency between a captured frame and its encoded packet,
+		 * e.g. for remote control.
+		 * This disables B-frames, limits the encoder to one frame in flight and splits each frame into multiple slices,
+		 * unless these options are explicitly set with withCodecOptions().
+		 * The scaler and encoder queues hold only a single frame, so older frames are dropped instead of being delayed
+		 * when the GPU can't keep up.
+		 * Each packet is still output only after the whole frame has been encoded, as libavcodec does not provide
+		 * access to individual slices. */
+		SCW_EXPORT Builder& withLowLatency(bool enable = true) noexcept
+		{
+			lowLatency = enable;
+			return *this;
+		}
+
 		SCW_EXPORT Builder& withOutputFormat(std::string format) noexcept
 		{
 			outputFormat = std::move(format);
@@ -108,7 +193,82 @@ public:
 			return *this;
 		}
 
+		/** Pass every encoded packet to this sink, in addition to writing it to the output.
+		 * When a sink is set, output format and path are optional. If both are empty, no muxer is created and the
+		 * sink is the only consumer of the encoded packets. */
+		SCW_EXPORT Builder& withPacketSink(PacketSink sink) noexcept
+		{
+			packetSink = std::move(sink);
+			return *this;
+		}
+
+		/** Count statistics in the given pipeline, e.g. the one from PipeWireStream::getStats(), so that capture and
+		 * encoding show up together. By default, a new pipeline is registered for each output. */
+		SCW_EXPORT Builder& withStats(std::shared_ptr<stats::PipelineStats> stats) noexcept
+		{
+			pipelineStats = std::move(stats);
+			return *this;
+		}
+
+		/** Set CPU affinity and scheduling of the thread that uploads and scales frames.
+		 * Settings that are not permitted fall back to the defaults with a warning. */
+		SCW_EXPORT Builder& withScalerThreadConfig(ThreadConfig config) noexcept
+		{
+			scalerThreadConfig = std::move(config);
+			return *this;
+		}
+
+		/** Set CPU affinity and scheduling of the thread that encodes frames and writes the packets.
+		 * Settings that are not permitted fall back to the defaults with a warning. */
+		SCW_EXPORT Builder& withEncoderThreadConfig(ThreadConfig config) noexcept
+		{
+			encoderThreadConfig = std::move(config);
+			return *this;
+		}
+
+		/** Compose the frames of several inputs, e.g. all monitors of a pw::PipeWireStreamGroup, onto one canvas on the
+		 * GPU and encode it as a single video. The canvas has the source size given to the constructor, the source
+		 * format and DRM PRIME flag of the constructor are replaced by those of each input.
+		 * Push frames with pushFrame(size_t, AVFrame_Heap). Once every input has delivered its first frame, canvases are
+		 * encoded at the given frame rate at most, and frames in between only update the next canvas.
+		 * @param framerate the maximum number of canvases per second, or 0 for one canvas per frame of the first input,
+		 *     e.g. the monitor with the highest refresh rate
+		 * For memory frames, pw::CanvasCompositor composes on the CPU without this option, which avoids uploading
+		 * unchanged inputs again. */
+		SCW_EXPORT Builder& withCanvas(std::vector<CanvasInput> inputs, unsigned int framerate = 60) noexcept
+		{
+			canvasInputs = std::move(inputs);
+			canvasFramerate = framerate;
+			return *this;
+		}
+
+		/** Draw the cursor that the frames carry (see wrapInAVFrame() and CURSOR_MODE_META) on the GPU, after scaling.
+		 * Cursor updates without a frame are encoded by pushCursor(). Disabled by default. */
+		SCW_EXPORT Builder& withCursorOverlay(bool enable = true) noexcept
+		{
+			drawCursor = enable;
+			return *this;
+		}
+
+		/** Encode only a region of the source frames, e.g. one application on a large monitor.
+		 * Memory frames are pointed at the region before they are uploaded, so only its rows are transferred to the
+		 * GPU. DRM PRIME frames are mapped as a whole, and the scaler reads only the region. A crop region of the
+		 * frames themselves (see MemoryFrame::crop) is replaced by this one. Not available with withCanvas().
+		 * @param region the region in source frame coordinates. It must lie within the source size. */
+		SCW_EXPORT Builder& withCrop(CropRegion region) noexcept
+		{
+			crop = region;
+			return *this;
+		}
+
 		SCW_EXPORT FFmpegOutput build();
+
+		/** Like build(), but open the hardware device, encoder and muxer on a separate thread.
+		 * Use this to prepare the output while waiting for the first frame, e.g. after receiving
+		 * pw::event::FormatNegotiated. The builder is copied, so it may be modified or destroyed afterwards.
+		 * @return A future that holds the finished FFmpegOutput, or the exception build() would have thrown
+		 * @throw std::bad_alloc or LibAVException if the builder could not be copied */
+		SCW_EXPORT std::future<FFmpegOutput> buildAsync();
 	};
 };
 
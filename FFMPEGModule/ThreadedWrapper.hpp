@@ -8,7 +8,11 @@
 
 #include "libavcommon.hpp"
 #include "BlockingRingbuffer.hpp"
+#include "../stats.hpp"
+#include "../trace.hpp"
 #include <thread>
+#include <string>
+#include <optional>
 #include <exception>
 
 namespace ffmpeg
@@ -30,6 +34,9 @@ class ThreadedWrapper
 	std::thread thread;
 	std::exception_ptr threadException;
 	FrameProcessedCallback frameProcessedCallback;
+	std::shared_ptr<stats::PipelineStats> pipelineStats;
+	stats::Stage stage;
+	std::optional<common::ThreadConfig> threadConfig;
 
 	FrameProcessor wrapped;
 
@@ -37,12 +44,16 @@ class ThreadedWrapper
 	 * its @em processFrame method. */
 	void processFramesLoop() noexcept;
 
+	/** Drop the frames still waiting in the queue, and remove them from the queue depth of the stats */
+	void discardQueuedFrames() noexcept;
+
 	SCW_EXPORT void init();
 
 public:
 	template <typename... Args>
 	SCW_EXPORT ThreadedWrapper(Args&&... args)
-	: wrapped(std::forward<Args>(args)...)
+	: stage(stats::Stage::COUNT),
+	  wrapped(std::forward<Args>(args)...)
 	{
 		init();
 	}
@@ -55,6 +66,30 @@ public:
 		frameProcessedCallback = std::move(cb);
 	}
 
+	/** Limit the number of frames waiting in the thread queue. A smaller queue drops frames earlier when
+	 * the wrapped object can't keep up, but adds less latency. Call this before the first processFrame(). */
+	SCW_EXPORT void setQueueCapacity(size_t capacity) noexcept
+	{
+		queue.setCapacity(capacity);
+	}
+
+	/** Count queue depth, dropped frames and processing time of this thread as the given stage.
+	 * The thread is renamed after the stage. Call this before the first processFrame(). */
+	SCW_EXPORT void setStats(std::shared_ptr<stats::PipelineStats> s, stats::Stage st) noexcept
+	{
+		pipelineStats = std::move(s);
+		stage = st;
+		std::string name = std::string("scw-") + stats::toString(st);
+		common::setThreadName(thread, name.c_str());
+	}
+
+	/** Apply scheduling settings to this object's thread, when it takes the first frame from the queue.
+	 * Call this before the first processFrame(). */
+	SCW_EXPORT void setThreadConfig(common::ThreadConfig config) noexcept
+	{
+		threadConfig = std::move(config);
+	}
+
 	/** Get access to the wrapped object. */
 	SCW_EXPORT FrameProcessor& unwrap() noexcept { return wrapped; }
 	SCW_EXPORT const FrameProcessor& unwrap() const noexcept { return wrapped; }
@@ -0,0 +1,295 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#include "VAAPICompositor.hpp"
+#include <cstdio>
+#include <cstring> // memset
+#include <cstdint>
+#include <cinttypes> // PRIu64
+#include <chrono>
+#include <string>
+#include <algorithm> // all_of, max
+
+extern "C"
+{
+#include <libavutil/opt.h>
+#include <libavutil/hwcontext.h>
+#include <libavfilter/buffersrc.h>
+#include <libavfilter/buffersink.h>
+}
+
+using namespace std::chrono_literals;
+
+namespace ffmpeg
+{
+
+/** Allocate a VAAPI surface of the given size and fill it with black */
+static AVFrame_Heap createBackground(Rect size, AVBufferRef* vaapiDevice)
+{
+	AVBufferRef* hwFramesContext = av_hwframe_ctx_alloc(vaapiDevice);
+	if (!hwFramesContext)
+		throw LibAVException(AVERROR(ENOMEM), "Allocating the canvas frame pool failed");
+	auto hwCtx = reinterpret_cast<AVHWFramesContext*>(hwFramesContext->data);
+	hwCtx->format = AV_PIX_FMT_VAAPI;
+	hwCtx->sw_format = AV_PIX_FMT_NV12;
+	hwCtx->width = size.w;
+	hwCtx->height = size.h;
+	int ret = av_hwframe_ctx_init(hwFramesContext);
+	if (ret < 0)
+	{
+		av_buffer_unref(&hwFramesContext);
+		throw LibAVException(ret, "Initializing the canvas frame pool failed");
+	}
+	auto background = AVFrame_Heap(av_frame_alloc());
+	ret = av_hwframe_get_buffer(hwFramesContext, background.get(), 0);
+	// the frame keeps its own reference to the pool
+	av_buffer_unref(&hwFramesContext);
+	if (ret < 0)
+		throw LibAVException(ret, "Allocating the canvas failed");
+
+	// black in full range NV12, like the output of the scaler
+	auto black = AVFrame_Heap(av_frame_alloc());
+	black->format = AV_PIX_FMT_NV12;
+	black->width = size.w;
+	black->height = size.h;
+	ret = av_frame_get_buffer(black.get(), 0);
+	if (ret < 0)
+		throw LibAVException(ret, "Allocating the canvas background failed");
+	std::memset(black->data[0], 0, black->linesize[0] * size.h);
+	std::memset(black->data[1], 128, black->linesize[1] * ((size.h + 1) / 2));
+	ret = av_hwframe_transfer_data(background.get(), black.get(), 0);
+	if (ret < 0)
+		throw LibAVException(ret, "Uploading the canvas background failed");
+	return background;
+}
+
+AVFilterContext* createHardwareSource(AVFilterGraph* graph, const char* name, Rect size, AVBufferRef* hwFramesContext)
+{
+	char args[128];
+	std::snprintf(args, sizeof(args), "video_size=%dx%d:pix_fmt=%d:time_base=1/%" PRIu64 ":pixel_aspect=1/1",
+	              size.w, size.h, AV_PIX_FMT_VAAPI,
+	              std::chrono::duration_cast<std::chrono::microseconds>(1s).count());
+	AVFilterContext* src;
+	int ret = avfilter_graph_create_filter(&src, avfilter_get_by_name("buffer"), name, args, nullptr, graph);
+	if (ret < 0)
+		throw LibAVException(ret, "Failed to create filter graph input %s", name);
+
+	AVBufferSrcParameters* srcParams = av_buffersrc_parameters_alloc();
+	srcParams->hw_frames_ctx = hwFramesContext;
+	ret = av_buffersrc_parameters_set(src, srcParams);
+	av_free(srcParams);
+	if (ret < 0)
+		throw LibAVException(ret, "Failed to set the frame pool of filter graph input %s", name);
+	return src;
+}
+
+VAAPICompositor::VAAPICompositor(Rect canvasSize, const std::vector<CanvasInput>& inputs, Rect targetSize,
+                                 unsigned int framerate, AVBufferRef* drmDevice, AVBufferRef* vaapiDevice)
+: canvasSize(canvasSize),
+  targetSize(targetSize),
+  background(createBackground(canvasSize, vaapiDevice)),
+  filterGraph{},
+  backgroundSrcContext{},
+  filterSinkContext{},
+  lastPts(AV_NOPTS_VALUE),
+  // timestamps are in microseconds, see createHardwareSource()
+  frameInterval(framerate > 0 ? std::chrono::duration_cast<std::chrono::microseconds>(1s).count() / framerate : 0),
+  cursor{},
+  cursorInput(0)
+{
+	for (const CanvasInput& in : inputs)
+	{
+		CanvasInput placement = in;
+		placement.x &= ~1u;
+		placement.y &= ~1u;
+		this->inputs.push_back({placement,
+		                        VAAPIScaler(in.size, pixelFormat2AV(in.format), in.size, drmDevice, vaapiDevice, in.isDrmPrime),
+		                        nullptr, nullptr});
+	}
+}
+
+VAAPICompositor::VAAPICompositor(VAAPICompositor&& o) noexcept
+: inputs(std::move(o.inputs)),
+  canvasSize(o.canvasSize),
+  targetSize(o.targetSize),
+  background(std::move(o.background)),
+  filterGraph(o.filterGraph),
+  backgroundSrcContext(o.backgroundSrcContext),
+  filterSinkContext(o.filterSinkContext),
+  lastPts(o.lastPts),
+  frameInterval(o.frameInterval),
+  cursor(std::move(o.cursor)),
+  cursorInput(o.cursorInput)
+{
+	o.filterGraph = nullptr;
+	o.backgroundSrcContext = nullptr;
+	o.filterSinkContext = nullptr;
+}
+
+VAAPICompositor::~VAAPICompositor() noexcept
+{
+	if (filterGraph)
+		avfilter_graph_free(&filterGraph);
+}
+
+void VAAPICompositor::createFilterGraph()
+{
+	filterGraph = avfilter_graph_alloc();
+	if (!filterGraph)
+		throw LibAVException(AVERROR(ENOMEM), "Failed to allocate filter graph");
+
+	backgroundSrcContext = createHardwareSource(filterGraph, "background", canvasSize, background->hw_frames_ctx);
+	for (size_t i = 0; i < inputs.size(); ++i)
+	{
+		std::string name = "in" + std::to_string(i);
+		inputs[i].filterSrcContext = createHardwareSource(filterGraph, name.c_str(), inputs[i].placement.size,
+		                                                  inputs[i].latest->hw_frames_ctx);
+	}
+
+	int ret = avfilter_graph_create_filter(&filterSinkContext, avfilter_get_by_name("buffersink"), "out",
+	                                       nullptr, nullptr, filterGraph);
+	if (ret < 0)
+		throw LibAVException(ret, "Failed to create filter graph output");
+	AVPixelFormat allowedOutputPixFormats[] = { AV_PIX_FMT_VAAPI, AV_PIX_FMT_NONE };
+	ret = av_opt_set_int_list(filterSinkContext, "pix_fmts", allowedOutputPixFormats, AV_PIX_FMT_NONE, AV_OPT_SEARCH_CHILDREN);
+	if (ret < 0)
+		throw LibAVException(ret, "Failed to set output pixel format");
+
+	// connect the existing sources to the unconnected inputs of the parsed graph, the background first
+	AVFilterInOut* outputs = nullptr;
+	for (size_t i = inputs.size(); i > 0; --i)
+	{
+		AVFilterInOut* o = avfilter_inout_alloc();
+		o->name = av_strdup(("in" + std::to_string(i - 1)).c_str());
+		o->filter_ctx = inputs[i - 1].filterSrcContext;
+		o->pad_idx = 0;
+		o->next = outputs;
+		outputs = o;
+	}
+	AVFilterInOut* backgroundOutput = avfilter_inout_alloc();
+	backgroundOutput->name = av_strdup("background");
+	backgroundOutput->filter_ctx = backgroundSrcContext;
+	backgroundOutput->pad_idx = 0;
+	backgroundOutput->next = outputs;
+	outputs = backgroundOutput;
+
+	AVFilterInOut* graphInputs = avfilter_inout_alloc();
+	graphInputs->name = av_strdup("out");
+	graphInputs->filter_ctx = filterSinkContext;
+	graphInputs->pad_idx = 0;
+	graphInputs->next = nullptr;
+
+	// overlay each input on the result of the previous overlay, then scale the canvas
+	std::string filterGraphDesc;
+	std::string previous = "background";
+	for (size_t i = 0; i < inputs.size(); ++i)
+	{
+		std::string current = "canvas" + std::to_string(i);
+		filterGraphDesc += "[" + previous + "][in" + std::to_string(i) + "]overlay_vaapi="
+				+ "x=" + std::to_string(inputs[i].placement.x) + ":y=" + std::to_string(inputs[i].placement.y)
+				+ "[" + current + "];";
+		previous = current;
+	}
+	filterGraphDesc += "[" + previous + "]scale_vaapi=w=" + std::to_string(targetSize.w)
+			+ ":h=" + std::to_string(targetSize.h) + ":format=nv12:out_range=full[out]";
+
+	ret = avfilter_graph_parse_ptr(filterGraph, filterGraphDesc.c_str(), &graphInputs, &outputs, nullptr);
+	avfilter_inout_free(&graphInputs);
+	avfilter_inout_free(&outputs);
+	if (ret < 0)
+		throw LibAVException(ret, "Failed to parse filter graph");
+
+	ret = avfilter_graph_config(filterGraph, nullptr);
+	if (ret < 0)
+		throw LibAVException(ret, "Failed to configure filter graph");
+}
+
+void VAAPICompositor::composeFrame(AVFrame& frame, const CompositionDoneCallback& compositionDone)
+{
+	auto index = reinterpret_cast<uintptr_t>(frame.opaque);
+	if (index >= inputs.size())
+		throw LibAVException(AVERROR(EINVAL), "Frame for unknown canvas input %zu", static_cast<size_t>(index));
+	Input& input = inputs[index];
+	// a frame without pixels only updates the cursor
+	if (frame.buf[0])
+	{
+		input.converter.scaleFrame(frame, [&input] (AVFrame_Heap converted)
+		{
+			input.latest = std::move(converted);
+		});
+	}
+	const Cursor* inputCursor = getCursor(frame);
+	if (inputCursor && inputCursor->visible)
+	{
+		cursor = input.converter.cropCursor(*inputCursor);
+		cursor.x += static_cast<int32_t>(input.placement.x);
+		cursor.y += static_cast<int32_t>(input.placement.y);
+		cursorInput = index;
+	}
+	else if (index == cursorInput)
+	{
+		// the cursor left this input, but might have entered another one already
+		cursor.visible = false;
+	}
+
+	if (!std::all_of(inputs.begin(), inputs.end(), [] (const Input& in) { return in.latest != nullptr; }))
+		return;
+	// fold the updates of all inputs into one canvas per interval. The inputs' frames arrive with some jitter, so a
+	// canvas is due a little early, or a frame that is late by a few microseconds would be skipped for a whole interval.
+	bool isDue = frameInterval > 0
+			? lastPts == AV_NOPTS_VALUE || frame.pts - lastPts >= frameInterval - frameInterval / 4
+			: index == 0;
+	if (!isDue)
+		return;
+	if (!filterGraph)
+		createFilterGraph();
+
+	int64_t pts = frame.pts;
+	if (lastPts != AV_NOPTS_VALUE)
+		pts = std::max(pts, lastPts + 1);
+	lastPts = pts;
+
+	// all filter inputs get a frame with the same timestamp, so the overlays output exactly one canvas
+	auto addFrame = [pts] (AVFilterContext* src, const AVFrame* f)
+	{
+		auto ref = AVFrame_Heap(av_frame_clone(f));
+		if (!ref)
+			throw LibAVException(AVERROR(ENOMEM), "Referencing canvas input failed");
+		ref->pts = pts;
+		int err = av_buffersrc_add_frame_flags(src, ref.get(), 0);
+		if (err)
+			throw LibAVException(err, "Inserting frame into filter failed");
+	};
+	addFrame(backgroundSrcContext, background.get());
+	for (const Input& in : inputs)
+		addFrame(in.filterSrcContext, in.latest.get());
+
+	while (true)
+	{
+		auto canvas = AVFrame_Heap(av_frame_alloc());
+		int err = av_buffersink_get_frame(filterSinkContext, canvas.get());
+		if (err == AVERROR(EAGAIN))
+		{
+			break;
+		}
+		if (err < 0)
+		{
+			throw LibAVException(err, "Extracting frame from filter failed");
+		}
+		if (cursor.visible)
+			attachCursor(*canvas, cursor);
+		compositionDone(std::move(canvas));
+	}
+}
+
+}
+
+#include "ThreadedWrapper.inc"
+
+namespace ffmpeg
+{
+// instantiate code for template
+template class ThreadedWrapper<VAAPICompositor>;
+}
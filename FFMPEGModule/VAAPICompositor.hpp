@@ -0,0 +1,118 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#ifndef SCREENCAPTURE_VAAPICOMPOSITOR_HPP
+#define SCREENCAPTURE_VAAPICOMPOSITOR_HPP
+
+#include "libavcommon.hpp"
+#include "ThreadedWrapper.hpp"
+#include "VAAPIScaler.hpp"
+#include <vector>
+
+extern "C"
+{
+#include <libavutil/pixfmt.h>
+#include <libavfilter/avfilter.h>
+}
+
+namespace ffmpeg
+{
+
+/** Create a buffer source for VAAPI frames from the given hardware frame context */
+AVFilterContext* createHardwareSource(AVFilterGraph* graph, const char* name, Rect size, AVBufferRef* hwFramesContext);
+
+/** One input of a VAAPICompositor, e.g. a monitor */
+struct CanvasInput
+{
+	/** the size of the input frames */
+	Rect size;
+	/** the pixel format of the input frames */
+	PixelFormat format;
+	/** if the input frames are DRM PRIME frames instead of normal memory frames */
+	bool isDrmPrime;
+	/** the position on the canvas. It is rounded down to even coordinates, as required by NV12. */
+	unsigned int x;
+	unsigned int y;
+};
+
+/** Compose the frames of several inputs onto one canvas on the GPU using VAAPI, then scale the canvas like VAAPIScaler.
+ *
+ * Each input frame is uploaded (or mapped) and converted to NV12 once when it arrives. The canvas is then composed from
+ * the latest converted frame of every input by a chain of overlay_vaapi filters, so an input without a new frame costs
+ * only a blit on the GPU. Canvases are output at most at the configured frame rate, or for each frame of the first
+ * input, and only once each input has delivered its first frame. Frames that arrive in between only update their
+ * input, and appear with the next canvas, so the encoder gets one frame per interval instead of one per input frame.
+ * The input of a frame is given by its AVFrame::opaque field, see FFmpegOutput::pushFrame(size_t, AVFrame_Heap).
+ * The canvas carries the cursor of the input it was last seen on (see getCursor()), moved to canvas coordinates.
+ * A frame without pixels only updates the cursor of its input. */
+class SCW_EXPORT VAAPICompositor
+{
+	struct Input
+	{
+		CanvasInput placement;
+		/** uploads and converts the input frames to NV12 at their original size */
+		VAAPIScaler converter;
+		AVFrame_Heap latest;
+		AVFilterContext* filterSrcContext;
+	};
+
+	std::vector<Input> inputs;
+	Rect canvasSize;
+	Rect targetSize;
+	/** the empty canvas, which is referenced for every composition */
+	AVFrame_Heap background;
+	/** created when each input has a frame, as the filter inputs need their hardware frame contexts */
+	AVFilterGraph* filterGraph;
+	AVFilterContext* backgroundSrcContext;
+	AVFilterContext* filterSinkContext;
+	int64_t lastPts;
+	/** the minimum distance of the canvas timestamps, or 0 to compose for each frame of the first input */
+	int64_t frameInterval;
+	/** the cursor in canvas coordinates, and the input it was last seen on */
+	Cursor cursor;
+	size_t cursorInput;
+
+	void createFilterGraph();
+
+public:
+	using CompositionDoneCallback = std::function<void(AVFrame_Heap)>;
+
+	using CallbackType = CompositionDoneCallback;
+
+	/** Create a new VAAPICompositor.
+	 * @param canvasSize the size of the canvas the inputs are placed on
+	 * @param inputs the format and position of each input
+	 * @param targetSize the size the canvas should be scaled to
+	 * @param framerate how many canvases to output per second at most, or 0 to output one for each frame of the first
+	 *     input
+	 * @param drmDevice the DRM device that provides input frames, for inputs with DRM PRIME frames
+	 * @param vaapiDevice the VAAPI device that should do the composition and scaling */
+	VAAPICompositor(Rect canvasSize, const std::vector<CanvasInput>& inputs, Rect targetSize, unsigned int framerate,
+	                AVBufferRef* drmDevice, AVBufferRef* vaapiDevice);
+
+	VAAPICompositor(VAAPICompositor&&) noexcept;
+	VAAPICompositor(const VAAPICompositor&) = delete;
+	~VAAPICompositor() noexcept;
+
+	/** Update the input given by frame.opaque with the frame, and compose the canvas if the next one is due.
+	 * After composition, the given callback is called with the scaled canvas, whose timestamp is the frame's or, if
+	 * that is not newer than the previous canvas, one more than the previous canvas's.
+	 * This function is NOT thread-safe. */
+	void composeFrame(AVFrame& frame, const CompositionDoneCallback& compositionDone);
+
+	inline void processFrame(AVFrame& frame, const CompositionDoneCallback& compositionDone)
+	{ composeFrame(frame, compositionDone); }
+};
+
+
+using ThreadedVAAPICompositor = ThreadedWrapper<VAAPICompositor>;
+
+// declare external instantiation for template
+extern template class ThreadedWrapper<VAAPICompositor>;
+
+}
+
+
+#endif //SCREENCAPTURE_VAAPICOMPOSITOR_HPP
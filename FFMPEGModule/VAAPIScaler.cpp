@@ -27,7 +27,9 @@ VAAPIScaler::VAAPIScaler(Rect sourceSize, AVPixelFormat sourceFormat, Rect targe
                          AVBufferRef* drmDevice, AVBufferRef* vaapiDevice, bool inputIsDRMPrime)
 : filterGraph(avfilter_graph_alloc()),
   // DRM PRIME frames can be directly mapped to VAAPI. Memory frames have to be copied to the GPU first.
-  hardwareFrameFilterName(inputIsDRMPrime ? "hwmap" : "hwupload")
+  hardwareFrameFilterName(inputIsDRMPrime ? "hwmap" : "hwupload"),
+  keepLastFrame(false),
+  lastCrop{}
 {
 	const AVFilter* buffersrc = avfilter_get_by_name("buffer");
 	const AVFilter* buffersink = avfilter_get_by_name("buffersink");
@@ -133,7 +135,10 @@ VAAPIScaler::VAAPIScaler(VAAPIScaler&& o) noexcept
 : filterGraph(o.filterGraph),
   filterSrcContext(o.filterSrcContext),
   filterSinkContext(o.filterSinkContext),
-  hardwareFrameFilterName(o.hardwareFrameFilterName)
+  hardwareFrameFilterName(o.hardwareFrameFilterName),
+  keepLastFrame(o.keepLastFrame),
+  lastFrame(std::move(o.lastFrame)),
+  lastCrop(o.lastCrop)
 {
 	o.filterSrcContext = nullptr;
 	o.filterSinkContext = nullptr;
@@ -158,8 +163,47 @@ VAAPIScaler::~VAAPIScaler() noexcept
 	}
 }
 
+Cursor VAAPIScaler::cropCursor(const Cursor& cursor) const noexcept
+{
+	Cursor cropped = cursor;
+	int64_t w = lastCrop.width - int64_t(lastCrop.left + lastCrop.right);
+	int64_t h = lastCrop.height - int64_t(lastCrop.top + lastCrop.bottom);
+	if (w <= 0 || h <= 0)
+		return cropped;
+	cropped.x = static_cast<int32_t>((cursor.x - int64_t(lastCrop.left)) * lastCrop.width / w);
+	cropped.y = static_cast<int32_t>((cursor.y - int64_t(lastCrop.top)) * lastCrop.height / h);
+	return cropped;
+}
+
+void VAAPIScaler::cropFrameCursor(AVFrame& scaled) const
+{
+	const Cursor* cursor = getCursor(scaled);
+	if (!cursor || (lastCrop.left | lastCrop.top | lastCrop.right | lastCrop.bottom) == 0)
+		return;
+	attachCursor(scaled, cropCursor(*cursor));
+}
+
 void VAAPIScaler::scaleFrame(AVFrame& frame, const ScalingDoneCallback& scalingDone)
 {
+	if (!frame.buf[0])
+	{
+		// nothing changed but the properties, e.g. the cursor
+		if (!lastFrame)
+			return;
+		auto repeated = AVFrame_Heap(av_frame_clone(lastFrame.get()));
+		if (!repeated)
+			throw LibAVException(AVERROR(ENOMEM), "Repeating the last frame failed");
+		repeated->pts = frame.pts;
+		av_buffer_unref(&repeated->opaque_ref);
+		if (frame.opaque_ref)
+			repeated->opaque_ref = av_buffer_ref(frame.opaque_ref);
+		cropFrameCursor(*repeated);
+		scalingDone(std::move(repeated));
+		return;
+	}
+
+	// scale_vaapi scales only the cropped part
+	lastCrop = {frame.crop_left, frame.crop_top, frame.crop_right, frame.crop_bottom, frame.width, frame.height};
 	int err = av_buffersrc_add_frame_flags(filterSrcContext, &frame, 0);
 	if (err)
 		throw LibAVException(err, "Inserting frame into filter failed");
@@ -176,6 +220,11 @@ void VAAPIScaler::scaleFrame(AVFrame& frame, const ScalingDoneCallback& scalingD
 		{
 			throw LibAVException(err, "Extracting frame from filter failed");
 		}
+		// the crop has been applied, but it is copied along with the other frame properties
+		gpuFrame->crop_left = gpuFrame->crop_top = gpuFrame->crop_right = gpuFrame->crop_bottom = 0;
+		cropFrameCursor(*gpuFrame);
+		if (keepLastFrame)
+			lastFrame.reset(av_frame_clone(gpuFrame.get()));
 		scalingDone(std::move(gpuFrame));
 	}
 }
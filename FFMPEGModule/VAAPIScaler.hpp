@@ -20,6 +20,8 @@ namespace ffmpeg
 
 /** Upload and scale frames on the GPU using VAAPI.
  * Frames are converted to the NV12 pixel format during this process.
+ * The crop fields of a frame (AVFrame::crop_left etc.) select the part of it that is scaled to the target size, in
+ * the same pass. Scaled frames have no crop left, and their cursor is moved and scaled along with the cropped part.
  * Scaled frames are output by calling the ScalingDoneCallback function. */
 class SCW_EXPORT VAAPIScaler
 {
@@ -27,6 +29,21 @@ class SCW_EXPORT VAAPIScaler
 	AVFilterContext* filterSrcContext;
 	AVFilterContext* filterSinkContext;
 	const char* const hardwareFrameFilterName;
+	/** the previous output, if frames without pixels should repeat it */
+	bool keepLastFrame;
+	AVFrame_Heap lastFrame;
+	/** the crop of the last frame, which also applies to the cursor of frames without pixels */
+	struct
+	{
+		size_t left;
+		size_t top;
+		size_t right;
+		size_t bottom;
+		int width;
+		int height;
+	} lastCrop;
+
+	void cropFrameCursor(AVFrame& scaled) const;
 
 public:
 	using ScalingDoneCallback = std::function<void(AVFrame_Heap)>;
@@ -47,9 +64,22 @@ public:
 	VAAPIScaler(const VAAPIScaler&) = delete;
 	~VAAPIScaler() noexcept;
 
+	/** Keep a reference to the last scaled frame, so a frame without pixels (like one from
+	 * FFmpegOutput::pushCursor()) repeats it with its own timestamp and cursor. This holds one more GPU surface.
+	 * Call this before the first frame. */
+	void setKeepLastFrame(bool enable) noexcept
+	{
+		keepLastFrame = enable;
+	}
+
+	/** @return the cursor of a source frame moved to the frame size without the crop of the last frame, i.e. where
+	 *     it is in the scaled frame before it is scaled to the target size */
+	Cursor cropCursor(const Cursor& cursor) const noexcept;
+
 	/** Scale a single frame.
 	 * After scaling, the given ScalingDoneCallback is called with the scaled frame.
 	 * Ownership of the frame is transferred to the callback.
+	 * A frame without pixels is dropped, unless setKeepLastFrame() was enabled.
 	 * This function is NOT thread-safe. */
 	void scaleFrame(AVFrame& frame, const ScalingDoneCallback& scalingDone);
 
@@ -12,6 +12,7 @@
 extern "C" {
 #include <libavutil/pixdesc.h>
 #include <libavutil/frame.h>
+#include <libavcodec/packet.h>
 }
 
 namespace ffmpeg
@@ -20,6 +21,9 @@ using common::Rect;
 using common::PixelFormat;
 using common::MemoryFrame;
 using common::DmaBufFrame;
+using common::Cursor;
+using common::CropRegion;
+using common::ThreadConfig;
 
 class SCW_EXPORT LibAVException : public std::exception
 {
@@ -51,9 +55,18 @@ enum class Codec
 	VP9,
 };
 
+/** Wrap a frame without copying it. A visible cursor of the frame is attached to the AVFrame, see getCursor().
+ * The frame's crop region is set in the AVFrame's crop fields, which VAAPIScaler applies. */
 SCW_EXPORT AVFrame* wrapInAVFrame(std::unique_ptr<MemoryFrame> frame) noexcept;
 SCW_EXPORT AVFrame* wrapInAVFrame(std::unique_ptr<DmaBufFrame> frame) noexcept;
 
+/** Attach the cursor to the frame in AVFrame::opaque_ref, which the filters pass on to their output frames.
+ * An invisible cursor is attached too, as it hides the cursor of previous frames. */
+SCW_EXPORT void attachCursor(AVFrame& frame, Cursor cursor);
+
+/** @return the cursor attached to the frame, or nullptr if it has none */
+SCW_EXPORT const Cursor* getCursor(const AVFrame& frame) noexcept;
+
 struct AVFrameFree
 {
 	void operator()(AVFrame* f)
@@ -63,6 +76,15 @@ struct AVFrameFree
 };
 using AVFrame_Heap = std::unique_ptr<AVFrame, AVFrameFree>;
 
+struct AVPacketFree
+{
+	void operator()(AVPacket* p)
+	{
+		av_packet_free(&p);
+	}
+};
+using AVPacket_Heap = std::unique_ptr<AVPacket, AVPacketFree>;
+
 }
 
 #endif //SCREENCAPTURE_LIBAVCOMMON_HPP
@@ -2,6 +2,7 @@
 #include <gst/app/gstappsrc.h>
 #include <gst/video/video-format.h>
 #include <gst/video/video-info.h>
+#include <gst/video/gstvideometa.h>
 #include <cstdio>
 #include <cstdarg>
 #include <chrono>
@@ -78,9 +79,11 @@ static void pollMessages(GstElement* pipeline) noexcept
 	gst_object_unref(bus);
 }
 
-GstOutput::GstOutput(Rect sourceSize, PixelFormat sourceFormat, Rect scaledSize,
+GstOutput::GstOutput(Rect sourceSize, PixelFormat sourceFormat, CropRegion crop, Rect scaledSize,
                      const std::string& hwDevicePath, Codec codec,
                      const std::string& outputPath, const std::string& outputFormat)
+: sourceFormat(sourceFormat),
+  crop(crop)
 {
 	const char* codecName;
 	const char* codecParser;
@@ -95,13 +98,15 @@ GstOutput::GstOutput(Rect sourceSize, PixelFormat sourceFormat, Rect scaledSize,
 			codecParser = "h265parse";
 			break;
 	}
+	// the pushed buffers only contain the crop region
+	Rect inputSize = crop.size.w != 0 ? crop.size : sourceSize;
 	char pipelineDescription[600];
 	snprintf(pipelineDescription, sizeof(pipelineDescription),
 			"appsrc max-buffers=8 block=true name=appsrc ! video/x-raw, format=%s, width=%u, height=%u, framerate=0/1, interlace-mode=progressive "
 			"! vaapipostproc width=%u height=%u ! vaapi%senc quality-level=6 rate-control=cqp init-qp=26 name=encoder "
 			"! %s ! queue max-size-buffers=8 ! mpegtsmux name=mux ! filesink location=%s",
 			gst_video_format_to_string(pixelFormat2Gst(sourceFormat)),
-			sourceSize.w, sourceSize.h,
+			inputSize.w, inputSize.h,
 			scaledSize.w, scaledSize.h,
 			codecName, codecParser,
 			outputPath.c_str());
@@ -137,7 +142,9 @@ GstOutput::~GstOutput() noexcept
 
 GstOutput::GstOutput(GstOutput&& o)
 : pipeline(o.pipeline),
-  appSource(o.appSource)
+  appSource(o.appSource),
+  sourceFormat(o.sourceFormat),
+  crop(o.crop)
 {
 	o.pipeline = nullptr;
 	o.appSource = nullptr;
@@ -146,8 +153,9 @@ GstOutput::GstOutput(GstOutput&& o)
 GstOutput::Builder::Builder(common::Rect sourceSize, common::PixelFormat sourceFormat) noexcept
 : sourceSize(sourceSize),
   sourceFormat(sourceFormat),
-  targetSize(sourceSize),
-  codec(Codec::H264)
+  targetSize{},
+  codec(Codec::H264),
+  crop{}
 {
 }
 
@@ -157,7 +165,17 @@ GstOutput GstOutput::Builder::build()
 	{
 		throw GStreamerException("Source frame dimensions must not be zero, got %ux%u", sourceSize.w, sourceSize.h);
 	}
-	if (targetSize.w == 0 || targetSize.h == 0)
+	bool isCropped = crop.size.w != 0 || crop.size.h != 0;
+	if (isCropped && (crop.size.w == 0 || crop.size.h == 0
+	                  || uint64_t(crop.x) + crop.size.w > sourceSize.w || uint64_t(crop.y) + crop.size.h > sourceSize.h))
+	{
+		throw GStreamerException("Crop region of %ux%u at %u,%u is empty or exceeds the %ux%u source",
+		                         crop.size.w, crop.size.h, crop.x, crop.y, sourceSize.w, sourceSize.h);
+	}
+	Rect scaledSize = targetSize;
+	if (targetSize.w == 0 && targetSize.h == 0)
+		scaledSize = isCropped ? crop.size : sourceSize;
+	if (scaledSize.w == 0 || scaledSize.h == 0)
 	{
 		throw GStreamerException("Scaled frame dimensions must not be zero, got %ux%u", targetSize.w, targetSize.h);
 	}
@@ -169,7 +187,7 @@ GstOutput GstOutput::Builder::build()
 	{
 		throw GStreamerException("No hardware device path specified");
 	}
-	return GstOutput(sourceSize, sourceFormat, targetSize, hwDevicePath, codec, outputPath, outputFormat);
+	return GstOutput(sourceSize, sourceFormat, crop, scaledSize, hwDevicePath, codec, outputPath, outputFormat);
 }
 
 static void onFrameMemoryDropped(void* p)
@@ -180,6 +198,40 @@ static void onFrameMemoryDropped(void* p)
 
 void GstOutput::pushFrame(std::unique_ptr<common::MemoryFrame> frame)
 {
+	if (this->crop.size.w != 0)
+	{
+		// the pipeline has been set up for the region, so a frame that doesn't contain it can't be pushed
+		if (uint64_t(this->crop.x) + this->crop.size.w > frame->width
+		    || uint64_t(this->crop.y) + this->crop.size.h > frame->height || frame->stride < frame->width * 4)
+		{
+			throw GStreamerException("Crop region of %ux%u at %u,%u exceeds the %ux%u frame",
+			                         this->crop.size.w, this->crop.size.h, this->crop.x, this->crop.y,
+			                         frame->width, frame->height);
+		}
+		// point the buffer at the region, so only its rows are uploaded
+		gsize offset = this->crop.y * frame->stride + this->crop.x * 4;
+		gsize size = (this->crop.size.h - 1) * frame->stride + this->crop.size.w * 4;
+		GstBuffer* regionMem = gst_buffer_new_wrapped_full(
+				GST_MEMORY_FLAG_READONLY,
+				frame->memory,
+				frame->stride * frame->height,
+				offset,
+				size,
+				frame.get(),
+				onFrameMemoryDropped);
+		if (!regionMem)
+			throw GStreamerException("Wrapping the crop region of the frame failed");
+		gint planeStride[GST_VIDEO_MAX_PLANES] = {static_cast<gint>(frame->stride)};
+		// released via onFrameMemoryDropped
+		frame.release();
+		// the rows of the region are as far apart as those of the frame
+		gsize planeOffset[GST_VIDEO_MAX_PLANES] = {0};
+		gst_buffer_add_video_meta_full(regionMem, GST_VIDEO_FRAME_FLAG_NONE, pixelFormat2Gst(sourceFormat),
+		                               this->crop.size.w, this->crop.size.h, 1, planeOffset, planeStride);
+		pushFrame(regionMem);
+		return;
+	}
+	common::CropRegion crop = frame->crop;
 	GstBuffer* frameMem = gst_buffer_new_wrapped_full(
 			static_cast<GstMemoryFlags>(GST_MEMORY_FLAG_READONLY | GST_MEMORY_FLAG_ZERO_PADDED),
 			frame->memory,
@@ -188,6 +240,15 @@ void GstOutput::pushFrame(std::unique_ptr<common::MemoryFrame> frame)
 			frame->size,
 			frame.get(),
 			onFrameMemoryDropped);
+	if (crop.size.w != 0 && crop.size.h != 0)
+	{
+		// vaapipostproc only scales the cropped region
+		GstVideoCropMeta* cropMeta = gst_buffer_add_video_crop_meta(frameMem);
+		cropMeta->x = crop.x;
+		cropMeta->y = crop.y;
+		cropMeta->width = crop.size.w;
+		cropMeta->height = crop.size.h;
+	}
 	// release object from unique_ptr, it is now owned by the GstBuffer and released via onFrameMemoryDropped
 	frame.release();
 	pushFrame(frameMem);
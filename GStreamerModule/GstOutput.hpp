@@ -15,6 +15,7 @@ namespace gstreamer
 {
 using common::PixelFormat;
 using common::Rect;
+using common::CropRegion;
 
 void init(int* argc, char*** argv);
 void deinit();
@@ -29,9 +30,12 @@ class GstOutput
 {
 	GstElement* pipeline;
 	GstElement* appSource;
+	PixelFormat sourceFormat;
+	/** the region of the frames to encode, or 0x0 for all of it */
+	CropRegion crop;
 
 	void pushFrame(GstBuffer* buf);
-	GstOutput(Rect sourceSize, PixelFormat sourceFormat, Rect scaledSize,
+	GstOutput(Rect sourceSize, PixelFormat sourceFormat, CropRegion crop, Rect scaledSize,
 	          const std::string& hwDevicePath, Codec codec,
 	          const std::string& outputPath, const std::string& outputFormat);
 
@@ -40,6 +44,8 @@ public:
 	SCW_EXPORT GstOutput(GstOutput&&);
 	SCW_EXPORT GstOutput operator=(GstOutput&&);
 
+	/** @throw GStreamerException if the frame does not contain the crop region, or it could not be pushed.
+	 *     The frame is released then. */
 	SCW_EXPORT void pushFrame(std::unique_ptr<common::MemoryFrame> frame);
 
 	class Builder
@@ -51,6 +57,7 @@ public:
 		std::string outputPath;
 		Codec codec;
 		std::string hwDevicePath;
+		CropRegion crop;
 
 	public:
 		SCW_EXPORT Builder(Rect sourceSize, PixelFormat sourceFormat) noexcept;
@@ -61,6 +68,7 @@ public:
 			return *this;
 		}
 
+		/** Scale frames to the given size. By default, they keep the source size, or the size of the crop region. */
 		SCW_EXPORT Builder& withScaling(Rect scaledSize) noexcept
 		{
 			targetSize = scaledSize;
@@ -85,6 +93,15 @@ public:
 			return *this;
 		}
 
+		/** Encode only a region of the source frames. The buffers given to the pipeline start at the region, so only
+		 * its rows are uploaded. A crop region of the frames themselves is replaced by this one.
+		 * @param region the region in source frame coordinates. It must lie within the source size. */
+		SCW_EXPORT Builder& withCrop(CropRegion region) noexcept
+		{
+			crop = region;
+			return *this;
+		}
+
 		SCW_EXPORT GstOutput build();
 	};
 };
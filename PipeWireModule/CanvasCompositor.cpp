@@ -0,0 +1,456 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#include "CanvasCompositor.hpp"
+#include "../trace.hpp"
+#include <algorithm> // min, max
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib> // calloc
+#include <cstring> // memcpy, memset
+#include <new> // bad_alloc
+#include <stdexcept> // runtime_error
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std::chrono;
+
+namespace pw
+{
+
+static constexpr size_t BYTES_PER_PIXEL = 4;
+
+/** @return true if both formats store the color channels in the same order */
+static constexpr bool sameChannelOrder(PixelFormat a, PixelFormat b)
+{
+	auto isBGR = [] (PixelFormat f) { return f == PixelFormat::BGRA || f == PixelFormat::BGRX; };
+	return isBGR(a) == isBGR(b);
+}
+
+/** Copy with non-temporal stores, which write around the caches. Call finishStreamCopies() afterwards. */
+static void streamCopy(uint8_t* dst, const uint8_t* src, size_t n) noexcept
+{
+#ifdef __SSE2__
+	// streaming stores need an aligned destination, the source may be unaligned
+	size_t head = std::min(n, (16 - reinterpret_cast<uintptr_t>(dst) % 16) % 16);
+	std::memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	n -= head;
+	for (; n >= 64; n -= 64, dst += 64, src += 64)
+	{
+		__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+		__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16));
+		__m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 32));
+		__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 48));
+		_mm_stream_si128(reinterpret_cast<__m128i*>(dst), a);
+		_mm_stream_si128(reinterpret_cast<__m128i*>(dst + 16), b);
+		_mm_stream_si128(reinterpret_cast<__m128i*>(dst + 32), c);
+		_mm_stream_si128(reinterpret_cast<__m128i*>(dst + 48), d);
+	}
+	for (; n >= 16; n -= 16, dst += 16, src += 16)
+		_mm_stream_si128(reinterpret_cast<__m128i*>(dst), _mm_loadu_si128(reinterpret_cast<const __m128i*>(src)));
+#endif
+	std::memcpy(dst, src, n);
+}
+
+/** @return true if only the crop region of the frame is shown, as a 0x0 region stands for the whole frame */
+static bool isCropped(const MemoryFrame& frame) noexcept
+{
+	return frame.crop.size.w != 0 && frame.crop.size.h != 0;
+}
+
+/** @return the area of the canvas that the shown part of the frame covers, clipped to the canvas.
+ *     Empty without a frame. */
+static PixelArea coveredArea(const CanvasPlacement& placement, const MemoryFrame* frame, Rect canvasSize) noexcept
+{
+	if (!frame || placement.x >= canvasSize.w || placement.y >= canvasSize.h)
+		return {};
+	unsigned int w = isCropped(*frame) ? frame->crop.size.w : frame->width;
+	unsigned int h = isCropped(*frame) ? frame->crop.size.h : frame->height;
+	return {placement.x, placement.y, std::min(w, canvasSize.w - placement.x), std::min(h, canvasSize.h - placement.y)};
+}
+
+/** @return the first pixel of the frame's crop region, or of the whole frame if it is not cropped */
+static const uint8_t* shownPixels(const MemoryFrame& frame) noexcept
+{
+	auto memory = static_cast<const uint8_t*>(frame.memory) + frame.offset;
+	if (!isCropped(frame))
+		return memory;
+	return memory + frame.crop.y * frame.stride + frame.crop.x * BYTES_PER_PIXEL;
+}
+
+/** @return true if the area lies completely within the other one */
+static bool contains(const PixelArea& outer, const PixelArea& inner) noexcept
+{
+	return inner.x >= outer.x && inner.y >= outer.y && inner.x + inner.w <= outer.x + outer.w
+			&& inner.y + inner.h <= outer.y + outer.h;
+}
+
+/** Order the non-temporal stores before the canvas is handed to another thread */
+static inline void finishStreamCopies() noexcept
+{
+#ifdef __SSE2__
+	_mm_sfence();
+#endif
+}
+
+CanvasCompositor::CanvasCompositor(Rect size, PixelFormat format, const std::vector<CanvasPlacement>& placements,
+                                   size_t maxCanvases) noexcept
+: size(size),
+  format(format),
+  // align rows to cache lines, so the streaming stores of a row fill whole lines
+  stride((size.w * BYTES_PER_PIXEL + 63) / 64 * 64),
+  canvasSize(stride * size.h),
+  cursor{},
+  cursorSource(0),
+  drawCursor(false),
+  changed(false),
+  lastPts(-1),
+  canvasCount(0),
+  maxCanvases(maxCanvases)
+{
+	for (const CanvasPlacement& p : placements)
+		sources.push_back({p, nullptr, 0});
+}
+
+std::shared_ptr<CanvasCompositor> CanvasCompositor::create(Rect size, PixelFormat format,
+                                                           const std::vector<CanvasPlacement>& placements,
+                                                           size_t maxCanvases)
+{
+	return std::shared_ptr<CanvasCompositor>(new CanvasCompositor(size, format, placements, maxCanvases));
+}
+
+CanvasCompositor::~CanvasCompositor() noexcept
+{
+	for (const Canvas& c : freeCanvases)
+		munmap(c.memory, canvasSize);
+}
+
+void CanvasCompositor::release(Canvas canvas) noexcept
+{
+	std::lock_guard lock(mutex);
+	freeCanvases.push_back(std::move(canvas));
+}
+
+void CanvasCompositor::update(size_t source, std::unique_ptr<MemoryFrame> frame)
+{
+	if (source >= sources.size())
+		throw std::runtime_error("CanvasCompositor: source index out of range");
+	if (frame && !sameChannelOrder(frame->format, format))
+		throw std::runtime_error("CanvasCompositor: source pixel format does not match the canvas");
+	if (frame && isCropped(*frame)
+	    && (frame->crop.x + frame->crop.size.w > frame->width || frame->crop.y + frame->crop.size.h > frame->height))
+		throw std::runtime_error("CanvasCompositor: source crop region exceeds the frame");
+	Source& s = sources[source];
+	bool hadFrame = s.frame != nullptr;
+	s.frame = std::move(frame);
+	if (s.frame)
+		setSourceCursor(source, s.frame->cursor);
+	else if (!hadFrame)
+		return;
+	// a cleared source is cleared from the canvases as well
+	++s.generation;
+	changed = true;
+}
+
+void CanvasCompositor::updateCursor(size_t source, const Cursor& sourceCursor)
+{
+	if (source >= sources.size())
+		throw std::runtime_error("CanvasCompositor: source index out of range");
+	if (setSourceCursor(source, sourceCursor))
+		changed = true;
+}
+
+bool CanvasCompositor::setSourceCursor(size_t source, const Cursor& sourceCursor) noexcept
+{
+	if (!sourceCursor.visible)
+	{
+		// the cursor left this source, but might have entered another one already
+		if (source != cursorSource || !cursor.visible)
+			return false;
+		cursor.visible = false;
+		return true;
+	}
+	const Source& s = sources[source];
+	Cursor moved = sourceCursor;
+	moved.x += static_cast<int32_t>(s.placement.x);
+	moved.y += static_cast<int32_t>(s.placement.y);
+	// the cursor position refers to the whole frame, but only its crop region is placed on the canvas
+	if (s.frame && isCropped(*s.frame))
+	{
+		moved.x -= static_cast<int32_t>(s.frame->crop.x);
+		moved.y -= static_cast<int32_t>(s.frame->crop.y);
+	}
+	bool same = cursor.visible && cursor.x == moved.x && cursor.y == moved.y && cursor.hotspotX == moved.hotspotX
+			&& cursor.hotspotY == moved.hotspotY && cursor.image == moved.image;
+	cursor = std::move(moved);
+	cursorSource = source;
+	return !same;
+}
+
+void CanvasCompositor::restoreArea(uint8_t* canvas, PixelArea area) noexcept
+{
+	for (unsigned int y = 0; y < area.h; ++y)
+		std::memset(canvas + (area.y + y) * stride + area.x * BYTES_PER_PIXEL, 0, area.w * BYTES_PER_PIXEL);
+	for (const Source& s : sources)
+	{
+		PixelArea covered = coveredArea(s.placement, s.frame.get(), size);
+		// the part of the area that this source covers
+		unsigned int x0 = std::max(area.x, covered.x);
+		unsigned int y0 = std::max(area.y, covered.y);
+		unsigned int x1 = std::min(area.x + area.w, covered.x + covered.w);
+		unsigned int y1 = std::min(area.y + area.h, covered.y + covered.h);
+		if (x1 <= x0 || y1 <= y0)
+			continue;
+		const uint8_t* src = shownPixels(*s.frame);
+		for (unsigned int y = y0; y < y1; ++y)
+		{
+			std::memcpy(canvas + y * stride + x0 * BYTES_PER_PIXEL,
+			            src + (y - s.placement.y) * s.frame->stride + (x0 - s.placement.x) * BYTES_PER_PIXEL,
+			            (x1 - x0) * BYTES_PER_PIXEL);
+		}
+	}
+}
+
+std::unique_ptr<MemoryFrame> CanvasCompositor::compose()
+{
+	if (!changed)
+		return nullptr;
+
+	Canvas canvas;
+	{
+		std::lock_guard lock(mutex);
+		if (!freeCanvases.empty())
+		{
+			canvas = std::move(freeCanvases.back());
+			freeCanvases.pop_back();
+		}
+		else if (canvasCount >= maxCanvases)
+		{
+			// the consumer is behind, the changes go into the next canvas
+			return nullptr;
+		}
+		else
+		{
+			// a new canvas is zeroed, so uncovered areas are black
+			void* p = mmap(nullptr, canvasSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (p == MAP_FAILED)
+				throw std::bad_alloc();
+			madvise(p, canvasSize, MADV_HUGEPAGE);
+			canvas = {p, std::vector<uint64_t>(sources.size(), 0), std::vector<PixelArea>(sources.size()), PixelArea{}};
+			++canvasCount;
+		}
+	}
+
+	nanoseconds pts = lastPts;
+	for (const Source& s : sources)
+		if (s.frame)
+			pts = std::max(pts, s.frame->pts);
+	// encoders count in microseconds, so a smaller step would result in a duplicate timestamp
+	pts = std::max(pts, lastPts + microseconds(1));
+	lastPts = pts;
+
+	trace::Scope traceScope("compose", duration_cast<microseconds>(pts).count());
+	auto memory = static_cast<uint8_t*>(canvas.memory);
+	if (canvas.cursorArea.w > 0)
+	{
+		restoreArea(memory, canvas.cursorArea);
+		canvas.cursorArea = {};
+	}
+	for (size_t i = 0; i < sources.size(); ++i)
+	{
+		const Source& s = sources[i];
+		if (canvas.generations[i] == s.generation)
+			continue;
+		canvas.generations[i] = s.generation;
+		PixelArea area = coveredArea(s.placement, s.frame.get(), size);
+		// an older, larger frame of the source (or one that has been cleared) left pixels outside its new area
+		if (canvas.areas[i].w > 0 && !contains(area, canvas.areas[i]))
+			restoreArea(memory, canvas.areas[i]);
+		canvas.areas[i] = area;
+		if (area.w == 0)
+			continue;
+		size_t rowBytes = area.w * BYTES_PER_PIXEL;
+		const uint8_t* src = shownPixels(*s.frame);
+		auto dst = memory + area.y * stride + area.x * BYTES_PER_PIXEL;
+		for (uint32_t y = 0; y < area.h; ++y)
+			streamCopy(dst + y * stride, src + y * s.frame->stride, rowBytes);
+	}
+	finishStreamCopies();
+	// the cursor is drawn with normal stores, as the blending reads the canvas
+	if (drawCursor)
+		canvas.cursorArea = blendCursor(memory, stride, size, format, cursor);
+	changed = false;
+
+	auto f = std::make_unique<MemoryFrame>();
+	f->width = size.w;
+	f->height = size.h;
+	f->pts = pts;
+	f->format = format;
+	f->memory = canvas.memory;
+	f->stride = stride;
+	f->size = canvasSize;
+	f->offset = 0;
+	if (!drawCursor)
+		f->cursor = cursor;
+	f->onFrameDone = [compositor = shared_from_this(), canvas = std::move(canvas)]() mutable
+	{
+		compositor->release(std::move(canvas));
+	};
+	return f;
+}
+
+}
+
+
+// C interface
+#include "EventToCEventConverter.hpp"
+
+struct CanvasCompositor
+{
+	std::shared_ptr<pw::CanvasCompositor> cppCompositor;
+	/** one for each source */
+	std::vector<common::CursorFromC> cursorConverters;
+};
+
+static constexpr inline common::PixelFormat fromCFormat(::PixelFormat format)
+{
+	switch (format)
+	{
+		case PixelFormat::BGRA:
+			return common::PixelFormat::BGRA;
+		case PixelFormat::RGBA:
+			return common::PixelFormat::RGBA;
+		case PixelFormat::BGRX:
+			return common::PixelFormat::BGRX;
+		case PixelFormat::RGBX:
+			return common::PixelFormat::RGBX;
+	}
+	return common::PixelFormat::BGRA;
+}
+
+struct CanvasCompositor* CanvasCompositor_create(struct Rect size, enum PixelFormat format,
+                                                 const struct CanvasCompositor_Placement* placements,
+                                                 uint32_t sourceCount)
+{
+	try
+	{
+		std::vector<pw::CanvasPlacement> cppPlacements;
+		for (uint32_t i = 0; i < sourceCount; ++i)
+			cppPlacements.push_back({placements[i].x, placements[i].y});
+		return new CanvasCompositor {
+			pw::CanvasCompositor::create(common::Rect{size.w, size.h}, fromCFormat(format), cppPlacements),
+			std::vector<common::CursorFromC>(sourceCount)
+		};
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return nullptr;
+	}
+}
+
+void CanvasCompositor_free(struct CanvasCompositor* compositor)
+{
+	delete compositor;
+}
+
+int CanvasCompositor_update(struct CanvasCompositor* compositor, uint32_t source, struct MemoryFrame* c_frame)
+{
+	try
+	{
+		std::unique_ptr<common::MemoryFrame> frame;
+		if (c_frame)
+		{
+			frame = std::make_unique<common::MemoryFrame>();
+			frame->width = c_frame->width;
+			frame->height = c_frame->height;
+			frame->pts = std::chrono::nanoseconds(c_frame->pts);
+			frame->format = fromCFormat(c_frame->format);
+			frame->memory = c_frame->memory;
+			frame->stride = c_frame->stride;
+			frame->size = c_frame->size;
+			frame->offset = c_frame->offset;
+			frame->fd = c_frame->fd;
+			frame->fdOffset = c_frame->fdOffset;
+			frame->isSealed = c_frame->isSealed;
+			frame->crop = {c_frame->crop.x, c_frame->crop.y, {c_frame->crop.width, c_frame->crop.height}};
+			if (source < compositor->cursorConverters.size())
+				frame->cursor = compositor->cursorConverters[source].convert(c_frame->cursor);
+			frame->onFrameDone = [c_frame]()
+			{
+				freeMemoryFrame(c_frame);
+			};
+		}
+		compositor->cppCompositor->update(source, std::move(frame));
+		return 0;
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return -1;
+	}
+}
+
+int CanvasCompositor_updateCursor(struct CanvasCompositor* compositor, uint32_t source,
+                                  const struct FrameCursor* cursor)
+{
+	try
+	{
+		if (source >= compositor->cursorConverters.size())
+			throw std::runtime_error("CanvasCompositor: source index out of range");
+		compositor->cppCompositor->updateCursor(source, compositor->cursorConverters[source].convert(*cursor));
+		return 0;
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return -1;
+	}
+}
+
+void CanvasCompositor_setDrawCursor(struct CanvasCompositor* compositor, bool enable)
+{
+	compositor->cppCompositor->setDrawCursor(enable);
+}
+
+struct MemoryFrame* CanvasCompositor_compose(struct CanvasCompositor* compositor)
+{
+	try
+	{
+		std::unique_ptr<common::MemoryFrame> frame = compositor->cppCompositor->compose();
+		if (!frame)
+			return nullptr;
+		auto c_frame = static_cast<struct MemoryFrame*>(calloc(1, sizeof(struct MemoryFrame)));
+		if (!c_frame)
+			return nullptr;
+		c_frame->width = frame->width;
+		c_frame->height = frame->height;
+		c_frame->pts = frame->pts.count();
+		c_frame->format = toCFormat(frame->format);
+		c_frame->memory = frame->memory;
+		c_frame->stride = frame->stride;
+		c_frame->size = frame->size;
+		c_frame->offset = frame->offset;
+		c_frame->fd = frame->fd;
+		c_frame->fdOffset = frame->fdOffset;
+		c_frame->isSealed = frame->isSealed;
+		c_frame->cursor = toCCursor(frame->cursor);
+		c_frame->opaque = frame.release();
+		c_frame->onFrameDone = [](void* opaque)
+		{
+			delete static_cast<common::MemoryFrame*>(opaque);
+		};
+		return c_frame;
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return nullptr;
+	}
+}
@@ -0,0 +1,140 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#ifndef SCREENCAPTURE_CANVASCOMPOSITOR_HPP
+#define SCREENCAPTURE_CANVASCOMPOSITOR_HPP
+
+#include "../common.hpp"
+#include "CursorBlend.hpp"
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace pw
+{
+
+using common::Rect;
+using common::PixelFormat;
+using common::MemoryFrame;
+using common::Cursor;
+
+/** Position of a source on the canvas of a CanvasCompositor, in pixels */
+struct CanvasPlacement
+{
+	unsigned int x;
+	unsigned int y;
+};
+
+/** Composes the memory frames of several streams, e.g. the monitors of a PipeWireStreamGroup, into one canvas frame,
+ * so they can be encoded as a single video.
+ *
+ * Canvases are buffers that compose() hands out as MemoryFrame, and that are reused after the frame is released.
+ * A canvas only gets those sources copied whose frame changed since the canvas was composed the last time, so a static
+ * monitor costs nothing. The latest frame of each source is kept until a newer one replaces it, so consider
+ * PipeWireStream::setCopyOnHold() to return its PipeWire buffer early.
+ * Rows are copied with non-temporal SIMD stores, as the canvas is read by another thread (the upload to the GPU) and
+ * would only evict the caches of this one.
+ *
+ * The canvas frames carry the cursor of the source it was last seen on, moved to canvas coordinates, so it can be
+ * drawn at encode time. With setDrawCursor(), it is blended into the canvas instead. A cursor update without a frame
+ * (see updateCursor()) then only restores and redraws the area under the cursor.
+ *
+ * update() and compose() must be called from the same thread. Canvas frames can be released from any thread. */
+class CanvasCompositor : public std::enable_shared_from_this<CanvasCompositor>
+{
+	struct Canvas
+	{
+		void* memory;
+		/** generation of each source's frame that has been copied into this canvas, or 0 for none */
+		std::vector<uint64_t> generations;
+		/** the area of the canvas that each source's frame has been copied to */
+		std::vector<PixelArea> areas;
+		/** the area the cursor has been drawn over, which has to be restored before the canvas is reused */
+		PixelArea cursorArea;
+	};
+
+	struct Source
+	{
+		CanvasPlacement placement;
+		std::unique_ptr<MemoryFrame> frame;
+		uint64_t generation;
+	};
+
+	Rect size;
+	PixelFormat format;
+	size_t stride;
+	size_t canvasSize;
+	std::vector<Source> sources;
+	/** the cursor in canvas coordinates, and the source it was last seen on */
+	Cursor cursor;
+	size_t cursorSource;
+	bool drawCursor;
+	bool changed;
+	std::chrono::nanoseconds lastPts;
+
+	std::mutex mutex;
+	std::vector<Canvas> freeCanvases;
+	size_t canvasCount;
+	size_t maxCanvases;
+
+	CanvasCompositor(Rect size, PixelFormat format, const std::vector<CanvasPlacement>& placements,
+	                 size_t maxCanvases) noexcept;
+
+	void release(Canvas canvas) noexcept;
+
+	/** @return true if the cursor changed */
+	bool setSourceCursor(size_t source, const Cursor& sourceCursor) noexcept;
+
+	/** Copy an area of the sources into the canvas, without the cursor. Areas without a source are black. */
+	void restoreArea(uint8_t* canvas, PixelArea area) noexcept;
+
+public:
+	/** @param size the size of the canvas in pixels
+	 * @param format the pixel format of the canvas. Sources must have the same channel order, alpha may differ.
+	 * @param placements the position of each source on the canvas. Sources that extend beyond it are clipped.
+	 * @param maxCanvases how many canvases may be in use at the same time, e.g. waiting in the encoder queues */
+	SCW_EXPORT static std::shared_ptr<CanvasCompositor> create(Rect size, PixelFormat format,
+	                                                           const std::vector<CanvasPlacement>& placements,
+	                                                           size_t maxCanvases = 3);
+
+	CanvasCompositor(const CanvasCompositor&) = delete;
+	CanvasCompositor& operator=(const CanvasCompositor&) = delete;
+
+	SCW_EXPORT ~CanvasCompositor() noexcept;
+
+	/** Replace the frame of a source. It is copied into the canvases when they are composed next.
+	 * @param source the index of the source in the placements
+	 * @param frame the new frame, or nullptr to release the current one. Its area of the canvases turns black then.
+	 *     Only the frame's crop region is shown.
+	 * @throw std::runtime_error if the source index is out of range, the frame has an incompatible pixel format or its
+	 *     crop region exceeds it */
+	SCW_EXPORT void update(size_t source, std::unique_ptr<MemoryFrame> frame);
+
+	/** Update the cursor of a source without a new frame, e.g. from a pw::event::CursorMoved.
+	 * The cursor of a frame given to update() is taken as well.
+	 * @throw std::runtime_error if the source index is out of range */
+	SCW_EXPORT void updateCursor(size_t source, const Cursor& sourceCursor);
+
+	/** Blend the cursor into the canvases, for consumers that can't draw it themselves. The canvas frames carry no
+	 * visible cursor then. Disabled by default. */
+	SCW_EXPORT void setDrawCursor(bool enable) noexcept
+	{
+		drawCursor = enable;
+		changed = true;
+	}
+
+	/** Copy the changed sources into a free canvas and return it.
+	 * Its timestamp is the newest one of all sources, and increases by at least a microsecond with each canvas.
+	 * @return the canvas frame, or nullptr if neither a source nor the cursor has changed since the last canvas, or
+	 *     all canvases are in use
+	 * @throw std::bad_alloc if a new canvas could not be allocated */
+	SCW_EXPORT std::unique_ptr<MemoryFrame> compose();
+};
+
+}
+
+#endif //SCREENCAPTURE_CANVASCOMPOSITOR_HPP
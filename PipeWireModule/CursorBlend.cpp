@@ -0,0 +1,118 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#include "CursorBlend.hpp"
+#include <algorithm> // min, max
+#include <utility> // swap
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace pw
+{
+
+static constexpr size_t BYTES_PER_PIXEL = 4;
+
+static constexpr bool isBGR(PixelFormat f)
+{
+	return f == PixelFormat::BGRA || f == PixelFormat::BGRX;
+}
+
+static constexpr bool hasAlpha(PixelFormat f)
+{
+	return f == PixelFormat::BGRA || f == PixelFormat::RGBA;
+}
+
+/** @return x / 255, rounded, for x <= 255 * 255 */
+static inline uint32_t div255(uint32_t x) noexcept
+{
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
+/** Blend one row of premultiplied pixels over the destination: dst = src + dst * (255 - srcAlpha) / 255 */
+static void blendRow(uint8_t* dst, const uint8_t* src, size_t pixels, bool swapRB, bool opaque) noexcept
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i max = _mm_set1_epi16(255);
+	const __m128i round = _mm_set1_epi16(128);
+	const __m128i alphaMask = _mm_set1_epi32(opaque ? static_cast<int>(0xFF000000u) : 0);
+	for (; i + 4 <= pixels; i += 4)
+	{
+		__m128i s = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * BYTES_PER_PIXEL)), alphaMask);
+		__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i * BYTES_PER_PIXEL));
+		__m128i sLo = _mm_unpacklo_epi8(s, zero);
+		__m128i sHi = _mm_unpackhi_epi8(s, zero);
+		if (swapRB)
+		{
+			sLo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(sLo, _MM_SHUFFLE(3, 0, 1, 2)), _MM_SHUFFLE(3, 0, 1, 2));
+			sHi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(sHi, _MM_SHUFFLE(3, 0, 1, 2)), _MM_SHUFFLE(3, 0, 1, 2));
+		}
+		// 255 - alpha of each pixel, in all of its channels
+		__m128i invLo = _mm_sub_epi16(max, _mm_shufflehi_epi16(_mm_shufflelo_epi16(sLo, _MM_SHUFFLE(3, 3, 3, 3)),
+		                                                       _MM_SHUFFLE(3, 3, 3, 3)));
+		__m128i invHi = _mm_sub_epi16(max, _mm_shufflehi_epi16(_mm_shufflelo_epi16(sHi, _MM_SHUFFLE(3, 3, 3, 3)),
+		                                                       _MM_SHUFFLE(3, 3, 3, 3)));
+		__m128i dLo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), invLo), round);
+		__m128i dHi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), invHi), round);
+		dLo = _mm_srli_epi16(_mm_add_epi16(dLo, _mm_srli_epi16(dLo, 8)), 8);
+		dHi = _mm_srli_epi16(_mm_add_epi16(dHi, _mm_srli_epi16(dHi, 8)), 8);
+		__m128i result = _mm_packus_epi16(_mm_add_epi16(dLo, sLo), _mm_add_epi16(dHi, sHi));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * BYTES_PER_PIXEL), result);
+	}
+#endif
+	for (; i < pixels; ++i)
+	{
+		const uint8_t* s = src + i * BYTES_PER_PIXEL;
+		uint8_t* d = dst + i * BYTES_PER_PIXEL;
+		uint8_t c[4] = {s[0], s[1], s[2], opaque ? uint8_t(255) : s[3]};
+		if (swapRB)
+			std::swap(c[0], c[2]);
+		uint32_t inv = 255 - c[3];
+		for (int ch = 0; ch < 4; ++ch)
+			d[ch] = static_cast<uint8_t>(std::min(255u, c[ch] + div255(d[ch] * inv)));
+	}
+}
+
+PixelArea cursorArea(Rect frameSize, const Cursor& cursor) noexcept
+{
+	if (!cursor.visible || !cursor.image)
+		return {};
+	int64_t left = int64_t(cursor.x) - cursor.hotspotX;
+	int64_t top = int64_t(cursor.y) - cursor.hotspotY;
+	int64_t x0 = std::max<int64_t>(left, 0);
+	int64_t y0 = std::max<int64_t>(top, 0);
+	int64_t x1 = std::min<int64_t>(left + cursor.image->width, frameSize.w);
+	int64_t y1 = std::min<int64_t>(top + cursor.image->height, frameSize.h);
+	if (x1 <= x0 || y1 <= y0)
+		return {};
+	return {static_cast<unsigned int>(x0), static_cast<unsigned int>(y0),
+	        static_cast<unsigned int>(x1 - x0), static_cast<unsigned int>(y1 - y0)};
+}
+
+PixelArea blendCursor(uint8_t* pixels, size_t stride, Rect frameSize, PixelFormat format, const Cursor& cursor) noexcept
+{
+	PixelArea area = cursorArea(frameSize, cursor);
+	if (area.w == 0)
+		return area;
+	const common::CursorImage& image = *cursor.image;
+	// the part of the image that is inside the frame
+	size_t imageX = area.x - (int64_t(cursor.x) - cursor.hotspotX);
+	size_t imageY = area.y - (int64_t(cursor.y) - cursor.hotspotY);
+	size_t imageStride = image.width * BYTES_PER_PIXEL;
+	bool swapRB = isBGR(image.format) != isBGR(format);
+	bool opaque = !hasAlpha(image.format);
+	for (unsigned int y = 0; y < area.h; ++y)
+	{
+		blendRow(pixels + (area.y + y) * stride + area.x * BYTES_PER_PIXEL,
+		         image.pixels.get() + (imageY + y) * imageStride + imageX * BYTES_PER_PIXEL,
+		         area.w, swapRB, opaque);
+	}
+	return area;
+}
+
+}
@@ -0,0 +1,41 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#ifndef SCREENCAPTURE_CURSORBLEND_HPP
+#define SCREENCAPTURE_CURSORBLEND_HPP
+
+#include "../common.hpp"
+#include <cstddef>
+#include <cstdint>
+
+namespace pw
+{
+
+using common::Rect;
+using common::PixelFormat;
+using common::Cursor;
+
+/** An area of a frame in pixels */
+struct PixelArea
+{
+	unsigned int x;
+	unsigned int y;
+	unsigned int w;
+	unsigned int h;
+};
+
+/** @return the area of the frame that the cursor image covers, clipped to the frame. Empty if it is not visible. */
+SCW_EXPORT PixelArea cursorArea(Rect frameSize, const Cursor& cursor) noexcept;
+
+/** Draw the cursor into writable pixels of a frame with 4 bytes per pixel, e.g. a copy or a canvas, by alpha blending
+ * its premultiplied image over them. The channels are swapped if the image has the other channel order.
+ * Four pixels are blended at once with SSE2, if available.
+ * @return the area that was drawn over, see cursorArea() */
+SCW_EXPORT PixelArea blendCursor(uint8_t* pixels, size_t stride, Rect frameSize, PixelFormat format,
+                                 const Cursor& cursor) noexcept;
+
+}
+
+#endif //SCREENCAPTURE_CURSORBLEND_HPP
@@ -0,0 +1,135 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#include "CursorState.hpp"
+#include <spa/utils/defs.h>
+#include <spa/debug/types.h>
+#include <spa/param/video/type-info.h>
+#include <cstdio>
+#include <cstring> // memcpy, memcmp
+#include <new> // bad_alloc
+
+namespace pw
+{
+
+static constexpr size_t BYTES_PER_PIXEL = 4;
+
+/** @return false if the cursor can't be described by a PixelFormat */
+static constexpr bool spa2pixelFormat(uint32_t format, common::PixelFormat& out)
+{
+	switch (format)
+	{
+		case SPA_VIDEO_FORMAT_RGBA:
+			out = common::PixelFormat::RGBA;
+			return true;
+		case SPA_VIDEO_FORMAT_RGBx:
+			out = common::PixelFormat::RGBX;
+			return true;
+		case SPA_VIDEO_FORMAT_BGRA:
+			out = common::PixelFormat::BGRA;
+			return true;
+		case SPA_VIDEO_FORMAT_BGRx:
+			out = common::PixelFormat::BGRX;
+			return true;
+		default:
+			return false;
+	}
+}
+
+/** @return the stride of the bitmap, which some compositors leave at 0 for packed rows */
+static inline size_t bitmapStride(const spa_meta_bitmap& mb) noexcept
+{
+	size_t rowBytes = mb.size.width * BYTES_PER_PIXEL;
+	return mb.stride > 0 && static_cast<size_t>(mb.stride) >= rowBytes ? static_cast<size_t>(mb.stride) : rowBytes;
+}
+
+/** @return true if the image has the same size, format and pixels as the bitmap */
+static bool sameImage(const CursorImage& image, const spa_meta_bitmap& mb, common::PixelFormat format) noexcept
+{
+	if (image.width != mb.size.width || image.height != mb.size.height || image.format != format)
+		return false;
+	auto pixels = SPA_MEMBER(&mb, mb.offset, const uint8_t);
+	size_t rowBytes = image.width * BYTES_PER_PIXEL;
+	size_t stride = bitmapStride(mb);
+	for (uint32_t y = 0; y < image.height; ++y)
+		if (std::memcmp(image.pixels.get() + y * rowBytes, pixels + y * stride, rowBytes) != 0)
+			return false;
+	return true;
+}
+
+bool CursorState::update(const spa_meta_cursor& mcs, size_t metaSize) noexcept
+{
+	if (!spa_meta_cursor_is_valid(&mcs))
+	{
+		cursor.visible = false;
+		return false;
+	}
+	cursor.visible = true;
+	cursor.x = mcs.position.x;
+	cursor.y = mcs.position.y;
+	cursor.hotspotX = mcs.hotspot.x;
+	cursor.hotspotY = mcs.hotspot.y;
+	// without a bitmap, the image did not change
+	if (mcs.bitmap_offset < sizeof(mcs))
+		return true;
+
+	// the bitmap and its pixels must lie within the meta, or a broken compositor would make us read past it
+	if (uint64_t(mcs.bitmap_offset) + sizeof(spa_meta_bitmap) > metaSize)
+	{
+		cursor.image = nullptr;
+		return true;
+	}
+	auto mb = SPA_MEMBER(&mcs, mcs.bitmap_offset, const spa_meta_bitmap);
+	common::PixelFormat format;
+	if (mb->size.width == 0 || mb->size.height == 0 || !spa2pixelFormat(mb->format, format)
+	    || uint64_t(mcs.bitmap_offset) + mb->offset + uint64_t(bitmapStride(*mb)) * mb->size.height > metaSize)
+	{
+		// an empty bitmap hides the cursor, unknown formats can't be drawn
+		cursor.image = nullptr;
+		return true;
+	}
+	// some compositors send the bitmap with every position, so only copy it if it differs
+	if (cursor.image && sameImage(*cursor.image, *mb, format))
+		return true;
+
+	uint32_t w = mb->size.width;
+	uint32_t h = mb->size.height;
+	size_t rowBytes = w * BYTES_PER_PIXEL;
+	std::shared_ptr<CursorImage> image;
+	if (cursor.image && cursor.image.use_count() == 1 && cursor.image->width == w && cursor.image->height == h)
+	{
+		// no frame shows the old image anymore, so its buffer can be overwritten
+		image = std::const_pointer_cast<CursorImage>(cursor.image);
+	}
+	else
+	{
+		try
+		{
+			image = std::make_shared<CursorImage>();
+			image->pixels = std::make_unique<uint8_t[]>(rowBytes * h);
+		}
+		catch (const std::bad_alloc&)
+		{
+			cursor.image = nullptr;
+			return true;
+		}
+		image->width = w;
+		image->height = h;
+	}
+	image->format = format;
+	image->serial = nextSerial++;
+	auto pixels = SPA_MEMBER(mb, mb->offset, const uint8_t);
+	size_t stride = bitmapStride(*mb);
+	for (uint32_t y = 0; y < h; ++y)
+		std::memcpy(image->pixels.get() + y * rowBytes, pixels + y * stride, rowBytes);
+	cursor.image = std::move(image);
+#ifndef NDEBUG
+	printf("Cursor: (%d,%d) [%u,%u] %s\n", cursor.x, cursor.y, w, h,
+	       spa_debug_type_find_name(spa_type_video_format, mb->format));
+#endif
+	return true;
+}
+
+}
@@ -0,0 +1,43 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#ifndef SCREENCAPTURE_CURSORSTATE_HPP
+#define SCREENCAPTURE_CURSORSTATE_HPP
+
+#include "../common.hpp"
+#include <cstdint>
+#include <spa/buffer/meta.h>
+
+namespace pw
+{
+
+using common::Cursor;
+using common::CursorImage;
+
+/** The last known cursor of a stream, taken from the SPA_META_Cursor of its buffers.
+ * The image is only copied when the compositor sends a different one, and is shared with all frames that show it. */
+struct CursorState
+{
+	Cursor cursor;
+	/** the serial of the next new image */
+	uint64_t nextSerial;
+
+	CursorState() noexcept
+	: cursor{}, nextSerial(1)
+	{}
+
+	CursorState(const CursorState&) = delete;
+	CursorState& operator=(const CursorState&) = delete;
+
+	/** Take the position and, if the meta contains one that differs from the current image, the bitmap from a cursor
+	 * meta of a buffer. This runs for every frame with cursor metadata.
+	 * @param metaSize the size of the meta, including the bitmap. A bitmap that exceeds it is ignored.
+	 * @return false if the meta is not valid, which hides the cursor */
+	SCW_EXPORT bool update(const spa_meta_cursor& mcs, size_t metaSize) noexcept;
+};
+
+}
+
+#endif //SCREENCAPTURE_CURSORSTATE_HPP
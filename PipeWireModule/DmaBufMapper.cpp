@@ -0,0 +1,277 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#include "DmaBufMapper.hpp"
+#include <algorithm> // find_if, min
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib> // calloc
+#include <cstring> // strerror
+#include <stdexcept> // runtime_error
+#include <string>
+#include <libdrm/drm_fourcc.h>
+#include <linux/dma-buf.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std::string_literals;
+
+namespace pw
+{
+
+struct DmaBufMapper::Mapping
+{
+	void* address;
+	size_t length;
+
+	Mapping(void* address, size_t length) noexcept
+	: address(address),
+	  length(length)
+	{}
+
+	Mapping(const Mapping&) = delete;
+
+	~Mapping() noexcept
+	{
+		munmap(address, length);
+	}
+};
+
+static common::PixelFormat drm2pixelFormat(uint64_t drmFormat)
+{
+	switch (drmFormat)
+	{
+		case DRM_FORMAT_ARGB8888:
+			return common::PixelFormat::BGRA;
+		case DRM_FORMAT_XRGB8888:
+			return common::PixelFormat::BGRX;
+		case DRM_FORMAT_ABGR8888:
+			return common::PixelFormat::RGBA;
+		case DRM_FORMAT_XBGR8888:
+			return common::PixelFormat::RGBX;
+		default:
+			throw std::runtime_error("DmaBufMapper: unsupported DRM format " + std::to_string(drmFormat));
+	}
+}
+
+/** @return 0, or the errno of the ioctl, which is ENOTTY if the file is no DMA-BUF */
+static int syncDmaBuf(int fd, uint64_t flags) noexcept
+{
+	dma_buf_sync sync = {flags};
+	while (ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync) == -1)
+	{
+		if (errno != EINTR && errno != EAGAIN)
+			return errno;
+	}
+	return 0;
+}
+
+DmaBufMapper::DmaBufMapper(size_t maxMappings) noexcept
+: maxMappings(std::max(maxMappings, size_t(1)))
+{}
+
+DmaBufMapper::~DmaBufMapper() noexcept = default;
+
+void DmaBufMapper::clear() noexcept
+{
+	cache.clear();
+}
+
+std::shared_ptr<const DmaBufMapper::Mapping> DmaBufMapper::getMapping(int fd, size_t size)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		throw std::runtime_error("DmaBufMapper: fstat failed: "s + std::strerror(errno));
+
+	auto cached = std::find_if(cache.begin(), cache.end(), [&] (const CachedMapping& c) { return c.fd == fd; });
+	if (cached != cache.end())
+	{
+		CachedMapping c = std::move(*cached);
+		cache.erase(cached);
+		// the fd number may have been reused for another buffer
+		if (c.inode == st.st_ino && c.mapping->length >= size)
+		{
+			cache.push_back(std::move(c));
+			return cache.back().mapping;
+		}
+	}
+
+	if (size == 0)
+	{
+		// DMA-BUFs report their size like a file
+		off_t end = lseek(fd, 0, SEEK_END);
+		if (end <= 0)
+			throw std::runtime_error("DmaBufMapper: could not determine the buffer size");
+		size = static_cast<size_t>(end);
+	}
+	void* address = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (address == MAP_FAILED)
+		throw std::runtime_error("DmaBufMapper: mmap failed: "s + std::strerror(errno));
+	std::shared_ptr<const Mapping> mapping;
+	try
+	{
+		mapping = std::make_shared<const Mapping>(address, size);
+	}
+	catch (...)
+	{
+		munmap(address, size);
+		throw;
+	}
+
+	if (cache.size() >= maxMappings)
+		cache.erase(cache.begin());
+	cache.push_back({fd, st.st_ino, mapping});
+	return mapping;
+}
+
+std::unique_ptr<MemoryFrame> DmaBufMapper::map(std::unique_ptr<DmaBufFrame> frame)
+{
+	if (frame->planeCount != 1 || frame->objectCount < 1)
+		throw std::runtime_error("DmaBufMapper: only frames with one plane can be mapped, got "
+		                         + std::to_string(frame->planeCount));
+	const auto& plane = frame->planes[0];
+	// a DmaBufFrame has room for 4 objects
+	if (frame->objectCount > 4 || plane.objectIndex >= frame->objectCount)
+		throw std::runtime_error("DmaBufMapper: the plane refers to object " + std::to_string(plane.objectIndex)
+		                         + " of " + std::to_string(frame->objectCount));
+	const auto& object = frame->drmObjects[plane.objectIndex];
+	if (object.modifier != DRM_FORMAT_MOD_LINEAR)
+		throw std::runtime_error("DmaBufMapper: only linear frames can be mapped");
+	common::PixelFormat format = drm2pixelFormat(frame->drmFormat);
+
+	size_t rowSize = size_t(frame->width) * 4;
+	if (plane.pitch < rowSize || frame->height == 0)
+		throw std::runtime_error("DmaBufMapper: invalid plane pitch");
+	size_t lastByte = plane.offset + plane.pitch * (frame->height - 1) + rowSize;
+	std::shared_ptr<const Mapping> mapping = getMapping(object.fd, object.totalSize);
+	if (lastByte > mapping->length)
+		throw std::runtime_error("DmaBufMapper: the frame exceeds its buffer");
+
+	auto view = std::make_unique<MemoryFrame>();
+	view->width = frame->width;
+	view->height = frame->height;
+	view->pts = frame->pts;
+	view->format = format;
+	view->memory = mapping->address;
+	view->stride = plane.pitch;
+	view->size = std::min(plane.pitch * frame->height, mapping->length - plane.offset);
+	view->offset = plane.offset;
+	view->crop = frame->crop;
+	view->cursor = frame->cursor;
+	view->onFrameDone = [] () {};
+
+	int fd = object.fd;
+	int err = syncDmaBuf(fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+	if (err != 0 && err != ENOTTY)
+		throw std::runtime_error("DmaBufMapper: DMA_BUF_IOCTL_SYNC failed: "s + std::strerror(err));
+	bool isSynced = err == 0;
+	// the DMA-BUF frame keeps the fd open and the buffer away from the compositor until the view is released
+	view->onFrameDone = [dmaBufFrame = frame.release(), mapping = std::move(mapping), fd, isSynced] ()
+	{
+		if (isSynced)
+			syncDmaBuf(fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+		delete dmaBufFrame;
+	};
+	return view;
+}
+
+}
+
+
+// C interface
+#include <module-pipewire.h>
+#include "EventToCEventConverter.hpp"
+
+struct DmaBufMapper
+{
+	pw::DmaBufMapper cppMapper;
+	common::CursorFromC cursorConverter;
+};
+
+struct DmaBufMapper* DmaBufMapper_create(uint32_t maxMappings)
+{
+	try
+	{
+		return new DmaBufMapper {pw::DmaBufMapper(maxMappings), {}};
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return nullptr;
+	}
+}
+
+void DmaBufMapper_free(struct DmaBufMapper* mapper)
+{
+	delete mapper;
+}
+
+void DmaBufMapper_clear(struct DmaBufMapper* mapper)
+{
+	mapper->cppMapper.clear();
+}
+
+struct MemoryFrame* DmaBufMapper_map(struct DmaBufMapper* mapper, struct DmaBufFrame* c_frame)
+{
+	try
+	{
+		auto frame = std::make_unique<common::DmaBufFrame>();
+		frame->onFrameDone = [c_frame]()
+		{
+			freeDmaBufFrame(c_frame);
+		};
+		frame->width = c_frame->width;
+		frame->height = c_frame->height;
+		frame->pts = std::chrono::nanoseconds(c_frame->pts);
+		frame->drmFormat = c_frame->drmFormat;
+		if (c_frame->objectCount == 0 || c_frame->objectCount > 4 || c_frame->planes[0].objectIndex >= c_frame->objectCount)
+			throw std::runtime_error("DmaBufMapper: invalid DMA-BUF objects");
+		frame->objectCount = c_frame->objectCount;
+		for (uint32_t i = 0; i < 4; ++i)
+		{
+			const auto& o = c_frame->drmObjects[i];
+			frame->drmObjects[i] = {o.fd, o.totalSize, o.modifier};
+		}
+		frame->planeCount = c_frame->planeCount;
+		for (uint32_t i = 0; i < 4; ++i)
+		{
+			const auto& p = c_frame->planes[i];
+			frame->planes[i] = {p.objectIndex, p.offset, p.pitch};
+		}
+		frame->crop = {c_frame->crop.x, c_frame->crop.y, {c_frame->crop.width, c_frame->crop.height}};
+		frame->cursor = mapper->cursorConverter.convert(c_frame->cursor);
+
+		std::unique_ptr<common::MemoryFrame> view = mapper->cppMapper.map(std::move(frame));
+		auto c_view = static_cast<struct MemoryFrame*>(calloc(1, sizeof(struct MemoryFrame)));
+		if (!c_view)
+			return nullptr;
+		c_view->width = view->width;
+		c_view->height = view->height;
+		c_view->pts = view->pts.count();
+		c_view->format = toCFormat(view->format);
+		c_view->memory = view->memory;
+		c_view->stride = view->stride;
+		c_view->size = view->size;
+		c_view->offset = view->offset;
+		c_view->fd = view->fd;
+		c_view->fdOffset = view->fdOffset;
+		c_view->isSealed = view->isSealed;
+		c_view->crop = toCCrop(view->crop);
+		c_view->cursor = toCCursor(view->cursor);
+		c_view->opaque = view.release();
+		c_view->onFrameDone = [](void* opaque)
+		{
+			delete static_cast<common::MemoryFrame*>(opaque);
+		};
+		return c_view;
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return nullptr;
+	}
+}
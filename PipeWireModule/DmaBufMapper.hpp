@@ -0,0 +1,70 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#ifndef SCREENCAPTURE_DMABUFMAPPER_HPP
+#define SCREENCAPTURE_DMABUFMAPPER_HPP
+
+#include "../common.hpp"
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include <sys/types.h>
+
+namespace pw
+{
+
+using common::MemoryFrame;
+using common::DmaBufFrame;
+
+/** Maps DMA-BUF frames for reading on the CPU, for consumers without a GPU pipeline, e.g. analyzers or software
+ * encoders.
+ *
+ * PipeWire cycles through a fixed set of buffers, so each DMA-BUF is mapped only once, and the mapping is cached by
+ * its fd and inode. CPU access is bracketed with DMA_BUF_IOCTL_SYNC from map() until the returned frame is released,
+ * so the CPU sees everything the GPU has written. Files that are no DMA-BUF, like a memfd, are mapped without sync.
+ * Only single-plane RGB frames with the linear modifier can be read this way, tiled or compressed ones need the GPU.
+ *
+ * map() and clear() must be called from the same thread. The returned frames can be released from any thread, and
+ * stay valid after the mapper has been destroyed. */
+class DmaBufMapper
+{
+	struct Mapping;
+
+	struct CachedMapping
+	{
+		int fd;
+		ino_t inode;
+		std::shared_ptr<const Mapping> mapping;
+	};
+
+	/** the most recently used mapping last */
+	std::vector<CachedMapping> cache;
+	size_t maxMappings;
+
+	std::shared_ptr<const Mapping> getMapping(int fd, size_t size);
+
+public:
+	/** @param maxMappings how many buffers to keep mapped, e.g. the buffer count of the stream. The least recently
+	 *     used one is unmapped when more buffers are seen. */
+	SCW_EXPORT explicit DmaBufMapper(size_t maxMappings = 16) noexcept;
+
+	DmaBufMapper(const DmaBufMapper&) = delete;
+	DmaBufMapper& operator=(const DmaBufMapper&) = delete;
+
+	SCW_EXPORT ~DmaBufMapper() noexcept;
+
+	/** Map the frame and return a view of its pixels, which owns the frame until it is released.
+	 * @throw std::runtime_error if the frame is not linear, has several planes, an unsupported format or a plane that
+	 *     refers to a missing object, or could not be mapped. The frame is released then. */
+	SCW_EXPORT std::unique_ptr<MemoryFrame> map(std::unique_ptr<DmaBufFrame> frame);
+
+	/** Forget all cached mappings, e.g. after the stream has been renegotiated with new buffers.
+	 * Frames that are still in use keep their mapping. */
+	SCW_EXPORT void clear() noexcept;
+};
+
+}
+
+#endif //SCREENCAPTURE_DMABUFMAPPER_HPP
@@ -0,0 +1,107 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#ifndef SCREENCAPTURE_EVENTQUEUE_HPP
+#define SCREENCAPTURE_EVENTQUEUE_HPP
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <optional>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <sys/eventfd.h>
+#include <unistd.h> // read, write, close
+
+namespace pw
+{
+
+/** A thread-safe FIFO queue that signals an eventfd while it is not empty, so consumers can poll() for new elements.
+ * Used to pass stream events from the PipeWire loop thread to the application. */
+template <typename T>
+class EventQueue
+{
+	std::deque<T> queue;
+	std::mutex mutex;
+	int eventFd;
+
+public:
+	/** @throw std::runtime_error if the eventfd could not be created */
+	EventQueue()
+	: eventFd(eventfd(0, EFD_CLOEXEC))
+	{
+		if (eventFd == -1)
+		{
+			throw std::runtime_error("eventfd creation failed: " + std::string(strerror(errno)));
+		}
+	}
+
+	EventQueue(const EventQueue&) = delete;
+	EventQueue& operator=(const EventQueue&) = delete;
+
+	~EventQueue() noexcept
+	{
+		close(eventFd);
+	}
+
+	/** Get a file descriptor that becomes readable while the queue is not empty */
+	int getPollFd() const noexcept
+	{
+		return eventFd;
+	}
+
+	void push(T e) noexcept
+	{
+		std::lock_guard lock(mutex);
+		queue.push_back(std::move(e));
+		uint64_t num = 1;
+		write(eventFd, &num, sizeof(num));
+	}
+
+	/** Remove the oldest element from the queue.
+	 * @return the element, or nothing if the queue is empty */
+	std::optional<T> pop() noexcept
+	{
+		std::lock_guard lock(mutex);
+		if (queue.empty())
+			return std::nullopt;
+		auto e = std::move(queue.front());
+		queue.pop_front();
+		if (queue.empty())
+		{
+			// clear eventfd status
+			uint64_t buf;
+			read(eventFd, &buf, sizeof(buf));
+		}
+		return e;
+	}
+
+	/** Call f with every queued element, from the oldest to the newest, while the queue is locked */
+	template <typename F>
+	void forEach(F&& f)
+	{
+		std::lock_guard lock(mutex);
+		for (T& e : queue)
+			f(e);
+	}
+
+	/** Drop all queued elements */
+	void clear() noexcept
+	{
+		std::lock_guard lock(mutex);
+		if (queue.empty())
+			return;
+		queue.clear();
+		// clear eventfd status, which is only set while there are elements (reading it otherwise would block)
+		uint64_t buf;
+		read(eventFd, &buf, sizeof(buf));
+	}
+};
+
+}
+
+#endif //SCREENCAPTURE_EVENTQUEUE_HPP
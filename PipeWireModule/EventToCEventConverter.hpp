@@ -0,0 +1,176 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#ifndef SCREENCAPTURE_EVENTTOCEVENTCONVERTER_HPP
+#define SCREENCAPTURE_EVENTTOCEVENTCONVERTER_HPP
+
+#include "PipeWireStream.hpp"
+#include <module-pipewire.h>
+#include <cstdlib> // calloc
+#include <cstring> // memcpy
+
+static constexpr inline PixelFormat toCFormat(pw::PixelFormat format)
+{
+	switch (format)
+	{
+		case pw::PixelFormat::BGRA:
+			return PixelFormat::BGRA;
+		case pw::PixelFormat::RGBA:
+			return PixelFormat::RGBA;
+		case pw::PixelFormat::BGRX:
+			return PixelFormat::BGRX;
+		case pw::PixelFormat::RGBX:
+			return PixelFormat::RGBX;
+	}
+}
+
+static inline FrameCrop toCCrop(const common::CropRegion& crop)
+{
+	return {crop.x, crop.y, crop.size.w, crop.size.h};
+}
+
+/** The cursor's bitmap points into its image, so the C struct is only valid as long as the C++ cursor */
+static inline FrameCursor toCCursor(const pw::Cursor& cursor)
+{
+	FrameCursor c_cursor = {};
+	c_cursor.visible = cursor.visible;
+	c_cursor.x = cursor.x;
+	c_cursor.y = cursor.y;
+	c_cursor.hotspotX = cursor.hotspotX;
+	c_cursor.hotspotY = cursor.hotspotY;
+	if (cursor.image)
+	{
+		c_cursor.bitmap = cursor.image->pixels.get();
+		c_cursor.width = cursor.image->width;
+		c_cursor.height = cursor.image->height;
+		c_cursor.format = toCFormat(cursor.image->format);
+		c_cursor.serial = cursor.image->serial;
+	}
+	return c_cursor;
+}
+
+/** Converts C++ stream events to the C interface. This runs once per frame for users of the C interface. */
+class EventToCEventConverter
+{
+	PipeWireStream_Event* output_c_event;
+
+public:
+
+	void processEvent(pw::event::Event e, PipeWireStream_Event* output_event)
+	{
+		output_c_event = output_event;
+		std::visit(*this, e);
+	}
+
+	void operator()(pw::event::FormatNegotiated& e)
+	{
+		::Rect c_dimensions = {
+				e.dimensions.w,
+				e.dimensions.h
+		};
+		::PixelFormat c_format = toCFormat(e.format);
+		output_c_event->type = PWSTREAM_EVENT_TYPE_FORMAT_NEGOTIATED;
+		output_c_event->formatNegotiated = {c_dimensions, c_format, e.isDmaBuf};
+	}
+
+	void operator()(pw::event::Connected& e)
+	{
+		::Rect c_dimensions = {
+				e.dimensions.w,
+				e.dimensions.h
+		};
+		::PixelFormat c_format = toCFormat(e.format);
+		output_c_event->type = PWSTREAM_EVENT_TYPE_CONNECTED;
+		output_c_event->connect = {c_dimensions, c_format, e.isDmaBuf};
+	}
+
+	void operator()(pw::event::Disconnected& e)
+	{
+		output_c_event->type = PWSTREAM_EVENT_TYPE_DISCONNECTED;
+		output_c_event->disconnect = {};
+	}
+
+	static void onMemoryFrameDoneWrapper(void* opaque) noexcept
+	{
+		auto cb = static_cast<pw::MemoryFrame*>(opaque);
+		delete cb;
+	}
+
+	static void onDmaBufFrameDoneWrapper(void* opaque) noexcept
+	{
+		auto cb = static_cast<pw::DmaBufFrame*>(opaque);
+		delete cb;
+	}
+
+	static void onCursorUpdateDoneWrapper(void* opaque) noexcept
+	{
+		auto cursor = static_cast<pw::Cursor*>(opaque);
+		delete cursor;
+	}
+
+	void operator()(pw::event::MemoryFrameReceived& e)
+	{
+		std::unique_ptr<common::MemoryFrame>& frame = e.frame;
+		auto c_frame = static_cast<::MemoryFrame*>(calloc(1, sizeof(::MemoryFrame)));
+		c_frame->width = frame->width;
+		c_frame->height = frame->height;
+		c_frame->pts = frame->pts.count();
+		c_frame->format = toCFormat(frame->format);
+		c_frame->memory = frame->memory;
+		c_frame->size = frame->size;
+		c_frame->stride = frame->stride;
+		c_frame->offset = frame->offset;
+		c_frame->fd = frame->fd;
+		c_frame->fdOffset = frame->fdOffset;
+		c_frame->isSealed = frame->isSealed;
+		c_frame->crop = toCCrop(frame->crop);
+		c_frame->cursor = toCCursor(frame->cursor);
+
+		c_frame->opaque = frame.release();
+		c_frame->onFrameDone = &onMemoryFrameDoneWrapper;
+
+		output_c_event->type = PWSTREAM_EVENT_TYPE_MEMORY_FRAME_RECEIVED;
+		output_c_event->memoryFrameReceived = {c_frame};
+	}
+
+	void operator()(pw::event::DmaBufFrameReceived& e)
+	{
+		std::unique_ptr<common::DmaBufFrame>& frame = e.frame;
+		auto c_frame = static_cast<::DmaBufFrame*>(calloc(1, sizeof(::DmaBufFrame)));
+		c_frame->width = frame->width;
+		c_frame->height = frame->height;
+		c_frame->pts = frame->pts.count();
+		c_frame->drmFormat = frame->drmFormat;
+		c_frame->objectCount = frame->objectCount;
+		memcpy(c_frame->drmObjects, frame->drmObjects, sizeof(frame->drmObjects));
+		c_frame->planeCount = frame->planeCount;
+		memcpy(c_frame->planes, frame->planes, sizeof(frame->planes));
+		c_frame->crop = toCCrop(frame->crop);
+		c_frame->cursor = toCCursor(frame->cursor);
+
+		c_frame->opaque = frame.release();
+		c_frame->onFrameDone = &onDmaBufFrameDoneWrapper;
+
+		output_c_event->type = PWSTREAM_EVENT_TYPE_DMA_BUF_RECEIVED;
+		output_c_event->dmaBufFrameReceived = {c_frame};
+	}
+
+	void operator()(pw::event::CursorMoved& e)
+	{
+		auto cursor = new pw::Cursor(std::move(e.cursor));
+		auto c_update = static_cast<::CursorUpdate*>(calloc(1, sizeof(::CursorUpdate)));
+		c_update->cursor = toCCursor(*cursor);
+		c_update->pts = e.pts.count();
+
+		c_update->opaque = cursor;
+		c_update->onDone = &onCursorUpdateDoneWrapper;
+
+		output_c_event->type = PWSTREAM_EVENT_TYPE_CURSOR_MOVED;
+		output_c_event->cursorMoved = {c_update};
+	}
+};
+
+
+#endif //SCREENCAPTURE_EVENTTOCEVENTCONVERTER_HPP
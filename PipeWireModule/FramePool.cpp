@@ -0,0 +1,116 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#include "FramePool.hpp"
+#include <algorithm> // find
+#include <iterator> // next
+#include <cstring>
+#include <new> // bad_alloc
+#include <sys/mman.h>
+
+namespace pw
+{
+
+// size of a huge page on x86-64 and the usual one on aarch64
+static constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+static void* mapBuffer(size_t size) noexcept
+{
+	void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED)
+		return p;
+	// no huge pages reserved, so fall back to transparent huge pages
+	p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return nullptr;
+	madvise(p, size, MADV_HUGEPAGE);
+	return p;
+}
+
+FramePool::FramePool(size_t maxFreeBuffers) noexcept
+: maxFreeBuffers(maxFreeBuffers)
+{}
+
+std::shared_ptr<FramePool> FramePool::create(size_t maxFreeBuffers)
+{
+	return std::shared_ptr<FramePool>(new FramePool(maxFreeBuffers));
+}
+
+FramePool::~FramePool() noexcept
+{
+	for (const Buffer& b : freeBuffers)
+		munmap(b.memory, b.size);
+}
+
+void FramePool::release(void* buffer, size_t size) noexcept
+{
+	std::lock_guard lock(mutex);
+	usedBuffers.erase(std::find(usedBuffers.begin(), usedBuffers.end(), buffer));
+	if (maxFreeBuffers == 0)
+	{
+		munmap(buffer, size);
+		return;
+	}
+	// drop the least recently used buffer, which is likely of an outdated size or a stream that stopped
+	if (freeBuffers.size() >= maxFreeBuffers)
+	{
+		munmap(freeBuffers.front().memory, freeBuffers.front().size);
+		freeBuffers.erase(freeBuffers.begin());
+	}
+	freeBuffers.push_back({buffer, size});
+}
+
+void FramePool::detach(MemoryFrame& frame)
+{
+	size_t size = (frame.size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+	void* buffer = nullptr;
+	common::FrameDoneCallback onFrameDone;
+	{
+		std::lock_guard lock(mutex);
+		auto it = std::find_if(freeBuffers.rbegin(), freeBuffers.rend(), [size] (const Buffer& b)
+		{
+			return b.size == size;
+		});
+		bool isReused = it != freeBuffers.rend();
+		buffer = isReused ? it->memory : mapBuffer(size);
+		if (!buffer)
+			throw std::bad_alloc();
+		// everything that can fail happens before the frame is touched, so it stays unchanged on failure
+		try
+		{
+			onFrameDone = [pool = shared_from_this(), buffer, size]()
+			{
+				pool->release(buffer, size);
+			};
+			usedBuffers.push_back(buffer);
+		}
+		catch (...)
+		{
+			if (!isReused)
+				munmap(buffer, size);
+			throw;
+		}
+		if (isReused)
+			freeBuffers.erase(std::next(it).base());
+	}
+
+	std::memcpy(buffer, static_cast<const uint8_t*>(frame.memory) + frame.offset, frame.size);
+	frame.onFrameDone.swap(onFrameDone);
+	frame.memory = buffer;
+	frame.offset = 0;
+	frame.fd = -1;
+	frame.fdOffset = 0;
+	frame.isSealed = false;
+	// release the original memory last, after the frame no longer refers to it
+	onFrameDone();
+}
+
+bool FramePool::owns(const MemoryFrame& frame) noexcept
+{
+	std::lock_guard lock(mutex);
+	return std::find(usedBuffers.begin(), usedBuffers.end(), frame.memory) != usedBuffers.end();
+}
+
+}
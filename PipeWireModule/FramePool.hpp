@@ -0,0 +1,65 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#ifndef SCREENCAPTURE_FRAMEPOOL_HPP
+#define SCREENCAPTURE_FRAMEPOOL_HPP
+
+#include "../common.hpp"
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace pw
+{
+
+using common::MemoryFrame;
+
+/** A pool of equally sized frame buffers, used for copies of frames whose PipeWire buffer has to be returned early.
+ *
+ * The buffers are backed by huge pages if the system has some reserved, and otherwise by memory that is advised
+ * to use transparent huge pages, so copying a frame causes fewer TLB misses.
+ * Buffers are released from any thread, so the pool is shared by all frames that use one of its buffers.
+ * Frames of different sizes can share a pool, e.g. for several monitors, as buffers are reused by size. */
+class FramePool : public std::enable_shared_from_this<FramePool>
+{
+	struct Buffer
+	{
+		void* memory;
+		size_t size;
+	};
+
+	std::mutex mutex;
+	/** unused buffers, the most recently released last */
+	std::vector<Buffer> freeBuffers;
+	std::vector<const void*> usedBuffers;
+	size_t maxFreeBuffers;
+
+	FramePool(size_t maxFreeBuffers) noexcept;
+
+	void release(void* buffer, size_t size) noexcept;
+
+public:
+	/** @param maxFreeBuffers how many unused buffers to keep for reuse, the least recently released ones are unmapped
+	 *     when more are released */
+	SCW_EXPORT static std::shared_ptr<FramePool> create(size_t maxFreeBuffers = 4);
+
+	FramePool(const FramePool&) = delete;
+	FramePool& operator=(const FramePool&) = delete;
+
+	SCW_EXPORT ~FramePool() noexcept;
+
+	/** Copy the pixel data of the frame into a buffer of this pool and release the frame's original memory
+	 * by calling its onFrameDone callback. Afterwards, the frame owns the pool buffer.
+	 * @throw std::bad_alloc if no buffer could be allocated, the frame is unchanged then */
+	SCW_EXPORT void detach(MemoryFrame& frame);
+
+	/** @return true if the frame's memory is a buffer of this pool, i.e. it has already been detached */
+	SCW_EXPORT bool owns(const MemoryFrame& frame) noexcept;
+};
+
+}
+
+#endif //SCREENCAPTURE_FRAMEPOOL_HPP
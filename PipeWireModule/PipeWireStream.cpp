@@ -4,6 +4,7 @@
    SPDX-License-Identifier: GPL-3.0-or-later
 *******************************************************************************/
 #include "PipeWireStream.hpp"
+#include "../trace.hpp"
 #include <spa/param/video/format-utils.h>
 #include <spa/pod/pod.h>
 #include <spa/debug/format.h>
@@ -12,11 +13,10 @@
 #include <cassert>
 #include <cerrno>
 #include <stdexcept> // runtime_error
-#include <algorithm> // max
+#include <algorithm> // max, clamp
 #include <string>
 #include <libdrm/drm_fourcc.h>
-#include <sys/eventfd.h>
-#include <unistd.h> // read, write
+#include <fcntl.h> // F_GET_SEALS
 
 using namespace std::chrono;
 using namespace std::string_literals;
@@ -70,6 +70,37 @@ static constexpr inline PixelFormat spa2pixelFormat(spa_video_format format)
 	}
 }
 
+/** Copy the frame into a pool buffer and return its PipeWire buffer */
+static void copyOnHold(FramePool& pool, stats::PipelineStats& stats, MemoryFrame& f) noexcept
+{
+	try
+	{
+		pool.detach(f);
+		stats.framesCopiedOnHold.fetch_add(1, std::memory_order_relaxed);
+		trace::instant("copy on hold", duration_cast<microseconds>(f.pts).count());
+	}
+	catch (const std::bad_alloc&)
+	{
+		// keep holding the PipeWire buffer then
+	}
+}
+
+/** @return the region of the buffer's crop metadata, clipped to the frame, or an empty one for the whole frame */
+static CropRegion readCrop(spa_buffer* buffer, uint32_t width, uint32_t height) noexcept
+{
+	auto crop = static_cast<spa_meta_region*>(spa_buffer_find_meta_data(buffer, SPA_META_VideoCrop, sizeof(spa_meta_region)));
+	if (!crop || !spa_meta_region_is_valid(crop))
+		return {};
+	const spa_region& r = crop->region;
+	int64_t x0 = std::clamp<int64_t>(r.position.x, 0, width);
+	int64_t y0 = std::clamp<int64_t>(r.position.y, 0, height);
+	int64_t x1 = std::clamp<int64_t>(int64_t(r.position.x) + r.size.width, 0, width);
+	int64_t y1 = std::clamp<int64_t>(int64_t(r.position.y) + r.size.height, 0, height);
+	if (x1 <= x0 || y1 <= y0 || (x1 - x0 == width && y1 - y0 == height))
+		return {};
+	return {static_cast<unsigned int>(x0), static_cast<unsigned int>(y0),
+	        {static_cast<unsigned int>(x1 - x0), static_cast<unsigned int>(y1 - y0)}};
+}
 
 void processFrame(void* userData) noexcept
 {
@@ -78,35 +109,33 @@ void processFrame(void* userData) noexcept
 	if (pw_stream_get_state(si->stream, nullptr) != PW_STREAM_STATE_STREAMING)
 		return;
 
+	stats::StageTimer timer(si->stats, stats::Stage::CAPTURE);
 	pw_buffer* b = pw_stream_dequeue_buffer(si->stream);
+	auto dequeueTime = steady_clock::now();
 	if (!b) {
 		// out of buffers
+		si->stats->drop(stats::DropReason::NO_BUFFER);
+		trace::instant("drop: no buffer", -1);
 		return;
 	}
+	si->stats->framesCaptured.fetch_add(1, std::memory_order_relaxed);
 
-	spa_meta_cursor *mcs;
-	mcs = static_cast<spa_meta_cursor*>(spa_buffer_find_meta_data(b->buffer, SPA_META_Cursor, sizeof(*mcs)));
-	if (mcs && spa_meta_cursor_is_valid(mcs))
+	spa_meta* cursorMeta = spa_buffer_find_meta(b->buffer, SPA_META_Cursor);
+	if (cursorMeta && cursorMeta->size >= sizeof(spa_meta_cursor))
+		si->cursor.update(*static_cast<spa_meta_cursor*>(cursorMeta->data), cursorMeta->size);
+
+	// without damage metadata, every frame counts as changed
+	bool hasDamage = true;
+	if (spa_meta* damage = spa_buffer_find_meta(b->buffer, SPA_META_VideoDamage))
 	{
-		si->cursorPos.x = mcs->position.x;
-		si->cursorPos.y = mcs->position.y;
-		if (mcs->bitmap_offset >= sizeof(*mcs))
-		{
-			spa_meta_bitmap* mb = SPA_MEMBER(mcs, mcs->bitmap_offset, struct spa_meta_bitmap);
-			si->cursorBitmap.w = mb->size.width;
-			si->cursorBitmap.h = mb->size.height;
-			const uint8_t* bitmap = SPA_MEMBER(mb, mb->offset, uint8_t);
-			size_t size = si->cursorBitmap.w * si->cursorBitmap.h * 4;
-			if (si->cursorBitmap.bitmap)
-				delete[] si->cursorBitmap.bitmap;
-			si->cursorBitmap.bitmap = new uint8_t[size];
-			std::memcpy(si->cursorBitmap.bitmap, bitmap, size);
-#ifndef NDEBUG
-			printf("Cursor: (%d,%d) [%d,%d] %s\n", si->cursorPos.x, si->cursorPos.y,
-					si->cursorBitmap.w, si->cursorBitmap.h, spa_debug_type_find_name(spa_type_video_format, mb->format));
-#endif
-		}
+		// the regions end with the first invalid one, so the frame is damaged if the first is valid
+		auto region = static_cast<spa_meta_region*>(spa_meta_first(damage));
+		hasDamage = spa_meta_check(region, damage) && spa_meta_region_is_valid(region);
 	}
+	if (hasDamage)
+		si->lastDamageTime = dequeueTime;
+	// while idle, frames are copied, so the buffers can be reallocated when the full framerate is restored
+	bool isIdle = si->throttleState == StreamInfo::ThrottleState::IDLE;
 
 	nanoseconds pts;
 	spa_meta_header* header;
@@ -120,8 +149,16 @@ void processFrame(void* userData) noexcept
 		auto now = steady_clock::now();
 		pts = now - si->startTime;
 	}
+	trace::Scope traceScope("capture", duration_cast<microseconds>(pts).count());
 
 	spa_data& d = b->buffer->datas[0];
+	if (mcs && d.chunk->size == 0)
+	{
+		// the compositor only updated the cursor, the buffer has no frame
+		pwStream->enqueueEvent(event::CursorMoved{si->cursor.cursor, pts});
+		pw_stream_queue_buffer(si->stream, b);
+		return;
+	}
 	if (d.type == SPA_DATA_MemPtr || d.type == SPA_DATA_MemFd)
 	{
 #ifndef NDEBUG
@@ -139,10 +176,23 @@ void processFrame(void* userData) noexcept
 		f->stride = static_cast<size_t>(d.chunk->stride);
 		f->size = d.chunk->size;
 		f->offset = d.chunk->offset;
-		f->onFrameDone = [si, b]()
+		if (d.type == SPA_DATA_MemFd)
+		{
+			f->fd = static_cast<int>(d.fd);
+			f->fdOffset = d.mapoffset;
+			f->isSealed = b->user_data != nullptr;
+		}
+		f->crop = readCrop(b->buffer, f->width, f->height);
+		f->cursor = si->cursor.cursor;
+		f->onFrameDone = [si, b, dequeueTime]()
 		{
+			si->stats->recordHoldTime(steady_clock::now() - dequeueTime);
+			si->stats->buffersHeld.fetch_sub(1, std::memory_order_relaxed);
 			pw_stream_queue_buffer(si->stream, b);
 		};
+		int64_t held = si->stats->buffersHeld.fetch_add(1, std::memory_order_relaxed);
+		if (isIdle || (si->copyOnHold.maxHeldBuffers > 0 && held >= static_cast<int64_t>(si->copyOnHold.maxHeldBuffers)))
+			copyOnHold(*si->framePool, *si->stats, *f);
 		pwStream->enqueueEvent(event::MemoryFrameReceived{std::move(f)});
 	}
 	else if (d.type == SPA_DATA_DmaBuf)
@@ -159,25 +209,89 @@ void processFrame(void* userData) noexcept
 		f->height = si->format.info.raw.size.height;
 		f->pts = pts;
 		f->drmFormat = spa2drmFormat(si->format.info.raw.format);
-		f->drmObject = {
-				.fd = static_cast<int>(b->buffer->datas[0].fd),
-				.totalSize = b->buffer->datas[0].maxsize,
-				.modifier = si->format.info.raw.modifier,
-		};
+		f->objectCount = 0;
 		f->planeCount = planeCount;
-		f->onFrameDone = [si, b]()
+		f->crop = readCrop(b->buffer, f->width, f->height);
+		f->cursor = si->cursor.cursor;
+		f->onFrameDone = [si, b, dequeueTime]()
 		{
+			si->stats->recordHoldTime(steady_clock::now() - dequeueTime);
+			si->stats->buffersHeld.fetch_sub(1, std::memory_order_relaxed);
 			pw_stream_queue_buffer(si->stream, b);
 		};
+		si->stats->buffersHeld.fetch_add(1, std::memory_order_relaxed);
+		// planes in the same DMA-BUF share its fd, others (like compression metadata) have their own
 		for (unsigned int l = 0; l < planeCount; ++l)
 		{
+			spa_data& planeData = b->buffer->datas[l];
+			int fd = static_cast<int>(planeData.fd);
+			uint32_t object = 0;
+			while (object < f->objectCount && f->drmObjects[object].fd != fd)
+				++object;
+			if (object == f->objectCount)
+			{
+				f->drmObjects[object] = {fd, planeData.maxsize, si->format.info.raw.modifier};
+				++f->objectCount;
+			}
 			auto& plane = f->planes[l];
-			spa_chunk& chunk = *b->buffer->datas[l].chunk;
-			plane.offset = chunk.offset;
-			plane.pitch = chunk.stride;
+			plane.objectIndex = object;
+			plane.offset = planeData.chunk->offset;
+			plane.pitch = planeData.chunk->stride;
 		}
 		pwStream->enqueueEvent(event::DmaBufFrameReceived{std::move(f)});
 	}
+
+	if (isIdle && hasDamage)
+	{
+		trace::instant("throttle: active", -1);
+		si->throttleState = StreamInfo::ThrottleState::NONE;
+		renegotiateFormat(pwStream, si->options, true);
+	}
+}
+
+void checkHeldFrames(void* userData, uint64_t) noexcept
+{
+	auto pwStream = static_cast<pw::PipeWireStream*>(userData);
+	auto si = &pwStream->streamData;
+	std::vector<const MemoryFrame*> stillWaiting;
+	pwStream->eventQueue.forEach([&] (event::Event& e)
+	{
+		auto m = std::get_if<event::MemoryFrameReceived>(&e);
+		if (!m || si->framePool->owns(*m->frame))
+			return;
+		// this check runs twice per maxHoldTime, so a frame that already waited during the last one is old enough
+		bool waitedBefore = std::find(si->waitingFrames.begin(), si->waitingFrames.end(), m->frame.get())
+				!= si->waitingFrames.end();
+		if (waitedBefore)
+			copyOnHold(*si->framePool, *si->stats, *m->frame);
+		else
+			stillWaiting.push_back(m->frame.get());
+	});
+	si->waitingFrames = std::move(stillWaiting);
+}
+
+int updateCopyOnHold(spa_loop*, bool, uint32_t, const void* data, size_t, void* userData) noexcept
+{
+	auto pwStream = static_cast<pw::PipeWireStream*>(userData);
+	auto si = &pwStream->streamData;
+	si->copyOnHold = *static_cast<const CopyOnHoldPolicy*>(data);
+	si->waitingFrames.clear();
+
+	pw_loop* loop = pw_main_loop_get_loop(pwStream->mainLoop);
+	if (si->copyOnHold.maxHoldTime.count() > 0)
+	{
+		if (!si->holdWatchdog)
+			si->holdWatchdog = pw_loop_add_timer(loop, checkHeldFrames, pwStream);
+		auto half = duration_cast<nanoseconds>(si->copyOnHold.maxHoldTime) / 2;
+		timespec interval = {static_cast<time_t>(duration_cast<seconds>(half).count()),
+		                     static_cast<long>((half % seconds(1)).count())};
+		pw_loop_update_timer(loop, si->holdWatchdog, &interval, &interval, false);
+	}
+	else if (si->holdWatchdog)
+	{
+		pw_loop_update_timer(loop, si->holdWatchdog, nullptr, nullptr, false);
+	}
+	return 0;
 }
 
 void streamStateChanged(void* userData, pw_stream_state old, pw_stream_state nw, const char* msg) noexcept
@@ -185,6 +299,18 @@ void streamStateChanged(void* userData, pw_stream_state old, pw_stream_state nw,
 	auto pwStream = static_cast<pw::PipeWireStream*>(userData);
 	pwStream->streamData.state = nw;
 	printf("\x1b[1mStream state changed:\x1b[0m old: %s, new: %s, msg: %s\n", pw_stream_state_as_string(old), pw_stream_state_as_string(nw), msg);
+	// paused or renegotiated by the throttling, the application continues with the same format
+	auto& si = pwStream->streamData;
+	if (old == PW_STREAM_STATE_STREAMING && nw == PW_STREAM_STATE_PAUSED && si.hiddenPauses > 0)
+	{
+		--si.hiddenPauses;
+		return;
+	}
+	if (old == PW_STREAM_STATE_PAUSED && nw == PW_STREAM_STATE_STREAMING && si.hiddenResumes > 0)
+	{
+		--si.hiddenResumes;
+		return;
+	}
 	if (old == PW_STREAM_STATE_PAUSED && nw == PW_STREAM_STATE_STREAMING)
 	{
 		auto& raw = pwStream->streamData.format.info.raw;
@@ -205,34 +331,17 @@ void streamStateChanged(void* userData, pw_stream_state old, pw_stream_state nw,
 	(sizeof(struct spa_meta_cursor) + sizeof(struct spa_meta_bitmap) + \
 	 width * height * 4)
 
-void streamParamChanged(void* userdata, uint32_t paramID, const spa_pod* param) noexcept
+/** Request buffers and metadata for the negotiated format, with the number of buffers from the stream options */
+void updateBufferParams(PipeWireStream* pwStream) noexcept
 {
-	if (!param || paramID != SPA_PARAM_Format)
-		return;
-	auto pwStream = static_cast<pw::PipeWireStream*>(userdata);
 	auto si = &pwStream->streamData;
-	if (spa_format_parse(param, &si->format.media_type, &si->format.media_subtype) < 0)
-		return;
-	if (spa_format_video_raw_parse(param, &si->format.info.raw) < 0)
-		return;
-
-	const spa_pod_prop* modifier = spa_pod_find_prop(param, nullptr, SPA_FORMAT_VIDEO_modifier);
-	si->haveDmaBuf = modifier != nullptr;
-
-	auto& formatInfo = si->format.info.raw;
-	printf("Video format:\n\t%s (%#x)\n\tsize = %ux%u\n\tframerate = %d/%d\n\tmodifier = %#lx\n",
-			spa_debug_type_find_name(spa_type_video_format, formatInfo.format), formatInfo.format,
-			formatInfo.size.width, formatInfo.size.height,
-			formatInfo.framerate.num, formatInfo.framerate.denom,
-			formatInfo.modifier);
-
-
-	char buffer[0x100];
+	int bufferCount = static_cast<int>(std::max(si->options.bufferCount, 1u));
+	char buffer[0x400];
 	spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
 	uint32_t bufferTypes = (1 << SPA_DATA_MemPtr) | (1 << SPA_DATA_MemFd);
-	if (modifier)
+	if (si->haveDmaBuf)
 		bufferTypes |= (1 << SPA_DATA_DmaBuf);
-	const spa_pod* params[3];
+	const spa_pod* params[5];
 	params[0] = static_cast<spa_pod*>(spa_pod_builder_add_object(&b,
 			SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
 			SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Cursor),
@@ -249,19 +358,104 @@ void streamParamChanged(void* userdata, uint32_t paramID, const spa_pod* param)
 	));
 	params[2] = static_cast<spa_pod*>(spa_pod_builder_add_object(&b,
 			SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
-			SPA_PARAM_BUFFERS_buffers, SPA_POD_Int(16),
+			SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(bufferCount, 1, bufferCount),
 			SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int(bufferTypes)
 	));
-	assert(params[0] && params[1] && params[2] && params[0]->size + params[1]->size + params[2]->size <= sizeof(buffer));
+	// damaged regions tell the throttling whether the screen changed
+	params[3] = static_cast<spa_pod*>(spa_pod_builder_add_object(&b,
+			SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+			SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoDamage),
+			SPA_PARAM_META_size, SPA_POD_CHOICE_RANGE_Int(
+					sizeof(spa_meta_region) * 16,
+					sizeof(spa_meta_region) * 1,
+					sizeof(spa_meta_region) * 16
+			)
+	));
+	// window captures have a larger buffer than the window, with the window's region in the crop metadata
+	params[4] = static_cast<spa_pod*>(spa_pod_builder_add_object(&b,
+			SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+			SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoCrop),
+			SPA_PARAM_META_size, SPA_POD_Int(sizeof(spa_meta_region))
+	));
+	assert(params[0] && params[1] && params[2] && params[3] && params[4]);
 
 	pw_stream_update_params(si->stream, params, sizeof(params)/sizeof(params[0]));
 }
 
+void streamParamChanged(void* userdata, uint32_t paramID, const spa_pod* param) noexcept
+{
+	if (!param || paramID != SPA_PARAM_Format)
+		return;
+	auto pwStream = static_cast<pw::PipeWireStream*>(userdata);
+	auto si = &pwStream->streamData;
+	spa_video_info_raw oldFormat = si->format.info.raw;
+	bool hadDmaBuf = si->haveDmaBuf;
+	if (spa_format_parse(param, &si->format.media_type, &si->format.media_subtype) < 0)
+		return;
+	if (spa_format_video_raw_parse(param, &si->format.info.raw) < 0)
+		return;
+
+	const spa_pod_prop* modifier = spa_pod_find_prop(param, nullptr, SPA_FORMAT_VIDEO_modifier);
+	si->haveDmaBuf = modifier != nullptr;
+
+	auto& formatInfo = si->format.info.raw;
+	printf("Video format:\n\t%s (%#x)\n\tsize = %ux%u\n\tframerate = %d/%d\n\tmodifier = %#lx\n",
+			spa_debug_type_find_name(spa_type_video_format, formatInfo.format), formatInfo.format,
+			formatInfo.size.width, formatInfo.size.height,
+			formatInfo.framerate.num, formatInfo.framerate.denom,
+			formatInfo.modifier);
+
+	bool sameFormat = oldFormat.format == formatInfo.format
+			&& oldFormat.size.width == formatInfo.size.width && oldFormat.size.height == formatInfo.size.height
+			&& hadDmaBuf == si->haveDmaBuf;
+	bool hidden = si->hideRenegotiation;
+	si->hideRenegotiation = false;
+	if (hidden && sameFormat)
+	{
+		// only the framerate changed for throttling
+		updateBufferParams(pwStream);
+		return;
+	}
+	// the application sees the new format, so it must also see the stream starting again
+	si->hiddenPauses = si->hiddenResumes = 0;
+
+	try
+	{
+		// tell the consumer about the format right away, so it can prepare for frames while the stream starts
+		pwStream->enqueueEvent(event::FormatNegotiated {
+			Rect {formatInfo.size.width, formatInfo.size.height},
+			spa2pixelFormat(formatInfo.format),
+			si->haveDmaBuf
+		});
+	}
+	catch (const std::exception& e)
+	{
+		// the format is not representable as PixelFormat; Connected will not be sent either
+		fprintf(stderr, "%s\n", e.what());
+	}
+
+	updateBufferParams(pwStream);
+}
+
+
+/** Check the seals of a memfd buffer once, instead of with every frame */
+static void addBuffer(void*, pw_buffer* b) noexcept
+{
+	b->user_data = nullptr;
+	spa_data& d = b->buffer->datas[0];
+	if (b->buffer->n_datas == 0 || d.type != SPA_DATA_MemFd)
+		return;
+	int seals = fcntl(static_cast<int>(d.fd), F_GET_SEALS);
+	// marks the buffer as sealed, see MemoryFrame::isSealed
+	if (seals != -1 && (seals & F_SEAL_SHRINK))
+		b->user_data = b;
+}
 
 static const pw_stream_events streamEvents = {
 		.version = PW_VERSION_STREAM_EVENTS,
 		.state_changed = streamStateChanged,
 		.param_changed = streamParamChanged,
+		.add_buffer = addBuffer,
 		.process = processFrame,
 };
 
@@ -284,14 +478,18 @@ static const pw_core_events coreEvents = {
 		.error = coreError,
 };
 
-static const spa_pod* buildStreamParams(spa_pod_builder& b, bool withDMABuf)
+static const spa_pod* buildStreamParams(spa_pod_builder& b, bool withDMABuf, const StreamOptions& options)
 {
 	auto sizeDefault = SPA_RECTANGLE(1280, 720);
 	auto sizeMin = SPA_RECTANGLE(1, 1);
 	auto sizeMax = SPA_RECTANGLE(4096, 4096);
-	auto rateDefault = SPA_FRACTION(30, 1);
+	uint32_t maxFramerate = std::max(options.maxFramerate, 1u);
+	auto rateDefault = SPA_FRACTION(std::clamp(options.preferredFramerate, 1u, maxFramerate), 1);
 	auto rateMin = SPA_FRACTION(0, 1);
-	auto rateMax = SPA_FRACTION(240, 1);
+	auto rateMax = SPA_FRACTION(maxFramerate, 1);
+	// compositors with a variable framerate announce 0/1 as framerate and limit the rate with maxFramerate
+	auto maxRateDefault = rateMax;
+	auto maxRateMin = SPA_FRACTION(1, 1);
 	spa_pod_frame f, f2;
 	spa_pod_builder_push_object(&b, &f, SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat);
 	spa_pod_builder_add(&b, SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video), 0);
@@ -304,6 +502,8 @@ static const spa_pod* buildStreamParams(spa_pod_builder& b, bool withDMABuf)
 	                                           SPA_VIDEO_FORMAT_RGBA), 0);
 	spa_pod_builder_add(&b, SPA_FORMAT_VIDEO_size,      SPA_POD_CHOICE_RANGE_Rectangle(&sizeDefault, &sizeMin, &sizeMax), 0);
 	spa_pod_builder_add(&b, SPA_FORMAT_VIDEO_framerate, SPA_POD_CHOICE_RANGE_Fraction(&rateDefault, &rateMin, &rateMax), 0);
+	spa_pod_builder_add(&b, SPA_FORMAT_VIDEO_maxFramerate,
+	                    SPA_POD_CHOICE_RANGE_Fraction(&maxRateDefault, &maxRateMin, &rateMax), 0);
 	if (withDMABuf)
 	{
 		spa_pod_builder_prop(&b, SPA_FORMAT_VIDEO_modifier,
@@ -354,65 +554,99 @@ static const spa_pod* buildStreamParams(spa_pod_builder& b, bool withDMABuf)
 	return static_cast<const spa_pod*>(spa_pod_builder_pop(&b, &f));
 }
 
-PipeWireStream::PipeWireStream(const SharedScreen& shareInfo, bool supportDmaBuf)
-: mainLoop{pw_main_loop_new(nullptr)},
-  ctx{pw_context_new(pw_main_loop_get_loop(mainLoop), nullptr, 0)},
-  core{},
-  streamData{},
-  eventFd{-1}
+/** Connect to the PipeWire instance given by the shared file descriptor, or the local daemon if there is none */
+static pw_core* connectCore(pw_context* ctx, int pipeWireFd)
 {
-	eventFd = eventfd(0, EFD_CLOEXEC);
-	if (eventFd == -1)
-	{
-		throw std::runtime_error("eventfd creation failed"s + strerror(errno));
-	}
-
-	// first connect to the PipeWire instance given by the shared file descriptor
-	core = pw_context_connect_fd(ctx, shareInfo.pipeWireFd, nullptr, 0);
+	pw_core* core;
+	if (pipeWireFd >= 0)
+		core = pw_context_connect_fd(ctx, pipeWireFd, nullptr, 0);
+	else
+		core = pw_context_connect(ctx, nullptr, 0);
 	if (!core)
 	{
 		throw std::runtime_error("PipeWire connection failed");
 	}
+	return core;
+}
+
+PipeWireStream::PipeWireStream(const SharedScreen& shareInfo, bool supportDmaBuf, const StreamOptions& options,
+                               const ThreadConfig& loopThreadConfig)
+: mainLoop{pw_main_loop_new(nullptr)},
+  ownsLoop{true},
+  ctx{pw_context_new(pw_main_loop_get_loop(mainLoop), nullptr, 0)},
+  core{},
+  streamData{},
+  pipelineStats(stats::PipelineStats::create())
+{
+	streamData.framePool = FramePool::create();
 
+	core = connectCore(ctx, shareInfo.pipeWireFd);
 	// register callbacks for core info and error events
 	pw_core_add_listener(core, &coreListener, &coreEvents, this);
 
-	// create a new video stream with our stream event callbacks
+	connectStream(core, shareInfo.pipeWireNode, supportDmaBuf, options);
+
+	mainLoopThread = std::thread([mainLoop = this->mainLoop, loopThreadConfig]() {
+		common::setCurrentThreadName("scw-pw-loop");
+		common::applyThreadConfig(loopThreadConfig);
+		pw_main_loop_run(mainLoop);
+	});
+}
+
+PipeWireStream::PipeWireStream(pw_main_loop* mainLoop, pw_core* core, uint32_t pipeWireNode, bool supportDmaBuf,
+                               const StreamOptions& options, std::shared_ptr<FramePool> framePool)
+: mainLoop{mainLoop},
+  ownsLoop{false},
+  ctx{},
+  core{},
+  streamData{},
+  pipelineStats(stats::PipelineStats::create())
+{
+	streamData.framePool = std::move(framePool);
+	connectStream(core, pipeWireNode, supportDmaBuf, options);
+}
+
+void PipeWireStream::connectStream(pw_core* pwCore, uint32_t pipeWireNode, bool supportDmaBuf,
+                                   const StreamOptions& options)
+{
+	streamData.stats = pipelineStats.get();
+	streamData.options = options;
+	streamData.supportDmaBuf = supportDmaBuf;
+
+	// create a new video stream on the core, so it uses the connection to the shared PipeWire instance
 	pw_properties* props = pw_properties_new(PW_KEY_MEDIA_TYPE, "Video",
 											 PW_KEY_MEDIA_CATEGORY, "Capture",
 											 PW_KEY_MEDIA_ROLE, "Screen", nullptr);
-	streamData.stream = pw_stream_new_simple(pw_main_loop_get_loop(mainLoop), "GfxTablet ScreenCapture",
-	                                         props, &streamEvents, this);
+	streamData.stream = pw_stream_new(pwCore, "GfxTablet ScreenCapture", props);
 	if (!streamData.stream)
 	{
 		throw std::runtime_error("Could not create stream");
 	}
+	// register our stream event callbacks
+	pw_stream_add_listener(streamData.stream, &streamData.streamListener, &streamEvents, this);
 
 	// build a parameters list for our stream and connect it to the shared PipeWire node ID
-	char buffer[0x300];
+	char buffer[0x400];
 	spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
 	const spa_pod* params[2];
 
-	params[0] = buildStreamParams(b, supportDmaBuf);
-	params[1] = buildStreamParams(b, false);
+	params[0] = buildStreamParams(b, supportDmaBuf, options);
+	params[1] = buildStreamParams(b, false, options);
 
 	assert(params[0] && params[1] && params[0]->size + params[1]->size <= sizeof(buffer));
 
-	if (pw_stream_connect(streamData.stream, PW_DIRECTION_INPUT, shareInfo.pipeWireNode,
+	if (pw_stream_connect(streamData.stream, PW_DIRECTION_INPUT, pipeWireNode,
 	                      static_cast<pw_stream_flags>(PW_STREAM_FLAG_MAP_BUFFERS | PW_STREAM_FLAG_AUTOCONNECT),
 	                      params, sizeof(params)/sizeof(params[0])) < 0)
 	{
 		throw std::runtime_error("Stream connect failed");
 	}
-
-	mainLoopThread = std::thread([mainLoop = this->mainLoop]() {
-		pw_main_loop_run(mainLoop);
-	});
 }
 
 PipeWireStream::~PipeWireStream() noexcept
 {
-	if (mainLoop)
+	// a group stops its loop before destroying its streams
+	if (ownsLoop && mainLoop)
 	{
 		if (streamData.stream)
 		{
@@ -430,21 +664,20 @@ PipeWireStream::~PipeWireStream() noexcept
 	// wait for main loop termination to make sure *this is not used concurrently afterward
 	if (mainLoopThread.joinable())
 		mainLoopThread.join();
+	if (streamData.holdWatchdog)
+		pw_loop_destroy_source(pw_main_loop_get_loop(mainLoop), streamData.holdWatchdog);
+	if (streamData.throttleTimer)
+		pw_loop_destroy_source(pw_main_loop_get_loop(mainLoop), streamData.throttleTimer);
 	// clear the event queue before destroying the stream or anything else, as the events might still reference it
-	while(!eventQueue.empty())
-		eventQueue.pop();
+	eventQueue.clear();
 	if (streamData.stream)
 	{
 		pw_stream_disconnect(streamData.stream);
 		pw_stream_destroy(streamData.stream);
 	}
-	if (eventFd != -1)
-		close(eventFd);
-	if (streamData.cursorBitmap.bitmap)
-		delete[] streamData.cursorBitmap.bitmap;
 	if (core) pw_core_disconnect(core);
 	if (ctx) pw_context_destroy(ctx);
-	if (mainLoop) pw_main_loop_destroy(mainLoop);
+	if (ownsLoop && mainLoop) pw_main_loop_destroy(mainLoop);
 }
 
 std::optional<pw::event::Event> PipeWireStream::nextEvent()
@@ -460,141 +693,298 @@ std::optional<pw::event::Event> PipeWireStream::nextEvent()
 		pw_stream_get_state(streamData.stream, &error);
 		throw std::runtime_error("PipeWireStream::pollEvent called, but stream is in failed state. Reason: "s + error);
 	}
-	std::lock_guard lock(eventQueueMutex);
-	if (!eventQueue.empty())
-	{
-		auto event = std::move(eventQueue.front());
-		eventQueue.pop();
-		if (eventQueue.empty())
-		{
-			// clear eventfd status
-			char buf[8];
-			read(eventFd, buf, sizeof(buf));
-		}
-		return event;
-	}
-	return std::nullopt;
+	auto e = eventQueue.pop();
+	if (e && (std::holds_alternative<event::MemoryFrameReceived>(*e)
+	          || std::holds_alternative<event::DmaBufFrameReceived>(*e)))
+		pipelineStats->framesDelivered.fetch_add(1, std::memory_order_relaxed);
+	return e;
 }
 
-void PipeWireStream::enqueueEvent(pw::event::Event e) noexcept
+void PipeWireStream::setCopyOnHold(const CopyOnHoldPolicy& policy) noexcept
 {
-	std::lock_guard lock(eventQueueMutex);
-	eventQueue.push(std::move(e));
-	uint64_t num = 1;
-	write(eventFd, &num, sizeof(num));
+	// the policy is only used on the loop thread, so change it there
+	pw_loop_invoke(pw_main_loop_get_loop(mainLoop), updateCopyOnHold, 0, &policy, sizeof(policy), true, this);
 }
 
-int PipeWireStream::getEventPollFd() noexcept
+/** Update the format parameters, so the compositor chooses a format again
+ * @param hidden don't report the renegotiation to the application, unless the format changes */
+void renegotiateFormat(PipeWireStream* pwStream, const StreamOptions& options, bool hidden) noexcept
 {
-	return eventFd;
+	auto si = &pwStream->streamData;
+	si->hideRenegotiation = hidden;
+	// a renegotiation pauses and restarts the stream, if it changes the buffers
+	if (hidden && si->state == PW_STREAM_STATE_STREAMING)
+	{
+		si->hiddenPauses = 1;
+		si->hiddenResumes = 1;
+	}
+	si->renegotiationTime = steady_clock::now();
+	char buffer[0x400];
+	spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+	const spa_pod* params[2];
+	params[0] = buildStreamParams(b, si->supportDmaBuf, options);
+	params[1] = buildStreamParams(b, false, options);
+	assert(params[0] && params[1]);
+	pw_stream_update_params(si->stream, params, sizeof(params)/sizeof(params[0]));
 }
 
+/** Pause or resume the stream without reporting it to the application */
+void setActiveForThrottling(PipeWireStream* pwStream, bool active) noexcept
+{
+	auto si = &pwStream->streamData;
+	if (active && si->state == PW_STREAM_STATE_PAUSED)
+		++si->hiddenResumes;
+	else if (!active && si->state == PW_STREAM_STATE_STREAMING)
+		++si->hiddenPauses;
+	pw_stream_set_active(si->stream, active);
 }
 
-
-// C interface
-#include <module-pipewire.h>
-
-static constexpr inline PixelFormat toCFormat(pw::PixelFormat format)
+void checkThrottling(void* userData, uint64_t) noexcept
 {
-	switch (format)
+	auto pwStream = static_cast<pw::PipeWireStream*>(userData);
+	auto si = &pwStream->streamData;
+	const ThrottlePolicy& policy = si->throttle;
+	using ThrottleState = StreamInfo::ThrottleState;
+	auto now = steady_clock::now();
+
+	// outputs remove their frames from the queue depth when they are destroyed, so it only counts the current ones
+	int64_t queued = std::max(si->stats->getQueueDepth(stats::Stage::SCALE), int64_t(0))
+			+ std::max(si->stats->getQueueDepth(stats::Stage::ENCODE), int64_t(0));
+	uint64_t drops = si->stats->getDropped(stats::DropReason::QUEUE_OVERFLOW);
+	bool tooManyDrops = policy.maxDropsPerSecond > 0 && drops - si->dropsAtWindowStart >= policy.maxDropsPerSecond;
+	if (now - si->dropWindowStart >= seconds(1) || tooManyDrops)
 	{
-		case pw::PixelFormat::BGRA:
-			return PixelFormat::BGRA;
-		case pw::PixelFormat::RGBA:
-			return PixelFormat::RGBA;
-		case pw::PixelFormat::BGRX:
-			return PixelFormat::BGRX;
-		case pw::PixelFormat::RGBX:
-			return PixelFormat::RGBX;
+		si->dropWindowStart = now;
+		si->dropsAtWindowStart = drops;
 	}
-}
-
-class EventToCEventConverter
-{
-	PipeWireStream_Event* output_c_event;
-
-public:
+	bool tooManyQueued = policy.maxQueuedFrames > 0 && queued >= static_cast<int64_t>(policy.maxQueuedFrames);
 
-	void processEvent(pw::event::Event e, PipeWireStream_Event* output_event)
+	if (si->throttleState == ThrottleState::PAUSED)
 	{
-		output_c_event = output_event;
-		std::visit(*this, e);
+		// resume when the consumer has mostly caught up, this check runs once per frame interval
+		int64_t resumeBelow = std::max<int64_t>(policy.maxQueuedFrames / 2, 1);
+		bool pausedTooLong = policy.maxPauseTime.count() > 0 && now - si->pauseTime >= policy.maxPauseTime;
+		if (queued < resumeBelow || pausedTooLong)
+		{
+			trace::instant("throttle: active", -1);
+			si->throttleState = ThrottleState::NONE;
+			si->dropWindowStart = now;
+			si->dropsAtWindowStart = drops;
+			setActiveForThrottling(pwStream, true);
+		}
+		return;
 	}
-
-	void operator()(pw::event::Connected& e)
+	if (si->state != PW_STREAM_STATE_STREAMING)
+		return;
+	// a renegotiation might not change the stream state, so stop expecting state changes from it after a while
+	if (now - si->renegotiationTime >= seconds(1))
 	{
-		::Rect c_dimensions = {
-				e.dimensions.w,
-				e.dimensions.h
-		};
-		::PixelFormat c_format = toCFormat(e.format);
-		output_c_event->type = PWSTREAM_EVENT_TYPE_CONNECTED;
-		output_c_event->connect = {c_dimensions, c_format, e.isDmaBuf};
+		si->hiddenPauses = si->hiddenResumes = 0;
+		si->hideRenegotiation = false;
 	}
 
-	void operator()(pw::event::Disconnected& e)
+	if (si->throttleState == ThrottleState::NONE && (tooManyQueued || tooManyDrops))
+	{
+		trace::instant("throttle: paused", -1);
+		si->throttleState = ThrottleState::PAUSED;
+		si->pauseTime = now;
+		setActiveForThrottling(pwStream, false);
+	}
+	else if (si->throttleState == ThrottleState::NONE && policy.idleAfter.count() > 0 && !si->haveDmaBuf
+	         && now - si->lastDamageTime >= policy.idleAfter
+	         && si->stats->buffersHeld.load(std::memory_order_relaxed) == 0)
 	{
-		output_c_event->type = PWSTREAM_EVENT_TYPE_DISCONNECTED;
-		output_c_event->disconnect = {};
+		trace::instant("throttle: idle", -1);
+		si->throttleState = ThrottleState::IDLE;
+		StreamOptions idleOptions = si->options;
+		idleOptions.maxFramerate = std::min(std::max(policy.idleFramerate, 1u), std::max(si->options.maxFramerate, 1u));
+		idleOptions.preferredFramerate = idleOptions.maxFramerate;
+		renegotiateFormat(pwStream, idleOptions, true);
 	}
+}
 
-	static void onMemoryFrameDoneWrapper(void* opaque) noexcept
+int updateThrottling(spa_loop*, bool, uint32_t, const void* data, size_t, void* userData) noexcept
+{
+	auto pwStream = static_cast<pw::PipeWireStream*>(userData);
+	auto si = &pwStream->streamData;
+	si->throttle = *static_cast<const ThrottlePolicy*>(data);
+	si->lastDamageTime = si->dropWindowStart = steady_clock::now();
+	si->dropsAtWindowStart = si->stats->getDropped(stats::DropReason::QUEUE_OVERFLOW);
+
+	pw_loop* loop = pw_main_loop_get_loop(pwStream->mainLoop);
+	bool enabled = si->throttle.idleAfter.count() > 0 || si->throttle.maxQueuedFrames > 0
+			|| si->throttle.maxDropsPerSecond > 0;
+	if (enabled)
+	{
+		if (!si->throttleTimer)
+			si->throttleTimer = pw_loop_add_timer(loop, checkThrottling, pwStream);
+		// check once per frame interval at the full framerate
+		timespec interval = {0, static_cast<long>(SPA_NSEC_PER_SEC / std::max(si->options.maxFramerate, 1u))};
+		pw_loop_update_timer(loop, si->throttleTimer, &interval, &interval, false);
+	}
+	else
 	{
-		auto cb = static_cast<pw::MemoryFrame*>(opaque);
-		delete cb;
+		if (si->throttleTimer)
+			pw_loop_update_timer(loop, si->throttleTimer, nullptr, nullptr, false);
+		if (si->throttleState == StreamInfo::ThrottleState::PAUSED)
+			setActiveForThrottling(pwStream, true);
+		else if (si->throttleState == StreamInfo::ThrottleState::IDLE)
+			renegotiateFormat(pwStream, si->options, true);
+		si->throttleState = StreamInfo::ThrottleState::NONE;
 	}
+	return 0;
+}
 
-	static void onDmaBufFrameDoneWrapper(void* opaque) noexcept
+int updateStreamOptions(spa_loop*, bool, uint32_t, const void* data, size_t, void* userData) noexcept
+{
+	auto pwStream = static_cast<pw::PipeWireStream*>(userData);
+	auto si = &pwStream->streamData;
+	StreamOptions old = si->options;
+	si->options = *static_cast<const StreamOptions*>(data);
+
+	if (old.preferredFramerate != si->options.preferredFramerate || old.maxFramerate != si->options.maxFramerate
+	    || si->throttleState == StreamInfo::ThrottleState::IDLE)
+	{
+		bool wasIdle = si->throttleState == StreamInfo::ThrottleState::IDLE;
+		si->throttleState = StreamInfo::ThrottleState::NONE;
+		renegotiateFormat(pwStream, si->options, wasIdle);
+	}
+	else if (old.bufferCount != si->options.bufferCount && si->format.media_type == SPA_MEDIA_TYPE_video)
 	{
-		auto cb = static_cast<pw::DmaBufFrame*>(opaque);
-		delete cb;
+		updateBufferParams(pwStream);
 	}
+	return 0;
+}
 
-	void operator()(pw::event::MemoryFrameReceived& e)
+void PipeWireStream::setOptions(const StreamOptions& options) noexcept
+{
+	pw_loop_invoke(pw_main_loop_get_loop(mainLoop), updateStreamOptions, 0, &options, sizeof(options), true, this);
+}
+
+void PipeWireStream::setThrottling(const ThrottlePolicy& policy) noexcept
+{
+	pw_loop_invoke(pw_main_loop_get_loop(mainLoop), updateThrottling, 0, &policy, sizeof(policy), true, this);
+}
+
+void PipeWireStream::enqueueEvent(pw::event::Event e) noexcept
+{
+	eventQueue.push(std::move(e));
+}
+
+int PipeWireStream::getEventPollFd() noexcept
+{
+	return eventQueue.getPollFd();
+}
+
+
+void groupCoreError(void* userData, uint32_t id, int seq, int res, const char* msg) noexcept
+{
+	auto group = static_cast<pw::PipeWireStreamGroup*>(userData);
+	fprintf(stderr, "PipeWire error, id = %u, seq = %d, res = %d (%s): %s\n", id, seq, res, strerror(res), msg);
+	// the connection is shared, so all streams are affected
+	for (auto& pwStream : group->streams)
 	{
-		std::unique_ptr<common::MemoryFrame>& frame = e.frame;
-		auto c_frame = static_cast<::MemoryFrame*>(calloc(1, sizeof(::MemoryFrame)));
-		c_frame->width = frame->width;
-		c_frame->height = frame->height;
-		c_frame->format = toCFormat(frame->format);
-		c_frame->memory = frame->memory;
-		c_frame->size = frame->size;
-		c_frame->stride = frame->stride;
-		c_frame->offset = frame->offset;
+		pw_stream_set_active(pwStream->streamData.stream, false);
+		pw_stream_flush(pwStream->streamData.stream, false);
+	}
+}
 
-		c_frame->opaque = frame.release();
-		c_frame->onFrameDone = &onMemoryFrameDoneWrapper;
+static const pw_core_events groupCoreEvents = {
+		.version = PW_VERSION_CORE_EVENTS,
+		.info = coreInfo,
+		.error = groupCoreError,
+};
 
-		output_c_event->type = PWSTREAM_EVENT_TYPE_MEMORY_FRAME_RECEIVED;
-		output_c_event->memoryFrameReceived = {c_frame};
+PipeWireStreamGroup::PipeWireStreamGroup(const SharedScreen& shareInfo, bool supportDmaBuf,
+                                         const StreamOptions& options, const ThreadConfig& loopThreadConfig)
+: mainLoop{pw_main_loop_new(nullptr)},
+  ctx{pw_context_new(pw_main_loop_get_loop(mainLoop), nullptr, 0)},
+  core{}
+{
+	std::vector<uint32_t> nodes;
+	for (const common::SharedStream& s : shareInfo.streams)
+		nodes.push_back(s.pipeWireNode);
+	if (nodes.empty())
+		nodes.push_back(shareInfo.pipeWireNode);
+	// keep as many free buffers per stream as a single stream does
+	framePool = FramePool::create(4 * nodes.size());
+
+	core = connectCore(ctx, shareInfo.pipeWireFd);
+	pw_core_add_listener(core, &coreListener, &groupCoreEvents, this);
+
+	for (uint32_t node : nodes)
+	{
+		streams.push_back(std::unique_ptr<PipeWireStream>(
+				new PipeWireStream(mainLoop, core, node, supportDmaBuf, options, framePool)));
 	}
 
-	void operator()(pw::event::DmaBufFrameReceived& e)
+	mainLoopThread = std::thread([mainLoop = this->mainLoop, loopThreadConfig]() {
+		common::setCurrentThreadName("scw-pw-loop");
+		common::applyThreadConfig(loopThreadConfig);
+		pw_main_loop_run(mainLoop);
+	});
+}
+
+PipeWireStreamGroup::~PipeWireStreamGroup() noexcept
+{
+	// invoke function inside main loop to disable all streams, so no more events are generated
+	auto f = [](spa_loop*, bool, uint32_t, const void*, size_t, void* userData)
 	{
-		std::unique_ptr<common::DmaBufFrame>& frame = e.frame;
-		auto c_frame = static_cast<::DmaBufFrame*>(calloc(1, sizeof(::DmaBufFrame)));
-		c_frame->width = frame->width;
-		c_frame->height = frame->height;
-		c_frame->drmFormat = frame->drmFormat;
-		memcpy(&c_frame->drmObject, &frame->drmObject, sizeof(frame->drmObject));
-		c_frame->planeCount = frame->planeCount;
-		memcpy(c_frame->planes, frame->planes, sizeof(frame->planes));
+		auto group = static_cast<PipeWireStreamGroup*>(userData);
+		for (auto& pwStream : group->streams)
+			pw_stream_set_active(pwStream->streamData.stream, false);
+		return 0;
+	};
+	pw_loop_invoke(pw_main_loop_get_loop(mainLoop), f, 0, nullptr, 0, false, this);
+	pw_main_loop_quit(mainLoop);
+	if (mainLoopThread.joinable())
+		mainLoopThread.join();
+	// the streams are destroyed while the loop is stopped, and before the core they use
+	streams.clear();
+	if (core) pw_core_disconnect(core);
+	if (ctx) pw_context_destroy(ctx);
+	if (mainLoop) pw_main_loop_destroy(mainLoop);
+}
 
-		c_frame->opaque = frame.release();
-		c_frame->onFrameDone = &onDmaBufFrameDoneWrapper;
+}
 
-		output_c_event->type = PWSTREAM_EVENT_TYPE_DMA_BUF_RECEIVED;
-		output_c_event->dmaBufFrameReceived = {c_frame};
-	}
-};
+
+// C interface
+#include <module-pipewire.h>
+#include "EventToCEventConverter.hpp"
 
 struct PipeWireStream
 {
-	std::unique_ptr<pw::PipeWireStream> cppStream;
+	std::unique_ptr<pw::PipeWireStream> ownedStream;
+	/** the stream, which belongs to a PipeWireStreamGroup unless it is ownedStream */
+	pw::PipeWireStream* cppStream;
+};
+
+struct PipeWireStreamGroup
+{
+	std::unique_ptr<pw::PipeWireStreamGroup> cppGroup;
+	std::vector<PipeWireStream> streams;
 };
 
+static pw::StreamOptions toStreamOptions(const PipeWireStream_Options* c_options) noexcept
+{
+	pw::StreamOptions options;
+	if (c_options && c_options->bufferCount)
+		options.bufferCount = c_options->bufferCount;
+	if (c_options && c_options->preferredFramerate)
+		options.preferredFramerate = c_options->preferredFramerate;
+	if (c_options && c_options->maxFramerate)
+		options.maxFramerate = c_options->maxFramerate;
+	return options;
+}
+
 struct PipeWireStream* PipeWireStream_connect(const SharedScreen_t* c_shareInfo)
+{
+	return PipeWireStream_connectWithOptions(c_shareInfo, nullptr);
+}
+
+struct PipeWireStream* PipeWireStream_connectWithOptions(const SharedScreen_t* c_shareInfo,
+                                                         const PipeWireStream_Options* c_options)
 {
 	try
 	{
@@ -603,9 +993,9 @@ struct PipeWireStream* PipeWireStream_connect(const SharedScreen_t* c_shareInfo)
 				c_shareInfo->pipeWireFd,
 				c_shareInfo->pipeWireNode
 		};
-		return new PipeWireStream {
-			std::make_unique<pw::PipeWireStream>(shareInfo, true)
-		};
+		auto cppStream = std::make_unique<pw::PipeWireStream>(shareInfo, true, toStreamOptions(c_options));
+		pw::PipeWireStream* p = cppStream.get();
+		return new PipeWireStream {std::move(cppStream), p};
 	}
 	catch (const std::exception& e)
 	{
@@ -619,6 +1009,51 @@ void PipeWireStream_free(struct PipeWireStream* stream)
 	delete stream;
 }
 
+struct PipeWireStreamGroup* PipeWireStreamGroup_connect(const SharedScreen_t* c_shareInfo,
+                                                        const PipeWireStream_Options* c_options)
+{
+	try
+	{
+		pw::SharedScreen shareInfo = {
+				nullptr,
+				c_shareInfo->pipeWireFd,
+				c_shareInfo->pipeWireNode
+		};
+		for (uint32_t i = 0; i < c_shareInfo->streamCount; ++i)
+		{
+			const SharedStream_t& s = c_shareInfo->streams[i];
+			shareInfo.streams.push_back({s.pipeWireNode, s.x, s.y, {s.size.w, s.size.h}});
+		}
+		auto group = std::make_unique<PipeWireStreamGroup>();
+		group->cppGroup = std::make_unique<pw::PipeWireStreamGroup>(shareInfo, true, toStreamOptions(c_options));
+		for (size_t i = 0; i < group->cppGroup->size(); ++i)
+			group->streams.push_back({nullptr, &(*group->cppGroup)[i]});
+		return group.release();
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return nullptr;
+	}
+}
+
+void PipeWireStreamGroup_free(struct PipeWireStreamGroup* group)
+{
+	delete group;
+}
+
+uint32_t PipeWireStreamGroup_getStreamCount(struct PipeWireStreamGroup* group)
+{
+	return static_cast<uint32_t>(group->streams.size());
+}
+
+struct PipeWireStream* PipeWireStreamGroup_getStream(struct PipeWireStreamGroup* group, uint32_t index)
+{
+	if (index >= group->streams.size())
+		return nullptr;
+	return &group->streams[index];
+}
+
 int PipeWireStream_getEventPollFd(struct PipeWireStream* stream)
 {
 	return stream->cppStream->getEventPollFd();
@@ -644,4 +1079,35 @@ int PipeWireStream_nextEvent(struct PipeWireStream* stream, struct PipeWireStrea
 		fprintf(stderr, "%s\n", e.what());
 		return -1;
 	}
-}
\ No newline at end of file
+}
+
+const char* PipeWireStream_getStatsName(struct PipeWireStream* stream)
+{
+	return stream->cppStream->getStats()->getName().c_str();
+}
+
+void PipeWireStream_setOptions(struct PipeWireStream* stream, const PipeWireStream_Options* options)
+{
+	stream->cppStream->setOptions(toStreamOptions(options));
+}
+
+void PipeWireStream_setThrottling(struct PipeWireStream* stream, const PipeWireStream_ThrottlePolicy* c_policy)
+{
+	pw::ThrottlePolicy policy;
+	if (c_policy)
+	{
+		policy.idleAfter = std::chrono::milliseconds(c_policy->idleAfterMs);
+		if (c_policy->idleFramerate)
+			policy.idleFramerate = c_policy->idleFramerate;
+		policy.maxQueuedFrames = c_policy->maxQueuedFrames;
+		policy.maxDropsPerSecond = c_policy->maxDropsPerSecond;
+		if (c_policy->maxPauseTimeMs)
+			policy.maxPauseTime = std::chrono::milliseconds(c_policy->maxPauseTimeMs);
+	}
+	stream->cppStream->setThrottling(policy);
+}
+
+void PipeWireStream_setCopyOnHold(struct PipeWireStream* stream, uint32_t maxHeldBuffers, uint32_t maxHoldTimeMs)
+{
+	stream->cppStream->setCopyOnHold({maxHeldBuffers, std::chrono::milliseconds(maxHoldTimeMs)});
+}
@@ -11,9 +11,12 @@
 #include <chrono>
 #include <variant>
 #include <optional>
-#include <queue>
 #include <thread>
-#include <mutex>
+#include <vector>
+#include "EventQueue.hpp"
+#include "CursorState.hpp"
+#include "FramePool.hpp"
+#include "../stats.hpp"
 #include <pipewire/pipewire.h>
 #include <spa/param/video/format.h>
 
@@ -23,7 +26,9 @@ using common::Rect;
 using common::PixelFormat;
 using common::MemoryFrame;
 using common::DmaBufFrame;
+using common::CropRegion;
 using common::SharedScreen;
+using common::ThreadConfig;
 
 void init(int* argc, char*** argv);
 void deinit();
@@ -31,7 +36,26 @@ void deinit();
 namespace event
 {
 
-/** This event is the first you will receive once the PipeWire stream became connected.
+/** This event is sent as soon as a video format has been negotiated with the stream source, which happens
+ * before the stream actually starts and the Connected event is sent.
+ * It carries the same information as Connected, so you can use it to set up a frame consumer speculatively
+ * while the stream is still starting up (for example with FFmpegOutput::Builder::buildAsync()).
+ * The format might be renegotiated, so this event can be sent multiple times. The one received last before
+ * Connected is the format the frames will have. */
+class FormatNegotiated
+{
+public:
+	/** The width and height of the stream in pixels */
+	Rect dimensions;
+
+	/** The pixel format of each video frame */
+	PixelFormat format;
+
+	/** true if the stream provides DmaBufFrame, false for MemoryFrame */
+	bool isDmaBuf;
+};
+
+/** This event is sent once the PipeWire stream became connected and starts streaming.
  * You should use it to set up a consumer that processes the frames given to you by
  * the MemoryFrameReceived and DmaBufFrameReceived events.
  *
@@ -75,11 +99,69 @@ public:
 };
 
 
-using Event = std::variant<Connected, Disconnected, MemoryFrameReceived, DmaBufFrameReceived>;
+/** This event is sent when the compositor only moved the cursor or changed its image, without a new frame.
+ * It requires cursor metadata, see CURSOR_MODE_META. The frame events carry the cursor as well, so the last frame
+ * with this cursor shows the current screen, e.g. FFmpegOutput::pushCursor() encodes it again. */
+class CursorMoved
+{
+public:
+	/** the new cursor */
+	Cursor cursor;
+	/** the presentation timestamp of the cursor update, in the same clock as the frames */
+	std::chrono::nanoseconds pts;
+};
+
+
+using Event = std::variant<FormatNegotiated, Connected, Disconnected, MemoryFrameReceived, DmaBufFrameReceived,
+                           CursorMoved>;
 
 } // namespace event
 
 
+/** Negotiation settings of a PipeWireStream */
+struct StreamOptions
+{
+	/** Number of buffers to request. The compositor might choose fewer.
+	 * Fewer buffers reduce latency and memory, more buffers give a slow consumer more room before frames are dropped. */
+	unsigned int bufferCount = 16;
+	/** framerate proposed to the compositor */
+	unsigned int preferredFramerate = 30;
+	/** Highest framerate to accept. The compositor renders at most this many frames per second for the stream,
+	 * so a lower value saves its work too, not only ours. */
+	unsigned int maxFramerate = 240;
+};
+
+/** When to copy a memory frame into a FramePool buffer, so its PipeWire buffer can be returned to the compositor
+ * before the application releases the frame. Otherwise a slow consumer can hold all buffers, and the compositor has to
+ * wait for one. Zero values disable the respective condition. DMA-BUF frames are never copied. */
+struct CopyOnHoldPolicy
+{
+	/** copy new frames while the application already holds this many PipeWire buffers */
+	unsigned int maxHeldBuffers = 0;
+	/** copy frames that are still waiting in the event queue after this time */
+	std::chrono::milliseconds maxHoldTime{0};
+};
+
+/** When to reduce the work of the compositor and the capture, see PipeWireStream::setThrottling().
+ * Zero values disable the respective condition. */
+struct ThrottlePolicy
+{
+	/** Lower the framerate to idleFramerate when no frame had damage for this long.
+	 * The full framerate is renegotiated when the first damaged frame arrives at the idle framerate, so a change of
+	 * the screen is captured at the full framerate only after up to 1/idleFramerate plus one renegotiation, e.g.
+	 * 200 ms at 5 fps. Needs a compositor that sends damage metadata. */
+	std::chrono::milliseconds idleAfter{0};
+	unsigned int idleFramerate = 5;
+	/** Pause the stream while this many frames wait for the scaler and encoder. It is resumed when less than half of
+	 * them are waiting. */
+	unsigned int maxQueuedFrames = 0;
+	/** Pause the stream when this many frames were dropped by full queues within one second. */
+	unsigned int maxDropsPerSecond = 0;
+	/** Resume a paused stream after this long, even if the queues have not drained, e.g. because the consumer
+	 * stopped taking frames. */
+	std::chrono::milliseconds maxPauseTime{1000};
+};
+
 /** This class encapsulates a receiver of a PipeWire video stream. It connects to the stream, negotiates a suitable
  * frame format and starts receiving frames. Stream events (like when a frame has been received) can be polled for with
  * the file descriptor from getEventPollFd() and then retrieved by nextEvent().
@@ -101,6 +183,10 @@ using Event = std::variant<Connected, Disconnected, MemoryFrameReceived, DmaBufF
  *     {
  *         // call lambda function appropriate for the type of *ev
  *         std::visit(overloaded{
+ *             [&] (pw::event::FormatNegotiated& e)
+ *             {
+ *                 // optional: start setting up a consumer for this format
+ *             },
  *             [&] (pw::event::Connected& e)
  *             {
  *                 ...
@@ -116,6 +202,10 @@ using Event = std::variant<Connected, Disconnected, MemoryFrameReceived, DmaBufF
  *             [&] (pw::event::DmaBufFrameReceived& e)
  *             {
  *                 // might only reach this when you passed supportDmaBuf=true
+ *             },
+ *             [&] (pw::event::CursorMoved& e)
+ *             {
+ *                 // only with cursor metadata
  *             }
  *         }, *ev);
  *     }
@@ -126,37 +216,75 @@ class PipeWireStream
 	struct StreamInfo
 	{
 		pw_stream* stream;
+		spa_hook streamListener;
 		spa_video_info format;
 		bool haveDmaBuf;
 		pw_stream_state state;
 		std::chrono::time_point<std::chrono::steady_clock> startTime;
-		struct
+		CursorState cursor;
+		stats::PipelineStats* stats;
+		CopyOnHoldPolicy copyOnHold;
+		std::shared_ptr<FramePool> framePool;
+		spa_source* holdWatchdog;
+		StreamOptions options;
+		bool supportDmaBuf;
+		ThrottlePolicy throttle;
+		enum class ThrottleState
 		{
-			int32_t x;
-			int32_t y;
-		} cursorPos;
-		struct
-		{
-			uint32_t w;
-			uint32_t h;
-			uint8_t* bitmap;
-		} cursorBitmap;
+			NONE,
+			/** renegotiated to the idle framerate */
+			IDLE,
+			/** deactivated because of backpressure */
+			PAUSED,
+		} throttleState;
+		spa_source* throttleTimer;
+		/** state changes to PAUSED and STREAMING that are expected from throttling, which are not reported to the
+		 * application. All others are. */
+		unsigned int hiddenPauses;
+		unsigned int hiddenResumes;
+		/** don't report the next format if it only changes the framerate for throttling */
+		bool hideRenegotiation;
+		std::chrono::steady_clock::time_point renegotiationTime;
+		std::chrono::steady_clock::time_point pauseTime;
+		std::chrono::steady_clock::time_point lastDamageTime;
+		std::chrono::steady_clock::time_point dropWindowStart;
+		uint64_t dropsAtWindowStart;
+		/** frames that were waiting in the event queue during the last watchdog check */
+		std::vector<const MemoryFrame*> waitingFrames;
 	};
 
 	pw_main_loop* mainLoop;
+	/** false if the loop, context and core belong to a PipeWireStreamGroup, which also runs the loop */
+	bool ownsLoop;
 	pw_context* ctx;
 	pw_core* core;
 	StreamInfo streamData;
 	spa_hook coreListener;
-	int eventFd;
-	std::queue<event::Event> eventQueue;
+	EventQueue<event::Event> eventQueue;
+	std::shared_ptr<stats::PipelineStats> pipelineStats;
 	std::thread mainLoopThread;
-	std::mutex eventQueueMutex;
 
 	friend void streamStateChanged(void*, pw_stream_state, pw_stream_state, const char*) noexcept;
 	friend void processFrame(void*) noexcept;
 	friend void streamParamChanged(void*, uint32_t, const spa_pod*) noexcept;
 	friend void coreError(void*, uint32_t, int, int, const char*) noexcept;
+	friend void checkHeldFrames(void*, uint64_t) noexcept;
+	friend int updateCopyOnHold(spa_loop*, bool, uint32_t, const void*, size_t, void*) noexcept;
+	friend void updateBufferParams(PipeWireStream*) noexcept;
+	friend void renegotiateFormat(PipeWireStream*, const StreamOptions&, bool) noexcept;
+	friend void setActiveForThrottling(PipeWireStream*, bool) noexcept;
+	friend void checkThrottling(void*, uint64_t) noexcept;
+	friend int updateThrottling(spa_loop*, bool, uint32_t, const void*, size_t, void*) noexcept;
+	friend int updateStreamOptions(spa_loop*, bool, uint32_t, const void*, size_t, void*) noexcept;
+	friend void groupCoreError(void*, uint32_t, int, int, const char*) noexcept;
+	friend class PipeWireStreamGroup;
+
+	/** Create a stream on the loop and core of a PipeWireStreamGroup */
+	PipeWireStream(pw_main_loop* mainLoop, pw_core* core, uint32_t pipeWireNode, bool supportDmaBuf,
+	               const StreamOptions& options, std::shared_ptr<FramePool> framePool);
+
+	/** Create the PipeWire stream and connect it to the node. The loop must not be running yet. */
+	void connectStream(pw_core* core, uint32_t pipeWireNode, bool supportDmaBuf, const StreamOptions& options);
 
 	void enqueueEvent(pw::event::Event e) noexcept;
 public:
@@ -166,8 +294,12 @@ public:
 	 * (the display server) can ignore this request and provide memory-mapped frames.
 	 * When supportDmaBuf is false, DmaBufFrameReceived events are never generated.
 	 * @param shareInfo PipeWire descriptor of the shared stream to connect to
-	 * @param supportDmaBuf Set to true if you want to support DmaBuf frames */
-	SCW_EXPORT PipeWireStream(const SharedScreen& shareInfo, bool supportDmaBuf);
+	 * @param supportDmaBuf Set to true if you want to support DmaBuf frames
+	 * @param options buffer count and framerate limits to negotiate
+	 * @param loopThreadConfig CPU affinity and scheduling of the thread that receives the frames from PipeWire.
+	 *                         Settings that are not permitted fall back to the defaults with a warning. */
+	SCW_EXPORT PipeWireStream(const SharedScreen& shareInfo, bool supportDmaBuf, const StreamOptions& options = {},
+	                          const ThreadConfig& loopThreadConfig = {});
 
 	/** Destroy the stream and all frames associated with it.
 	 *
@@ -188,6 +320,75 @@ public:
 	 * This method is thread-safe.
 	 * @throw std::exception In case you called this method again after it returned a disconnected event */
 	SCW_EXPORT std::optional<pw::event::Event> nextEvent();
+
+	/** Get the statistics of this stream. Pass them to the frame consumer (e.g. FFmpegOutput::Builder::withStats())
+	 * to count the whole pipeline in one place. */
+	SCW_EXPORT const std::shared_ptr<stats::PipelineStats>& getStats() const noexcept
+	{
+		return pipelineStats;
+	}
+
+	/** Copy memory frames to return their PipeWire buffers early, according to the policy.
+	 * How often it happened and how long buffers were held is counted in getStats().
+	 * This method is thread-safe. */
+	SCW_EXPORT void setCopyOnHold(const CopyOnHoldPolicy& policy) noexcept;
+
+	/** Renegotiate the stream with new options while it is running.
+	 * A changed framerate limit renegotiates the format, so a new pw::event::FormatNegotiated follows if the
+	 * compositor picks a different one. A changed buffer count reallocates the buffers, so release all frames of this
+	 * stream before, as their buffers become invalid.
+	 * This method is thread-safe. */
+	SCW_EXPORT void setOptions(const StreamOptions& options) noexcept;
+
+	/** Throttle the stream at the compositor while the screen is static or the consumer can't keep up, according to
+	 * the policy. Queue depths and drops are taken from getStats(), so pass them to the consumer, e.g. with
+	 * FFmpegOutput::Builder::withStats().
+	 * Pausing and renegotiating for throttling are not reported as events. Frames are not renegotiated to a lower
+	 * framerate while the application holds any of them, as that reallocates the buffers.
+	 * This method is thread-safe. */
+	SCW_EXPORT void setThrottling(const ThrottlePolicy& policy) noexcept;
+};
+
+/** Several PipeWire streams that share one connection and one loop thread, e.g. for all monitors of a SharedScreen
+ * that was requested with multiple sources. Each stream works like a standalone PipeWireStream with its own events,
+ * statistics and settings. Memory frames that are copied on hold share one FramePool.
+ *
+ * The streams are owned by the group, so release all frames of all streams before destroying it. */
+class PipeWireStreamGroup
+{
+	pw_main_loop* mainLoop;
+	pw_context* ctx;
+	pw_core* core;
+	spa_hook coreListener;
+	std::shared_ptr<FramePool> framePool;
+	std::vector<std::unique_ptr<PipeWireStream>> streams;
+	std::thread mainLoopThread;
+
+	friend void groupCoreError(void*, uint32_t, int, int, const char*) noexcept;
+
+public:
+	/** Connect to all streams of the shared screen, or only to its pipeWireNode if SharedScreen::streams is empty.
+	 * The parameters apply to every stream, see PipeWireStream::PipeWireStream(). */
+	SCW_EXPORT PipeWireStreamGroup(const SharedScreen& shareInfo, bool supportDmaBuf, const StreamOptions& options = {},
+	                               const ThreadConfig& loopThreadConfig = {});
+
+	PipeWireStreamGroup(const PipeWireStreamGroup&) = delete;
+	PipeWireStreamGroup& operator=(const PipeWireStreamGroup&) = delete;
+
+	/** Disconnect and destroy all streams */
+	SCW_EXPORT ~PipeWireStreamGroup() noexcept;
+
+	/** @return the number of streams, in the order of SharedScreen::streams */
+	SCW_EXPORT size_t size() const noexcept
+	{
+		return streams.size();
+	}
+
+	/** @return the stream at the index. Poll each stream's getEventPollFd() for its events. */
+	SCW_EXPORT PipeWireStream& operator[](size_t index) noexcept
+	{
+		return *streams[index];
+	}
 };
 
 } // namespace pw
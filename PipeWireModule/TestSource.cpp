@@ -0,0 +1,488 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#include "TestSource.hpp"
+#include <spa/param/video/format-utils.h>
+#include <spa/buffer/meta.h>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cassert>
+#include <stdexcept>
+#include <algorithm> // max
+#include <string>
+#include <ctime>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace std::string_literals;
+
+namespace pw
+{
+
+static constexpr uint32_t CURSOR_SIZE = 32;
+static constexpr uint32_t MAX_DAMAGE_REGIONS = 4;
+
+static constexpr inline spa_video_format pixelFormat2spa(PixelFormat format)
+{
+	switch (format)
+	{
+		case PixelFormat::RGBA:
+			return SPA_VIDEO_FORMAT_RGBA;
+		case PixelFormat::RGBX:
+			return SPA_VIDEO_FORMAT_RGBx;
+		case PixelFormat::BGRA:
+			return SPA_VIDEO_FORMAT_BGRA;
+		case PixelFormat::BGRX:
+			return SPA_VIDEO_FORMAT_BGRx;
+	}
+	return SPA_VIDEO_FORMAT_BGRx;
+}
+
+/** Per-buffer state, stored in pw_buffer::user_data */
+struct TestBuffer
+{
+	bool isFirstUse;
+};
+
+bool TestSource::fillFrame(uint8_t* pixels, bool isFirstUse) noexcept
+{
+	const uint32_t w = options.size.w;
+	const uint32_t h = options.size.h;
+	switch (options.pattern)
+	{
+		case TestPattern::STATIC:
+		{
+			// all buffers show the same picture, so it only needs to be drawn once per buffer
+			if (isFirstUse)
+			{
+				for (uint32_t y = 0; y < h; ++y)
+				{
+					auto row = reinterpret_cast<uint32_t*>(pixels + y * stride);
+					for (uint32_t x = 0; x < w; ++x)
+						row[x] = 0xff000000u | (x * 255 / w) << 16 | (y * 255 / h) << 8 | 0x80u;
+				}
+			}
+			return frameCount == 0;
+		}
+		case TestPattern::SCROLLING_TEXT:
+		{
+			// light background with dark "words" of blocks, 16 pixel high lines, scrolling by 2 pixels per frame
+			constexpr uint32_t lineHeight = 16;
+			constexpr uint32_t glyphWidth = 8;
+			uint64_t scroll = frameCount * 2;
+			for (uint32_t y = 0; y < h; ++y)
+			{
+				auto row = reinterpret_cast<uint32_t*>(pixels + y * stride);
+				uint64_t contentY = y + scroll;
+				uint64_t line = contentY / lineHeight;
+				uint32_t yInLine = contentY % lineHeight;
+				bool isGlyphRow = yInLine >= 3 && yInLine < 13;
+				for (uint32_t x = 0; x < w; ++x)
+				{
+					uint64_t glyph = x / glyphWidth;
+					// pseudo-random glyph pattern that is stable for each line, with gaps between words
+					uint64_t hash = (line * 0x9e3779b97f4a7c15ull) ^ (glyph * 0xbf58476d1ce4e5b9ull);
+					bool isSpace = (hash >> 29) % 7 == 0 || x % glyphWidth == 7;
+					bool isInk = isGlyphRow && !isSpace && ((hash >> (yInLine + x % glyphWidth)) & 1);
+					row[x] = isInk ? 0xff202020u : 0xfff0f0f0u;
+				}
+			}
+			return true;
+		}
+		case TestPattern::NOISE:
+		{
+			// xorshift64, fast enough to not limit the frame rate
+			uint64_t s = randomState;
+			auto next = [&s] ()
+			{
+				s ^= s << 13;
+				s ^= s >> 7;
+				s ^= s << 17;
+				return s;
+			};
+			for (uint32_t y = 0; y < h; ++y)
+			{
+				// two pixels at a time, and the last one of an odd width on its own
+				auto row = reinterpret_cast<uint64_t*>(pixels + y * stride);
+				for (uint32_t x = 0; x < w / 2; ++x)
+					row[x] = next();
+				if (w % 2)
+					reinterpret_cast<uint32_t*>(row)[w - 1] = static_cast<uint32_t>(next());
+			}
+			randomState = s;
+			return true;
+		}
+	}
+	return true;
+}
+
+void testSourceProcess(void* userData) noexcept
+{
+	auto source = static_cast<TestSource*>(userData);
+	pw_buffer* b = pw_stream_dequeue_buffer(source->stream);
+	if (!b)
+		return;
+	spa_buffer* buf = b->buffer;
+	spa_data& d = buf->datas[0];
+	if (!d.data)
+		return;
+
+	auto testBuffer = static_cast<TestBuffer*>(b->user_data);
+	bool isFirstUse = testBuffer->isFirstUse;
+	testBuffer->isFirstUse = false;
+	bool changed = source->fillFrame(static_cast<uint8_t*>(d.data), isFirstUse);
+
+	auto header = static_cast<spa_meta_header*>(spa_buffer_find_meta_data(buf, SPA_META_Header, sizeof(spa_meta_header)));
+	if (header)
+	{
+		timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		header->pts = SPA_TIMESPEC_TO_NSEC(&now);
+		header->flags = 0;
+		header->seq = source->frameCount;
+		header->dts_offset = 0;
+	}
+
+	spa_meta* damage = spa_buffer_find_meta(buf, SPA_META_VideoDamage);
+	if (damage && damage->size >= sizeof(spa_meta_region))
+	{
+		// a single region for the whole frame if it changed, otherwise an empty list
+		auto regions = static_cast<spa_meta_region*>(damage->data);
+		size_t regionCount = damage->size / sizeof(spa_meta_region);
+		size_t next = 0;
+		if (changed)
+			regions[next++].region = SPA_REGION(0, 0, source->options.size.w, source->options.size.h);
+		if (next < regionCount)
+			regions[next].region = SPA_REGION(0, 0, 0, 0);
+	}
+
+	auto cursor = static_cast<spa_meta_cursor*>(spa_buffer_find_meta_data(buf, SPA_META_Cursor, sizeof(spa_meta_cursor)));
+	if (cursor)
+	{
+		// move the cursor along a diagonal that bounces off the borders
+		uint32_t rangeX = source->options.size.w > CURSOR_SIZE ? source->options.size.w - CURSOR_SIZE : 1;
+		uint32_t rangeY = source->options.size.h > CURSOR_SIZE ? source->options.size.h - CURSOR_SIZE : 1;
+		uint64_t tx = source->frameCount * 4 % (2 * rangeX);
+		uint64_t ty = source->frameCount * 3 % (2 * rangeY);
+		cursor->id = 1;
+		cursor->flags = 0;
+		cursor->position.x = static_cast<int32_t>(tx < rangeX ? tx : 2 * rangeX - tx);
+		cursor->position.y = static_cast<int32_t>(ty < rangeY ? ty : 2 * rangeY - ty);
+		cursor->hotspot.x = 0;
+		cursor->hotspot.y = 0;
+		// the bitmap never changes, so it is only sent once per buffer
+		cursor->bitmap_offset = 0;
+		if (isFirstUse)
+		{
+			cursor->bitmap_offset = sizeof(spa_meta_cursor);
+			auto bitmap = SPA_MEMBER(cursor, cursor->bitmap_offset, spa_meta_bitmap);
+			bitmap->format = SPA_VIDEO_FORMAT_BGRA;
+			bitmap->size.width = CURSOR_SIZE;
+			bitmap->size.height = CURSOR_SIZE;
+			bitmap->stride = CURSOR_SIZE * 4;
+			bitmap->offset = sizeof(spa_meta_bitmap);
+			auto pixels = SPA_MEMBER(bitmap, bitmap->offset, uint32_t);
+			// a white triangle with a black border
+			for (uint32_t y = 0; y < CURSOR_SIZE; ++y)
+			{
+				for (uint32_t x = 0; x < CURSOR_SIZE; ++x)
+				{
+					bool inside = x <= y && y < CURSOR_SIZE - 1;
+					bool border = x == 0 || x == y || y == CURSOR_SIZE - 2;
+					pixels[y * CURSOR_SIZE + x] = !inside ? 0u : border ? 0xff000000u : 0xffffffffu;
+				}
+			}
+		}
+	}
+
+	d.chunk->offset = 0;
+	d.chunk->size = source->stride * source->options.size.h;
+	d.chunk->stride = static_cast<int32_t>(source->stride);
+	++source->frameCount;
+	pw_stream_queue_buffer(source->stream, b);
+}
+
+void testSourceTimeout(void* userData, uint64_t) noexcept
+{
+	auto source = static_cast<TestSource*>(userData);
+	// we are the driver of the graph, so a new frame is produced on every timer tick
+	pw_stream_trigger_process(source->stream);
+}
+
+void testSourceStateChanged(void* userData, pw_stream_state old, pw_stream_state nw, const char* msg) noexcept
+{
+	auto source = static_cast<TestSource*>(userData);
+	pw_loop* loop = pw_main_loop_get_loop(source->mainLoop);
+	if (nw == PW_STREAM_STATE_PAUSED && old == PW_STREAM_STATE_CONNECTING)
+	{
+		try
+		{
+			source->nodeIdPromise.set_value(pw_stream_get_node_id(source->stream));
+		}
+		catch (const std::future_error&)
+		{
+			// already set by a previous connection
+		}
+	}
+	if (nw == PW_STREAM_STATE_STREAMING)
+	{
+		timespec timeout = {0, 1};
+		timespec interval = {0, static_cast<long>(SPA_NSEC_PER_SEC / std::max(source->options.framerate, 1u))};
+		pw_loop_update_timer(loop, source->timer, &timeout, &interval, false);
+	}
+	else
+	{
+		pw_loop_update_timer(loop, source->timer, nullptr, nullptr, false);
+	}
+	if (nw == PW_STREAM_STATE_ERROR)
+	{
+		fprintf(stderr, "Test source stream failed: %s\n", msg);
+	}
+}
+
+#define CURSOR_META_SIZE(width, height)                                \
+	(sizeof(struct spa_meta_cursor) + sizeof(struct spa_meta_bitmap) + \
+	 width * height * 4)
+
+void testSourceParamChanged(void* userData, uint32_t paramID, const spa_pod* param) noexcept
+{
+	if (!param || paramID != SPA_PARAM_Format)
+		return;
+	auto source = static_cast<TestSource*>(userData);
+	source->stride = SPA_ROUND_UP_N(source->options.size.w * 4, 4);
+	uint32_t size = source->stride * source->options.size.h;
+
+	char buffer[0x200];
+	spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+	const spa_pod* params[4];
+	uint32_t paramCount = 0;
+	params[paramCount++] = static_cast<spa_pod*>(spa_pod_builder_add_object(&b,
+			SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+			SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(8, 2, 16),
+			SPA_PARAM_BUFFERS_blocks, SPA_POD_Int(1),
+			SPA_PARAM_BUFFERS_size, SPA_POD_Int(size),
+			SPA_PARAM_BUFFERS_stride, SPA_POD_Int(source->stride),
+			SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int(1 << SPA_DATA_MemFd)
+	));
+	params[paramCount++] = static_cast<spa_pod*>(spa_pod_builder_add_object(&b,
+			SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+			SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Header),
+			SPA_PARAM_META_size, SPA_POD_Int(sizeof(struct spa_meta_header))
+	));
+	if (source->options.withDamage)
+	{
+		params[paramCount++] = static_cast<spa_pod*>(spa_pod_builder_add_object(&b,
+				SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+				SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoDamage),
+				SPA_PARAM_META_size, SPA_POD_CHOICE_RANGE_Int(
+						sizeof(struct spa_meta_region) * MAX_DAMAGE_REGIONS,
+						sizeof(struct spa_meta_region) * 1,
+						sizeof(struct spa_meta_region) * MAX_DAMAGE_REGIONS)
+		));
+	}
+	if (source->options.withCursor)
+	{
+		params[paramCount++] = static_cast<spa_pod*>(spa_pod_builder_add_object(&b,
+				SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+				SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Cursor),
+				SPA_PARAM_META_size, SPA_POD_Int(CURSOR_META_SIZE(CURSOR_SIZE, CURSOR_SIZE))
+		));
+	}
+	pw_stream_update_params(source->stream, params, paramCount);
+}
+
+void testSourceAddBuffer(void* userData, pw_buffer* b) noexcept
+{
+	auto source = static_cast<TestSource*>(userData);
+	spa_data& d = b->buffer->datas[0];
+	b->user_data = new TestBuffer{true};
+	// before allocation, the type field holds the allowed types as bit mask
+	if ((d.type & (1u << SPA_DATA_MemFd)) == 0)
+		return;
+
+	d.type = SPA_DATA_MemFd;
+	d.flags = SPA_DATA_FLAG_READWRITE;
+	d.mapoffset = 0;
+	d.maxsize = source->stride * source->options.size.h;
+	d.fd = memfd_create("screencapture-testsrc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (d.fd < 0)
+	{
+		fprintf(stderr, "Creating test source buffer failed: %s\n", strerror(errno));
+		return;
+	}
+	if (ftruncate(d.fd, d.maxsize) < 0)
+	{
+		fprintf(stderr, "Resizing test source buffer failed: %s\n", strerror(errno));
+		return;
+	}
+	fcntl(d.fd, F_ADD_SEALS, F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL);
+	d.data = mmap(nullptr, d.maxsize, PROT_READ | PROT_WRITE, MAP_SHARED, d.fd, d.mapoffset);
+	if (d.data == MAP_FAILED)
+	{
+		fprintf(stderr, "Mapping test source buffer failed: %s\n", strerror(errno));
+		d.data = nullptr;
+	}
+}
+
+void testSourceRemoveBuffer(void*, pw_buffer* b) noexcept
+{
+	spa_data& d = b->buffer->datas[0];
+	delete static_cast<TestBuffer*>(b->user_data);
+	b->user_data = nullptr;
+	if (d.type != SPA_DATA_MemFd)
+		return;
+	if (d.data)
+		munmap(d.data, d.maxsize);
+	if (d.fd >= 0)
+		close(d.fd);
+}
+
+static const pw_stream_events testSourceEvents = {
+		.version = PW_VERSION_STREAM_EVENTS,
+		.state_changed = testSourceStateChanged,
+		.param_changed = testSourceParamChanged,
+		.add_buffer = testSourceAddBuffer,
+		.remove_buffer = testSourceRemoveBuffer,
+		.process = testSourceProcess,
+};
+
+TestSource::TestSource(const TestSourceOptions& options)
+: mainLoop{},
+  ctx{},
+  core{},
+  stream{},
+  timer{},
+  streamListener{},
+  options(options),
+  stride(options.size.w * 4),
+  frameCount(0),
+  randomState(0x2545f4914f6cdd1dull),
+  nodeId(nodeIdPromise.get_future().share())
+{
+	if (options.size.w == 0 || options.size.h == 0)
+		throw std::runtime_error("Test source dimensions must not be zero");
+
+	try
+	{
+		connect();
+	}
+	catch (...)
+	{
+		// the destructor does not run for a constructor that throws
+		destroy();
+		throw;
+	}
+}
+
+void TestSource::connect()
+{
+	mainLoop = pw_main_loop_new(nullptr);
+	if (!mainLoop)
+		throw std::runtime_error("Creating the PipeWire main loop failed: "s + strerror(errno));
+	ctx = pw_context_new(pw_main_loop_get_loop(mainLoop), nullptr, 0);
+	if (!ctx)
+		throw std::runtime_error("Creating the PipeWire context failed: "s + strerror(errno));
+
+	core = pw_context_connect(ctx, nullptr, 0);
+	if (!core)
+		throw std::runtime_error("Connecting to the PipeWire daemon failed: "s + strerror(errno));
+
+	timer = pw_loop_add_timer(pw_main_loop_get_loop(mainLoop), testSourceTimeout, this);
+	if (!timer)
+		throw std::runtime_error("Creating the test source timer failed");
+
+	pw_properties* props = pw_properties_new(PW_KEY_MEDIA_TYPE, "Video",
+	                                         PW_KEY_MEDIA_CATEGORY, "Source",
+	                                         PW_KEY_MEDIA_ROLE, "Screen",
+	                                         PW_KEY_MEDIA_CLASS, "Video/Source", nullptr);
+	stream = pw_stream_new(core, "ScreenCapture test source", props);
+	if (!stream)
+		throw std::runtime_error("Could not create test source stream");
+	pw_stream_add_listener(stream, &streamListener, &testSourceEvents, this);
+
+	char buffer[0x100];
+	spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+	auto size = SPA_RECTANGLE(options.size.w, options.size.h);
+	auto variableRate = SPA_FRACTION(0, 1);
+	auto rate = SPA_FRACTION(options.framerate, 1);
+	auto maxRate = SPA_FRACTION(options.framerate, 1);
+	auto minRate = SPA_FRACTION(0, 1);
+	const spa_pod* params[1];
+	params[0] = static_cast<spa_pod*>(spa_pod_builder_add_object(&b,
+			SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat,
+			SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video),
+			SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw),
+			SPA_FORMAT_VIDEO_format, SPA_POD_Id(pixelFormat2spa(options.format)),
+			SPA_FORMAT_VIDEO_size, SPA_POD_Rectangle(&size),
+			SPA_FORMAT_VIDEO_framerate, SPA_POD_Fraction(&variableRate),
+			SPA_FORMAT_VIDEO_maxFramerate, SPA_POD_CHOICE_RANGE_Fraction(&rate, &minRate, &maxRate)
+	));
+	assert(params[0]);
+
+	if (pw_stream_connect(stream, PW_DIRECTION_OUTPUT, PW_ID_ANY,
+	                      static_cast<pw_stream_flags>(PW_STREAM_FLAG_DRIVER | PW_STREAM_FLAG_ALLOC_BUFFERS),
+	                      params, 1) < 0)
+	{
+		throw std::runtime_error("Test source stream connect failed");
+	}
+
+	mainLoopThread = std::thread([mainLoop = this->mainLoop]() {
+		common::setCurrentThreadName("scw-testsrc");
+		pw_main_loop_run(mainLoop);
+	});
+}
+
+TestSource::~TestSource() noexcept
+{
+	destroy();
+}
+
+void TestSource::destroy() noexcept
+{
+	if (mainLoopThread.joinable())
+	{
+		if (stream)
+		{
+			// invoke function inside main loop to disable the stream, so no more buffers are processed
+			auto f = [](spa_loop*, bool, uint32_t, const void*, size_t, void* userData)
+			{
+				auto stream = static_cast<pw_stream*>(userData);
+				return pw_stream_set_active(stream, false);
+			};
+			pw_loop_invoke(pw_main_loop_get_loop(mainLoop), f, 0, nullptr, 0, false, stream);
+		}
+		pw_main_loop_quit(mainLoop);
+		mainLoopThread.join();
+	}
+	if (stream)
+	{
+		pw_stream_disconnect(stream);
+		pw_stream_destroy(stream);
+	}
+	if (timer)
+		pw_loop_destroy_source(pw_main_loop_get_loop(mainLoop), timer);
+	if (core) pw_core_disconnect(core);
+	if (ctx) pw_context_destroy(ctx);
+	if (mainLoop) pw_main_loop_destroy(mainLoop);
+}
+
+uint32_t TestSource::getNodeId()
+{
+	return nodeId.get();
+}
+
+std::chrono::nanoseconds TestSource::getCpuTime() noexcept
+{
+	clockid_t clock;
+	timespec t;
+	if (pthread_getcpuclockid(mainLoopThread.native_handle(), &clock) != 0 || clock_gettime(clock, &t) != 0)
+		return std::chrono::nanoseconds::zero();
+	return std::chrono::seconds(t.tv_sec) + std::chrono::nanoseconds(t.tv_nsec);
+}
+
+}
@@ -0,0 +1,107 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#ifndef SCREENCAPTURE_TESTSOURCE_HPP
+#define SCREENCAPTURE_TESTSOURCE_HPP
+
+#include "../common.hpp"
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
+#include <pipewire/pipewire.h>
+#include <spa/param/video/format.h>
+
+namespace pw
+{
+using common::Rect;
+using common::PixelFormat;
+
+enum class TestPattern
+{
+	/** a gradient that never changes, frames after the first one have no damage */
+	STATIC,
+	/** lines of text-like blocks that scroll upwards */
+	SCROLLING_TEXT,
+	/** random pixels in every frame, the worst case for any encoder */
+	NOISE,
+};
+
+struct TestSourceOptions
+{
+	Rect size = {1920, 1080};
+	uint32_t framerate = 60;
+	PixelFormat format = PixelFormat::BGRX;
+	TestPattern pattern = TestPattern::SCROLLING_TEXT;
+	/** attach SPA_META_VideoDamage with the changed region to every frame */
+	bool withDamage = true;
+	/** attach SPA_META_Cursor with a moving cursor to every frame */
+	bool withCursor = false;
+};
+
+/** A synthetic video source that provides a PipeWire stream on the local PipeWire daemon, like a compositor does
+ * for a shared screen. Its frames are MemFd buffers filled with a test pattern at a fixed rate.
+ *
+ * Connect a PipeWireStream to it by passing getNodeId() as the node and -1 as the fd of the SharedScreen,
+ * so the capture pipeline can be tested and benchmarked without xdg-desktop-portal or a compositor. */
+class TestSource
+{
+	pw_main_loop* mainLoop;
+	pw_context* ctx;
+	pw_core* core;
+	pw_stream* stream;
+	spa_source* timer;
+	spa_hook streamListener;
+	TestSourceOptions options;
+	uint32_t stride;
+	std::atomic<uint64_t> frameCount;
+	uint64_t randomState;
+	std::promise<uint32_t> nodeIdPromise;
+	std::shared_future<uint32_t> nodeId;
+	std::thread mainLoopThread;
+
+	friend void testSourceStateChanged(void*, pw_stream_state, pw_stream_state, const char*) noexcept;
+	friend void testSourceParamChanged(void*, uint32_t, const spa_pod*) noexcept;
+	friend void testSourceAddBuffer(void*, pw_buffer*) noexcept;
+	friend void testSourceRemoveBuffer(void*, pw_buffer*) noexcept;
+	friend void testSourceProcess(void*) noexcept;
+	friend void testSourceTimeout(void*, uint64_t) noexcept;
+
+	/** Draw the next frame of the test pattern.
+	 * @param pixels the buffer to draw into
+	 * @param isFirstUse true if this buffer has never been drawn into
+	 * @return true if the frame differs from the previous one */
+	bool fillFrame(uint8_t* pixels, bool isFirstUse) noexcept;
+
+	/** Create the PipeWire objects, connect the stream and start the loop thread.
+	 * @throw std::runtime_error if any step fails, call destroy() then */
+	void connect();
+	/** Stop the loop thread and free all PipeWire objects that have been created */
+	void destroy() noexcept;
+
+public:
+	/** Create the stream on the local PipeWire daemon and start producing frames once a consumer connects.
+	 * @throw std::runtime_error if connecting to PipeWire fails */
+	SCW_EXPORT explicit TestSource(const TestSourceOptions& options);
+	SCW_EXPORT ~TestSource() noexcept;
+
+	/** Wait until the stream has been registered on the PipeWire daemon and return its node ID. */
+	SCW_EXPORT uint32_t getNodeId();
+
+	/** Get the number of frames produced so far. Can be called from any thread. */
+	SCW_EXPORT uint64_t getFrameCount() const noexcept
+	{
+		return frameCount.load(std::memory_order_relaxed);
+	}
+
+	/** Get the CPU time consumed by the thread that draws the frames, so it can be subtracted from measurements of
+	 * the capture pipeline running in the same process. */
+	SCW_EXPORT std::chrono::nanoseconds getCpuTime() noexcept;
+};
+
+}
+
+#endif //SCREENCAPTURE_TESTSOURCE_HPP
@@ -7,15 +7,28 @@
 #include "xdg-desktop-portal.hpp"
 #include <cstdio>
 #include <cstdarg>
+#include <cstdlib> // getenv, free, mkostemp
+#include <algorithm>
 #include <random>
 #include <array>
 #include <utility>
 #include <vector>
 #include <map>
-#include <future>
 #include <memory>
 #include <exception>
 #include <variant>
+#include <atomic>
+#include <stdexcept>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cerrno>
+#include <cstring> // strerror
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h> // mkdir
+#include <fcntl.h> // O_CLOEXEC
+#include <unistd.h>
 
 namespace portal
 {
@@ -34,6 +47,11 @@ static const char KEY_SESSION_TOKEN[] = "session_handle_token";
 static const char KEY_SESSION_HANDLE[] = "session_handle";
 static const char KEY_SOURCE_TYPES[] = "types";
 static const char KEY_CURSOR_MODE[] = "cursor_mode";
+static const char KEY_MULTIPLE[] = "multiple";
+static const char KEY_POSITION[] = "position";
+static const char KEY_SIZE[] = "size";
+static const char KEY_PERSIST_MODE[] = "persist_mode";
+static const char KEY_RESTORE_TOKEN[] = "restore_token";
 static constexpr unsigned char CURSOR_MODE_HIDDEN = 1u;
 static constexpr unsigned char CURSOR_MODE_EMBED = 2u;
 static constexpr unsigned char CURSOR_MODE_META = 4u;
@@ -47,6 +65,33 @@ public:
 };
 
 
+/** Thrown out of a portal request when the PendingShare it belongs to has been cancelled */
+class CancelledException : public std::exception
+{
+public:
+	const char* what() const noexcept override { return "Portal request has been cancelled"; }
+};
+
+/** Lets another thread cancel the portal requests of a PendingShare, and guards the response of the current request */
+struct Cancellation
+{
+	std::mutex mutex;
+	std::condition_variable responseReceived;
+	bool isCancelled = false;
+};
+
+using ProgressCallback = PendingShare::ProgressCallback;
+
+/** The parameters of requestPipeWireShare() */
+struct ShareRequest
+{
+	CursorMode cursorMode;
+	bool multipleSources;
+	PersistMode persistMode;
+	std::string restoreToken;
+};
+
+
 enum PortalResponseStatus
 {
 	SUCCESS = 0,
@@ -55,16 +100,31 @@ enum PortalResponseStatus
 };
 
 std::optional<PortalResponse> portalRequest(sdbus::IProxy& portal, const std::string& methodName,
-											OptionsMap options, const RequestParameterList& fixedParams)
+											OptionsMap options, const RequestParameterList& fixedParams,
+											Cancellation& cancellation)
 {
+	// a cancelled share must not open the dialog of its next request
+	{
+		std::lock_guard lock(cancellation.mutex);
+		if (cancellation.isCancelled)
+			throw CancelledException();
+	}
 	std::string myName = portal.getConnection().getUniqueName().substr(1);
 	std::replace(myName.begin(), myName.end(), '.', '_');
 	sdbus::ObjectPath expectedReplyPath = "/org/freedesktop/portal/desktop/request/" + myName + "/gfxtablet";
 
+	// set by the signal handler under the lock of cancellation.mutex
+	struct
+	{
+		bool isReceived = false;
+		uint32_t resultCode = 0;
+		OptionsMap results;
+		std::exception_ptr error;
+	} response;
+
 	// install response signal receiver on reply path
 	std::unique_ptr<sdbus::IProxy> signalProxy = sdbus::createProxy(portal.getConnection(), PORTAL_BUS, expectedReplyPath);
 
-	std::promise<std::pair<uint32_t, OptionsMap>> promisedResponse;
 	// this handler is unregistered when signalProxy is destroyed, so capturing stack variables is safe
 	auto responseSignalHandler = [&] (const sdbus::Error* err, uint32_t resultCode, OptionsMap results)
 	{
@@ -74,16 +134,22 @@ std::optional<PortalResponse> portalRequest(sdbus::IProxy& portal, const std::st
 		const auto& signal = *signalProxy->getCurrentlyProcessedMessage();
 		printf("Recv signal: sender = %s, path = %s\n", signal.getSender().c_str(), signal.getPath().c_str());
 #endif
-		if (err != nullptr)
-		{
-			// parsing of arguments failed
-			// → pass error to thread waiting on the promise object
-			promisedResponse.set_exception(std::make_exception_ptr(*err));
-		}
-		else
 		{
-			promisedResponse.set_value({resultCode, std::move(results)});
+			std::lock_guard lock(cancellation.mutex);
+			if (err != nullptr)
+			{
+				// parsing of arguments failed
+				// → pass error to the waiting thread
+				response.error = std::make_exception_ptr(*err);
+			}
+			else
+			{
+				response.resultCode = resultCode;
+				response.results = std::move(results);
+			}
+			response.isReceived = true;
 		}
+		cancellation.responseReceived.notify_all();
 	};
 
 	signalProxy->uponSignal("Response").onInterface(PORTAL_REQUEST_INTERFACE).call(responseSignalHandler);
@@ -118,8 +184,29 @@ std::optional<PortalResponse> portalRequest(sdbus::IProxy& portal, const std::st
 		signalProxy->finishRegistration();
 	}
 
-	// wait for actual result, placed in the promise by the signal handler
-	auto [resultCode, results] = promisedResponse.get_future().get();
+	// wait for actual result, placed in the response by the signal handler
+	{
+		std::unique_lock lock(cancellation.mutex);
+		cancellation.responseReceived.wait(lock, [&] () { return response.isReceived || cancellation.isCancelled; });
+		if (!response.isReceived)
+		{
+			lock.unlock();
+			// dismiss the dialog, if there is one
+			try
+			{
+				auto close = signalProxy->createMethodCall(PORTAL_REQUEST_INTERFACE, "Close");
+				signalProxy->callMethod(close);
+			}
+			catch (const sdbus::Error& e)
+			{
+				std::fprintf(stderr, "Closing the portal request failed: %s\n", e.what());
+			}
+			throw CancelledException();
+		}
+	}
+	if (response.error)
+		std::rethrow_exception(response.error);
+	uint32_t resultCode = response.resultCode;
 
 	if (resultCode == PortalResponseStatus::USER_CANCELLED)
 	{
@@ -130,7 +217,7 @@ std::optional<PortalResponse> portalRequest(sdbus::IProxy& portal, const std::st
 		throw DBusException("Portal request has been aborted");
 	}
 
-	return std::move(results);
+	return std::move(response.results);
 }
 
 sdbus::UnixFd openPipeWireRemoteFd(sdbus::IProxy& portal, const sdbus::ObjectPath& sessionHandle)
@@ -146,7 +233,32 @@ sdbus::UnixFd openPipeWireRemoteFd(sdbus::IProxy& portal, const sdbus::ObjectPat
 	return fd;
 }
 
-std::pair<int,uint32_t> getPipeWireShareInfo(sdbus::IConnection& connection, CursorMode cursorMode)
+/** Read the node ID, position and size of a stream returned by Portal::Start */
+static SharedStream parseStream(const sdbus::Struct<uint32_t, OptionsMap>& stream)
+{
+	SharedStream s = {stream.get<0>(), 0, 0, {0, 0}};
+	using IntPair = sdbus::Struct<int32_t, int32_t>;
+	const OptionsMap& properties = stream.get<1>();
+	auto positionIt = properties.find(KEY_POSITION);
+	if (positionIt != properties.end() && positionIt->second.containsValueOfType<IntPair>())
+	{
+		auto position = positionIt->second.get<IntPair>();
+		s.x = position.get<0>();
+		s.y = position.get<1>();
+	}
+	auto sizeIt = properties.find(KEY_SIZE);
+	if (sizeIt != properties.end() && sizeIt->second.containsValueOfType<IntPair>())
+	{
+		auto size = sizeIt->second.get<IntPair>();
+		s.size = {static_cast<unsigned int>(std::max(size.get<0>(), 0)),
+		          static_cast<unsigned int>(std::max(size.get<1>(), 0))};
+	}
+	return s;
+}
+
+/** @return the shared screen without its D-Bus connection, or with a pipeWireFd of -1 if the user cancelled */
+SharedScreen getPipeWireShareInfo(sdbus::IConnection& connection, const ShareRequest& request,
+                                  Cancellation& cancellation, const ProgressCallback& onProgress)
 {
 	std::unique_ptr<sdbus::IProxy> portal = sdbus::createProxy(connection, PORTAL_BUS, PORTAL_PATH);
 
@@ -170,7 +282,9 @@ std::pair<int,uint32_t> getPipeWireShareInfo(sdbus::IConnection& connection, Cur
 	sessionName.back() = 0; // null terminate
 
 	// create a Session object first
-	auto response = portalRequest(*portal, "CreateSession", {{KEY_SESSION_TOKEN, sessionName.begin()}}, {});
+	onProgress(PORTAL_STEP_CREATE_SESSION);
+	auto response = portalRequest(*portal, "CreateSession", {{KEY_SESSION_TOKEN, sessionName.begin()}}, {},
+	                              cancellation);
 	if (!response)
 	{
 		throw DBusException("No response received for CreateSession");
@@ -189,33 +303,47 @@ std::pair<int,uint32_t> getPipeWireShareInfo(sdbus::IConnection& connection, Cur
 	// select the source type and cursor mode
 	OptionsMap options;
 	options[KEY_SOURCE_TYPES] = screenCastSources;
+	options[KEY_MULTIPLE] = request.multipleSources;
 	if (interfaceVersion >= 2)
 	{
 		unsigned int cmRequested = 0;
-		if (cursorMode & ::CURSOR_MODE_HIDDEN)
+		if (request.cursorMode & ::CURSOR_MODE_HIDDEN)
 			cmRequested |= portal::CURSOR_MODE_HIDDEN;
-		if (cursorMode & ::CURSOR_MODE_EMBED)
+		if (request.cursorMode & ::CURSOR_MODE_EMBED)
 			cmRequested |= portal::CURSOR_MODE_EMBED;
-		if (cursorMode & ::CURSOR_MODE_META)
+		if (request.cursorMode & ::CURSOR_MODE_META)
 			cmRequested |= portal::CURSOR_MODE_META;
-		unsigned int cm = cmRequested & cursorModes;
-		if (cm == 0u)
-			cm = portal::CURSOR_MODE_HIDDEN;
+		unsigned int available = cmRequested & cursorModes;
+		// the portal accepts only one mode, so prefer metadata, which leaves drawing the cursor to the consumer
+		unsigned int cm = portal::CURSOR_MODE_HIDDEN;
+		if (available & portal::CURSOR_MODE_META)
+			cm = portal::CURSOR_MODE_META;
+		else if (available & portal::CURSOR_MODE_EMBED)
+			cm = portal::CURSOR_MODE_EMBED;
 		options[KEY_CURSOR_MODE] = cm;
 	}
-	response = portalRequest(*portal, "SelectSources", std::move(options), {sessionHandle});
+	// restoring a session skips the dialog, if the portal still knows the token
+	if (interfaceVersion >= 4 && request.persistMode != PERSIST_MODE_NONE)
+	{
+		options[KEY_PERSIST_MODE] = static_cast<uint32_t>(request.persistMode);
+		if (!request.restoreToken.empty())
+			options[KEY_RESTORE_TOKEN] = request.restoreToken;
+	}
+	onProgress(PORTAL_STEP_SELECT_SOURCES);
+	response = portalRequest(*portal, "SelectSources", std::move(options), {sessionHandle}, cancellation);
 	if (!response)
 	{
 		throw DBusException("No response received for SelectSources");
 	}
 
-	response = portalRequest(*portal, "Start", {}, {sessionHandle, /* parent_window */ std::string()});
+	onProgress(PORTAL_STEP_START);
+	response = portalRequest(*portal, "Start", {}, {sessionHandle, /* parent_window */ std::string()}, cancellation);
 	if (!response)
 	{
 #ifndef NDEBUG
 		std::fprintf(stderr, "User cancelled screen sharing\n");
 #endif
-		return {-1, {}};
+		return {nullptr, -1, 0, {}, {}};
 	}
 	auto streamIt = response.value().find("streams");
 	if (streamIt == response.value().end())
@@ -228,24 +356,48 @@ std::pair<int,uint32_t> getPipeWireShareInfo(sdbus::IConnection& connection, Cur
 		throw DBusException("Portal::Start did not return any stream!");
 	}
 
-	// use the first stream, but it should be only one by default anyway
-	auto& stream = streams.at(0);
-	uint32_t pipeWireNode = stream.get<0>();
+	// there is only one stream unless multiple sources were requested
+	std::vector<SharedStream> sharedStreams;
+	for (const auto& stream : streams)
+	{
+		sharedStreams.push_back(parseStream(stream));
+#ifndef NDEBUG
+		const SharedStream& s = sharedStreams.back();
+		std::printf("Stream node %u at %d,%d size %ux%u\n", s.pipeWireNode, s.x, s.y, s.size.w, s.size.h);
+#endif
+	}
+	// a token is only returned if the session may be persisted, and each one can be used once
+	std::string restoreToken;
+	auto tokenIt = response.value().find(KEY_RESTORE_TOKEN);
+	if (tokenIt != response.value().end() && tokenIt->second.containsValueOfType<std::string>())
+		restoreToken = tokenIt->second.get<std::string>();
+
+	onProgress(PORTAL_STEP_OPEN_REMOTE);
 	sdbus::UnixFd fd = openPipeWireRemoteFd(*portal, sessionHandle);
-	return {fd.release(), {pipeWireNode}};
+	uint32_t firstNode = sharedStreams.front().pipeWireNode;
+	return {nullptr, fd.release(), firstNode, std::move(sharedStreams), std::move(restoreToken)};
 }
 
-std::optional<SharedScreen> requestPipeWireShare(CursorMode cursorMode)
+static std::optional<SharedScreen> requestShare(const ShareRequest& request, Cancellation& cancellation,
+                                                const ProgressCallback& onProgress)
 {
+	onProgress(PORTAL_STEP_CONNECTING);
 	std::unique_ptr<sdbus::IConnection> connection = sdbus::createSessionBusConnection();
+	// sd-bus creates its event loop thread itself, and a new thread inherits the name of its creator
+	char ownName[16];
+	bool hasOwnName = pthread_getname_np(pthread_self(), ownName, sizeof(ownName)) == 0;
+	common::setCurrentThreadName("scw-dbus");
 	connection->enterEventLoopAsync();
+	if (hasOwnName)
+		common::setCurrentThreadName(ownName);
 
 	try
 	{
-		auto [fd, pipeWireNode] = getPipeWireShareInfo(*connection, cursorMode);
-		if (fd < 0)
+		SharedScreen share = getPipeWireShareInfo(*connection, request, cancellation, onProgress);
+		if (share.pipeWireFd < 0)
 			return std::nullopt;
-		return SharedScreen {std::move(connection), fd, pipeWireNode};
+		share.dbusConnection = std::move(connection);
+		return share;
 	}
 	catch (const sdbus::Error& e)
 	{
@@ -253,6 +405,204 @@ std::optional<SharedScreen> requestPipeWireShare(CursorMode cursorMode)
 	}
 }
 
+std::optional<SharedScreen> requestPipeWireShare(CursorMode cursorMode, bool multipleSources, PersistMode persistMode,
+                                                 const std::string& restoreToken)
+{
+	Cancellation cancellation;
+	return requestShare({cursorMode, multipleSources, persistMode, restoreToken}, cancellation, [] (PortalStep) {});
+}
+
+
+struct PendingShare::State
+{
+	Cancellation cancellation;
+	ProgressCallback onProgress;
+	int eventFd = -1;
+	std::atomic<PortalStep> step;
+	/** written by the request thread before the step becomes final */
+	std::optional<SharedScreen> result;
+	std::exception_ptr error;
+
+	void setStep(PortalStep s) noexcept
+	{
+		step = s;
+		if (onProgress)
+			onProgress(s);
+	}
+
+	~State() noexcept
+	{
+		if (eventFd != -1)
+			close(eventFd);
+	}
+};
+
+PendingShare::PendingShare(CursorMode cursorMode, bool multipleSources, PersistMode persistMode,
+                           std::string restoreToken, ProgressCallback onProgress)
+: state(std::make_unique<State>())
+{
+	state->onProgress = std::move(onProgress);
+	state->step = PORTAL_STEP_CONNECTING;
+	state->eventFd = eventfd(0, EFD_CLOEXEC);
+	if (state->eventFd == -1)
+		throw std::runtime_error("eventfd creation failed: " + std::string(std::strerror(errno)));
+
+	thread = std::thread([s = state.get(),
+	                      request = ShareRequest{cursorMode, multipleSources, persistMode, std::move(restoreToken)}] ()
+	{
+		common::setCurrentThreadName("scw-portal");
+		PortalStep finalStep = PORTAL_STEP_DONE;
+		try
+		{
+			s->result = requestShare(request, s->cancellation, [s] (PortalStep step) { s->setStep(step); });
+			if (!s->result)
+				finalStep = PORTAL_STEP_CANCELLED;
+		}
+		catch (const CancelledException&)
+		{
+			finalStep = PORTAL_STEP_CANCELLED;
+		}
+		catch (...)
+		{
+			s->error = std::current_exception();
+			finalStep = PORTAL_STEP_FAILED;
+		}
+		s->setStep(finalStep);
+		uint64_t num = 1;
+		write(s->eventFd, &num, sizeof(num));
+	});
+}
+
+PendingShare::PendingShare(PendingShare&&) noexcept = default;
+
+PendingShare::~PendingShare() noexcept
+{
+	if (!state)
+		return;
+	cancel();
+	if (thread.joinable())
+		thread.join();
+	// nobody took the result, so nobody else will close its fd
+	if (state->result && state->result->pipeWireFd >= 0)
+		close(state->result->pipeWireFd);
+}
+
+int PendingShare::getPollFd() const noexcept
+{
+	return state->eventFd;
+}
+
+PortalStep PendingShare::getStep() const noexcept
+{
+	return state->step;
+}
+
+bool PendingShare::isDone() const noexcept
+{
+	PortalStep step = state->step;
+	return step == PORTAL_STEP_DONE || step == PORTAL_STEP_CANCELLED || step == PORTAL_STEP_FAILED;
+}
+
+void PendingShare::cancel() noexcept
+{
+	{
+		std::lock_guard lock(state->cancellation.mutex);
+		state->cancellation.isCancelled = true;
+	}
+	state->cancellation.responseReceived.notify_all();
+}
+
+std::optional<SharedScreen> PendingShare::get()
+{
+	if (thread.joinable())
+		thread.join();
+	if (state->error)
+		std::rethrow_exception(std::exchange(state->error, nullptr));
+	return std::exchange(state->result, std::nullopt);
+}
+
+std::string getDefaultRestoreTokenPath(const std::string& name)
+{
+	std::string stateDir;
+	const char* stateHome = std::getenv("XDG_STATE_HOME");
+	const char* home = std::getenv("HOME");
+	if (stateHome && stateHome[0] == '/')
+		stateDir = stateHome;
+	else if (home && home[0] == '/')
+		stateDir = std::string(home) + "/.local/state";
+	else
+		throw std::runtime_error("Neither XDG_STATE_HOME nor HOME is set");
+	return stateDir + "/screencapture-wayland/" + name + ".token";
+}
+
+std::string loadRestoreToken(const std::string& path)
+{
+	FILE* file = std::fopen(path.c_str(), "re");
+	if (!file)
+	{
+		if (errno == ENOENT)
+			return {};
+		throw std::runtime_error("Opening " + path + " failed: " + std::strerror(errno));
+	}
+	char buffer[256];
+	size_t length = std::fread(buffer, 1, sizeof(buffer), file);
+	bool failed = std::ferror(file);
+	std::fclose(file);
+	if (failed)
+		throw std::runtime_error("Reading " + path + " failed");
+	std::string token(buffer, length);
+	// tolerate a trailing newline from editing the file by hand
+	while (!token.empty() && (token.back() == '\n' || token.back() == '\r'))
+		token.pop_back();
+	return token;
+}
+
+/** Create the directory and its parents, like mkdir -p */
+static void createDirectories(const std::string& path)
+{
+	for (size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1))
+	{
+		std::string dir = path.substr(0, slash);
+		if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST)
+			throw std::runtime_error("Creating " + dir + " failed: " + std::strerror(errno));
+		if (slash == std::string::npos)
+			break;
+	}
+}
+
+void saveRestoreToken(const std::string& path, const std::string& token)
+{
+	if (token.empty())
+	{
+		if (unlink(path.c_str()) != 0 && errno != ENOENT)
+			throw std::runtime_error("Removing " + path + " failed: " + std::strerror(errno));
+		return;
+	}
+	size_t dirEnd = path.rfind('/');
+	if (dirEnd != std::string::npos && dirEnd > 0)
+		createDirectories(path.substr(0, dirEnd));
+
+	// replace the file atomically, so a crash never leaves a truncated token behind. The data must be on disk before
+	// the rename, and a unique temporary file keeps concurrent writers from mixing their tokens.
+	std::string tempPath = path + ".XXXXXX";
+	int fd = mkostemp(tempPath.data(), O_CLOEXEC);
+	if (fd == -1)
+		throw std::runtime_error("Creating " + tempPath + " failed: " + std::strerror(errno));
+	bool written = write(fd, token.data(), token.size()) == static_cast<ssize_t>(token.size()) && fsync(fd) == 0;
+	int err = written ? 0 : errno;
+	if (close(fd) != 0 && written)
+	{
+		written = false;
+		err = errno;
+	}
+	if (!written || rename(tempPath.c_str(), path.c_str()) != 0)
+	{
+		err = written ? errno : err;
+		unlink(tempPath.c_str());
+		throw std::runtime_error("Writing " + path + " failed: " + std::strerror(err));
+	}
+}
+
 DBusException::DBusException(const char* messageFmtStr, ...) noexcept
 {
 	std::va_list v_args;
@@ -269,18 +619,42 @@ DBusException::DBusException(const char* messageFmtStr, ...) noexcept
 // C interface
 
 SharedScreen_t* requestPipeWireShareFromPortal(CursorMode cursorMode)
+{
+	return requestMultiplePipeWireSharesFromPortal(cursorMode, false);
+}
+
+static SharedScreen_t* toCSharedScreen(portal::SharedScreen& cppStruct)
+{
+	auto cStruct = new SharedScreen_t;
+	cStruct->pipeWireFd = cppStruct.pipeWireFd;
+	cStruct->pipeWireNode = cppStruct.pipeWireNode;
+	cStruct->streamCount = static_cast<uint32_t>(cppStruct.streams.size());
+	cStruct->streams = new SharedStream_t[cppStruct.streams.size()];
+	for (size_t i = 0; i < cppStruct.streams.size(); ++i)
+	{
+		const auto& s = cppStruct.streams[i];
+		cStruct->streams[i] = {s.pipeWireNode, s.x, s.y, {s.size.w, s.size.h}};
+	}
+	cStruct->restoreToken = cppStruct.restoreToken.empty() ? nullptr : strdup(cppStruct.restoreToken.c_str());
+	cStruct->connection = new std::shared_ptr<sdbus::IConnection>(cppStruct.dbusConnection);
+	return cStruct;
+}
+
+SharedScreen_t* requestMultiplePipeWireSharesFromPortal(CursorMode cursorMode, bool multipleSources)
+{
+	return requestPersistentPipeWireShareFromPortal(cursorMode, multipleSources, PERSIST_MODE_NONE, nullptr);
+}
+
+SharedScreen_t* requestPersistentPipeWireShareFromPortal(CursorMode cursorMode, bool multipleSources,
+                                                         PersistMode persistMode, const char* restoreToken)
 {
 	try
 	{
-		std::optional<portal::SharedScreen> shareInfo = portal::requestPipeWireShare(cursorMode);
+		std::optional<portal::SharedScreen> shareInfo = portal::requestPipeWireShare(
+				cursorMode, multipleSources, persistMode, restoreToken ? restoreToken : "");
 		if (!shareInfo)
 			return nullptr;
-		auto cStruct = new SharedScreen_t;
-		auto& cppStruct = shareInfo.value();
-		cStruct->pipeWireFd = cppStruct.pipeWireFd;
-		cStruct->pipeWireNode = cppStruct.pipeWireNode;
-		cStruct->connection = new std::shared_ptr<sdbus::IConnection>(cppStruct.dbusConnection);
-		return cStruct;
+		return toCSharedScreen(shareInfo.value());
 	}
 	catch (const std::exception& e)
 	{
@@ -289,9 +663,108 @@ SharedScreen_t* requestPipeWireShareFromPortal(CursorMode cursorMode)
 	}
 }
 
+struct PendingShare
+{
+	portal::PendingShare cppShare;
+};
+
+struct PendingShare* requestPipeWireShareFromPortalAsync(CursorMode cursorMode, bool multipleSources,
+                                                         PersistMode persistMode, const char* restoreToken,
+                                                         PortalProgressCallback_t onProgress, void* userData)
+{
+	try
+	{
+		portal::PendingShare::ProgressCallback callback;
+		if (onProgress)
+			callback = [onProgress, userData] (PortalStep step) { onProgress(step, userData); };
+		return new PendingShare {portal::PendingShare(cursorMode, multipleSources, persistMode,
+		                                              restoreToken ? restoreToken : "", std::move(callback))};
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return nullptr;
+	}
+}
+
+int PendingShare_getPollFd(struct PendingShare* pendingShare)
+{
+	return pendingShare->cppShare.getPollFd();
+}
+
+PortalStep PendingShare_getStep(struct PendingShare* pendingShare)
+{
+	return pendingShare->cppShare.getStep();
+}
+
+SharedScreen_t* PendingShare_finish(struct PendingShare* pendingShare)
+{
+	SharedScreen_t* result = nullptr;
+	try
+	{
+		std::optional<portal::SharedScreen> shareInfo = pendingShare->cppShare.get();
+		if (shareInfo)
+			result = toCSharedScreen(shareInfo.value());
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+	}
+	delete pendingShare;
+	return result;
+}
+
+void PendingShare_free(struct PendingShare* pendingShare)
+{
+	delete pendingShare;
+}
+
 void dropSharedScreen(SharedScreen_t* shareInfo)
 {
 	auto* conn = static_cast<std::shared_ptr<sdbus::IConnection>*>(shareInfo->connection);
 	delete conn;
+	delete[] shareInfo->streams;
+	free(shareInfo->restoreToken);
 	delete shareInfo;
-}
\ No newline at end of file
+}
+
+char* getDefaultPortalRestoreTokenPath(const char* name)
+{
+	try
+	{
+		return strdup(portal::getDefaultRestoreTokenPath(name).c_str());
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return nullptr;
+	}
+}
+
+char* loadPortalRestoreToken(const char* path)
+{
+	try
+	{
+		std::string token = portal::loadRestoreToken(path);
+		return token.empty() ? nullptr : strdup(token.c_str());
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return nullptr;
+	}
+}
+
+int savePortalRestoreToken(const char* path, const char* token)
+{
+	try
+	{
+		portal::saveRestoreToken(path, token ? token : "");
+		return 0;
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return -1;
+	}
+}
@@ -8,19 +8,94 @@
 
 #include "../common.hpp"
 #include <module-portal.h>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
 
 namespace portal
 {
 using common::SharedScreen;
+using common::SharedStream;
 
 /** Request a shared screen via D-Bus from xdg-desktop-portal. This will ask the user if they want
  * to share their screen and which screen to share to this application.
  * The returned SharedScreen object allows you to acquire a PipeWire video stream for the screen.
  * @param cursorMode a bitfield of #CursorMode flags that describe which cursor mode you want to request
- *     (may be ignored by the portal)
+ *     (may be ignored by the portal). Of several available ones, CURSOR_MODE_META is preferred over CURSOR_MODE_EMBED.
+ * @param multipleSources let the user select several sources, e.g. all monitors. They are returned in
+ *     SharedScreen::streams and can be captured together with a pw::PipeWireStreamGroup.
+ * @param persistMode how long the portal should remember the user's selection. If it is not PERSIST_MODE_NONE and
+ *     the portal supports it (ScreenCast version 4), SharedScreen::restoreToken is set.
+ * @param restoreToken a token from a previous SharedScreen::restoreToken, to restore its selection without asking
+ *     the user again. It is ignored unless a persistMode is given. If the portal does not accept it, the user is asked.
  * @return A SharedScreen object on success, or nothing if the user cancelled the request
  * @throw std::exception if an I/O or protocol error occurs */
-SCW_EXPORT std::optional<SharedScreen> requestPipeWireShare(CursorMode cursorMode);
+SCW_EXPORT std::optional<SharedScreen> requestPipeWireShare(CursorMode cursorMode, bool multipleSources = false,
+                                                            PersistMode persistMode = PERSIST_MODE_NONE,
+                                                            const std::string& restoreToken = {});
+
+/** A screen share request that runs on its own thread, so the application can set up PipeWire, hardware devices and
+ * outputs while the user is in the share dialog. Request steps are reported by an optional callback, and
+ * getPollFd() becomes readable when the request is done.
+ *
+ * Destroying an unfinished request cancels it and closes the share dialog. */
+class PendingShare
+{
+	struct State;
+	std::unique_ptr<State> state;
+	std::thread thread;
+
+public:
+	/** Called on the request thread with every step, the last one is PORTAL_STEP_DONE, PORTAL_STEP_CANCELLED or
+	 * PORTAL_STEP_FAILED */
+	using ProgressCallback = std::function<void(PortalStep)>;
+
+	/** Start a request like requestPipeWireShare().
+	 * @throw std::runtime_error if the request thread could not be started */
+	SCW_EXPORT PendingShare(CursorMode cursorMode, bool multipleSources = false,
+	                        PersistMode persistMode = PERSIST_MODE_NONE, std::string restoreToken = {},
+	                        ProgressCallback onProgress = {});
+
+	SCW_EXPORT PendingShare(PendingShare&&) noexcept;
+	PendingShare(const PendingShare&) = delete;
+
+	SCW_EXPORT ~PendingShare() noexcept;
+
+	/** Get a file descriptor that becomes readable when the request is done */
+	SCW_EXPORT int getPollFd() const noexcept;
+
+	/** Get the step the request is currently in */
+	SCW_EXPORT PortalStep getStep() const noexcept;
+
+	/** @return if the request has finished, and get() does not block */
+	SCW_EXPORT bool isDone() const noexcept;
+
+	/** Cancel the request and close the share dialog. get() returns nothing afterwards, unless the request had
+	 * finished already. */
+	SCW_EXPORT void cancel() noexcept;
+
+	/** Wait until the request is done and take its result. This can only be called once.
+	 * @return A SharedScreen object on success, or nothing if the user or cancel() cancelled the request
+	 * @throw std::exception if an I/O or protocol error occurred */
+	SCW_EXPORT std::optional<SharedScreen> get();
+};
+
+/** Get the standard place for the restore token of an application, $XDG_STATE_HOME/screencapture-wayland/<name>.token
+ * @throw std::runtime_error if neither XDG_STATE_HOME nor HOME is set */
+SCW_EXPORT std::string getDefaultRestoreTokenPath(const std::string& name);
+
+/** Read a restore token that has been saved with saveRestoreToken().
+ * @return the token, or an empty string if the file does not exist
+ * @throw std::runtime_error if the file could not be read */
+SCW_EXPORT std::string loadRestoreToken(const std::string& path);
+
+/** Save a restore token, readable only by the current user. The file is replaced atomically, and missing directories
+ * are created. An empty token removes the file.
+ * A token can be used only once, so save the new SharedScreen::restoreToken after every request.
+ * @throw std::runtime_error if the file could not be written */
+SCW_EXPORT void saveRestoreToken(const std::string& path, const std::string& token);
 
 }
 
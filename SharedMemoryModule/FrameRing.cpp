@@ -0,0 +1,298 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#include "FrameRing.hpp"
+#include <atomic>
+#include <new>
+#include <cstring>
+#include <unistd.h>
+
+using namespace std::chrono;
+
+namespace shm
+{
+
+static constexpr uint32_t FRAME_RING_MAGIC = 0x53435746; // "SCWF"
+static constexpr uint32_t FRAME_RING_VERSION = 1;
+
+/** Header of one frame slot.
+ * @em sequence is odd while the writer modifies the slot, and is incremented again after it finished. */
+struct FrameSlot
+{
+	std::atomic<uint32_t> sequence;
+	uint32_t isDmaBuf;
+	uint64_t frameNumber;
+	int64_t pts;
+	uint32_t width;
+	uint32_t height;
+	/** common::PixelFormat for memory frames */
+	uint32_t format;
+	uint32_t planeCount;
+	uint64_t stride;
+	uint64_t size;
+	/** DMA-BUF descriptor, the fd itself is sent over the socket */
+	uint64_t drmFormat;
+	uint64_t modifier;
+	uint64_t totalSize;
+	struct {
+		uint64_t offset;
+		uint64_t pitch;
+	} planes[4];
+};
+
+struct FrameRingHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slotCount;
+	uint32_t slotHeaderOffset;
+	uint64_t slotDataOffset;
+	uint64_t slotDataSize;
+	std::atomic<uint64_t> framesPublished;
+
+	FrameSlot& slot(uint32_t i) noexcept
+	{
+		return reinterpret_cast<FrameSlot*>(reinterpret_cast<uint8_t*>(this) + slotHeaderOffset)[i];
+	}
+	const FrameSlot& slot(uint32_t i) const noexcept
+	{
+		return reinterpret_cast<const FrameSlot*>(reinterpret_cast<const uint8_t*>(this) + slotHeaderOffset)[i];
+	}
+	uint8_t* slotData(uint32_t i) noexcept
+	{
+		return reinterpret_cast<uint8_t*>(this) + slotDataOffset + i * slotDataSize;
+	}
+	const uint8_t* slotData(uint32_t i) const noexcept
+	{
+		return reinterpret_cast<const uint8_t*>(this) + slotDataOffset + i * slotDataSize;
+	}
+};
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+              "shared memory synchronisation needs lock-free atomics");
+
+/** Message sent to readers for each published frame */
+struct FrameMessage
+{
+	uint64_t frameNumber;
+	uint32_t slot;
+};
+
+static constexpr size_t alignUp(size_t value, size_t alignment) noexcept
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+static UniqueFd createFrameRing(Rect maxSize, uint32_t slotCount)
+{
+	if (slotCount == 0)
+		throw ShmException("Frame ring needs at least one slot");
+	size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	size_t slotHeaderOffset = alignUp(sizeof(FrameRingHeader), 64);
+	size_t slotDataOffset = alignUp(slotHeaderOffset + slotCount * sizeof(FrameSlot), pageSize);
+	size_t slotDataSize = alignUp(size_t(maxSize.w) * maxSize.h * 4, pageSize);
+
+	UniqueFd fd = createSharedMemory("screencapture-frames", slotDataOffset + slotCount * slotDataSize);
+	Mapping m(fd.get(), true);
+	// the memfd is zero-filled, so all slots start with sequence 0 and are empty
+	auto header = new (m.data()) FrameRingHeader;
+	header->magic = FRAME_RING_MAGIC;
+	header->version = FRAME_RING_VERSION;
+	header->slotCount = slotCount;
+	header->slotHeaderOffset = static_cast<uint32_t>(slotHeaderOffset);
+	header->slotDataOffset = slotDataOffset;
+	header->slotDataSize = slotDataSize;
+	header->framesPublished.store(0, std::memory_order_relaxed);
+	return fd;
+}
+
+FrameRingWriter::FrameRingWriter(const std::string& socketPath, Rect maxSize, uint32_t slotCount)
+: memFd(createFrameRing(maxSize, slotCount)),
+  mapping(memFd.get(), true),
+  publisher(socketPath, memFd.get()),
+  header(reinterpret_cast<FrameRingHeader*>(mapping.data())),
+  framesPublished(0),
+  heldDmaBufFrames(slotCount)
+{
+}
+
+FrameRingWriter::~FrameRingWriter() noexcept = default;
+
+/** Mark the slot as being modified, so readers don't use it anymore. */
+static uint32_t beginWrite(FrameSlot& slot) noexcept
+{
+	uint32_t sequence = slot.sequence.load(std::memory_order_relaxed);
+	slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	return sequence + 2;
+}
+
+void FrameRingWriter::publish(std::unique_ptr<MemoryFrame> frame)
+{
+	size_t rowSize = size_t(frame->width) * 4;
+	if (rowSize * frame->height > header->slotDataSize)
+	{
+		throw ShmException("Frame of %ux%u is larger than the frame ring slots", frame->width, frame->height);
+	}
+
+	uint32_t slotIndex = framesPublished % header->slotCount;
+	FrameSlot& slot = header->slot(slotIndex);
+	uint32_t nextSequence = beginWrite(slot);
+	// a DMA-BUF frame might still occupy this slot
+	heldDmaBufFrames[slotIndex].reset();
+
+	const uint8_t* src = static_cast<const uint8_t*>(frame->memory) + frame->offset;
+	uint8_t* dst = header->slotData(slotIndex);
+	if (frame->stride == rowSize)
+	{
+		std::memcpy(dst, src, rowSize * frame->height);
+	}
+	else
+	{
+		for (uint32_t y = 0; y < frame->height; ++y)
+			std::memcpy(dst + y * rowSize, src + y * frame->stride, rowSize);
+	}
+
+	slot.isDmaBuf = false;
+	slot.frameNumber = framesPublished;
+	slot.pts = frame->pts.count();
+	slot.width = frame->width;
+	slot.height = frame->height;
+	slot.format = static_cast<uint32_t>(frame->format);
+	slot.planeCount = 1;
+	slot.stride = rowSize;
+	slot.size = rowSize * frame->height;
+	slot.sequence.store(nextSequence, std::memory_order_release);
+
+	// the pixels are in the ring now, so the PipeWire buffer can go back to the compositor
+	frame.reset();
+
+	header->framesPublished.store(framesPublished + 1, std::memory_order_release);
+	FrameMessage message = {framesPublished, slotIndex};
+	publisher.broadcast(&message, sizeof(message));
+	++framesPublished;
+}
+
+void FrameRingWriter::publish(std::unique_ptr<DmaBufFrame> frame)
+{
+	if (frame->objectCount != 1)
+		throw ShmException("Frames with %u DMA-BUF objects can't be published, only one", frame->objectCount);
+	uint32_t slotIndex = framesPublished % header->slotCount;
+	FrameSlot& slot = header->slot(slotIndex);
+	uint32_t nextSequence = beginWrite(slot);
+	heldDmaBufFrames[slotIndex].reset();
+
+	slot.isDmaBuf = true;
+	slot.frameNumber = framesPublished;
+	slot.pts = frame->pts.count();
+	slot.width = frame->width;
+	slot.height = frame->height;
+	slot.format = 0;
+	slot.planeCount = frame->planeCount;
+	slot.stride = frame->planes[0].pitch;
+	slot.size = frame->drmObjects[0].totalSize;
+	slot.drmFormat = frame->drmFormat;
+	slot.modifier = frame->drmObjects[0].modifier;
+	slot.totalSize = frame->drmObjects[0].totalSize;
+	for (uint32_t i = 0; i < 4; ++i)
+		slot.planes[i] = {frame->planes[i].offset, frame->planes[i].pitch};
+	slot.sequence.store(nextSequence, std::memory_order_release);
+
+	header->framesPublished.store(framesPublished + 1, std::memory_order_release);
+	FrameMessage message = {framesPublished, slotIndex};
+	publisher.broadcast(&message, sizeof(message), frame->drmObjects[0].fd);
+	++framesPublished;
+	// keep the buffer away from the compositor while readers might still use it
+	heldDmaBufFrames[slotIndex] = std::move(frame);
+}
+
+
+FrameRingReader::FrameRingReader(const std::string& socketPath)
+: subscription(socketPath),
+  mapping(subscription.getSharedMemoryFd(), false),
+  header(reinterpret_cast<const FrameRingHeader*>(mapping.data()))
+{
+	if (mapping.size() < sizeof(FrameRingHeader) || header->magic != FRAME_RING_MAGIC)
+		throw ShmException("Shared memory from %s is not a frame ring", socketPath.c_str());
+	if (header->version != FRAME_RING_VERSION)
+		throw ShmException("Unsupported frame ring version %u", header->version);
+	if (header->slotDataOffset + header->slotCount * header->slotDataSize > mapping.size())
+		throw ShmException("Frame ring is larger than its shared memory");
+}
+
+std::optional<ReceivedFrame> FrameRingReader::nextFrame()
+{
+	// drain all pending messages and only keep the newest one, so a slow reader skips frames
+	std::optional<FrameMessage> newest;
+	UniqueFd newestFd;
+	while (true)
+	{
+		FrameMessage message;
+		UniqueFd fd;
+		if (subscription.receive(&message, sizeof(message), fd) != sizeof(message))
+			break;
+		newest = message;
+		newestFd = std::move(fd);
+	}
+	if (!newest || newest->slot >= header->slotCount)
+		return std::nullopt;
+
+	const FrameSlot& slot = header->slot(newest->slot);
+	uint32_t sequence = slot.sequence.load(std::memory_order_acquire);
+	if (sequence & 1u)
+		return std::nullopt;
+
+	// copy the slot header, then check that it was not modified while doing so
+	ReceivedFrame result {slot.frameNumber, newest->slot, sequence, {}};
+	bool isDmaBuf = slot.isDmaBuf;
+	uint32_t width = slot.width;
+	uint32_t height = slot.height;
+	int64_t pts = slot.pts;
+	if (isDmaBuf)
+	{
+		if (!newestFd)
+			return std::nullopt;
+		auto f = std::make_unique<DmaBufFrame>();
+		f->width = width;
+		f->height = height;
+		f->pts = nanoseconds(pts);
+		f->drmFormat = slot.drmFormat;
+		f->objectCount = 1;
+		f->drmObjects[0] = {newestFd.get(), slot.totalSize, slot.modifier};
+		f->planeCount = slot.planeCount;
+		for (uint32_t i = 0; i < 4; ++i)
+			f->planes[i] = {0, slot.planes[i].offset, slot.planes[i].pitch};
+		f->onFrameDone = [fd = newestFd.release()] ()
+		{
+			close(fd);
+		};
+		result.frame = std::move(f);
+	}
+	else
+	{
+		auto f = std::make_unique<MemoryFrame>();
+		f->width = width;
+		f->height = height;
+		f->pts = nanoseconds(pts);
+		f->format = static_cast<common::PixelFormat>(slot.format);
+		f->memory = const_cast<uint8_t*>(header->slotData(newest->slot));
+		f->stride = slot.stride;
+		f->size = slot.size;
+		f->offset = 0;
+		f->onFrameDone = [] () {};
+		result.frame = std::move(f);
+	}
+
+	if (result.frameNumber != newest->frameNumber || !isIntact(result))
+		return std::nullopt;
+	return result;
+}
+
+bool FrameRingReader::isIntact(const ReceivedFrame& frame) const noexcept
+{
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return header->slot(frame.slot).sequence.load(std::memory_order_relaxed) == frame.sequence;
+}
+
+}
@@ -0,0 +1,108 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#ifndef SCREENCAPTURE_FRAMERING_HPP
+#define SCREENCAPTURE_FRAMERING_HPP
+
+#include "../common.hpp"
+#include "ShmCommon.hpp"
+#include <memory>
+#include <optional>
+#include <string>
+#include <variant>
+#include <vector>
+
+namespace shm
+{
+using common::Rect;
+using common::MemoryFrame;
+using common::DmaBufFrame;
+
+struct FrameRingHeader;
+
+/** Publishes captured frames to other local processes through a ring of frame slots in shared memory.
+ *
+ * The pixels of a MemoryFrame are copied once into the next slot, and the frame is released right afterwards,
+ * so its PipeWire buffer goes back to the compositor immediately. DmaBufFrame objects are not copied at all:
+ * their descriptor is written into the slot and the DMA-BUF fd is passed to each reader with SCM_RIGHTS. These frames
+ * are kept until their slot is reused, so choose a slot count that leaves enough buffers to the PipeWire stream.
+ *
+ * Readers attach by connecting to a Unix socket (see FrameRingReader). Any number of readers can read the
+ * same slots without a copy. Each slot header is protected by a sequence lock, so a reader that is too slow to
+ * keep up detects overwritten slots and simply skips those frames, without ever stalling the writer. */
+class FrameRingWriter
+{
+	UniqueFd memFd;
+	Mapping mapping;
+	Publisher publisher;
+	FrameRingHeader* header;
+	uint64_t framesPublished;
+	std::vector<std::unique_ptr<DmaBufFrame>> heldDmaBufFrames;
+
+public:
+	/** Create the shared memory ring and start listening for readers.
+	 * @param socketPath path of the Unix socket that readers connect to
+	 * @param maxSize the largest frame size that will be published (only relevant for MemoryFrame)
+	 * @param slotCount number of frames in the ring */
+	SCW_EXPORT FrameRingWriter(const std::string& socketPath, Rect maxSize, uint32_t slotCount = 4);
+	SCW_EXPORT ~FrameRingWriter() noexcept;
+
+	/** Copy the frame into the ring and release it.
+	 * @throw ShmException if the frame is larger than the maximum size given in the constructor */
+	SCW_EXPORT void publish(std::unique_ptr<MemoryFrame> frame);
+
+	/** Publish the frame's descriptor and pass its fd to every reader. The frame is released when its slot is reused.
+	 * @throw ShmException if the planes are in more than one DMA-BUF object, as only one fd is passed per frame */
+	SCW_EXPORT void publish(std::unique_ptr<DmaBufFrame> frame);
+
+	/** New readers are attached with each published frame. If no frames are published for a while, poll this
+	 * file descriptor and call acceptReaders() when it becomes readable, so connecting readers don't have to wait. */
+	SCW_EXPORT int getPollFd() const noexcept { return publisher.getPollFd(); }
+
+	SCW_EXPORT void acceptReaders() noexcept { publisher.acceptClients(); }
+
+	/** Number of readers currently attached */
+	SCW_EXPORT size_t readerCount() const noexcept { return publisher.clientCount(); }
+};
+
+/** A frame read from a FrameRingWriter.
+ * A MemoryFrame points directly into the shared memory, so check FrameRingReader::isIntact() after using
+ * its pixels to see if the writer has overwritten the slot in the meantime.
+ * A DmaBufFrame owns the received fd, which is closed when the frame is destroyed. */
+struct ReceivedFrame
+{
+	uint64_t frameNumber;
+	uint32_t slot;
+	uint32_t sequence;
+	std::variant<std::unique_ptr<MemoryFrame>, std::unique_ptr<DmaBufFrame>> frame;
+};
+
+/** Attaches to a FrameRingWriter in another process. */
+class FrameRingReader
+{
+	Subscription subscription;
+	Mapping mapping;
+	const FrameRingHeader* header;
+
+public:
+	/** Connect to the writer's socket and map its ring.
+	 * @throw ShmException if connecting fails or the shared memory does not contain a frame ring */
+	SCW_EXPORT explicit FrameRingReader(const std::string& socketPath);
+
+	/** File descriptor that becomes readable when a new frame was published */
+	SCW_EXPORT int getPollFd() const noexcept { return subscription.getPollFd(); }
+
+	/** Return the most recently published frame, skipping all older ones that were not read yet.
+	 * Returns nothing if no new frame is available or it was overwritten before it could be read. */
+	SCW_EXPORT std::optional<ReceivedFrame> nextFrame();
+
+	/** Check that the frame's slot has not been overwritten since nextFrame() returned it.
+	 * Call this after reading the pixels of a MemoryFrame, and discard your results if it returns false. */
+	SCW_EXPORT bool isIntact(const ReceivedFrame& frame) const noexcept;
+};
+
+}
+
+#endif //SCREENCAPTURE_FRAMERING_HPP
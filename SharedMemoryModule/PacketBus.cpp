@@ -0,0 +1,305 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#include "PacketBus.hpp"
+#include <atomic>
+#include <new>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+namespace shm
+{
+
+static constexpr uint32_t PACKET_BUS_MAGIC = 0x53435750; // "SCWP"
+static constexpr uint32_t PACKET_BUS_VERSION = 2;
+static constexpr uint32_t MAX_READERS = 16;
+static constexpr uint64_t ENTRY_BEING_WRITTEN = ~uint64_t(0);
+
+/** Index entry of one packet. @em packetNumber is ENTRY_BEING_WRITTEN while the writer modifies the entry. */
+struct PacketEntry
+{
+	std::atomic<uint64_t> packetNumber;
+	/** absolute byte position of the data, its offset in the data ring is position % dataSize */
+	uint64_t position;
+	uint64_t size;
+	int64_t pts;
+	int64_t dts;
+	uint32_t isKeyframe;
+};
+
+/** Progress of one reader, written by the reader and read by the writer for statistics.
+ * A slot is free if @em clientId is 0, otherwise it belongs to the reader with that socket connection. */
+struct PacketBusReaderSlot
+{
+	std::atomic<uint64_t> clientId;
+	/** only informational, as it may be reused or belong to another PID namespace */
+	std::atomic<int32_t> pid;
+	std::atomic<uint64_t> position;
+	std::atomic<uint64_t> packetsRead;
+	std::atomic<uint64_t> overruns;
+};
+
+struct PacketBusHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t indexSize;
+	uint32_t readerSlotCount;
+	uint64_t dataSize;
+	uint64_t extradataSize;
+	uint64_t indexOffset;
+	uint64_t readerOffset;
+	uint64_t extradataOffset;
+	uint64_t dataOffset;
+	std::atomic<uint64_t> packetsPublished;
+	/** end of the data that is being written, everything up to dataSize bytes before it is valid */
+	std::atomic<uint64_t> reservedPosition;
+	/** number of the most recent keyframe plus one, or 0 if there was no keyframe yet */
+	std::atomic<uint64_t> latestKeyframe;
+
+	PacketEntry& entry(uint64_t packetNumber) noexcept
+	{
+		return reinterpret_cast<PacketEntry*>(reinterpret_cast<uint8_t*>(this) + indexOffset)[packetNumber % indexSize];
+	}
+	PacketBusReaderSlot& reader(uint32_t i) noexcept
+	{
+		return reinterpret_cast<PacketBusReaderSlot*>(reinterpret_cast<uint8_t*>(this) + readerOffset)[i];
+	}
+	uint8_t* data() noexcept
+	{
+		return reinterpret_cast<uint8_t*>(this) + dataOffset;
+	}
+};
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<int32_t>::is_always_lock_free,
+              "shared memory synchronisation needs lock-free atomics");
+
+static constexpr size_t alignUp(size_t value, size_t alignment) noexcept
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+static UniqueFd createPacketBus(const uint8_t* extradata, size_t extradataSize, size_t dataSize, uint32_t indexSize)
+{
+	if (indexSize == 0 || dataSize == 0)
+		throw ShmException("Packet bus needs a non-empty index and data ring");
+	size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	size_t indexOffset = alignUp(sizeof(PacketBusHeader), 64);
+	size_t readerOffset = alignUp(indexOffset + indexSize * sizeof(PacketEntry), 64);
+	size_t extradataOffset = readerOffset + MAX_READERS * sizeof(PacketBusReaderSlot);
+	size_t dataOffset = alignUp(extradataOffset + extradataSize, pageSize);
+
+	UniqueFd fd = createSharedMemory("screencapture-packets", dataOffset + alignUp(dataSize, pageSize));
+	Mapping m(fd.get(), true);
+	// the memfd is zero-filled, so all reader slots start out free
+	auto header = new (m.data()) PacketBusHeader;
+	header->magic = PACKET_BUS_MAGIC;
+	header->version = PACKET_BUS_VERSION;
+	header->indexSize = indexSize;
+	header->readerSlotCount = MAX_READERS;
+	header->dataSize = dataSize;
+	header->extradataSize = extradataSize;
+	header->indexOffset = indexOffset;
+	header->readerOffset = readerOffset;
+	header->extradataOffset = extradataOffset;
+	header->dataOffset = dataOffset;
+	header->packetsPublished.store(0, std::memory_order_relaxed);
+	header->reservedPosition.store(0, std::memory_order_relaxed);
+	header->latestKeyframe.store(0, std::memory_order_relaxed);
+	for (uint32_t i = 0; i < indexSize; ++i)
+		header->entry(i).packetNumber.store(ENTRY_BEING_WRITTEN, std::memory_order_relaxed);
+	if (extradataSize)
+		std::memcpy(m.data() + extradataOffset, extradata, extradataSize);
+	return fd;
+}
+
+PacketBusWriter::PacketBusWriter(const std::string& socketPath, const uint8_t* extradata, size_t extradataSize,
+                                 size_t dataSize, uint32_t indexSize)
+: memFd(createPacketBus(extradata, extradataSize, dataSize, indexSize)),
+  mapping(memFd.get(), true),
+  publisher(socketPath, memFd.get()),
+  header(reinterpret_cast<PacketBusHeader*>(mapping.data())),
+  packetsPublished(0),
+  writePosition(0)
+{
+}
+
+PacketBusWriter::~PacketBusWriter() noexcept = default;
+
+void PacketBusWriter::publish(const uint8_t* data, size_t size, int64_t pts, int64_t dts, bool isKeyframe)
+{
+	if (size > header->dataSize)
+		throw ShmException("Packet of %zu bytes is larger than the packet bus", size);
+
+	// packets are never split, continue at the start of the ring if it doesn't fit in before the end
+	uint64_t offset = writePosition % header->dataSize;
+	if (offset + size > header->dataSize)
+		writePosition += header->dataSize - offset;
+	uint64_t position = writePosition;
+	writePosition += size;
+
+	// announce which data is about to be overwritten before actually doing so
+	header->reservedPosition.store(writePosition, std::memory_order_relaxed);
+	PacketEntry& entry = header->entry(packetsPublished);
+	entry.packetNumber.store(ENTRY_BEING_WRITTEN, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	std::memcpy(header->data() + position % header->dataSize, data, size);
+	entry.position = position;
+	entry.size = size;
+	entry.pts = pts;
+	entry.dts = dts;
+	entry.isKeyframe = isKeyframe;
+	entry.packetNumber.store(packetsPublished, std::memory_order_release);
+
+	if (isKeyframe)
+		header->latestKeyframe.store(packetsPublished + 1, std::memory_order_release);
+	++packetsPublished;
+	header->packetsPublished.store(packetsPublished, std::memory_order_release);
+
+	publisher.broadcast(&packetsPublished, sizeof(packetsPublished));
+}
+
+std::vector<PacketBusReaderStats> PacketBusWriter::stats() const
+{
+	std::vector<PacketBusReaderStats> result;
+	for (uint32_t i = 0; i < header->readerSlotCount; ++i)
+	{
+		PacketBusReaderSlot& r = header->reader(i);
+		uint64_t clientId = r.clientId.load(std::memory_order_acquire);
+		if (clientId == 0)
+			continue;
+		// a reader keeps its connection while it is attached, so it died without detaching if it hung up
+		if (!publisher.isConnected(clientId))
+		{
+			r.clientId.compare_exchange_strong(clientId, 0, std::memory_order_acq_rel);
+			continue;
+		}
+		int32_t pid = r.pid.load(std::memory_order_relaxed);
+		uint64_t position = r.position.load(std::memory_order_relaxed);
+		result.push_back({
+			pid,
+			packetsPublished > position ? packetsPublished - position : 0,
+			r.packetsRead.load(std::memory_order_relaxed),
+			r.overruns.load(std::memory_order_relaxed)
+		});
+	}
+	return result;
+}
+
+
+PacketBusReader::PacketBusReader(const std::string& socketPath)
+: subscription(socketPath),
+  mapping(subscription.getSharedMemoryFd(), true),
+  header(reinterpret_cast<PacketBusHeader*>(mapping.data())),
+  slot(nullptr),
+  position(0),
+  waitingForKeyframe(true)
+{
+	if (mapping.size() < sizeof(PacketBusHeader) || header->magic != PACKET_BUS_MAGIC)
+		throw ShmException("Shared memory from %s is not a packet bus", socketPath.c_str());
+	if (header->version != PACKET_BUS_VERSION)
+		throw ShmException("Unsupported packet bus version %u", header->version);
+	if (header->dataOffset + header->dataSize > mapping.size())
+		throw ShmException("Packet bus is larger than its shared memory");
+
+	// claim a free slot to report our progress to the writer
+	for (uint32_t i = 0; i < header->readerSlotCount && !slot; ++i)
+	{
+		uint64_t expected = 0;
+		if (header->reader(i).clientId.compare_exchange_strong(expected, subscription.getClientId(),
+		                                                       std::memory_order_acq_rel))
+			slot = &header->reader(i);
+	}
+	if (!slot)
+		throw ShmException("Too many readers attached to %s", socketPath.c_str());
+	slot->pid.store(getpid(), std::memory_order_relaxed);
+	slot->packetsRead.store(0, std::memory_order_relaxed);
+	slot->overruns.store(0, std::memory_order_relaxed);
+
+	skipToLatestKeyframe();
+}
+
+PacketBusReader::~PacketBusReader() noexcept
+{
+	if (slot)
+		slot->clientId.store(0, std::memory_order_release);
+}
+
+void PacketBusReader::skipToLatestKeyframe() noexcept
+{
+	uint64_t keyframe = header->latestKeyframe.load(std::memory_order_acquire);
+	// without any keyframe yet, start with the next packet, non-keyframes are skipped in nextPacket()
+	position = keyframe ? keyframe - 1 : header->packetsPublished.load(std::memory_order_acquire);
+	waitingForKeyframe = true;
+	slot->position.store(position, std::memory_order_relaxed);
+}
+
+std::vector<uint8_t> PacketBusReader::getExtradata() const
+{
+	const uint8_t* extradata = mapping.data() + header->extradataOffset;
+	return std::vector<uint8_t>(extradata, extradata + header->extradataSize);
+}
+
+std::optional<ReceivedPacket> PacketBusReader::nextPacket()
+{
+	// the notifications only wake up the reader, the index in the shared memory tells what is new
+	uint64_t notification;
+	UniqueFd unused;
+	while (subscription.receive(&notification, sizeof(notification), unused) != 0)
+	{
+	}
+
+	while (position < header->packetsPublished.load(std::memory_order_acquire))
+	{
+		const PacketEntry& entry = header->entry(position);
+		ReceivedPacket packet {};
+		packet.packetNumber = entry.packetNumber.load(std::memory_order_acquire);
+		packet.position = entry.position;
+		packet.size = entry.size;
+		packet.pts = entry.pts;
+		packet.dts = entry.dts;
+		packet.isKeyframe = entry.isKeyframe;
+		packet.data = header->data() + packet.position % header->dataSize;
+		std::atomic_thread_fence(std::memory_order_acquire);
+		bool entryValid = packet.packetNumber == position
+		                  && entry.packetNumber.load(std::memory_order_relaxed) == position;
+		if (!entryValid || !isIntact(packet))
+		{
+			// we were too slow and the writer already overwrote our next packet
+			slot->overruns.fetch_add(1, std::memory_order_relaxed);
+			uint64_t before = position;
+			skipToLatestKeyframe();
+			if (position <= before)
+				// the latest keyframe is gone as well, wait for the next one
+				position = header->packetsPublished.load(std::memory_order_acquire);
+			continue;
+		}
+		// a reader can only start decoding at a keyframe
+		if (waitingForKeyframe && !packet.isKeyframe)
+		{
+			++position;
+			continue;
+		}
+		waitingForKeyframe = false;
+
+		++position;
+		slot->position.store(position, std::memory_order_relaxed);
+		slot->packetsRead.fetch_add(1, std::memory_order_relaxed);
+		return packet;
+	}
+	slot->position.store(position, std::memory_order_relaxed);
+	return std::nullopt;
+}
+
+bool PacketBusReader::isIntact(const ReceivedPacket& packet) const noexcept
+{
+	std::atomic_thread_fence(std::memory_order_acquire);
+	// the data is intact as long as the writer did not advance more than one ring size past its start
+	uint64_t reserved = header->reservedPosition.load(std::memory_order_relaxed);
+	return reserved - packet.position <= header->dataSize;
+}
+
+}
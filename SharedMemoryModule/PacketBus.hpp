@@ -0,0 +1,138 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#ifndef SCREENCAPTURE_PACKETBUS_HPP
+#define SCREENCAPTURE_PACKETBUS_HPP
+
+#include "../common.hpp"
+#include "ShmCommon.hpp"
+#include <optional>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+namespace shm
+{
+
+struct PacketBusHeader;
+struct PacketBusReaderSlot;
+
+/** Statistics about one attached PacketBusReader */
+struct PacketBusReaderStats
+{
+	/** process ID of the reader, as seen from its own PID namespace */
+	pid_t pid;
+	/** number of packets that were published, but not yet read */
+	uint64_t lagPackets;
+	/** number of packets read */
+	uint64_t packetsRead;
+	/** how often the reader fell so far behind that packets were overwritten before it could read them */
+	uint64_t overruns;
+};
+
+/** Publishes encoded packets to multiple local processes through shared memory, so a single encode can be consumed
+ * by e.g. a streaming, a recording and an analytics process at once.
+ *
+ * Packet data is appended to a byte ring inside a memfd, and each packet gets an entry in an index ring.
+ * The most recent keyframe is tracked, so a reader that attaches late starts decoding there.
+ * The codec extradata (e.g. H.264 SPS/PPS) is stored once in the shared memory as well.
+ *
+ * Readers attach through a Unix socket (see PacketBusReader). The writer never waits for readers: if a reader is too
+ * slow, its packets are overwritten and it continues at the next keyframe. Each reader reports its progress into the
+ * shared memory, which is available as lag and overrun statistics from stats().
+ *
+ * Encoded packets from FFmpegOutput can be published through its packet sink, for example:
+ * @code
+ * shm::PacketBusWriter bus("/run/user/1000/screen.sock", codecCtx->extradata, codecCtx->extradata_size);
+ * builder.withPacketSink([&bus] (ffmpeg::AVPacket_Heap p)
+ * {
+ *     bus.publish(p->data, p->size, p->pts, p->dts, p->flags & AV_PKT_FLAG_KEY);
+ * });
+ * @endcode */
+class PacketBusWriter
+{
+	UniqueFd memFd;
+	Mapping mapping;
+	Publisher publisher;
+	PacketBusHeader* header;
+	uint64_t packetsPublished;
+	uint64_t writePosition;
+
+public:
+	/** Create the shared memory bus and start listening for readers.
+	 * @param socketPath path of the Unix socket that readers connect to
+	 * @param extradata codec extradata that readers need to initialize their decoder, may be null
+	 * @param extradataSize size of @p extradata in bytes
+	 * @param dataSize size of the packet data ring in bytes, must be larger than the biggest packet
+	 * @param indexSize number of packets that can be held in the ring at most */
+	SCW_EXPORT PacketBusWriter(const std::string& socketPath, const uint8_t* extradata, size_t extradataSize,
+	                           size_t dataSize = 16 << 20, uint32_t indexSize = 1024);
+	SCW_EXPORT ~PacketBusWriter() noexcept;
+
+	/** Append a packet to the bus and notify all readers.
+	 * @throw ShmException if the packet is larger than the data ring */
+	SCW_EXPORT void publish(const uint8_t* data, size_t size, int64_t pts, int64_t dts, bool isKeyframe);
+
+	/** New readers are attached with each published packet. If no packets are published for a while, poll this
+	 * file descriptor and call acceptReaders() when it becomes readable, so connecting readers don't have to wait. */
+	SCW_EXPORT int getPollFd() const noexcept { return publisher.getPollFd(); }
+
+	SCW_EXPORT void acceptReaders() noexcept { publisher.acceptClients(); }
+
+	/** Get lag and overrun statistics of all attached readers. */
+	SCW_EXPORT std::vector<PacketBusReaderStats> stats() const;
+};
+
+/** A packet read from a PacketBusWriter. Its data points directly into the shared memory, so check
+ * PacketBusReader::isIntact() after using it to see if the writer has overwritten it in the meantime. */
+struct ReceivedPacket
+{
+	uint64_t packetNumber;
+	const uint8_t* data;
+	size_t size;
+	int64_t pts;
+	int64_t dts;
+	bool isKeyframe;
+	/** absolute position of the data in the writer's ring */
+	uint64_t position;
+};
+
+/** Attaches to a PacketBusWriter in another process. */
+class PacketBusReader
+{
+	Subscription subscription;
+	Mapping mapping;
+	PacketBusHeader* header;
+	PacketBusReaderSlot* slot;
+	uint64_t position;
+	bool waitingForKeyframe;
+
+	void skipToLatestKeyframe() noexcept;
+
+public:
+	/** Connect to the writer's socket and map its bus. Reading starts at the most recent keyframe.
+	 * @throw ShmException if connecting fails, the shared memory does not contain a packet bus, or too many
+	 *        readers are attached already */
+	SCW_EXPORT explicit PacketBusReader(const std::string& socketPath);
+	SCW_EXPORT ~PacketBusReader() noexcept;
+
+	/** File descriptor that becomes readable when a new packet was published */
+	SCW_EXPORT int getPollFd() const noexcept { return subscription.getPollFd(); }
+
+	/** Get the codec extradata the writer was created with. */
+	SCW_EXPORT std::vector<uint8_t> getExtradata() const;
+
+	/** Return the next packet in order, or nothing if no new packet is available.
+	 * If the reader fell behind and its next packet was overwritten already, it continues at the most recent
+	 * keyframe, so the returned packets can always be decoded. */
+	SCW_EXPORT std::optional<ReceivedPacket> nextPacket();
+
+	/** Check that the packet's data has not been overwritten since nextPacket() returned it. */
+	SCW_EXPORT bool isIntact(const ReceivedPacket& packet) const noexcept;
+};
+
+}
+
+#endif //SCREENCAPTURE_PACKETBUS_HPP
@@ -0,0 +1,257 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#include "ShmCommon.hpp"
+#include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <new> // bad_alloc
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+namespace shm
+{
+
+ShmException::ShmException(const char* messageFmtStr, ...) noexcept
+{
+	std::va_list v_args;
+	va_start(v_args, messageFmtStr);
+	std::vsnprintf(message, sizeof(message), messageFmtStr, v_args);
+	va_end(v_args);
+#ifndef NDEBUG
+	dumpStackTrace();
+#endif
+}
+
+UniqueFd& UniqueFd::operator=(UniqueFd&& o) noexcept
+{
+	if (this != &o)
+	{
+		if (fd >= 0)
+			close(fd);
+		fd = o.release();
+	}
+	return *this;
+}
+
+UniqueFd::~UniqueFd() noexcept
+{
+	if (fd >= 0)
+		close(fd);
+}
+
+Mapping::Mapping(int fd, bool writable)
+{
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+		throw ShmException("Querying shared memory size failed: %s", strerror(errno));
+	length = static_cast<size_t>(st.st_size);
+	address = mmap(nullptr, length, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	if (address == MAP_FAILED)
+		throw ShmException("Mapping shared memory failed: %s", strerror(errno));
+}
+
+Mapping::Mapping(Mapping&& o) noexcept
+: address(o.address),
+  length(o.length)
+{
+	o.address = MAP_FAILED;
+	o.length = 0;
+}
+
+Mapping::~Mapping() noexcept
+{
+	if (address != MAP_FAILED)
+		munmap(address, length);
+}
+
+UniqueFd createSharedMemory(const char* name, size_t size)
+{
+	UniqueFd fd(memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING));
+	if (!fd)
+		throw ShmException("Creating shared memory failed: %s", strerror(errno));
+	if (ftruncate(fd.get(), static_cast<off_t>(size)) < 0)
+		throw ShmException("Resizing shared memory to %zu bytes failed: %s", size, strerror(errno));
+	// readers map the whole file, so it must never shrink under them
+	if (fcntl(fd.get(), F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+		throw ShmException("Sealing shared memory failed: %s", strerror(errno));
+	return fd;
+}
+
+static sockaddr_un makeAddress(const std::string& path)
+{
+	sockaddr_un addr {};
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+		throw ShmException("Socket path too long: %s", path.c_str());
+	std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+	return addr;
+}
+
+static bool sendWithFd(int socket, const void* message, size_t length, int fd) noexcept
+{
+	iovec iov = {const_cast<void*>(message), length};
+	msghdr msg {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+	if (fd >= 0)
+	{
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	return sendmsg(socket, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) >= 0 || errno == EAGAIN;
+}
+
+/** The first message to every client, which carries the shared memory fd */
+struct Hello
+{
+	char tag[4];
+	uint64_t clientId;
+};
+
+Publisher::Publisher(std::string path, int sharedMemoryFd)
+: listenSocket(socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)),
+  nextClientId(1),
+  socketPath(std::move(path)),
+  sharedMemoryFd(sharedMemoryFd)
+{
+	if (!listenSocket)
+		throw ShmException("Creating socket failed: %s", strerror(errno));
+	sockaddr_un addr = makeAddress(socketPath);
+	// remove a stale socket left behind by a previous process
+	unlink(socketPath.c_str());
+	if (bind(listenSocket.get(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+		throw ShmException("Binding socket to %s failed: %s", socketPath.c_str(), strerror(errno));
+	if (listen(listenSocket.get(), 16) < 0)
+		throw ShmException("Listening on %s failed: %s", socketPath.c_str(), strerror(errno));
+}
+
+Publisher::~Publisher() noexcept
+{
+	if (listenSocket)
+		unlink(socketPath.c_str());
+}
+
+void Publisher::acceptClients() noexcept
+{
+	std::lock_guard lock(mutex);
+	acceptClientsLocked();
+}
+
+void Publisher::acceptClientsLocked() noexcept
+{
+	while (true)
+	{
+		UniqueFd client(accept4(listenSocket.get(), nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC));
+		if (!client)
+			break;
+		Hello hello = {{'s', 'h', 'm', '\0'}, nextClientId};
+		if (!sendWithFd(client.get(), &hello, sizeof(hello), sharedMemoryFd))
+			continue;
+		try
+		{
+			clients.push_back({std::move(client), nextClientId++});
+		}
+		catch (const std::bad_alloc&)
+		{
+			// the client sees the connection close
+		}
+	}
+}
+
+void Publisher::broadcast(const void* message, size_t length, int fd) noexcept
+{
+	std::lock_guard lock(mutex);
+	acceptClientsLocked();
+	clients.erase(std::remove_if(clients.begin(), clients.end(), [&] (const Client& client)
+	{
+		return !sendWithFd(client.socket.get(), message, length, fd);
+	}), clients.end());
+}
+
+bool Publisher::isConnected(uint64_t clientId) const noexcept
+{
+	std::lock_guard lock(mutex);
+	auto it = std::find_if(clients.begin(), clients.end(), [clientId] (const Client& c) { return c.id == clientId; });
+	if (it == clients.end())
+		return false;
+	// the socket hangs up when the client closes it or its process exits, however that happens
+	pollfd pfd = {it->socket.get(), POLLRDHUP, 0};
+	return poll(&pfd, 1, 0) <= 0 || !(pfd.revents & (POLLHUP | POLLRDHUP | POLLERR));
+}
+
+Subscription::Subscription(const std::string& socketPath)
+: socket(::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)),
+  clientId(0)
+{
+	if (!socket)
+		throw ShmException("Creating socket failed: %s", strerror(errno));
+	sockaddr_un addr = makeAddress(socketPath);
+	if (connect(socket.get(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+		throw ShmException("Connecting to %s failed: %s", socketPath.c_str(), strerror(errno));
+
+	// the publisher sends its shared memory first, wait for it
+	Hello hello {};
+	UniqueFd fd;
+	size_t helloSize = 0;
+	while (!fd)
+	{
+		pollfd pfd = {socket.get(), POLLIN, 0};
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			throw ShmException("Waiting for shared memory failed: %s", strerror(errno));
+		helloSize = receive(&hello, sizeof(hello), fd);
+	}
+	if (helloSize < sizeof(hello) || hello.clientId == 0)
+		throw ShmException("Publisher at %s sent no client ID", socketPath.c_str());
+	sharedMemoryFd = std::move(fd);
+	clientId = hello.clientId;
+	int flags = fcntl(socket.get(), F_GETFL);
+	fcntl(socket.get(), F_SETFL, flags | O_NONBLOCK);
+}
+
+size_t Subscription::receive(void* message, size_t length, UniqueFd& fd)
+{
+	iovec iov = {message, length};
+	msghdr msg {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	ssize_t n = recvmsg(socket.get(), &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+	if (n < 0)
+	{
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
+		throw ShmException("Receiving from publisher failed: %s", strerror(errno));
+	}
+	if (n == 0)
+		throw ShmException("Publisher closed the connection");
+	for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		{
+			int receivedFd;
+			std::memcpy(&receivedFd, CMSG_DATA(cmsg), sizeof(int));
+			fd = UniqueFd(receivedFd);
+		}
+	}
+	return static_cast<size_t>(n);
+}
+
+}
@@ -0,0 +1,147 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#ifndef SCREENCAPTURE_SHMCOMMON_HPP
+#define SCREENCAPTURE_SHMCOMMON_HPP
+
+#include "../common.hpp"
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <sys/types.h>
+
+namespace shm
+{
+
+class SCW_EXPORT ShmException : public std::exception
+{
+	char message[128];
+public:
+	explicit ShmException(const char* messageFmtStr, ...) noexcept __attribute__((format(printf, 2, 3)));
+	const char* what() const noexcept override { return message; }
+};
+
+/** Owns a file descriptor and closes it on destruction. */
+class UniqueFd
+{
+	int fd;
+
+public:
+	explicit UniqueFd(int fd = -1) noexcept : fd(fd) {}
+	UniqueFd(UniqueFd&& o) noexcept : fd(o.release()) {}
+	UniqueFd& operator=(UniqueFd&& o) noexcept;
+	UniqueFd(const UniqueFd&) = delete;
+	~UniqueFd() noexcept;
+
+	int get() const noexcept { return fd; }
+	int release() noexcept
+	{
+		int f = fd;
+		fd = -1;
+		return f;
+	}
+	explicit operator bool() const noexcept { return fd >= 0; }
+};
+
+/** A shared memory mapping that is unmapped on destruction. */
+class Mapping
+{
+	void* address;
+	size_t length;
+
+public:
+	/** Map the whole file behind @p fd.
+	 * @param writable map for reading and writing instead of read-only */
+	Mapping(int fd, bool writable);
+	Mapping(Mapping&& o) noexcept;
+	Mapping(const Mapping&) = delete;
+	~Mapping() noexcept;
+
+	uint8_t* data() const noexcept { return static_cast<uint8_t*>(address); }
+	size_t size() const noexcept { return length; }
+};
+
+/** Create a sealed memfd of the given size, which can't be resized by anyone afterwards. */
+UniqueFd createSharedMemory(const char* name, size_t size);
+
+/** A listening Unix socket that local processes connect to. Every new client is sent a shared memory fd and its
+ * client ID first, then messages are broadcast to all clients.
+ * Sending never blocks: a client whose socket buffer is full misses the message, and clients that hung up are
+ * dropped. The methods may be called from different threads. */
+class Publisher
+{
+	struct Client
+	{
+		UniqueFd socket;
+		uint64_t id;
+	};
+
+	UniqueFd listenSocket;
+	mutable std::mutex mutex;
+	std::vector<Client> clients;
+	uint64_t nextClientId;
+	std::string socketPath;
+	int sharedMemoryFd;
+
+	void acceptClientsLocked() noexcept;
+
+public:
+	Publisher(std::string socketPath, int sharedMemoryFd);
+	~Publisher() noexcept;
+
+	/** File descriptor that becomes readable when a client wants to connect */
+	int getPollFd() const noexcept { return listenSocket.get(); }
+
+	/** Accept all pending connections and send them the shared memory fd.
+	 * This is also done on every broadcast(). */
+	void acceptClients() noexcept;
+
+	/** Send a message to all clients, with an optional file descriptor attached. */
+	void broadcast(const void* message, size_t length, int fd = -1) noexcept;
+
+	size_t clientCount() const noexcept
+	{
+		std::lock_guard lock(mutex);
+		return clients.size();
+	}
+
+	/** Check if a client is still connected, e.g. to free the resources it claimed in the shared memory once it is
+	 * gone. Unlike a process ID, the client ID is never reused and can't refer to a process in another namespace.
+	 * @param clientId the ID the client received when it connected, see Subscription::getClientId() */
+	bool isConnected(uint64_t clientId) const noexcept;
+};
+
+/** The client side of a Publisher. */
+class Subscription
+{
+	UniqueFd socket;
+	UniqueFd sharedMemoryFd;
+	uint64_t clientId;
+
+public:
+	/** Connect to the Publisher listening at @p socketPath and receive its shared memory fd. */
+	explicit Subscription(const std::string& socketPath);
+
+	/** File descriptor that becomes readable when a message arrives. */
+	int getPollFd() const noexcept { return socket.get(); }
+
+	int getSharedMemoryFd() const noexcept { return sharedMemoryFd.get(); }
+
+	/** @return the ID the publisher assigned to this connection, which is never 0 */
+	uint64_t getClientId() const noexcept { return clientId; }
+
+	/** Receive the next message without blocking.
+	 * @param fd receives the attached file descriptor, if any
+	 * @return the message length, 0 if no message is pending
+	 * @throw ShmException if the publisher closed the connection or an error occurred */
+	size_t receive(void* message, size_t length, UniqueFd& fd);
+};
+
+}
+
+#endif //SCREENCAPTURE_SHMCOMMON_HPP
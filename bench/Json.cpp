@@ -0,0 +1,226 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#include "Json.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+
+using namespace std::string_literals;
+
+namespace bench
+{
+
+const JsonValue* JsonValue::get(std::string_view key) const noexcept
+{
+	if (type != Type::OBJECT)
+		return nullptr;
+	for (auto& member : object)
+		if (member.first == key)
+			return &member.second;
+	return nullptr;
+}
+
+double JsonValue::getNumber(std::string_view key, double defaultValue) const noexcept
+{
+	auto v = get(key);
+	return v && v->type == Type::NUMBER ? v->number : defaultValue;
+}
+
+namespace
+{
+
+class Parser
+{
+	std::string_view text;
+	size_t pos = 0;
+
+	[[noreturn]] void fail(const char* what)
+	{
+		throw std::runtime_error("JSON syntax error at offset "s + std::to_string(pos) + ": " + what);
+	}
+
+	void skipSpace() noexcept
+	{
+		while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' || text[pos] == '\r'))
+			++pos;
+	}
+
+	bool consume(char c) noexcept
+	{
+		skipSpace();
+		if (pos < text.size() && text[pos] == c)
+		{
+			++pos;
+			return true;
+		}
+		return false;
+	}
+
+	void expect(char c)
+	{
+		if (!consume(c))
+			fail("unexpected character");
+	}
+
+	bool consumeWord(std::string_view word) noexcept
+	{
+		if (text.substr(pos, word.size()) != word)
+			return false;
+		pos += word.size();
+		return true;
+	}
+
+	std::string parseString()
+	{
+		expect('"');
+		std::string s;
+		while (pos < text.size() && text[pos] != '"')
+		{
+			char c = text[pos++];
+			if (c != '\\')
+			{
+				s += c;
+				continue;
+			}
+			if (pos >= text.size())
+				break;
+			switch (char e = text[pos++])
+			{
+				case 'n': s += '\n'; break;
+				case 't': s += '\t'; break;
+				case 'r': s += '\r'; break;
+				case 'b': s += '\b'; break;
+				case 'f': s += '\f'; break;
+				case 'u':
+				{
+					// only needed for control characters in our own output, so ASCII is enough
+					if (pos + 4 > text.size())
+						fail("truncated escape sequence");
+					s += static_cast<char>(std::strtoul(std::string(text.substr(pos, 4)).c_str(), nullptr, 16) & 0x7f);
+					pos += 4;
+					break;
+				}
+				default: s += e; break;
+			}
+		}
+		if (pos >= text.size())
+			fail("unterminated string");
+		++pos;
+		return s;
+	}
+
+public:
+	explicit Parser(std::string_view text) noexcept
+	: text(text)
+	{}
+
+	JsonValue parseValue()
+	{
+		JsonValue v;
+		skipSpace();
+		if (pos >= text.size())
+			fail("unexpected end of document");
+		char c = text[pos];
+		if (c == '{')
+		{
+			++pos;
+			v.type = JsonValue::Type::OBJECT;
+			if (consume('}'))
+				return v;
+			do
+			{
+				skipSpace();
+				std::string key = parseString();
+				expect(':');
+				v.object.emplace_back(std::move(key), parseValue());
+			} while (consume(','));
+			expect('}');
+		}
+		else if (c == '[')
+		{
+			++pos;
+			v.type = JsonValue::Type::ARRAY;
+			if (consume(']'))
+				return v;
+			do
+			{
+				v.array.push_back(parseValue());
+			} while (consume(','));
+			expect(']');
+		}
+		else if (c == '"')
+		{
+			v.type = JsonValue::Type::STRING;
+			v.string = parseString();
+		}
+		else if (consumeWord("true"))
+		{
+			v.type = JsonValue::Type::BOOL;
+			v.boolean = true;
+		}
+		else if (consumeWord("false"))
+		{
+			v.type = JsonValue::Type::BOOL;
+		}
+		else if (consumeWord("null"))
+		{
+			v.type = JsonValue::Type::NUL;
+		}
+		else
+		{
+			std::string number(text.substr(pos, 32));
+			char* end;
+			v.type = JsonValue::Type::NUMBER;
+			v.number = std::strtod(number.c_str(), &end);
+			if (end == number.c_str())
+				fail("invalid value");
+			pos += static_cast<size_t>(end - number.c_str());
+		}
+		return v;
+	}
+
+	void expectEnd()
+	{
+		skipSpace();
+		if (pos != text.size())
+			fail("trailing characters");
+	}
+};
+
+}
+
+JsonValue JsonValue::parse(std::string_view text)
+{
+	Parser p(text);
+	JsonValue v = p.parseValue();
+	p.expectEnd();
+	return v;
+}
+
+std::string jsonEscape(std::string_view s)
+{
+	std::string out;
+	out.reserve(s.size());
+	for (char c : s)
+	{
+		if (c == '"' || c == '\\')
+		{
+			out += '\\';
+			out += c;
+		}
+		else if (static_cast<unsigned char>(c) < 0x20)
+		{
+			char buf[8];
+			std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+			out += buf;
+		}
+		else
+			out += c;
+	}
+	return out;
+}
+
+}
@@ -0,0 +1,47 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#ifndef SCREENCAPTURE_BENCH_JSON_HPP
+#define SCREENCAPTURE_BENCH_JSON_HPP
+
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace bench
+{
+
+/** A minimal JSON document tree, just enough to read back the benchmark reports written by this program */
+class JsonValue
+{
+public:
+	enum class Type { NUL, BOOL, NUMBER, STRING, ARRAY, OBJECT };
+
+	Type type = Type::NUL;
+	bool boolean = false;
+	double number = 0;
+	std::string string;
+	std::vector<JsonValue> array;
+	std::vector<std::pair<std::string, JsonValue>> object;
+
+	/** Look up a member of an object.
+	 * @return the member, or nullptr if this is not an object or has no such member */
+	const JsonValue* get(std::string_view key) const noexcept;
+
+	/** Get the number of a member, or a default if it is missing or not a number */
+	double getNumber(std::string_view key, double defaultValue = 0) const noexcept;
+
+	/** Parse a JSON document.
+	 * @throw std::runtime_error on syntax errors */
+	static JsonValue parse(std::string_view text);
+};
+
+/** Escape a string for use inside a JSON string literal */
+std::string jsonEscape(std::string_view s);
+
+}
+
+#endif //SCREENCAPTURE_BENCH_JSON_HPP
@@ -0,0 +1,214 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#include "Report.hpp"
+#include "Json.hpp"
+#include <algorithm> // max
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std::string_literals;
+
+namespace bench
+{
+
+static const char* patternName(pw::TestPattern p) noexcept
+{
+	switch (p)
+	{
+		case pw::TestPattern::STATIC:
+			return "static";
+		case pw::TestPattern::SCROLLING_TEXT:
+			return "text";
+		case pw::TestPattern::NOISE:
+			return "noise";
+	}
+	return "static";
+}
+
+static pw::TestPattern patternFromName(const std::string& name) noexcept
+{
+	if (name == "text")
+		return pw::TestPattern::SCROLLING_TEXT;
+	if (name == "noise")
+		return pw::TestPattern::NOISE;
+	return pw::TestPattern::STATIC;
+}
+
+static void writeLatency(FILE* f, const char* name, const LatencySummary& l, bool last)
+{
+	fprintf(f, "        \"%s\": {\"count\": %" PRIu64 ", \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}%s\n",
+	        name, l.count, l.p50, l.p90, l.p99, l.max, last ? "" : ",");
+}
+
+void writeReport(FILE* f, const std::vector<ReportEntry>& entries)
+{
+	fprintf(f, "{\n  \"version\": 1,\n  \"scenarios\": [\n");
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		const Scenario& s = entries[i].scenario;
+		const ScenarioResult& r = entries[i].result;
+		fprintf(f, "    {\n");
+		fprintf(f, "      \"name\": \"%s\",\n", jsonEscape(s.name).c_str());
+		fprintf(f, "      \"width\": %u,\n      \"height\": %u,\n      \"framerate\": %u,\n",
+		        s.size.w, s.size.h, s.framerate);
+		fprintf(f, "      \"pattern\": \"%s\",\n      \"dmaBuf\": %s,\n      \"external\": %s,\n",
+		        patternName(s.pattern), s.dmaBuf ? "true" : "false", s.external ? "true" : "false");
+		if (r.error[0])
+			fprintf(f, "      \"error\": \"%s\",\n", jsonEscape(r.error).c_str());
+		fprintf(f, "      \"durationSeconds\": %.3f,\n      \"fps\": %.2f,\n", r.durationSeconds, r.fps);
+		fprintf(f, "      \"framesProduced\": %" PRIu64 ",\n      \"framesReceived\": %" PRIu64 ",\n"
+		           "      \"packetsEncoded\": %" PRIu64 ",\n",
+		        r.framesProduced, r.framesReceived, r.packetsEncoded);
+		fprintf(f, "      \"droppedCapture\": %" PRIu64 ",\n      \"droppedPipeline\": %" PRIu64 ",\n",
+		        r.droppedCapture, r.droppedPipeline);
+		fprintf(f, "      \"latencyMicros\": {\n");
+		writeLatency(f, "capture", r.captureLatency, false);
+		writeLatency(f, "encode", r.encodeLatency, false);
+		writeLatency(f, "total", r.totalLatency, true);
+		fprintf(f, "      },\n");
+		fprintf(f, "      \"cpuMicrosPerFrame\": %.1f,\n      \"peakRssKiB\": %" PRIu64 "\n",
+		        r.cpuMicrosPerFrame, r.peakRssKiB);
+		fprintf(f, "    }%s\n", i + 1 < entries.size() ? "," : "");
+	}
+	fprintf(f, "  ]\n}\n");
+}
+
+static LatencySummary readLatency(const JsonValue* v) noexcept
+{
+	LatencySummary l{};
+	if (!v)
+		return l;
+	l.count = static_cast<uint64_t>(v->getNumber("count"));
+	l.p50 = v->getNumber("p50");
+	l.p90 = v->getNumber("p90");
+	l.p99 = v->getNumber("p99");
+	l.max = v->getNumber("max");
+	return l;
+}
+
+std::vector<ReportEntry> readReport(const char* path)
+{
+	std::ifstream in(path);
+	if (!in)
+		throw std::runtime_error("Could not open "s + path + ": " + strerror(errno));
+	std::stringstream content;
+	content << in.rdbuf();
+	JsonValue doc = JsonValue::parse(content.str());
+
+	const JsonValue* scenarios = doc.get("scenarios");
+	if (!scenarios || scenarios->type != JsonValue::Type::ARRAY)
+		throw std::runtime_error(path + " is not a benchmark report"s);
+
+	std::vector<ReportEntry> entries;
+	for (const JsonValue& v : scenarios->array)
+	{
+		ReportEntry e{};
+		auto name = v.get("name");
+		if (!name || name->type != JsonValue::Type::STRING)
+			throw std::runtime_error(path + ": scenario without name"s);
+		e.scenario.name = name->string;
+		e.scenario.size.w = static_cast<uint32_t>(v.getNumber("width"));
+		e.scenario.size.h = static_cast<uint32_t>(v.getNumber("height"));
+		e.scenario.framerate = static_cast<uint32_t>(v.getNumber("framerate"));
+		if (auto pattern = v.get("pattern"))
+			e.scenario.pattern = patternFromName(pattern->string);
+		if (auto dmaBuf = v.get("dmaBuf"))
+			e.scenario.dmaBuf = dmaBuf->boolean;
+		if (auto external = v.get("external"))
+			e.scenario.external = external->boolean;
+
+		ScenarioResult& r = e.result;
+		if (auto error = v.get("error"))
+			snprintf(r.error, sizeof(r.error), "%s", error->string.c_str());
+		r.durationSeconds = v.getNumber("durationSeconds");
+		r.fps = v.getNumber("fps");
+		r.framesProduced = static_cast<uint64_t>(v.getNumber("framesProduced"));
+		r.framesReceived = static_cast<uint64_t>(v.getNumber("framesReceived"));
+		r.packetsEncoded = static_cast<uint64_t>(v.getNumber("packetsEncoded"));
+		r.droppedCapture = static_cast<uint64_t>(v.getNumber("droppedCapture"));
+		r.droppedPipeline = static_cast<uint64_t>(v.getNumber("droppedPipeline"));
+		if (auto latency = v.get("latencyMicros"))
+		{
+			r.captureLatency = readLatency(latency->get("capture"));
+			r.encodeLatency = readLatency(latency->get("encode"));
+			r.totalLatency = readLatency(latency->get("total"));
+		}
+		r.cpuMicrosPerFrame = v.getNumber("cpuMicrosPerFrame");
+		r.peakRssKiB = static_cast<uint64_t>(v.getNumber("peakRssKiB"));
+		entries.push_back(std::move(e));
+	}
+	return entries;
+}
+
+void printSummary(FILE* f, const std::vector<ReportEntry>& entries)
+{
+	fprintf(f, "%-28s %8s %8s %8s %10s %10s %10s %8s\n",
+	        "scenario", "fps", "dropCap", "dropEnc", "p50 us", "p99 us", "cpu us/f", "RSS MiB");
+	for (auto& e : entries)
+	{
+		const ScenarioResult& r = e.result;
+		if (r.error[0])
+		{
+			fprintf(f, "%-28s failed: %s\n", e.scenario.name.c_str(), r.error);
+			continue;
+		}
+		fprintf(f, "%-28s %8.2f %8" PRIu64 " %8" PRIu64 " %10.0f %10.0f %10.0f %8.1f\n",
+		        e.scenario.name.c_str(), r.fps, r.droppedCapture, r.droppedPipeline,
+		        r.totalLatency.p50, r.totalLatency.p99, r.cpuMicrosPerFrame, static_cast<double>(r.peakRssKiB) / 1024);
+	}
+}
+
+std::vector<Regression> compareReports(const std::vector<ReportEntry>& baseline,
+                                       const std::vector<ReportEntry>& current,
+                                       double tolerance)
+{
+	std::vector<Regression> regressions;
+	for (auto& c : current)
+	{
+		const ReportEntry* b = nullptr;
+		for (auto& e : baseline)
+			if (e.scenario.name == c.scenario.name)
+				b = &e;
+		if (!b || b->result.error[0] || c.result.error[0])
+			continue;
+
+		// metrics where a lower value is worse
+		auto checkLower = [&] (const char* metric, double base, double cur)
+		{
+			if (cur < base * (1 - tolerance))
+				regressions.push_back(Regression{c.scenario.name, metric, base, cur});
+		};
+		// metrics where a higher value is worse
+		auto checkHigher = [&] (const char* metric, double base, double cur)
+		{
+			if (cur > base * (1 + tolerance))
+				regressions.push_back(Regression{c.scenario.name, metric, base, cur});
+		};
+		auto dropRate = [] (const ScenarioResult& r)
+		{
+			double frames = static_cast<double>(std::max<uint64_t>(r.framesProduced, 1));
+			return static_cast<double>(r.droppedCapture + r.droppedPipeline) / frames;
+		};
+
+		const ScenarioResult& br = b->result;
+		const ScenarioResult& cr = c.result;
+		checkLower("fps", br.fps, cr.fps);
+		// drop rates are compared absolutely, because a relative change of a tiny rate is mostly noise
+		if (dropRate(cr) > dropRate(br) + tolerance / 10)
+			regressions.push_back(Regression{c.scenario.name, "dropRate", dropRate(br), dropRate(cr)});
+		checkHigher("latency.total.p50", br.totalLatency.p50, cr.totalLatency.p50);
+		checkHigher("latency.total.p99", br.totalLatency.p99, cr.totalLatency.p99);
+		checkHigher("cpuMicrosPerFrame", br.cpuMicrosPerFrame, cr.cpuMicrosPerFrame);
+		checkHigher("peakRssKiB", static_cast<double>(br.peakRssKiB), static_cast<double>(cr.peakRssKiB));
+	}
+	return regressions;
+}
+
+}
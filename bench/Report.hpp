@@ -0,0 +1,51 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#ifndef SCREENCAPTURE_BENCH_REPORT_HPP
+#define SCREENCAPTURE_BENCH_REPORT_HPP
+
+#include "Scenario.hpp"
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace bench
+{
+
+struct ReportEntry
+{
+	Scenario scenario;
+	ScenarioResult result;
+};
+
+/** A metric that got worse than the baseline by more than the allowed tolerance */
+struct Regression
+{
+	std::string scenario;
+	std::string metric;
+	double baseline;
+	double current;
+};
+
+/** Write all results as a JSON document */
+void writeReport(FILE* f, const std::vector<ReportEntry>& entries);
+
+/** Read a JSON document written by writeReport().
+ * @throw std::runtime_error if the file cannot be read or is malformed */
+std::vector<ReportEntry> readReport(const char* path);
+
+/** Print a human-readable table of the results */
+void printSummary(FILE* f, const std::vector<ReportEntry>& entries);
+
+/** Compare results with a baseline, matching scenarios by name. Scenarios missing on either side or that failed
+ * are skipped.
+ * @param tolerance relative change that is still accepted, e.g. 0.1 for 10% */
+std::vector<Regression> compareReports(const std::vector<ReportEntry>& baseline,
+                                       const std::vector<ReportEntry>& current,
+                                       double tolerance);
+
+}
+
+#endif //SCREENCAPTURE_BENCH_REPORT_HPP
@@ -0,0 +1,315 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#include "Scenario.hpp"
+#include <PipeWireModule/PipeWireStream.hpp>
+#include <FFMPEGModule/FFmpegOutput.hpp>
+#include <c_common.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std::chrono;
+using namespace std::string_literals;
+
+namespace bench
+{
+
+// boilerplate for std::visit with lambdas
+template<class... Ts>
+struct overloaded : Ts... { using Ts::operator()...; };
+template<class... Ts>
+overloaded(Ts...) -> overloaded<Ts...>;
+
+std::vector<Scenario> defaultScenarios(bool withExternal)
+{
+	struct { const char* name; common::Rect size; } sizes[] = {
+			{"1080p", {1920, 1080}},
+			{"1440p", {2560, 1440}},
+			{"4k", {3840, 2160}},
+	};
+	uint32_t framerates[] = {60, 144};
+	struct { const char* name; pw::TestPattern pattern; } patterns[] = {
+			{"static", pw::TestPattern::STATIC},
+			{"motion", pw::TestPattern::NOISE},
+	};
+
+	std::vector<Scenario> scenarios;
+	for (auto& size : sizes)
+		for (uint32_t rate : framerates)
+			for (auto& pattern : patterns)
+			{
+				std::string name = size.name + std::to_string(rate) + "-" + pattern.name + "-memory";
+				scenarios.push_back(Scenario{name, size.size, rate, pattern.pattern, false, false});
+			}
+	// the test source only provides memory frames, DmaBuf needs a real compositor (or another DmaBuf source)
+	if (withExternal)
+		scenarios.push_back(Scenario{"external-dmabuf", {}, 0, pw::TestPattern::STATIC, true, true});
+	return scenarios;
+}
+
+static LatencySummary summarize(std::vector<double>& samples)
+{
+	LatencySummary s{};
+	s.count = samples.size();
+	if (samples.empty())
+		return s;
+	std::sort(samples.begin(), samples.end());
+	auto at = [&samples] (double p)
+	{
+		return samples[static_cast<size_t>(p * static_cast<double>(samples.size() - 1))];
+	};
+	s.p50 = at(0.5);
+	s.p90 = at(0.9);
+	s.p99 = at(0.99);
+	s.max = samples.back();
+	return s;
+}
+
+static nanoseconds processCpuTime()
+{
+	rusage usage{};
+	getrusage(RUSAGE_SELF, &usage);
+	return seconds(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+	       + microseconds(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+/** Latency samples and packet counts, written by the encoder thread and read by the benchmark thread */
+struct Measurement
+{
+	std::mutex mutex;
+	bool measuring = false;
+	/** push time and source time of frames in flight, by pts in microseconds */
+	std::unordered_map<int64_t, std::pair<steady_clock::time_point, steady_clock::time_point>> inFlight;
+	std::vector<double> captureLatency;
+	std::vector<double> encodeLatency;
+	std::vector<double> totalLatency;
+	uint64_t packets = 0;
+};
+
+ScenarioResult runScenario(const Scenario& scenario, const RunOptions& options)
+{
+	std::unique_ptr<pw::TestSource> source;
+	uint32_t node = options.externalNode;
+	if (!scenario.external)
+	{
+		pw::TestSourceOptions sourceOptions;
+		sourceOptions.size = scenario.size;
+		sourceOptions.framerate = scenario.framerate;
+		sourceOptions.pattern = scenario.pattern;
+		source = std::make_unique<pw::TestSource>(sourceOptions);
+		node = source->getNodeId();
+	}
+
+	Measurement m;
+	pw::PipeWireStream stream(common::SharedScreen{nullptr, -1, node}, scenario.dmaBuf);
+	// declared after stream, so it is destroyed first and releases all frames
+	std::unique_ptr<ffmpeg::FFmpegOutput> output;
+
+	auto sink = [&m] (ffmpeg::AVPacket_Heap p)
+	{
+		auto now = steady_clock::now();
+		std::lock_guard lock(m.mutex);
+		auto it = m.inFlight.find(p->pts);
+		if (it == m.inFlight.end())
+			return;
+		if (m.measuring)
+		{
+			m.encodeLatency.push_back(duration<double, std::micro>(now - it->second.first).count());
+			m.totalLatency.push_back(duration<double, std::micro>(now - it->second.second).count());
+			++m.packets;
+		}
+		m.inFlight.erase(it);
+	};
+
+	steady_clock::time_point connectedAt;
+	steady_clock::time_point measureStart;
+	steady_clock::time_point measureEnd;
+	nanoseconds cpuStart{};
+	nanoseconds sourceCpuStart{};
+	uint64_t producedStart = 0;
+	uint64_t receivedFrames = 0;
+	bool connected = false;
+	const auto setupTimeout = steady_clock::now() + 10s;
+
+	auto handleFrame = [&] (AVFrame* avFrame, nanoseconds sourcePts)
+	{
+		auto now = steady_clock::now();
+		// timestamps from PipeWire use CLOCK_MONOTONIC, the same as steady_clock
+		auto sourceTime = steady_clock::time_point(duration_cast<steady_clock::duration>(sourcePts));
+		bool measuring;
+		{
+			std::lock_guard lock(m.mutex);
+			measuring = m.measuring;
+			if (measuring)
+				m.captureLatency.push_back(duration<double, std::micro>(now - sourceTime).count());
+			m.inFlight[avFrame->pts] = {now, sourceTime};
+		}
+		if (measuring)
+			++receivedFrames;
+		output->pushFrame(ffmpeg::AVFrame_Heap(avFrame));
+	};
+
+	while (true)
+	{
+		pollfd pfd = {stream.getEventPollFd(), POLLIN, 0};
+		int res = poll(&pfd, 1, 100);
+		if (res == -1 && errno != EINTR)
+			throw std::runtime_error("poll failed: "s + strerror(errno));
+
+		auto now = steady_clock::now();
+		if (!connected && now > setupTimeout)
+			throw std::runtime_error("Stream did not start within 10 seconds");
+		if (connected && !m.measuring && now >= connectedAt + duration<double>(options.warmupSeconds))
+		{
+			measureStart = now;
+			cpuStart = processCpuTime();
+			sourceCpuStart = source ? source->getCpuTime() : nanoseconds::zero();
+			producedStart = source ? source->getFrameCount() : 0;
+			std::lock_guard lock(m.mutex);
+			m.measuring = true;
+		}
+		if (m.measuring && now >= measureStart + duration<double>(options.durationSeconds))
+		{
+			measureEnd = now;
+			break;
+		}
+		if (res <= 0 || !(pfd.revents & POLLIN))
+			continue;
+
+		auto ev = stream.nextEvent();
+		if (!ev)
+			continue;
+		std::visit(overloaded{
+				[&] (pw::event::FormatNegotiated&) {},
+				[&] (pw::event::Connected& e)
+				{
+					auto builder = ffmpeg::FFmpegOutput::Builder(e.dimensions, e.format, e.isDmaBuf);
+					builder.withHWDevice(options.hardwareDevicePath)
+					       .withOutputFormat(options.outputFormat)
+					       .withOutputPath(options.outputPath)
+					       .withPacketSink(sink);
+					output = std::make_unique<ffmpeg::FFmpegOutput>(builder.build());
+					connected = true;
+					connectedAt = steady_clock::now();
+				},
+				[&] (pw::event::Disconnected&)
+				{
+					throw std::runtime_error("Stream disconnected during the benchmark");
+				},
+				[&] (pw::event::MemoryFrameReceived& e)
+				{
+					auto pts = e.frame->pts;
+					handleFrame(ffmpeg::wrapInAVFrame(std::move(e.frame)), pts);
+				},
+				[&] (pw::event::DmaBufFrameReceived& e)
+				{
+					auto pts = e.frame->pts;
+					handleFrame(ffmpeg::wrapInAVFrame(std::move(e.frame)), pts);
+				},
+				[&] (pw::event::CursorMoved&) {}
+		}, *ev);
+	}
+
+	std::lock_guard lock(m.mutex);
+	m.measuring = false;
+	ScenarioResult r{};
+	double elapsed = duration<double>(measureEnd - measureStart).count();
+	nanoseconds cpu = processCpuTime() - cpuStart;
+	if (source)
+		cpu -= source->getCpuTime() - sourceCpuStart;
+
+	r.durationSeconds = elapsed;
+	r.framesReceived = receivedFrames;
+	r.packetsEncoded = m.packets;
+	r.fps = static_cast<double>(m.packets) / elapsed;
+	// an external source does not tell us how many frames it produced
+	r.framesProduced = source ? source->getFrameCount() - producedStart : receivedFrames;
+	r.droppedCapture = r.framesProduced > r.framesReceived ? r.framesProduced - r.framesReceived : 0;
+	r.droppedPipeline = r.framesReceived > r.packetsEncoded ? r.framesReceived - r.packetsEncoded : 0;
+	r.captureLatency = summarize(m.captureLatency);
+	r.encodeLatency = summarize(m.encodeLatency);
+	r.totalLatency = summarize(m.totalLatency);
+	r.cpuMicrosPerFrame = m.packets ? duration<double, std::micro>(cpu).count() / static_cast<double>(m.packets) : 0;
+	rusage usage{};
+	getrusage(RUSAGE_SELF, &usage);
+	r.peakRssKiB = static_cast<uint64_t>(usage.ru_maxrss);
+	return r;
+}
+
+ScenarioResult runScenarioIsolated(const Scenario& scenario, const RunOptions& options) noexcept
+{
+	ScenarioResult r{};
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) == -1)
+	{
+		snprintf(r.error, sizeof(r.error), "pipe failed: %s", strerror(errno));
+		return r;
+	}
+	fflush(stdout);
+	fflush(stderr);
+	pid_t pid = fork();
+	if (pid == -1)
+	{
+		snprintf(r.error, sizeof(r.error), "fork failed: %s", strerror(errno));
+		close(fds[0]);
+		close(fds[1]);
+		return r;
+	}
+	if (pid == 0)
+	{
+		close(fds[0]);
+		screencapture_wayland_init(nullptr, nullptr);
+		try
+		{
+			r = runScenario(scenario, options);
+		}
+		catch (const std::exception& e)
+		{
+			snprintf(r.error, sizeof(r.error), "%s", e.what());
+		}
+		screencapture_wayland_deinit();
+		ssize_t n = write(fds[1], &r, sizeof(r));
+		_exit(n == sizeof(r) ? 0 : 1);
+	}
+
+	close(fds[1]);
+	size_t received = 0;
+	while (received < sizeof(r))
+	{
+		ssize_t n = read(fds[0], reinterpret_cast<char*>(&r) + received, sizeof(r) - received);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		received += static_cast<size_t>(n);
+	}
+	close(fds[0]);
+	int status = 0;
+	while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+		;
+	if (received != sizeof(r))
+	{
+		r = ScenarioResult{};
+		if (WIFSIGNALED(status))
+			snprintf(r.error, sizeof(r.error), "benchmark process killed by signal %d", WTERMSIG(status));
+		else
+			snprintf(r.error, sizeof(r.error), "benchmark process exited without a result");
+	}
+	return r;
+}
+
+}
@@ -0,0 +1,92 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#ifndef SCREENCAPTURE_BENCH_SCENARIO_HPP
+#define SCREENCAPTURE_BENCH_SCENARIO_HPP
+
+#include <common.hpp>
+#include <PipeWireModule/TestSource.hpp>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace bench
+{
+
+/** One capture-to-packet configuration that is measured on its own */
+struct Scenario
+{
+	std::string name;
+	common::Rect size;
+	uint32_t framerate;
+	pw::TestPattern pattern;
+	/** request DmaBuf frames from the source */
+	bool dmaBuf;
+	/** capture an existing PipeWire node instead of a TestSource, size and framerate are then given by that node */
+	bool external;
+};
+
+/** Settings shared by all scenarios of a run */
+struct RunOptions
+{
+	const char* hardwareDevicePath;
+	const char* outputFormat;
+	const char* outputPath;
+	double warmupSeconds;
+	double durationSeconds;
+	/** node ID for external scenarios */
+	uint32_t externalNode;
+};
+
+struct LatencySummary
+{
+	uint64_t count;
+	double p50;
+	double p90;
+	double p99;
+	double max;
+};
+
+/** The measurements of one scenario. This is plain data, so it can be passed from a child process through a pipe. */
+struct ScenarioResult
+{
+	double durationSeconds;
+	/** encoded packets per second */
+	double fps;
+	uint64_t framesProduced;
+	uint64_t framesReceived;
+	uint64_t packetsEncoded;
+	/** frames produced by the source that never arrived in the PipeWireStream */
+	uint64_t droppedCapture;
+	/** frames that arrived, but did not leave the encoder */
+	uint64_t droppedPipeline;
+	/** in microseconds: source timestamp to frame event */
+	LatencySummary captureLatency;
+	/** in microseconds: FFmpegOutput::pushFrame() to encoded packet, which covers scaler and encoder queues */
+	LatencySummary encodeLatency;
+	/** in microseconds: source timestamp to encoded packet */
+	LatencySummary totalLatency;
+	/** CPU time of the process per encoded packet in microseconds, excluding the synthetic source */
+	double cpuMicrosPerFrame;
+	uint64_t peakRssKiB;
+	/** empty if the scenario ran successfully */
+	char error[256];
+};
+
+/** Build the default scenario matrix: 1080p/1440p/4K at 60/144 fps with static and high-motion content.
+ * If withExternal is true, a scenario for an external DmaBuf node is added. */
+std::vector<Scenario> defaultScenarios(bool withExternal);
+
+/** Run a single scenario in the current process.
+ * @throw std::runtime_error if the stream or encoder could not be set up */
+ScenarioResult runScenario(const Scenario& scenario, const RunOptions& options);
+
+/** Run a single scenario in a child process, so that its peak memory usage and CPU time are isolated from the
+ * other scenarios. Errors are reported through ScenarioResult::error. */
+ScenarioResult runScenarioIsolated(const Scenario& scenario, const RunOptions& options) noexcept;
+
+}
+
+#endif //SCREENCAPTURE_BENCH_SCENARIO_HPP
@@ -0,0 +1,177 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#include "Report.hpp"
+#include "Scenario.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <optional>
+#include <unistd.h>
+
+
+static void printUsage(const char* argv0)
+{
+	printf("Usage: %s -d <hardware device path> [-s <filter>] [-t <seconds>] [-w <seconds>] [-n <node id>]\n"
+	       "       [-f <output format> -o <output path>] [-j <result file>] [-b <baseline file> [-T <tolerance>]]\n"
+	       "       [-c <result file> -b <baseline file>] [-l]\n", argv0);
+	puts("\t-s only runs scenarios whose name contains <filter>");
+	puts("\t-t sets the measured duration per scenario (default 10), -w the warmup before it (default 2)");
+	puts("\t-n adds a DmaBuf scenario that captures the existing PipeWire node <node id>");
+	puts("\t-f and -o select the muxer output (default mpegts to /dev/null)");
+	puts("\t-j writes the results as JSON to <result file> (default stdout)");
+	puts("\t-b compares the results with <baseline file> and exits with 2 if any metric regressed by more than"
+	     " <tolerance> (default 0.1 = 10%)");
+	puts("\t-c compares an existing <result file> instead of running the scenarios");
+	puts("\t-l lists the scenarios and exits");
+}
+
+int main(int argc, char** argv)
+{
+	bench::RunOptions options{};
+	options.outputFormat = "mpegts";
+	options.outputPath = "/dev/null";
+	options.warmupSeconds = 2;
+	options.durationSeconds = 10;
+	const char* filter = nullptr;
+	const char* resultPath = nullptr;
+	const char* baselinePath = nullptr;
+	const char* comparePath = nullptr;
+	double tolerance = 0.1;
+	bool haveExternalNode = false;
+	bool listOnly = false;
+
+	int c;
+	while ((c = getopt(argc, argv, "d:s:t:w:n:f:o:j:b:T:c:l")) != -1)
+	{
+		switch (c)
+		{
+			case 'd':
+				options.hardwareDevicePath = optarg;
+				break;
+			case 's':
+				filter = optarg;
+				break;
+			case 't':
+				options.durationSeconds = strtod(optarg, nullptr);
+				break;
+			case 'w':
+				options.warmupSeconds = strtod(optarg, nullptr);
+				break;
+			case 'n':
+				options.externalNode = static_cast<uint32_t>(strtoul(optarg, nullptr, 10));
+				haveExternalNode = true;
+				break;
+			case 'f':
+				options.outputFormat = optarg;
+				break;
+			case 'o':
+				options.outputPath = optarg;
+				break;
+			case 'j':
+				resultPath = optarg;
+				break;
+			case 'b':
+				baselinePath = optarg;
+				break;
+			case 'T':
+				tolerance = strtod(optarg, nullptr);
+				break;
+			case 'c':
+				comparePath = optarg;
+				break;
+			case 'l':
+				listOnly = true;
+				break;
+			case '?':
+				fprintf(stderr, "Unrecognized option: '-%c'\n", optopt);
+				printUsage(argv[0]);
+				return 1;
+		}
+	}
+
+	try
+	{
+		std::vector<bench::ReportEntry> results;
+		if (comparePath)
+		{
+			if (!baselinePath)
+			{
+				fprintf(stderr, "Comparing requires a baseline\n");
+				printUsage(argv[0]);
+				return 1;
+			}
+			results = bench::readReport(comparePath);
+		}
+		else
+		{
+			std::vector<bench::Scenario> scenarios;
+			for (auto& s : bench::defaultScenarios(haveExternalNode))
+				if (!filter || s.name.find(filter) != std::string::npos)
+					scenarios.push_back(s);
+			if (listOnly)
+			{
+				for (auto& s : scenarios)
+					puts(s.name.c_str());
+				return 0;
+			}
+			if (!options.hardwareDevicePath)
+			{
+				fprintf(stderr, "Missing hardware device path\n");
+				printUsage(argv[0]);
+				return 1;
+			}
+			if (options.durationSeconds <= 0 || options.warmupSeconds < 0)
+			{
+				fprintf(stderr, "Invalid duration\n");
+				return 1;
+			}
+
+			for (auto& s : scenarios)
+			{
+				fprintf(stderr, "Running %s...\n", s.name.c_str());
+				results.push_back(bench::ReportEntry{s, bench::runScenarioIsolated(s, options)});
+			}
+
+			FILE* out = stdout;
+			if (resultPath)
+			{
+				out = fopen(resultPath, "w");
+				if (!out)
+				{
+					perror("opening result file failed");
+					return 1;
+				}
+			}
+			bench::writeReport(out, results);
+			if (out != stdout)
+				fclose(out);
+		}
+
+		bench::printSummary(stderr, results);
+
+		if (baselinePath)
+		{
+			auto baseline = bench::readReport(baselinePath);
+			auto regressions = bench::compareReports(baseline, results, tolerance);
+			for (auto& r : regressions)
+				fprintf(stderr, "REGRESSION %s: %s %.2f -> %.2f\n",
+				        r.scenario.c_str(), r.metric.c_str(), r.baseline, r.current);
+			if (!regressions.empty())
+				return 2;
+			fprintf(stderr, "No regressions compared to %s\n", baselinePath);
+		}
+		for (auto& e : results)
+			if (e.result.error[0])
+				return 1;
+		return 0;
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+}
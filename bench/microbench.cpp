@@ -0,0 +1,349 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#include <FFMPEGModule/BlockingRingbuffer.hpp>
+#include <FFMPEGModule/libavcommon.hpp>
+#include <PipeWireModule/CursorBlend.hpp>
+#include <PipeWireModule/CursorState.hpp>
+#include <PipeWireModule/EventQueue.hpp>
+#include <PipeWireModule/EventToCEventConverter.hpp>
+#include <benchmark/benchmark.h>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <poll.h>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+/* Microbenchmarks for the code that runs once per frame between the PipeWire loop and the encoder threads.
+ * Every benchmark reports the number of heap allocations per iteration, counted by interposing malloc. */
+
+static std::atomic<uint64_t> allocationCount{0};
+
+extern "C" {
+void* __libc_malloc(size_t);
+void* __libc_calloc(size_t, size_t);
+void* __libc_realloc(void*, size_t);
+void* __libc_memalign(size_t, size_t);
+
+void* malloc(size_t size) noexcept
+{
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) noexcept
+{
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	return __libc_calloc(n, size);
+}
+
+void* realloc(void* p, size_t size) noexcept
+{
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	return __libc_realloc(p, size);
+}
+
+int posix_memalign(void** p, size_t alignment, size_t size) noexcept
+{
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	*p = __libc_memalign(alignment, size);
+	return *p ? 0 : ENOMEM;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) noexcept
+{
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	return __libc_memalign(alignment, size);
+}
+}
+
+/** Measures the allocations during the timed loop of a benchmark */
+class AllocationCounter
+{
+	benchmark::State& state;
+	uint64_t start;
+
+public:
+	explicit AllocationCounter(benchmark::State& state) noexcept
+	: state(state),
+	  start(allocationCount.load(std::memory_order_relaxed))
+	{}
+
+	~AllocationCounter() noexcept
+	{
+		auto count = static_cast<double>(allocationCount.load(std::memory_order_relaxed) - start);
+		state.counters["allocs"] = benchmark::Counter(count, benchmark::Counter::kAvgIterations);
+	}
+};
+
+
+static std::unique_ptr<common::MemoryFrame> makeMemoryFrame(void* memory)
+{
+	auto f = std::make_unique<common::MemoryFrame>();
+	f->width = 1920;
+	f->height = 1080;
+	f->format = common::PixelFormat::BGRX;
+	f->memory = memory;
+	f->stride = 1920 * 4;
+	f->size = 1920 * 1080 * 4;
+	f->offset = 0;
+	// the same capture size as the buffer requeue lambda in processFrame
+	void* si = nullptr;
+	void* b = nullptr;
+	f->onFrameDone = [si, b]()
+	{
+		benchmark::DoNotOptimize(si);
+		benchmark::DoNotOptimize(b);
+	};
+	return f;
+}
+
+static std::unique_ptr<common::DmaBufFrame> makeDmaBufFrame()
+{
+	auto f = std::make_unique<common::DmaBufFrame>();
+	f->width = 1920;
+	f->height = 1080;
+	f->drmFormat = 0x34325258; // XR24
+	f->objectCount = 1;
+	f->drmObjects[0] = {-1, 1920 * 1080 * 4, 0};
+	f->planeCount = 1;
+	f->planes[0] = {0, 0, 1920 * 4};
+	void* si = nullptr;
+	void* b = nullptr;
+	f->onFrameDone = [si, b]()
+	{
+		benchmark::DoNotOptimize(si);
+		benchmark::DoNotOptimize(b);
+	};
+	return f;
+}
+
+
+/** Round trip of a frame between two threads through two queues, like between the scaler and encoder threads */
+static void BM_BlockingRingbuffer_PingPong(benchmark::State& state)
+{
+	BlockingRingbuffer<ffmpeg::AVFrame_Heap, 4> forward;
+	BlockingRingbuffer<ffmpeg::AVFrame_Heap, 4> backward;
+	std::thread worker([&]
+	{
+		while (true)
+		{
+			auto v = forward.dequeue();
+			if (std::holds_alternative<BlockingRingbuffer<ffmpeg::AVFrame_Heap, 4>::EndOfBuffer>(v))
+				break;
+			backward.enqueue(std::move(std::get<ffmpeg::AVFrame_Heap>(v)));
+		}
+	});
+
+	ffmpeg::AVFrame_Heap frame(av_frame_alloc());
+	{
+		AllocationCounter allocs(state);
+		for (auto _ : state)
+		{
+			forward.enqueue(std::move(frame));
+			auto v = backward.dequeue();
+			frame = std::move(std::get<ffmpeg::AVFrame_Heap>(v));
+		}
+	}
+	forward.signalEOF();
+	worker.join();
+}
+BENCHMARK(BM_BlockingRingbuffer_PingPong)->UseRealTime();
+
+/** A producer that is faster than the consumer, so the queue is full and drops the oldest elements */
+static void BM_BlockingRingbuffer_Contended(benchmark::State& state)
+{
+	BlockingRingbuffer<uint64_t, 4> queue;
+	std::thread consumer([&]
+	{
+		while (true)
+		{
+			auto v = queue.dequeue();
+			if (std::holds_alternative<BlockingRingbuffer<uint64_t, 4>::EndOfBuffer>(v))
+				break;
+			benchmark::DoNotOptimize(std::get<uint64_t>(v));
+		}
+	});
+
+	uint64_t next = 0;
+	{
+		AllocationCounter allocs(state);
+		for (auto _ : state)
+		{
+			queue.enqueue(uint64_t(next++));
+		}
+	}
+	queue.signalEOF();
+	consumer.join();
+}
+BENCHMARK(BM_BlockingRingbuffer_Contended)->UseRealTime();
+
+/** The event hand-off of PipeWireStream::enqueueEvent() and nextEvent(), including the creation of the frame */
+static void BM_EventQueue_PushPop(benchmark::State& state)
+{
+	pw::EventQueue<pw::event::Event> queue;
+	uint8_t pixels[64];
+	AllocationCounter allocs(state);
+	for (auto _ : state)
+	{
+		queue.push(pw::event::MemoryFrameReceived{makeMemoryFrame(pixels)});
+		auto e = queue.pop();
+		benchmark::DoNotOptimize(e);
+	}
+}
+BENCHMARK(BM_EventQueue_PushPop);
+
+/** Events pushed by one thread and polled for by another one, like the PipeWire loop and the application */
+static void BM_EventQueue_CrossThread(benchmark::State& state)
+{
+	pw::EventQueue<pw::event::Event> queue;
+	std::atomic<bool> stop = false;
+	std::thread consumer([&]
+	{
+		while (!stop.load(std::memory_order_relaxed))
+		{
+			pollfd pfd = {queue.getPollFd(), POLLIN, 0};
+			if (poll(&pfd, 1, 10) <= 0)
+				continue;
+			while (auto e = queue.pop())
+				benchmark::DoNotOptimize(e);
+		}
+	});
+
+	{
+		AllocationCounter allocs(state);
+		for (auto _ : state)
+		{
+			queue.push(pw::event::Disconnected{});
+		}
+	}
+	stop = true;
+	consumer.join();
+}
+BENCHMARK(BM_EventQueue_CrossThread)->UseRealTime();
+
+static void BM_WrapInAVFrame_Memory(benchmark::State& state)
+{
+	uint8_t pixels[64];
+	AllocationCounter allocs(state);
+	for (auto _ : state)
+	{
+		auto frame = makeMemoryFrame(pixels);
+		AVFrame* f = ffmpeg::wrapInAVFrame(std::move(frame));
+		av_frame_free(&f);
+	}
+}
+BENCHMARK(BM_WrapInAVFrame_Memory);
+
+static void BM_WrapInAVFrame_DmaBuf(benchmark::State& state)
+{
+	AllocationCounter allocs(state);
+	for (auto _ : state)
+	{
+		auto frame = makeDmaBufFrame();
+		AVFrame* f = ffmpeg::wrapInAVFrame(std::move(frame));
+		av_frame_free(&f);
+	}
+}
+BENCHMARK(BM_WrapInAVFrame_DmaBuf);
+
+static void BM_EventToCEventConverter_MemoryFrame(benchmark::State& state)
+{
+	uint8_t pixels[64];
+	EventToCEventConverter converter;
+	PipeWireStream_Event c_event;
+	AllocationCounter allocs(state);
+	for (auto _ : state)
+	{
+		converter.processEvent(pw::event::MemoryFrameReceived{makeMemoryFrame(pixels)}, &c_event);
+		freeMemoryFrame(c_event.memoryFrameReceived.frame);
+	}
+}
+BENCHMARK(BM_EventToCEventConverter_MemoryFrame);
+
+static void BM_EventToCEventConverter_DmaBufFrame(benchmark::State& state)
+{
+	EventToCEventConverter converter;
+	PipeWireStream_Event c_event;
+	AllocationCounter allocs(state);
+	for (auto _ : state)
+	{
+		converter.processEvent(pw::event::DmaBufFrameReceived{makeDmaBufFrame()}, &c_event);
+		freeDmaBufFrame(c_event.dmaBufFrameReceived.frame);
+	}
+}
+BENCHMARK(BM_EventToCEventConverter_DmaBufFrame);
+
+/** The cursor metadata handling in processFrame, with the bitmap size as argument (0 = position only).
+ * The same bitmap is sent every time, which only compares it with the cached image. */
+static void BM_CursorState_Update(benchmark::State& state)
+{
+	auto size = static_cast<uint32_t>(state.range(0));
+	std::vector<uint8_t> meta(sizeof(spa_meta_cursor) + sizeof(spa_meta_bitmap) + size * size * 4);
+	auto mcs = reinterpret_cast<spa_meta_cursor*>(meta.data());
+	mcs->id = 1;
+	mcs->position = {100, 100};
+	mcs->bitmap_offset = 0;
+	if (size > 0)
+	{
+		mcs->bitmap_offset = sizeof(spa_meta_cursor);
+		auto mb = SPA_MEMBER(mcs, mcs->bitmap_offset, spa_meta_bitmap);
+		mb->format = SPA_VIDEO_FORMAT_BGRA;
+		mb->size = {size, size};
+		mb->stride = static_cast<int32_t>(size * 4);
+		mb->offset = sizeof(spa_meta_bitmap);
+	}
+
+	pw::CursorState cursor;
+	AllocationCounter allocs(state);
+	for (auto _ : state)
+	{
+		cursor.update(*mcs, meta.size());
+		benchmark::DoNotOptimize(cursor.cursor.x);
+	}
+	state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * size * size * 4));
+}
+BENCHMARK(BM_CursorState_Update)->Arg(0)->Arg(24)->Arg(64)->Arg(256);
+
+/** Alpha blending a cursor of the given size into a 1080p frame, as done by CanvasCompositor::setDrawCursor() */
+static void BM_BlendCursor(benchmark::State& state)
+{
+	auto size = static_cast<uint32_t>(state.range(0));
+	auto image = std::make_shared<common::CursorImage>();
+	image->width = size;
+	image->height = size;
+	image->format = common::PixelFormat::RGBA;
+	image->pixels = std::make_unique<uint8_t[]>(size * size * 4);
+	for (uint32_t i = 0; i < size * size; ++i)
+	{
+		// half of the pixels transparent, half opaque white
+		uint8_t v = (i % 2) ? 255 : 0;
+		std::memset(image->pixels.get() + i * 4, v, 4);
+	}
+	common::Cursor cursor;
+	cursor.visible = true;
+	cursor.x = 500;
+	cursor.y = 500;
+	cursor.image = image;
+
+	common::Rect frameSize{1920, 1080};
+	std::vector<uint8_t> frame(frameSize.w * frameSize.h * 4);
+	for (auto _ : state)
+	{
+		pw::blendCursor(frame.data(), frameSize.w * 4, frameSize, common::PixelFormat::BGRA, cursor);
+		benchmark::ClobberMemory();
+	}
+	state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * size * size * 4));
+}
+BENCHMARK(BM_BlendCursor)->Arg(24)->Arg(64)->Arg(256);
+
+BENCHMARK_MAIN();
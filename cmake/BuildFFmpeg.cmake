@@ -21,7 +21,7 @@ ExternalProject_Add(ffmpeg
         --disable-swresample --disable-swscale --disable-postproc --disable-avdevice --disable-everything
         --enable-encoder=h264_vaapi
         --enable-muxer=rtsp --enable-muxer=mpegts
-        --enable-filter=scale_vaapi --enable-filter=hwupload --enable-filter=hwmap
+        --enable-filter=scale_vaapi --enable-filter=overlay_vaapi --enable-filter=hwupload --enable-filter=hwmap
         --enable-protocol=file --enable-protocol=rtp
         --enable-libdrm --disable-xlib --disable-vdpau --disable-asm --prefix=<INSTALL_DIR>
         ${FFMPEG_OPTIMIZATION_FLAGS}
@@ -5,7 +5,11 @@
 *******************************************************************************/
 
 #include "common.hpp"
+#include "trace.hpp"
 #include <c_common.h>
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
 #ifdef HAVE_PIPEWIRE_MODLE
 #include "PipeWireModule/PipeWireStream.hpp"
 #endif
@@ -16,6 +20,8 @@
 
 void screencapture_wayland_init(int* argc, char*** argv)
 {
+	if (getenv("SCREENCAPTURE_TRACE"))
+		trace::start();
 #ifdef HAVE_PIPEWIRE_MODLE
 	pw::init(argc, argv);
 #endif
@@ -31,6 +37,159 @@ void screencapture_wayland_deinit()
 #ifdef HAVE_GSTREAMER_MODULE
 	gstreamer::deinit();
 #endif
+	if (const char* tracePath = getenv("SCREENCAPTURE_TRACE"))
+	{
+		trace::stop();
+		trace::writeChromeJson(tracePath);
+	}
+}
+
+#include <cstring> // memcpy
+
+common::Cursor common::CursorFromC::convert(const ::FrameCursor& c)
+{
+	Cursor cursor;
+	cursor.visible = c.visible;
+	cursor.x = c.x;
+	cursor.y = c.y;
+	cursor.hotspotX = c.hotspotX;
+	cursor.hotspotY = c.hotspotY;
+	if (!c.bitmap || c.width == 0 || c.height == 0)
+		return cursor;
+	if (!image || image->serial != c.serial || image->width != c.width || image->height != c.height)
+	{
+		auto copy = std::make_shared<CursorImage>();
+		copy->width = c.width;
+		copy->height = c.height;
+		switch (c.format)
+		{
+			case ::PixelFormat::BGRA:
+				copy->format = PixelFormat::BGRA;
+				break;
+			case ::PixelFormat::BGRX:
+				copy->format = PixelFormat::BGRX;
+				break;
+			case ::PixelFormat::RGBA:
+				copy->format = PixelFormat::RGBA;
+				break;
+			case ::PixelFormat::RGBX:
+				copy->format = PixelFormat::RGBX;
+				break;
+			default:
+				throw std::runtime_error("Cursor bitmap has an invalid pixel format");
+		}
+		size_t size = size_t(c.width) * c.height * 4;
+		copy->pixels = std::make_unique<uint8_t[]>(size);
+		std::memcpy(copy->pixels.get(), c.bitmap, size);
+		copy->serial = c.serial;
+		image = std::move(copy);
+	}
+	cursor.image = image;
+	return cursor;
+}
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h> // gettid
+
+static const char* toString(common::ThreadConfig::Policy p) noexcept
+{
+	switch (p)
+	{
+		case common::ThreadConfig::Policy::FIFO:
+			return "SCHED_FIFO";
+		case common::ThreadConfig::Policy::RR:
+			return "SCHED_RR";
+		case common::ThreadConfig::Policy::DEFAULT:
+			break;
+	}
+	return "SCHED_OTHER";
+}
+
+/** @return true if the thread now uses the real-time policy */
+static bool setRealtimePolicy(const common::ThreadConfig& config) noexcept
+{
+	int policy = config.policy == common::ThreadConfig::Policy::FIFO ? SCHED_FIFO : SCHED_RR;
+	sched_param param{};
+	param.sched_priority = std::clamp(config.priority, sched_get_priority_min(policy), sched_get_priority_max(policy));
+	int r = pthread_setschedparam(pthread_self(), policy, &param);
+	if (r == EPERM)
+	{
+		// unprivileged processes may use real-time priorities up to RLIMIT_RTPRIO, so raise the soft limit and retry
+		rlimit limit;
+		if (getrlimit(RLIMIT_RTPRIO, &limit) == 0 && limit.rlim_max > 0)
+		{
+			if (limit.rlim_cur < limit.rlim_max)
+			{
+				limit.rlim_cur = limit.rlim_max;
+				setrlimit(RLIMIT_RTPRIO, &limit);
+				getrlimit(RLIMIT_RTPRIO, &limit);
+			}
+			if (limit.rlim_cur > 0)
+			{
+				param.sched_priority = std::min(param.sched_priority, static_cast<int>(limit.rlim_cur));
+				r = pthread_setschedparam(pthread_self(), policy, &param);
+			}
+		}
+	}
+	if (r != 0)
+	{
+		fprintf(stderr, "Warning: Setting %s with priority %d failed, using the default scheduler: %s\n",
+		        toString(config.policy), param.sched_priority, strerror(r));
+		return false;
+	}
+	if (param.sched_priority != config.priority)
+	{
+		fprintf(stderr, "Warning: Lowered %s priority from %d to %d\n",
+		        toString(config.policy), config.priority, param.sched_priority);
+	}
+	return true;
+}
+
+void common::applyThreadConfig(const ThreadConfig& config) noexcept
+{
+	if (!config.cpus.empty())
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (unsigned int cpu : config.cpus)
+			if (cpu < CPU_SETSIZE)
+				CPU_SET(cpu, &set);
+		int r = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (r != 0)
+			fprintf(stderr, "Warning: Setting the CPU affinity failed: %s\n", strerror(r));
+	}
+
+	bool isRealtime = config.policy != ThreadConfig::Policy::DEFAULT && setRealtimePolicy(config);
+	if (config.nice && !isRealtime)
+	{
+		// on Linux, the nice value of a thread ID only applies to this thread
+		if (setpriority(PRIO_PROCESS, static_cast<id_t>(gettid()), *config.nice) != 0)
+			fprintf(stderr, "Warning: Setting nice value %d failed: %s\n", *config.nice, strerror(errno));
+	}
+}
+
+static void setThreadName(pthread_t thread, const char* name) noexcept
+{
+	// longer names are rejected by the kernel instead of being truncated
+	char truncated[16];
+	strncpy(truncated, name, sizeof(truncated) - 1);
+	truncated[sizeof(truncated) - 1] = '\0';
+	pthread_setname_np(thread, truncated);
+}
+
+void common::setThreadName(std::thread& thread, const char* name) noexcept
+{
+	::setThreadName(thread.native_handle(), name);
+}
+
+void common::setCurrentThreadName(const char* name) noexcept
+{
+	::setThreadName(pthread_self(), name);
 }
 
 #include <execinfo.h>
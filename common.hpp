@@ -10,6 +10,10 @@
 #include <functional>
 #include <memory> // shared_ptr
 #include <chrono>
+#include <thread>
+#include <vector>
+#include <optional>
+#include <string>
 
 #define SCW_EXPORT [[gnu::visibility("default")]]
 
@@ -19,9 +23,41 @@ namespace sdbus
 class IConnection;
 }
 
+// from c_common.h
+struct FrameCursor;
+
 namespace common
 {
 
+struct Rect
+{
+	unsigned int w;
+	unsigned int h;
+};
+
+/** A region of a frame in pixels, e.g. the content of a window in a larger buffer */
+struct CropRegion
+{
+	unsigned int x;
+	unsigned int y;
+	/** the size of the region, or 0x0 for the whole frame */
+	Rect size;
+};
+
+/** One of the streams of a SharedScreen, e.g. a monitor */
+struct SharedStream
+{
+	/** PipeWire node ID of the video stream */
+	uint32_t pipeWireNode;
+
+	/** position of the source in the compositor's logical coordinate space, or 0 if the portal didn't report it */
+	int32_t x;
+	int32_t y;
+
+	/** size of the source in logical coordinates, or 0x0 if the portal didn't report it */
+	Rect size;
+};
+
 struct SharedScreen
 {
 	/** The D-Bus connection through which the shared screen has been requested.
@@ -29,17 +65,19 @@ struct SharedScreen
 	 * so keep it open as long as you need the shared screen. */
 	std::shared_ptr<sdbus::IConnection> dbusConnection;
 
-	/** file descriptor where the PipeWire server can be reached */
+	/** file descriptor where the PipeWire server can be reached, or -1 to use the local PipeWire daemon */
 	int pipeWireFd;
 
 	/** PipeWire node ID of the video stream for the shared screen */
 	uint32_t pipeWireNode;
-};
 
-struct Rect
-{
-	unsigned int w;
-	unsigned int h;
+	/** All streams the user selected, if multiple sources were requested. The first one is #pipeWireNode.
+	 * May be empty if only #pipeWireNode is known. */
+	std::vector<SharedStream> streams;
+
+	/** Token to restore this selection in a later request without asking the user, or empty if the session may not be
+	 * persisted. See portal::requestPipeWireShare(). */
+	std::string restoreToken;
 };
 
 enum class PixelFormat
@@ -52,22 +90,71 @@ enum class PixelFormat
 
 using FrameDoneCallback = std::function<void()>;
 
+/** An image of the mouse cursor, e.g. from the cursor metadata of a PipeWire stream (see CURSOR_MODE_META).
+ * It is shared by all frames that show it, so it must not be modified once it has been given to a frame. */
+struct CursorImage
+{
+	uint32_t width;
+	uint32_t height;
+	/** the channel order of the pixels. Their alpha is premultiplied, formats without alpha are opaque. */
+	PixelFormat format;
+	/** width * 4 bytes per row */
+	std::unique_ptr<uint8_t[]> pixels;
+	/** changes with every new image of a stream, so consumers can cache e.g. an uploaded copy */
+	uint64_t serial;
+};
+
+/** The mouse cursor at the time of a frame. It is not part of the frame's pixels and can be drawn at encode time. */
+struct Cursor
+{
+	/** false if the stream has no cursor metadata or the cursor is not over the frame */
+	bool visible = false;
+	/** position of the cursor's hotspot in frame coordinates */
+	int32_t x = 0;
+	int32_t y = 0;
+	/** position of the hotspot within the image */
+	int32_t hotspotX = 0;
+	int32_t hotspotY = 0;
+	/** the image of the cursor, or nullptr if it is not known yet */
+	std::shared_ptr<const CursorImage> image;
+};
+
+/** Converts the cursor of frames that are pushed through the C interface. The C cursor only borrows its bitmap from the
+ * frame, so the bitmap is copied, but only when its serial differs from the previous one. */
+class CursorFromC
+{
+	std::shared_ptr<const CursorImage> image;
+
+public:
+	/** @throw std::bad_alloc if a new bitmap could not be copied
+	 * @throw std::runtime_error if the bitmap has an invalid pixel format */
+	SCW_EXPORT Cursor convert(const ::FrameCursor& c);
+};
+
 struct DmaBufFrame
 {
 	uint32_t width;
 	uint32_t height;
 	std::chrono::nanoseconds pts;
 	uint64_t drmFormat;
+	/** the DMA-BUFs that hold the planes. All planes may be in one object, or each in its own, e.g. the compression
+	 * metadata of a CCS modifier. */
+	uint32_t objectCount;
 	struct {
 		int fd;
 		size_t totalSize;
 		uint64_t modifier;
-	} drmObject;
+	} drmObjects[4];
 	uint32_t planeCount;
 	struct {
+		/** index of the plane's object in drmObjects */
+		uint32_t objectIndex;
 		size_t offset;
 		size_t pitch;
 	} planes[4];
+	/** the part of the frame that should be shown, e.g. from SPA_META_VideoCrop */
+	CropRegion crop = {};
+	Cursor cursor;
 
 	FrameDoneCallback onFrameDone;
 
@@ -90,6 +177,16 @@ struct MemoryFrame
 	size_t stride;
 	size_t size;
 	size_t offset;
+	/** the memfd that #memory is mapped from, or -1 if there is none. It can be passed to another process (e.g. with
+	 * SCM_RIGHTS) to share the frame without copying it, and is valid as long as the frame. */
+	int fd = -1;
+	/** the offset of #memory within #fd */
+	size_t fdOffset = 0;
+	/** if #fd is sealed against shrinking, so another process can map it without risking SIGBUS */
+	bool isSealed = false;
+	/** the part of the frame that should be shown, e.g. from SPA_META_VideoCrop */
+	CropRegion crop = {};
+	Cursor cursor;
 
 	FrameDoneCallback onFrameDone;
 
@@ -103,6 +200,36 @@ struct MemoryFrame
 	}
 };
 
+/** Scheduling settings of an internal thread. The defaults leave the thread as it was created. */
+struct ThreadConfig
+{
+	enum class Policy
+	{
+		/** the normal time-sharing scheduler (SCHED_OTHER) */
+		DEFAULT,
+		FIFO,
+		RR,
+	};
+
+	/** CPUs the thread may run on, or empty for all CPUs */
+	std::vector<unsigned int> cpus;
+	Policy policy = Policy::DEFAULT;
+	/** real-time priority from 1 to 99, used with Policy::FIFO and Policy::RR */
+	int priority = 1;
+	/** nice value from -20 to 19, used with Policy::DEFAULT or when real-time scheduling is not permitted */
+	std::optional<int> nice;
+};
+
+/** Apply the scheduling settings to the calling thread.
+ * Real-time priorities above RLIMIT_RTPRIO are lowered to the limit. Settings that can't be applied are left at
+ * their defaults with a warning on stderr. */
+SCW_EXPORT void applyThreadConfig(const ThreadConfig& config) noexcept;
+
+/** Name a thread, so it can be told apart in top, debuggers and the CPU time metrics.
+ * Internal threads use the prefix "scw-". Names are truncated to 15 characters. */
+SCW_EXPORT void setThreadName(std::thread& thread, const char* name) noexcept;
+SCW_EXPORT void setCurrentThreadName(const char* name) noexcept;
+
 }
 
 
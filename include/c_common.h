@@ -7,6 +7,7 @@
 #define SCREENCAPTURE_C_COMMON_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <stddef.h> // size_t
 #include <stdlib.h> // free()
 
@@ -21,23 +22,50 @@ extern "C" {
 SCW_EXPORT void screencapture_wayland_init(int* argc, char*** argv);
 SCW_EXPORT void screencapture_wayland_deinit();
 
+/** Start recording per-frame trace events of all pipelines.
+ * Tracing is also started by screencapture_wayland_init() if the environment variable SCREENCAPTURE_TRACE
+ * names an output file, which is then written by screencapture_wayland_deinit().
+ * @param eventsPerThread capacity of each thread's ring buffer, or 0 for the default */
+SCW_EXPORT void screencapture_wayland_startTrace(size_t eventsPerThread);
+SCW_EXPORT void screencapture_wayland_stopTrace();
+/** Write the recorded trace events as Chrome trace JSON, which can be opened in Perfetto or chrome://tracing
+ * @return 0 on success, -1 if the file could not be written */
+SCW_EXPORT int screencapture_wayland_writeTrace(const char* path);
+
 #ifdef __cplusplus
 }
 #endif
 
+struct Rect
+{
+	unsigned int w;
+	unsigned int h;
+};
+
+/** One of the streams of a SharedScreen_t, e.g. a monitor */
+typedef struct
+{
+	uint32_t pipeWireNode;
+	/** position of the source in the compositor's logical coordinate space, or 0 if unknown */
+	int32_t x;
+	int32_t y;
+	/** size of the source in logical coordinates, or 0x0 if unknown */
+	struct Rect size;
+} SharedStream_t;
+
 typedef struct
 {
 	void* connection;
 	int pipeWireFd;
 	uint32_t pipeWireNode;
+	/** all streams the user selected, the first one is pipeWireNode. May be 0 if only pipeWireNode is known. */
+	uint32_t streamCount;
+	SharedStream_t* streams;
+	/** token to restore this selection in a later request without asking the user, or NULL if the session may not be
+	 * persisted. It is freed with the SharedScreen_t. */
+	char* restoreToken;
 } SharedScreen_t;
 
-struct Rect
-{
-	unsigned int w;
-	unsigned int h;
-};
-
 enum PixelFormat
 {
 	BGRA,
@@ -48,15 +76,57 @@ enum PixelFormat
 
 typedef void (*FrameDoneCallback_t)(void*);
 
+/** The part of a frame that should be shown, e.g. the content of a window in a larger buffer */
+struct FrameCrop
+{
+	uint32_t x;
+	uint32_t y;
+	/** the size of the region, or 0x0 for the whole frame */
+	uint32_t width;
+	uint32_t height;
+};
+
+/** The mouse cursor at the time of a frame, if the stream has cursor metadata (see CURSOR_MODE_META).
+ * It is not part of the frame's pixels. */
+struct FrameCursor
+{
+	bool visible;
+	/** position of the cursor's hotspot in frame coordinates */
+	int32_t x;
+	int32_t y;
+	/** position of the hotspot within the bitmap */
+	int32_t hotspotX;
+	int32_t hotspotY;
+	/** pixels with premultiplied alpha and a stride of width * 4 bytes, or NULL if the image is not known yet.
+	 * They are valid as long as the frame. */
+	const uint8_t* bitmap;
+	uint32_t width;
+	uint32_t height;
+	enum PixelFormat format;
+	/** changes with every new bitmap, so e.g. an uploaded copy can be reused while it stays the same */
+	uint64_t serial;
+};
+
 struct MemoryFrame
 {
 	uint32_t width;
 	uint32_t height;
+	/** presentation timestamp in nanoseconds */
+	int64_t pts;
 	enum PixelFormat format;
 	void* memory;
 	size_t stride;
 	size_t size;
 	size_t offset;
+	/** the memfd that memory is mapped from, or -1 if there is none. It can be passed to another process (e.g. with
+	 * SCM_RIGHTS) to share the frame without copying it, and is valid as long as the frame. */
+	int fd;
+	/** the offset of memory within fd */
+	size_t fdOffset;
+	/** if fd is sealed against shrinking, so another process can map it without risking SIGBUS */
+	bool isSealed;
+	struct FrameCrop crop;
+	struct FrameCursor cursor;
 
 	void* opaque;
 	FrameDoneCallback_t onFrameDone;
@@ -73,17 +143,25 @@ struct DmaBufFrame
 {
 	uint32_t width;
 	uint32_t height;
+	/** presentation timestamp in nanoseconds */
+	int64_t pts;
 	uint64_t drmFormat;
+	/** the DMA-BUFs that hold the planes, e.g. one per plane or one for all */
+	uint32_t objectCount;
 	struct {
 		int fd;
 		size_t totalSize;
 		uint64_t modifier;
-	} drmObject;
+	} drmObjects[4];
 	uint32_t planeCount;
 	struct {
+		/** index of the plane's object in drmObjects */
+		uint32_t objectIndex;
 		size_t offset;
 		size_t pitch;
 	} planes[4];
+	struct FrameCrop crop;
+	struct FrameCursor cursor;
 
 	void* opaque;
 	FrameDoneCallback_t onFrameDone;
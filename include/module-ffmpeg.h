@@ -0,0 +1,101 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#ifndef SCREENCAPTURE_MODULE_FFMPEG_H
+#define SCREENCAPTURE_MODULE_FFMPEG_H
+
+#include "c_common.h"
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** An encoded packet. The data is not copied from the encoder, but referenced until you release the packet
+ * with freeEncodedPacket(). */
+struct EncodedPacket
+{
+	const uint8_t* data;
+	size_t size;
+	/** presentation and decoding timestamps in microseconds */
+	int64_t pts;
+	int64_t dts;
+	bool isKeyframe;
+
+	void* opaque;
+	void (*release)(void* opaque);
+};
+
+__inline void freeEncodedPacket(struct EncodedPacket* packet)
+{
+	if (packet->release)
+		packet->release(packet->opaque);
+	free(packet);
+}
+
+/** Called on the encoder thread for every encoded packet. Ownership of @p packet is transferred to the callback,
+ * release it with freeEncodedPacket() when you are done. */
+typedef void (*EncodedPacketCallback_t)(struct EncodedPacket* packet, void* userData);
+
+struct FFmpegOutput_Options
+{
+	/** dimensions and format of the frames that will be pushed */
+	struct Rect sourceSize;
+	enum PixelFormat sourceFormat;
+	/** true if DmaBufFrame objects will be pushed, false for MemoryFrame */
+	bool isDmaBuf;
+	/** size of the encoded video, or zero to use sourceSize (or the size of crop) */
+	struct Rect targetSize;
+	/** DRM render node to encode on, or NULL for the default /dev/dri/renderD128 */
+	const char* hwDevicePath;
+	/** container format and URL of the output, may both be NULL when a packetCallback is given */
+	const char* outputFormat;
+	const char* outputPath;
+	/** optional callback that receives every encoded packet */
+	EncodedPacketCallback_t packetCallback;
+	void* packetCallbackUserData;
+	/** name of existing pipeline statistics to count in (see PipeWireStream_getStatsName()),
+	 * or NULL to register new ones */
+	const char* statsName;
+	/** draw the cursor of the frames on the GPU, see ffmpeg::FFmpegOutput::Builder::withCursorOverlay() */
+	bool drawCursor;
+	/** region of the source frames to encode, or 0x0 for all of it, see ffmpeg::FFmpegOutput::Builder::withCrop() */
+	struct FrameCrop crop;
+};
+
+struct FFmpegOutput;
+
+/** Create an encoder output with the given options.
+ * @return the new output, or NULL if an error occurred */
+SCW_EXPORT struct FFmpegOutput* FFmpegOutput_create(const struct FFmpegOutput_Options* options);
+
+SCW_EXPORT void FFmpegOutput_free(struct FFmpegOutput* output);
+
+/** Get the codec extradata (e.g. H.264 SPS/PPS) of the encoded stream, which a decoder needs before the first packet.
+ * The data stays valid until the output is freed.
+ * @return 0 on success, -1 if the codec has no extradata */
+SCW_EXPORT int FFmpegOutput_getExtradata(struct FFmpegOutput* output, const uint8_t** data, size_t* size);
+
+/** Encode a frame. Ownership of @p frame is transferred to the output, it is released with freeMemoryFrame().
+ * @return 0 on success, -1 if an error occurred */
+SCW_EXPORT int FFmpegOutput_pushMemoryFrame(struct FFmpegOutput* output, struct MemoryFrame* frame);
+
+/** Encode a frame. Ownership of @p frame is transferred to the output, it is released with freeDmaBufFrame().
+ * @return 0 on success, -1 if an error occurred */
+SCW_EXPORT int FFmpegOutput_pushDmaBufFrame(struct FFmpegOutput* output, struct DmaBufFrame* frame);
+
+/** Encode the last frame again with a new cursor, e.g. from a PWSTREAM_EVENT_TYPE_CURSOR_MOVED event.
+ * The bitmap is copied when its serial changes, so the cursor can be freed afterwards. Does nothing unless
+ * FFmpegOutput_Options::drawCursor is set.
+ * @param pts presentation timestamp in nanoseconds
+ * @return 0 on success, -1 if an error occurred */
+SCW_EXPORT int FFmpegOutput_pushCursor(struct FFmpegOutput* output, const struct FrameCursor* cursor, int64_t pts);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif //SCREENCAPTURE_MODULE_FFMPEG_H
@@ -19,8 +19,36 @@ enum PipeWireStream_EventType
 	PWSTREAM_EVENT_TYPE_DISCONNECTED,
 	PWSTREAM_EVENT_TYPE_MEMORY_FRAME_RECEIVED,
 	PWSTREAM_EVENT_TYPE_DMA_BUF_RECEIVED,
+	PWSTREAM_EVENT_TYPE_FORMAT_NEGOTIATED,
+	PWSTREAM_EVENT_TYPE_CURSOR_MOVED,
 };
 
+/** A cursor update without a new frame, see pw::event::CursorMoved. Release it with freeCursorUpdate(). */
+struct CursorUpdate
+{
+	struct FrameCursor cursor;
+	/** presentation timestamp in nanoseconds */
+	int64_t pts;
+
+	void* opaque;
+	FrameDoneCallback_t onDone;
+};
+
+__inline void freeCursorUpdate(struct CursorUpdate* update)
+{
+	if (update->onDone)
+		update->onDone(update->opaque);
+	free(update);
+}
+
+/** Sent as soon as the stream format is known, before the stream is connected.
+ * Use it to set up a frame consumer in advance. Can be sent more than once if the format is renegotiated. */
+struct PipeWireStream_Event_FormatNegotiated
+{
+	struct Rect dimensions;
+	enum PixelFormat format;
+	bool isDmaBuf;
+};
 struct PipeWireStream_Event_Connect
 {
 	struct Rect dimensions;
@@ -38,6 +66,11 @@ struct PipeWireStream_Event_DmaBufFrameReceived
 {
 	const struct DmaBufFrame* frame;
 };
+/** Sent when only the cursor changed, if the stream has cursor metadata */
+struct PipeWireStream_Event_CursorMoved
+{
+	const struct CursorUpdate* update;
+};
 
 struct PipeWireStream_Event
 {
@@ -48,19 +81,140 @@ struct PipeWireStream_Event
 		struct PipeWireStream_Event_Disconnect disconnect;
 		struct PipeWireStream_Event_MemoryFrameReceived memoryFrameReceived;
 		struct PipeWireStream_Event_DmaBufFrameReceived dmaBufFrameReceived;
+		struct PipeWireStream_Event_FormatNegotiated formatNegotiated;
+		struct PipeWireStream_Event_CursorMoved cursorMoved;
 	};
 };
 
 struct PipeWireStream;
 
+/** Negotiation settings of a stream. Fields set to 0 use the default value. */
+struct PipeWireStream_Options
+{
+	/** number of buffers to request, 16 by default */
+	uint32_t bufferCount;
+	/** framerate proposed to the compositor, 30 by default */
+	uint32_t preferredFramerate;
+	/** highest framerate the compositor may deliver, 240 by default */
+	uint32_t maxFramerate;
+};
+
 SCW_EXPORT struct PipeWireStream* PipeWireStream_connect(const SharedScreen_t* shareInfo);
 
+SCW_EXPORT struct PipeWireStream* PipeWireStream_connectWithOptions(const SharedScreen_t* shareInfo,
+                                                                    const struct PipeWireStream_Options* options);
+
+/** Renegotiate a running stream with new options, see pw::PipeWireStream::setOptions() */
+SCW_EXPORT void PipeWireStream_setOptions(struct PipeWireStream* stream, const struct PipeWireStream_Options* options);
+
 SCW_EXPORT void PipeWireStream_free(struct PipeWireStream* stream);
 
+struct PipeWireStreamGroup;
+
+/** Connect to all streams of a shared screen, e.g. from requestMultiplePipeWireSharesFromPortal(), with one PipeWire
+ * connection and loop thread, see pw::PipeWireStreamGroup. The options apply to every stream.
+ * @param options the negotiation settings, or NULL for the defaults */
+SCW_EXPORT struct PipeWireStreamGroup* PipeWireStreamGroup_connect(const SharedScreen_t* shareInfo,
+                                                                   const struct PipeWireStream_Options* options);
+
+/** Disconnect and free all streams of the group. Release all their frames before. */
+SCW_EXPORT void PipeWireStreamGroup_free(struct PipeWireStreamGroup* group);
+
+SCW_EXPORT uint32_t PipeWireStreamGroup_getStreamCount(struct PipeWireStreamGroup* group);
+
+/** Get a stream of the group, in the order of SharedScreen_t::streams. It is used with the PipeWireStream_*
+ * functions like any other stream, but belongs to the group, so don't call PipeWireStream_free() on it.
+ * @return the stream, or NULL if index is out of range */
+SCW_EXPORT struct PipeWireStream* PipeWireStreamGroup_getStream(struct PipeWireStreamGroup* group, uint32_t index);
+
 SCW_EXPORT int PipeWireStream_getEventPollFd(struct PipeWireStream* stream);
 
 SCW_EXPORT int PipeWireStream_nextEvent(struct PipeWireStream* stream, struct PipeWireStream_Event* e);
 
+/** Get the name under which the statistics of this stream are registered, see pipeline-stats.h.
+ * Pass it as FFmpegOutput_Options::statsName to count the encoder in the same pipeline.
+ * The string stays valid until the stream is freed. */
+SCW_EXPORT const char* PipeWireStream_getStatsName(struct PipeWireStream* stream);
+
+/** When to throttle a stream at the compositor, see pw::ThrottlePolicy. Fields set to 0 disable the condition. */
+struct PipeWireStream_ThrottlePolicy
+{
+	/** lower the framerate to idleFramerate after this many milliseconds without damage */
+	uint32_t idleAfterMs;
+	uint32_t idleFramerate;
+	/** pause while this many frames wait for the scaler and encoder */
+	uint32_t maxQueuedFrames;
+	/** pause when this many frames were dropped by full queues within one second */
+	uint32_t maxDropsPerSecond;
+	/** resume a paused stream after this many milliseconds even if the queues have not drained, 0 for 1000 ms */
+	uint32_t maxPauseTimeMs;
+};
+
+/** Throttle the stream while the screen is static or the consumer can't keep up.
+ * @param policy the conditions, or NULL to stop throttling */
+SCW_EXPORT void PipeWireStream_setThrottling(struct PipeWireStream* stream,
+                                             const struct PipeWireStream_ThrottlePolicy* policy);
+
+/** Copy memory frames into pooled buffers to return their PipeWire buffers to the compositor early:
+ * new frames while the application holds maxHeldBuffers buffers, and frames that have waited in the event queue for
+ * maxHoldTimeMs milliseconds. A value of 0 disables the respective condition. */
+SCW_EXPORT void PipeWireStream_setCopyOnHold(struct PipeWireStream* stream, uint32_t maxHeldBuffers, uint32_t maxHoldTimeMs);
+
+/** Position of a source on the canvas of a CanvasCompositor, in pixels */
+struct CanvasCompositor_Placement
+{
+	uint32_t x;
+	uint32_t y;
+};
+
+struct CanvasCompositor;
+
+/** Create a compositor that copies the memory frames of several streams into one canvas, see pw::CanvasCompositor.
+ * @param placements the position of each source on the canvas
+ * @param sourceCount the number of placements */
+SCW_EXPORT struct CanvasCompositor* CanvasCompositor_create(struct Rect size, enum PixelFormat format,
+                                                            const struct CanvasCompositor_Placement* placements,
+                                                            uint32_t sourceCount);
+
+/** Free the compositor and the frames it holds. Canvas frames that are still in use stay valid until freed. */
+SCW_EXPORT void CanvasCompositor_free(struct CanvasCompositor* compositor);
+
+/** Replace the frame of a source. The compositor takes ownership of the frame and frees it when it is replaced.
+ * @param frame the new frame, or NULL to free the current one
+ * @return 0 on success, -1 if the source index or the frame's pixel format is invalid */
+SCW_EXPORT int CanvasCompositor_update(struct CanvasCompositor* compositor, uint32_t source, struct MemoryFrame* frame);
+
+/** Update the cursor of a source without a new frame, e.g. from a PWSTREAM_EVENT_TYPE_CURSOR_MOVED event.
+ * The bitmap is copied when its serial changes, so the update can be freed afterwards.
+ * @return 0 on success, -1 if the source index is invalid */
+SCW_EXPORT int CanvasCompositor_updateCursor(struct CanvasCompositor* compositor, uint32_t source,
+                                             const struct FrameCursor* cursor);
+
+/** Blend the cursor into the canvases instead of passing it on in MemoryFrame::cursor, see
+ * pw::CanvasCompositor::setDrawCursor() */
+SCW_EXPORT void CanvasCompositor_setDrawCursor(struct CanvasCompositor* compositor, bool enable);
+
+/** Copy the changed sources into a canvas and return it. Free it with freeMemoryFrame() when done.
+ * @return the canvas, or NULL if nothing changed since the last canvas or all canvases are in use */
+SCW_EXPORT struct MemoryFrame* CanvasCompositor_compose(struct CanvasCompositor* compositor);
+
+struct DmaBufMapper;
+
+/** Create a mapper that makes linear DMA-BUF frames readable by the CPU, see pw::DmaBufMapper.
+ * @param maxMappings how many buffers to keep mapped, e.g. the buffer count of the stream */
+SCW_EXPORT struct DmaBufMapper* DmaBufMapper_create(uint32_t maxMappings);
+
+/** Free the mapper. Mapped frames that are still in use stay valid until freed. */
+SCW_EXPORT void DmaBufMapper_free(struct DmaBufMapper* mapper);
+
+/** Forget all cached mappings, e.g. after the stream has been renegotiated with new buffers */
+SCW_EXPORT void DmaBufMapper_clear(struct DmaBufMapper* mapper);
+
+/** Map a frame for reading. Ownership of @p frame is transferred to the returned memory frame, which releases it
+ * with freeDmaBufFrame() when it is freed with freeMemoryFrame(). On error, the frame is released right away.
+ * @return the mapped frame, or NULL if the frame is not linear, has several planes or could not be mapped */
+SCW_EXPORT struct MemoryFrame* DmaBufMapper_map(struct DmaBufMapper* mapper, struct DmaBufFrame* frame);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
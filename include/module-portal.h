@@ -7,6 +7,7 @@
 #define SCREENCAPTURE_MODULE_PORTAL_H
 
 #include "c_common.h"
+#include <stdbool.h>
 
 #ifdef __cplusplus
 extern "C"
@@ -20,20 +21,105 @@ enum CursorMode
 	CURSOR_MODE_META = 4,
 };
 
+/** How long the portal should remember what the user selected to share, see SharedScreen_t::restoreToken */
+enum PersistMode
+{
+	/** ask the user with every request */
+	PERSIST_MODE_NONE = 0,
+	/** remember the selection while the application is running */
+	PERSIST_MODE_TRANSIENT = 1,
+	/** remember the selection until the user revokes it, also across restarts */
+	PERSIST_MODE_PERSISTENT = 2,
+};
+
+/** The steps of a screen share request, in order. The last step is PORTAL_STEP_DONE, PORTAL_STEP_CANCELLED or
+ * PORTAL_STEP_FAILED. */
+enum PortalStep
+{
+	/** connecting to the session bus */
+	PORTAL_STEP_CONNECTING,
+	/** creating the screen cast session */
+	PORTAL_STEP_CREATE_SESSION,
+	/** selecting the source types and cursor mode */
+	PORTAL_STEP_SELECT_SOURCES,
+	/** waiting for the user to select what to share */
+	PORTAL_STEP_START,
+	/** opening the connection to PipeWire */
+	PORTAL_STEP_OPEN_REMOTE,
+	PORTAL_STEP_DONE,
+	PORTAL_STEP_CANCELLED,
+	PORTAL_STEP_FAILED,
+};
+
 /** Request a shared screen via D-Bus from xdg-desktop-portal. This will ask the user if they want
  * to share their screen and which screen to share to this application.
  * The returned SharedScreen_t object allows you to acquire a PipeWire video stream for the screen.
  * Call dropSharedScreen(SharedScreen_t*) when you want to revoke your request.
  * @param cursorMode a bitfield of #CursorMode flags that describe which cursor mode you want to request
- *     (may be ignored by the portal)
+ *     (may be ignored by the portal). Of several available ones, CURSOR_MODE_META is preferred over CURSOR_MODE_EMBED.
  * @return A SharedScreen object on success, or NULL if the user cancelled the request or a protocol error occurred */
 SCW_EXPORT SharedScreen_t* requestPipeWireShareFromPortal(enum CursorMode cursorMode);
 
+/** Like requestPipeWireShareFromPortal(), but lets the user select several sources if multipleSources is true.
+ * All selected streams are listed in SharedScreen_t::streams. */
+SCW_EXPORT SharedScreen_t* requestMultiplePipeWireSharesFromPortal(enum CursorMode cursorMode, bool multipleSources);
+
+/** Like requestMultiplePipeWireSharesFromPortal(), but lets the portal remember the selection.
+ * @param persistMode how long the portal should remember the selection. If it is not PERSIST_MODE_NONE and the portal
+ *     supports it, SharedScreen_t::restoreToken is set.
+ * @param restoreToken a token from a previous SharedScreen_t::restoreToken to restore its selection without asking
+ *     the user again, or NULL. If the portal does not accept it, the user is asked. */
+SCW_EXPORT SharedScreen_t* requestPersistentPipeWireShareFromPortal(enum CursorMode cursorMode, bool multipleSources,
+                                                                    enum PersistMode persistMode,
+                                                                    const char* restoreToken);
+
+struct PendingShare;
+
+typedef void (*PortalProgressCallback_t)(enum PortalStep step, void* userData);
+
+/** Like requestPersistentPipeWireShareFromPortal(), but returns immediately and runs the request on its own thread,
+ * so other setup can overlap with the share dialog. Call PendingShare_finish() to take the result when
+ * PendingShare_getPollFd() becomes readable.
+ * @param onProgress called on the request thread with every step, may be NULL
+ * @param userData passed to onProgress
+ * @return the pending request, or NULL if it could not be started */
+SCW_EXPORT struct PendingShare* requestPipeWireShareFromPortalAsync(enum CursorMode cursorMode, bool multipleSources,
+                                                                    enum PersistMode persistMode,
+                                                                    const char* restoreToken,
+                                                                    PortalProgressCallback_t onProgress, void* userData);
+
+/** Get a file descriptor that becomes readable when the request is done */
+SCW_EXPORT int PendingShare_getPollFd(struct PendingShare* pendingShare);
+
+/** Get the step the request is currently in */
+SCW_EXPORT enum PortalStep PendingShare_getStep(struct PendingShare* pendingShare);
+
+/** Wait until the request is done, then free it.
+ * @return A SharedScreen object on success, or NULL if the request has been cancelled or failed */
+SCW_EXPORT SharedScreen_t* PendingShare_finish(struct PendingShare* pendingShare);
+
+/** Cancel the request, close the share dialog and free the request */
+SCW_EXPORT void PendingShare_free(struct PendingShare* pendingShare);
+
 /** Drop the SharedScreen_t object and close the D-Bus connection.
  * The screen share permission is revoked and the PipeWire stream closed when doing this.
  * @param shareInfo the SharedScreen_t object you want to drop */
 SCW_EXPORT void dropSharedScreen(SharedScreen_t* shareInfo);
 
+/** Get the standard place for the restore token of an application,
+ * $XDG_STATE_HOME/screencapture-wayland/<name>.token
+ * @return the path, which must be freed with free(), or NULL if neither XDG_STATE_HOME nor HOME is set */
+SCW_EXPORT char* getDefaultPortalRestoreTokenPath(const char* name);
+
+/** Read a restore token that has been saved with savePortalRestoreToken().
+ * @return the token, which must be freed with free(), or NULL if there is none or it could not be read */
+SCW_EXPORT char* loadPortalRestoreToken(const char* path);
+
+/** Save a restore token, readable only by the current user. A token can be used only once, so save the new
+ * SharedScreen_t::restoreToken after every request. A NULL or empty token removes the file.
+ * @return 0 on success, or -1 if the file could not be written */
+SCW_EXPORT int savePortalRestoreToken(const char* path, const char* token);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -0,0 +1,99 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#ifndef SCREENCAPTURE_PIPELINE_STATS_H
+#define SCREENCAPTURE_PIPELINE_STATS_H
+
+#include "c_common.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+enum PipelineStats_DropReason
+{
+	PIPELINE_DROP_NO_BUFFER,
+	PIPELINE_DROP_QUEUE_OVERFLOW,
+	PIPELINE_DROP_NON_MONOTONIC_TIMESTAMP,
+	PIPELINE_DROP_REASON_COUNT
+};
+
+enum PipelineStats_Stage
+{
+	PIPELINE_STAGE_CAPTURE,
+	PIPELINE_STAGE_SCALE,
+	PIPELINE_STAGE_ENCODE,
+	PIPELINE_STAGE_MUX,
+	PIPELINE_STAGE_COUNT
+};
+
+#define PIPELINE_HOLD_TIME_BUCKET_COUNT 10
+
+/** The values of one capture pipeline at the time it was retrieved */
+struct PipelineStats_Snapshot
+{
+	/** name of the pipeline, see PipeWireStream_getStatsName() */
+	char name[64];
+	uint64_t framesCaptured;
+	uint64_t framesDelivered;
+	uint64_t framesScaled;
+	uint64_t framesEncoded;
+	uint64_t bytesEncoded;
+	uint64_t bytesMuxed;
+	/** indexed by enum PipelineStats_DropReason */
+	uint64_t framesDropped[PIPELINE_DROP_REASON_COUNT];
+	/** PipeWire buffers currently held by unreleased frames */
+	int64_t buffersHeld;
+	/** encoded bits per second */
+	uint64_t encoderBitrate;
+	/** frames waiting in the queue of each stage, indexed by enum PipelineStats_Stage */
+	int64_t queueDepth[PIPELINE_STAGE_COUNT];
+	/** total time spent processing frames in each stage, indexed by enum PipelineStats_Stage */
+	uint64_t stageNanoseconds[PIPELINE_STAGE_COUNT];
+	/** CPU time used while processing frames in each stage, indexed by enum PipelineStats_Stage */
+	uint64_t stageCpuNanoseconds[PIPELINE_STAGE_COUNT];
+	/** frames copied so their PipeWire buffer could be returned early, see PipeWireStream_setCopyOnHold() */
+	uint64_t framesCopiedOnHold;
+	/** number of PipeWire buffers held for up to 1, 2, 4, 8, 16, 33, 66, 133, 266 and more milliseconds */
+	uint64_t holdTimeBuckets[PIPELINE_HOLD_TIME_BUCKET_COUNT];
+	uint64_t holdTimeSumNanoseconds;
+};
+
+/** Get the values of all pipelines that currently exist.
+ * @param snapshots array that receives up to maxCount entries
+ * @return the number of existing pipelines, which can be larger than maxCount */
+SCW_EXPORT size_t PipelineStats_getAll(struct PipelineStats_Snapshot* snapshots, size_t maxCount);
+
+/** Get the values of the pipeline with the given name.
+ * @return false if there is no such pipeline */
+SCW_EXPORT bool PipelineStats_get(const char* name, struct PipelineStats_Snapshot* snapshot);
+
+/** Format the values of all pipelines in the OpenMetrics text format.
+ * Works like snprintf: at most size bytes including the terminating null byte are written to buffer.
+ * @return the length of the full text, excluding the terminating null byte */
+SCW_EXPORT size_t PipelineStats_formatOpenMetrics(char* buffer, size_t size);
+
+struct PipelineStats_Exporter;
+
+/** Rewrite the file at path with the OpenMetrics text every intervalMs milliseconds.
+ * @return the exporter, or NULL on error, e.g. if intervalMs is 0 */
+SCW_EXPORT struct PipelineStats_Exporter* PipelineStats_exportToFile(const char* path, uint32_t intervalMs);
+
+/** Serve the OpenMetrics text to every client that connects to a Unix socket at path.
+ * @return the exporter, or NULL on error */
+SCW_EXPORT struct PipelineStats_Exporter* PipelineStats_exportToSocket(const char* path);
+
+/** Stop and free an exporter */
+SCW_EXPORT void PipelineStats_stopExporter(struct PipelineStats_Exporter* exporter);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //SCREENCAPTURE_PIPELINE_STATS_H
@@ -6,7 +6,11 @@
 #include <PipeWireModule/PipeWireStream.hpp>
 #include <PortalModule/xdg-desktop-portal.hpp>
 #include <FFMPEGModule/FFmpegOutput.hpp>
+#include <stats.hpp>
+#include <trace.hpp>
 #include <cstdio>
+#include <cstdlib>
+#include <future>
 #include <unistd.h>
 #include <signal.h>
 #include <sys/signalfd.h>
@@ -15,8 +19,16 @@
 
 static void printUsage(const char* argv0)
 {
-	printf("Usage: %s [-c] -f <output format> -o <output path> -d <hardware device path>\n", argv0);
+	printf("Usage: %s [-c] [-n <node id>] [-s <token file>] [-m <metrics file>] [-t <trace file>] [-r <priority>] [-F <max fps>] -f <output format> -o <output path> -d <hardware device path>\n", argv0);
 	puts("\tWhere <hardware device path> is a DRM render node like /dev/dri/renderD128");
+	puts("\tWhere <metrics file> receives pipeline statistics in the OpenMetrics text format every 5 seconds");
+	puts("\tWhere <trace file> receives per-frame trace events in the Chrome trace format on exit or SIGUSR1,"
+	     " for viewing in Perfetto");
+	puts("\tWhere <priority> is a SCHED_FIFO priority for the capture and encoder threads, limited by RLIMIT_RTPRIO");
+	puts("\tWhere <max fps> limits the rate at which the compositor renders frames for the capture");
+	puts("\tWhere <node id> is a PipeWire node on the local daemon to capture instead of asking the portal,"
+	     " e.g. from screencapture-testsrc");
+	puts("\tWhere <token file> stores the portal's restore token, so the share dialog is skipped on the next start");
 	puts("\tWhere <output format> and <output path> can be any string that is recognized by ffmpeg");
 }
 
@@ -58,7 +70,13 @@ int main(int argc, char** argv)
 	char* hardwareDevicePath = nullptr;
 	const char* outputPath = nullptr;
 	const char* outputFormat = nullptr;
-	while ((c = getopt(argc, argv, "co:f:d:")) != -1)
+	std::optional<uint32_t> localNode;
+	const char* metricsPath = nullptr;
+	const char* tracePath = nullptr;
+	const char* tokenPath = nullptr;
+	common::ThreadConfig realtimeThreads;
+	pw::StreamOptions streamOptions;
+	while ((c = getopt(argc, argv, "co:f:d:n:m:t:r:F:s:")) != -1)
 	{
 		switch (c)
 		{
@@ -74,6 +92,25 @@ int main(int argc, char** argv)
 			case 'd':
 				hardwareDevicePath = optarg;
 				break;
+			case 'm':
+				metricsPath = optarg;
+				break;
+			case 'F':
+				streamOptions.maxFramerate = static_cast<unsigned int>(strtoul(optarg, nullptr, 10));
+				break;
+			case 'r':
+				realtimeThreads.policy = common::ThreadConfig::Policy::FIFO;
+				realtimeThreads.priority = atoi(optarg);
+				break;
+			case 't':
+				tracePath = optarg;
+				break;
+			case 'n':
+				localNode = static_cast<uint32_t>(strtoul(optarg, nullptr, 10));
+				break;
+			case 's':
+				tokenPath = optarg;
+				break;
 			case '?':
 				fprintf(stderr, "Unrecognized option: '-%c'\n", optopt);
 				printUsage(argv[0]);
@@ -97,6 +134,7 @@ int main(int argc, char** argv)
 	sigemptyset(&procMask);
 	sigaddset(&procMask, SIGINT);
 	sigaddset(&procMask, SIGTERM);
+	sigaddset(&procMask, SIGUSR1);
 	sigprocmask(SIG_BLOCK, &procMask, nullptr);
 
 	int signalFd = signalfd(-1, &procMask, SFD_CLOEXEC);
@@ -107,28 +145,70 @@ int main(int argc, char** argv)
 	}
 
 	screencapture_wayland_init(&argc, &argv);
+	if (tracePath)
+		trace::start();
 
 	try
 	{
-		auto cursorMode = withCursor ? CURSOR_MODE_EMBED : CURSOR_MODE_HIDDEN;
-		std::optional<portal::SharedScreen> shareInfo = portal::requestPipeWireShare(cursorMode);
+		// the cursor is drawn by the encoder if the compositor supports cursor metadata, and embedded otherwise
+		auto cursorMode = withCursor ? static_cast<CursorMode>(CURSOR_MODE_META | CURSOR_MODE_EMBED) : CURSOR_MODE_HIDDEN;
+		std::optional<portal::SharedScreen> shareInfo;
+		if (localNode)
+			shareInfo = portal::SharedScreen{nullptr, -1, *localNode};
+		else if (tokenPath)
+			shareInfo = portal::requestPipeWireShare(cursorMode, false, PERSIST_MODE_PERSISTENT,
+			                                         portal::loadRestoreToken(tokenPath));
+		else
+			shareInfo = portal::requestPipeWireShare(cursorMode);
 		if (!shareInfo)
 		{
 			printf("User cancelled request\n");
 			return 0;
 		}
+		if (tokenPath)
+		{
+			// the old token has been used up, so replace it even if the portal did not return a new one
+			try
+			{
+				portal::saveRestoreToken(tokenPath, shareInfo->restoreToken);
+			}
+			catch (const std::exception& e)
+			{
+				fprintf(stderr, "Saving the restore token failed: %s\n", e.what());
+			}
+		}
 
 		printf("SharedScreen fd = %d, node = %u\n", shareInfo.value().pipeWireFd, shareInfo.value().pipeWireNode);
 
 
 		{
-			auto pwStream = pw::PipeWireStream(shareInfo.value(), true);
+			auto pwStream = pw::PipeWireStream(shareInfo.value(), true, streamOptions, realtimeThreads);
+			std::optional<stats::Exporter> metricsExporter;
+			if (metricsPath)
+				metricsExporter.emplace(stats::ExportTarget::FILE, metricsPath);
 
 			// this must be declared after and therefore destroyed before pwStream, so that frame processing is stopped
 			// and all references to frames from the stream are dropped before pwStream is destroyed.
 			std::unique_ptr<ffmpeg::FFmpegOutput> ffmpegOutput;
+			// output that is being built in the background from the negotiated format, before the stream starts
+			std::future<ffmpeg::FFmpegOutput> pendingOutput;
+			std::optional<pw::event::FormatNegotiated> pendingFormat;
 			FPSCounter fpsCounter;
 
+			auto makeBuilder = [&] (common::Rect dimensions, common::PixelFormat format, bool isDmaBuf)
+			{
+				auto builder = ffmpeg::FFmpegOutput::Builder(dimensions, format, isDmaBuf);
+				builder
+						.withScaling(common::Rect{1920u, 1080u})
+						.withHWDevice(hardwareDevicePath)
+						.withOutputFormat(outputFormat)
+						.withOutputPath(outputPath)
+						.withStats(pwStream.getStats())
+						.withEncoderThreadConfig(realtimeThreads)
+						.withCursorOverlay(withCursor);
+				return builder;
+			};
+
 			bool shouldStop = false;
 			while (!shouldStop)
 			{
@@ -149,6 +229,8 @@ int main(int argc, char** argv)
 					read(signalFd, &siginfo, sizeof(siginfo));
 					if (siginfo.ssi_signo == SIGINT || siginfo.ssi_signo == SIGTERM)
 						shouldStop = true;
+					else if (siginfo.ssi_signo == SIGUSR1 && tracePath)
+						trace::writeChromeJson(tracePath);
 				}
 				if (!(fds[0].revents & POLLIN))
 					continue;
@@ -157,15 +239,26 @@ int main(int argc, char** argv)
 				{
 					// call lambda function appropriate for the type of *ev
 					std::visit(overloaded{
+							[&] (pw::event::FormatNegotiated& e)
+							{
+								// start opening the encoder now, so it is ready when the first frame arrives
+								// a previous pending output for an outdated format is waited for and dropped here
+								pendingOutput = makeBuilder(e.dimensions, e.format, e.isDmaBuf).buildAsync();
+								pendingFormat = e;
+							},
 							[&] (pw::event::Connected& e)
 							{
-								auto builder = ffmpeg::FFmpegOutput::Builder(e.dimensions, e.format, e.isDmaBuf);
-								builder
-										.withScaling(common::Rect{1920u, 1080u})
-										.withHWDevice(hardwareDevicePath)
-										.withOutputFormat(outputFormat)
-										.withOutputPath(outputPath);
-								ffmpegOutput = std::make_unique<ffmpeg::FFmpegOutput>(builder.build());
+								bool formatMatches = pendingFormat
+										&& pendingFormat->dimensions.w == e.dimensions.w
+										&& pendingFormat->dimensions.h == e.dimensions.h
+										&& pendingFormat->format == e.format
+										&& pendingFormat->isDmaBuf == e.isDmaBuf;
+								if (pendingOutput.valid() && formatMatches)
+									ffmpegOutput = std::make_unique<ffmpeg::FFmpegOutput>(pendingOutput.get());
+								else
+									ffmpegOutput = std::make_unique<ffmpeg::FFmpegOutput>(makeBuilder(e.dimensions, e.format, e.isDmaBuf).build());
+								pendingOutput = {};
+								pendingFormat.reset();
 								// restart the fps counter
 								fpsCounter = FPSCounter();
 							},
@@ -184,12 +277,21 @@ int main(int argc, char** argv)
 								auto avFrame = ffmpeg::wrapInAVFrame(std::move(e.frame));
 								ffmpegOutput->pushFrame(ffmpeg::AVFrame_Heap(avFrame));
 								fpsCounter.increment();
+							},
+							[&] (pw::event::CursorMoved& e)
+							{
+								ffmpegOutput->pushCursor(e.cursor, e.pts);
 							}
 					}, *ev);
 				}
 			}
 		}
 
+		if (tracePath)
+		{
+			trace::stop();
+			trace::writeChromeJson(tracePath);
+		}
 		screencapture_wayland_deinit();
 		close(signalFd);
 		return 0;
@@ -0,0 +1,610 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#include "stats.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std::string_literals;
+
+namespace stats
+{
+
+const char* toString(DropReason r) noexcept
+{
+	switch (r)
+	{
+		case DropReason::NO_BUFFER:
+			return "no_buffer";
+		case DropReason::QUEUE_OVERFLOW:
+			return "queue_overflow";
+		case DropReason::NON_MONOTONIC_TIMESTAMP:
+			return "non_monotonic_timestamp";
+		case DropReason::COUNT:
+			break;
+	}
+	return "unknown";
+}
+
+const char* toString(Stage s) noexcept
+{
+	switch (s)
+	{
+		case Stage::CAPTURE:
+			return "capture";
+		case Stage::SCALE:
+			return "scale";
+		case Stage::ENCODE:
+			return "encode";
+		case Stage::MUX:
+			return "mux";
+		case Stage::COUNT:
+			break;
+	}
+	return "unknown";
+}
+
+double cpuMillisecondsPerFrame(const Snapshot& s, Stage stage) noexcept
+{
+	uint64_t frames = 0;
+	switch (stage)
+	{
+		case Stage::CAPTURE:
+			frames = s.framesCaptured;
+			break;
+		case Stage::SCALE:
+			frames = s.framesScaled;
+			break;
+		case Stage::ENCODE:
+		case Stage::MUX:
+			// one packet per frame
+			frames = s.framesEncoded;
+			break;
+		case Stage::COUNT:
+			return 0;
+	}
+	if (frames == 0)
+		return 0;
+	return static_cast<double>(s.stageCpuNanoseconds[static_cast<unsigned>(stage)]) / 1e6 / static_cast<double>(frames);
+}
+
+std::chrono::nanoseconds currentThreadCpuTime() noexcept
+{
+	timespec t;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t) != 0)
+		return std::chrono::nanoseconds(0);
+	return std::chrono::seconds(t.tv_sec) + std::chrono::nanoseconds(t.tv_nsec);
+}
+
+std::vector<ThreadCpuTime> internalThreadCpuTimes()
+{
+	std::vector<ThreadCpuTime> threads;
+	DIR* tasks = opendir("/proc/self/task");
+	if (!tasks)
+		return threads;
+	while (dirent* entry = readdir(tasks))
+	{
+		if (entry->d_name[0] == '.')
+			continue;
+		pid_t tid = static_cast<pid_t>(strtol(entry->d_name, nullptr, 10));
+
+		char path[64];
+		snprintf(path, sizeof(path), "/proc/self/task/%d/comm", tid);
+		FILE* f = fopen(path, "re");
+		if (!f)
+			continue;
+		char name[32] = {};
+		bool ok = fgets(name, sizeof(name), f) != nullptr;
+		fclose(f);
+		if (!ok || strncmp(name, "scw-", 4) != 0)
+			continue;
+		name[strcspn(name, "\n")] = '\0';
+
+		// the CPU clock of another thread of this process, like pthread_getcpuclockid() builds it from the thread ID
+		clockid_t clock = (~static_cast<clockid_t>(tid) << 3) | 6;
+		timespec t;
+		if (clock_gettime(clock, &t) != 0)
+			continue;
+		threads.push_back({name, tid, std::chrono::seconds(t.tv_sec) + std::chrono::nanoseconds(t.tv_nsec)});
+	}
+	closedir(tasks);
+	return threads;
+}
+
+// registration only happens when a pipeline is created, so a mutex is fine here
+static std::mutex registryMutex;
+static std::vector<std::weak_ptr<PipelineStats>> registry;
+static uint64_t nextPipelineNumber = 1;
+
+PipelineStats::PipelineStats(std::string name) noexcept
+: name(std::move(name))
+{}
+
+std::shared_ptr<PipelineStats> PipelineStats::create(std::string name)
+{
+	std::lock_guard lock(registryMutex);
+	if (name.empty())
+		name = "pipeline-" + std::to_string(nextPipelineNumber++);
+	std::shared_ptr<PipelineStats> p(new PipelineStats(std::move(name)));
+	// drop entries of destroyed pipelines while we are at it
+	registry.erase(std::remove_if(registry.begin(), registry.end(), [] (auto& w) { return w.expired(); }),
+	               registry.end());
+	registry.push_back(p);
+	return p;
+}
+
+std::shared_ptr<PipelineStats> PipelineStats::find(std::string_view name)
+{
+	std::lock_guard lock(registryMutex);
+	for (auto& w : registry)
+	{
+		auto p = w.lock();
+		if (p && p->name == name)
+			return p;
+	}
+	return nullptr;
+}
+
+Snapshot PipelineStats::snapshot() const noexcept
+{
+	constexpr auto r = std::memory_order_relaxed;
+	Snapshot s{};
+	s.name = name;
+	s.framesCaptured = framesCaptured.load(r);
+	s.framesDelivered = framesDelivered.load(r);
+	s.framesScaled = framesScaled.load(r);
+	s.framesEncoded = framesEncoded.load(r);
+	s.bytesEncoded = bytesEncoded.load(r);
+	s.bytesMuxed = bytesMuxed.load(r);
+	for (unsigned i = 0; i < static_cast<unsigned>(DropReason::COUNT); ++i)
+		s.framesDropped[i] = framesDropped[i].load(r);
+	s.buffersHeld = buffersHeld.load(r);
+	s.encoderBitrate = encoderBitrate.load(r);
+	for (unsigned i = 0; i < static_cast<unsigned>(Stage::COUNT); ++i)
+	{
+		s.queueDepth[i] = stages[i].queueDepth.load(r);
+		s.stageNanoseconds[i] = stages[i].busyNanoseconds.load(r);
+		s.stageCpuNanoseconds[i] = stages[i].cpuNanoseconds.load(r);
+	}
+	s.framesCopiedOnHold = framesCopiedOnHold.load(r);
+	for (unsigned i = 0; i < HOLD_TIME_BUCKET_COUNT; ++i)
+		s.holdTimeBuckets[i] = holdTimeBuckets[i].load(r);
+	s.holdTimeSumNanoseconds = holdTimeSumNanoseconds.load(r);
+	return s;
+}
+
+std::vector<Snapshot> allPipelines()
+{
+	std::vector<std::shared_ptr<PipelineStats>> alive;
+	{
+		std::lock_guard lock(registryMutex);
+		for (auto& w : registry)
+			if (auto p = w.lock())
+				alive.push_back(std::move(p));
+	}
+	std::vector<Snapshot> snapshots;
+	snapshots.reserve(alive.size());
+	for (auto& p : alive)
+		snapshots.push_back(p->snapshot());
+	return snapshots;
+}
+
+static std::string escapeLabel(const std::string& value)
+{
+	std::string escaped;
+	for (char c : value)
+	{
+		if (c == '\\' || c == '"')
+			escaped += '\\';
+		if (c == '\n')
+		{
+			escaped += "\\n";
+			continue;
+		}
+		escaped += c;
+	}
+	return escaped;
+}
+
+std::string formatOpenMetrics()
+{
+	auto pipelines = allPipelines();
+	std::string out;
+	char line[256];
+
+	auto family = [&] (const char* name, const char* type, const char* help)
+	{
+		snprintf(line, sizeof(line), "# TYPE screencapture_%s %s\n# HELP screencapture_%s %s\n", name, type, name, help);
+		out += line;
+	};
+	auto counter = [&] (const char* name, const char* help, uint64_t Snapshot::* field)
+	{
+		family(name, "counter", help);
+		for (auto& p : pipelines)
+		{
+			snprintf(line, sizeof(line), "screencapture_%s_total{pipeline=\"%s\"} %" PRIu64 "\n",
+			         name, escapeLabel(p.name).c_str(), p.*field);
+			out += line;
+		}
+	};
+
+	counter("frames_captured", "Buffers dequeued from PipeWire", &Snapshot::framesCaptured);
+	counter("frames_delivered", "Frames handed to the application", &Snapshot::framesDelivered);
+	counter("frames_scaled", "Frames converted by the scaler", &Snapshot::framesScaled);
+	counter("frames_encoded", "Packets produced by the encoder", &Snapshot::framesEncoded);
+	counter("encoded_bytes", "Bytes produced by the encoder", &Snapshot::bytesEncoded);
+	counter("muxed_bytes", "Bytes of packets written to the muxer", &Snapshot::bytesMuxed);
+	counter("frames_copied_on_hold", "Frames copied to return their PipeWire buffer early", &Snapshot::framesCopiedOnHold);
+
+	family("frames_dropped", "counter", "Frames dropped before being encoded");
+	for (auto& p : pipelines)
+		for (unsigned i = 0; i < static_cast<unsigned>(DropReason::COUNT); ++i)
+		{
+			snprintf(line, sizeof(line), "screencapture_frames_dropped_total{pipeline=\"%s\",reason=\"%s\"} %" PRIu64 "\n",
+			         escapeLabel(p.name).c_str(), toString(static_cast<DropReason>(i)), p.framesDropped[i]);
+			out += line;
+		}
+
+	family("buffers_held", "gauge", "PipeWire buffers held by unreleased frames");
+	for (auto& p : pipelines)
+	{
+		snprintf(line, sizeof(line), "screencapture_buffers_held{pipeline=\"%s\"} %" PRIi64 "\n",
+		         escapeLabel(p.name).c_str(), p.buffersHeld);
+		out += line;
+	}
+
+	family("buffer_hold_seconds", "histogram", "Time a PipeWire buffer was held before it was returned");
+	for (auto& p : pipelines)
+	{
+		uint64_t cumulative = 0;
+		for (unsigned i = 0; i < HOLD_TIME_BUCKET_COUNT; ++i)
+		{
+			cumulative += p.holdTimeBuckets[i];
+			char bound[16];
+			if (i < HOLD_TIME_BUCKET_COUNT - 1)
+				snprintf(bound, sizeof(bound), "%g", HOLD_TIME_BUCKET_BOUNDS_MS[i] / 1000);
+			else
+				snprintf(bound, sizeof(bound), "+Inf");
+			snprintf(line, sizeof(line), "screencapture_buffer_hold_seconds_bucket{pipeline=\"%s\",le=\"%s\"} %" PRIu64 "\n",
+			         escapeLabel(p.name).c_str(), bound, cumulative);
+			out += line;
+		}
+		snprintf(line, sizeof(line), "screencapture_buffer_hold_seconds_count{pipeline=\"%s\"} %" PRIu64 "\n"
+		                             "screencapture_buffer_hold_seconds_sum{pipeline=\"%s\"} %.6f\n",
+		         escapeLabel(p.name).c_str(), cumulative,
+		         escapeLabel(p.name).c_str(), static_cast<double>(p.holdTimeSumNanoseconds) / 1e9);
+		out += line;
+	}
+
+	family("encoder_bitrate_bits_per_second", "gauge", "Encoded bitrate over the last second of stream time");
+	for (auto& p : pipelines)
+	{
+		snprintf(line, sizeof(line), "screencapture_encoder_bitrate_bits_per_second{pipeline=\"%s\"} %" PRIu64 "\n",
+		         escapeLabel(p.name).c_str(), p.encoderBitrate);
+		out += line;
+	}
+
+	family("queue_depth", "gauge", "Frames waiting for a stage");
+	for (auto& p : pipelines)
+		for (unsigned i = 0; i < static_cast<unsigned>(Stage::COUNT); ++i)
+		{
+			snprintf(line, sizeof(line), "screencapture_queue_depth{pipeline=\"%s\",stage=\"%s\"} %" PRIi64 "\n",
+			         escapeLabel(p.name).c_str(), toString(static_cast<Stage>(i)), p.queueDepth[i]);
+			out += line;
+		}
+
+	family("stage_busy_seconds", "counter", "Time spent processing frames in a stage");
+	for (auto& p : pipelines)
+		for (unsigned i = 0; i < static_cast<unsigned>(Stage::COUNT); ++i)
+		{
+			snprintf(line, sizeof(line), "screencapture_stage_busy_seconds_total{pipeline=\"%s\",stage=\"%s\"} %.6f\n",
+			         escapeLabel(p.name).c_str(), toString(static_cast<Stage>(i)),
+			         static_cast<double>(p.stageNanoseconds[i]) / 1e9);
+			out += line;
+		}
+
+	family("stage_cpu_seconds", "counter", "CPU time used by the threads of a stage while processing frames");
+	for (auto& p : pipelines)
+		for (unsigned i = 0; i < static_cast<unsigned>(Stage::COUNT); ++i)
+		{
+			snprintf(line, sizeof(line), "screencapture_stage_cpu_seconds_total{pipeline=\"%s\",stage=\"%s\"} %.6f\n",
+			         escapeLabel(p.name).c_str(), toString(static_cast<Stage>(i)),
+			         static_cast<double>(p.stageCpuNanoseconds[i]) / 1e9);
+			out += line;
+		}
+
+	family("stage_cpu_milliseconds_per_frame", "gauge", "Average CPU time a stage used per frame");
+	for (auto& p : pipelines)
+		for (unsigned i = 0; i < static_cast<unsigned>(Stage::COUNT); ++i)
+		{
+			snprintf(line, sizeof(line), "screencapture_stage_cpu_milliseconds_per_frame{pipeline=\"%s\",stage=\"%s\"} %.4f\n",
+			         escapeLabel(p.name).c_str(), toString(static_cast<Stage>(i)),
+			         cpuMillisecondsPerFrame(p, static_cast<Stage>(i)));
+			out += line;
+		}
+
+	family("thread_cpu_seconds", "counter", "CPU time used by an internal thread of the library");
+	for (auto& t : internalThreadCpuTimes())
+	{
+		snprintf(line, sizeof(line), "screencapture_thread_cpu_seconds_total{thread=\"%s\",tid=\"%d\"} %.6f\n",
+		         escapeLabel(t.name).c_str(), t.tid, static_cast<double>(t.cpuTime.count()) / 1e9);
+		out += line;
+	}
+
+	out += "# EOF\n";
+	return out;
+}
+
+
+Exporter::Exporter(ExportTarget target, std::string path, std::chrono::milliseconds interval)
+: target(target),
+  path(std::move(path)),
+  interval(interval),
+  listenFd(-1),
+  stopFd(-1)
+{
+	// a poll timeout of 0 would rewrite the file in a busy loop
+	if (target == ExportTarget::FILE && interval.count() <= 0)
+		throw std::runtime_error("Metrics export interval must be positive");
+	stopFd = eventfd(0, EFD_CLOEXEC);
+	if (stopFd == -1)
+		throw std::runtime_error("eventfd creation failed: "s + strerror(errno));
+
+	if (target == ExportTarget::UNIX_SOCKET)
+	{
+		sockaddr_un addr{};
+		addr.sun_family = AF_UNIX;
+		if (this->path.size() >= sizeof(addr.sun_path))
+		{
+			close(stopFd);
+			throw std::runtime_error("Socket path too long: " + this->path);
+		}
+		std::memcpy(addr.sun_path, this->path.c_str(), this->path.size() + 1);
+		// remove a stale socket left behind by a previous process, but nothing else that happens to be at the path
+		struct stat st;
+		if (lstat(this->path.c_str(), &st) == 0)
+		{
+			if (!S_ISSOCK(st.st_mode))
+			{
+				close(stopFd);
+				throw std::runtime_error("Metrics socket path " + this->path + " exists and is not a socket");
+			}
+			unlink(this->path.c_str());
+		}
+		listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+		if (listenFd == -1
+		    || bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1
+		    || listen(listenFd, 8) == -1)
+		{
+			int err = errno;
+			if (listenFd != -1)
+				close(listenFd);
+			close(stopFd);
+			throw std::runtime_error("Creating metrics socket " + this->path + " failed: " + strerror(err));
+		}
+	}
+
+	thread = std::thread([this] ()
+	{
+		common::setCurrentThreadName("scw-stats");
+		run();
+	});
+}
+
+Exporter::~Exporter() noexcept
+{
+	uint64_t one = 1;
+	write(stopFd, &one, sizeof(one));
+	if (thread.joinable())
+		thread.join();
+	if (listenFd != -1)
+	{
+		close(listenFd);
+		unlink(path.c_str());
+	}
+	close(stopFd);
+}
+
+void Exporter::writeFile() noexcept
+{
+	// write to a temporary file and rename it, so readers never see a partial file
+	std::string tmpPath = path + ".tmp";
+	FILE* f = fopen(tmpPath.c_str(), "we");
+	if (!f)
+	{
+		fprintf(stderr, "Writing metrics to %s failed: %s\n", tmpPath.c_str(), strerror(errno));
+		return;
+	}
+	std::string text = formatOpenMetrics();
+	bool ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+	ok = fclose(f) == 0 && ok;
+	if (!ok || rename(tmpPath.c_str(), path.c_str()) == -1)
+	{
+		fprintf(stderr, "Writing metrics to %s failed: %s\n", path.c_str(), strerror(errno));
+		unlink(tmpPath.c_str());
+	}
+}
+
+void Exporter::run() noexcept
+{
+	try
+	{
+		while (true)
+		{
+			pollfd fds[2] = {{stopFd, POLLIN, 0}, {listenFd, POLLIN, 0}};
+			int timeout = target == ExportTarget::FILE ? static_cast<int>(interval.count()) : -1;
+			if (target == ExportTarget::FILE)
+				writeFile();
+			int r = poll(fds, listenFd != -1 ? 2 : 1, timeout);
+			if (r == -1 && errno != EINTR)
+			{
+				perror("Metrics export: poll failed");
+				break;
+			}
+			if (fds[0].revents & POLLIN)
+			{
+				if (target == ExportTarget::FILE)
+					writeFile();
+				break;
+			}
+			if (listenFd != -1 && (fds[1].revents & POLLIN))
+			{
+				int client = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+				if (client == -1)
+					continue;
+				// clients read the whole text until we close the connection, like a scrape over HTTP
+				std::string text = formatOpenMetrics();
+				size_t written = 0;
+				while (written < text.size())
+				{
+					ssize_t n = send(client, text.data() + written, text.size() - written, MSG_NOSIGNAL);
+					if (n <= 0)
+						break;
+					written += static_cast<size_t>(n);
+				}
+				close(client);
+			}
+		}
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "Metrics export failed: %s\n", e.what());
+	}
+}
+
+}
+
+
+// C interface
+#include <pipeline-stats.h>
+
+static void toCSnapshot(const stats::Snapshot& s, PipelineStats_Snapshot* c) noexcept
+{
+	snprintf(c->name, sizeof(c->name), "%s", s.name.c_str());
+	c->framesCaptured = s.framesCaptured;
+	c->framesDelivered = s.framesDelivered;
+	c->framesScaled = s.framesScaled;
+	c->framesEncoded = s.framesEncoded;
+	c->bytesEncoded = s.bytesEncoded;
+	c->bytesMuxed = s.bytesMuxed;
+	static_assert(PIPELINE_DROP_REASON_COUNT == static_cast<unsigned>(stats::DropReason::COUNT));
+	std::copy(std::begin(s.framesDropped), std::end(s.framesDropped), c->framesDropped);
+	c->buffersHeld = s.buffersHeld;
+	c->encoderBitrate = s.encoderBitrate;
+	static_assert(PIPELINE_STAGE_COUNT == static_cast<unsigned>(stats::Stage::COUNT));
+	std::copy(std::begin(s.queueDepth), std::end(s.queueDepth), c->queueDepth);
+	std::copy(std::begin(s.stageNanoseconds), std::end(s.stageNanoseconds), c->stageNanoseconds);
+	std::copy(std::begin(s.stageCpuNanoseconds), std::end(s.stageCpuNanoseconds), c->stageCpuNanoseconds);
+	c->framesCopiedOnHold = s.framesCopiedOnHold;
+	static_assert(PIPELINE_HOLD_TIME_BUCKET_COUNT == stats::HOLD_TIME_BUCKET_COUNT);
+	std::copy(std::begin(s.holdTimeBuckets), std::end(s.holdTimeBuckets), c->holdTimeBuckets);
+	c->holdTimeSumNanoseconds = s.holdTimeSumNanoseconds;
+}
+
+size_t PipelineStats_getAll(struct PipelineStats_Snapshot* snapshots, size_t maxCount)
+{
+	try
+	{
+		auto all = stats::allPipelines();
+		for (size_t i = 0; i < std::min(all.size(), maxCount); ++i)
+			toCSnapshot(all[i], &snapshots[i]);
+		return all.size();
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return 0;
+	}
+}
+
+bool PipelineStats_get(const char* name, struct PipelineStats_Snapshot* snapshot)
+{
+	try
+	{
+		auto p = stats::PipelineStats::find(name);
+		if (!p)
+			return false;
+		toCSnapshot(p->snapshot(), snapshot);
+		return true;
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return false;
+	}
+}
+
+size_t PipelineStats_formatOpenMetrics(char* buffer, size_t size)
+{
+	try
+	{
+		std::string text = stats::formatOpenMetrics();
+		if (size > 0)
+			snprintf(buffer, size, "%s", text.c_str());
+		return text.size();
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		if (size > 0)
+			buffer[0] = '\0';
+		return 0;
+	}
+}
+
+struct PipelineStats_Exporter
+{
+	stats::Exporter cppExporter;
+};
+
+struct PipelineStats_Exporter* PipelineStats_exportToFile(const char* path, uint32_t intervalMs)
+{
+	try
+	{
+		return new PipelineStats_Exporter {
+			{stats::ExportTarget::FILE, path, std::chrono::milliseconds(intervalMs)}
+		};
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return nullptr;
+	}
+}
+
+struct PipelineStats_Exporter* PipelineStats_exportToSocket(const char* path)
+{
+	try
+	{
+		return new PipelineStats_Exporter {
+			{stats::ExportTarget::UNIX_SOCKET, path}
+		};
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return nullptr;
+	}
+}
+
+void PipelineStats_stopExporter(struct PipelineStats_Exporter* exporter)
+{
+	delete exporter;
+}
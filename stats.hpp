@@ -0,0 +1,259 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#ifndef SCREENCAPTURE_STATS_HPP
+#define SCREENCAPTURE_STATS_HPP
+
+#include "common.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iterator> // size
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <sys/types.h> // pid_t
+
+namespace stats
+{
+
+enum class DropReason : unsigned
+{
+	/** PipeWire had a frame, but all buffers were still held by the consumer */
+	NO_BUFFER,
+	/** a stage queue was full and discarded its oldest frame */
+	QUEUE_OVERFLOW,
+	/** the muxer requires strictly increasing timestamps */
+	NON_MONOTONIC_TIMESTAMP,
+	COUNT
+};
+
+enum class Stage : unsigned
+{
+	CAPTURE,
+	SCALE,
+	ENCODE,
+	MUX,
+	COUNT
+};
+
+/** Upper bounds in milliseconds of the buckets of the buffer hold time histogram.
+ * The last bucket, for longer hold times, has no bound. */
+inline constexpr double HOLD_TIME_BUCKET_BOUNDS_MS[] = {1, 2, 4, 8, 16, 33, 66, 133, 266};
+inline constexpr unsigned HOLD_TIME_BUCKET_COUNT = std::size(HOLD_TIME_BUCKET_BOUNDS_MS) + 1;
+
+SCW_EXPORT const char* toString(DropReason r) noexcept;
+SCW_EXPORT const char* toString(Stage s) noexcept;
+
+/** A consistent-enough copy of all values of a PipelineStats, see PipelineStats::snapshot() */
+struct Snapshot
+{
+	std::string name;
+	uint64_t framesCaptured;
+	uint64_t framesDelivered;
+	uint64_t framesScaled;
+	uint64_t framesEncoded;
+	uint64_t bytesEncoded;
+	uint64_t bytesMuxed;
+	uint64_t framesDropped[static_cast<unsigned>(DropReason::COUNT)];
+	int64_t buffersHeld;
+	uint64_t encoderBitrate;
+	int64_t queueDepth[static_cast<unsigned>(Stage::COUNT)];
+	uint64_t stageNanoseconds[static_cast<unsigned>(Stage::COUNT)];
+	/** CPU time of the threads while processing frames in each stage */
+	uint64_t stageCpuNanoseconds[static_cast<unsigned>(Stage::COUNT)];
+	uint64_t framesCopiedOnHold;
+	/** number of PipeWire buffers that were held for a time within each bucket, see HOLD_TIME_BUCKET_BOUNDS_MS */
+	uint64_t holdTimeBuckets[HOLD_TIME_BUCKET_COUNT];
+	uint64_t holdTimeSumNanoseconds;
+};
+
+/** Average CPU time a stage spent on a frame, in milliseconds, or 0 if the stage has not processed a frame yet */
+SCW_EXPORT double cpuMillisecondsPerFrame(const Snapshot& s, Stage stage) noexcept;
+
+/** Counters and gauges of one capture pipeline (a PipeWireStream and the outputs its frames are pushed into).
+ *
+ * All values are atomics that are updated with relaxed ordering from the threads of the pipeline, so updating them
+ * never blocks. Readers get a snapshot of independently loaded values, which is good enough for monitoring.
+ * Create instances with create(), so they are visible to allPipelines() and the exporter. */
+class PipelineStats
+{
+	struct StageStats
+	{
+		std::atomic<int64_t> queueDepth{0};
+		std::atomic<uint64_t> busyNanoseconds{0};
+		std::atomic<uint64_t> cpuNanoseconds{0};
+	};
+
+	const std::string name;
+	StageStats stages[static_cast<unsigned>(Stage::COUNT)];
+	std::atomic<uint64_t> framesDropped[static_cast<unsigned>(DropReason::COUNT)] = {};
+	std::atomic<uint64_t> holdTimeBuckets[HOLD_TIME_BUCKET_COUNT] = {};
+	std::atomic<uint64_t> holdTimeSumNanoseconds{0};
+
+	explicit PipelineStats(std::string name) noexcept;
+
+public:
+	/** buffers dequeued from PipeWire */
+	std::atomic<uint64_t> framesCaptured{0};
+	/** frames handed to the application through PipeWireStream::nextEvent() */
+	std::atomic<uint64_t> framesDelivered{0};
+	std::atomic<uint64_t> framesScaled{0};
+	/** encoded packets */
+	std::atomic<uint64_t> framesEncoded{0};
+	std::atomic<uint64_t> bytesEncoded{0};
+	std::atomic<uint64_t> bytesMuxed{0};
+	/** PipeWire buffers currently held by frames that have not been released */
+	std::atomic<int64_t> buffersHeld{0};
+	/** encoded bits per second, measured over the last second of stream time */
+	std::atomic<uint64_t> encoderBitrate{0};
+	/** frames copied so their PipeWire buffer could be returned before the application released them */
+	std::atomic<uint64_t> framesCopiedOnHold{0};
+
+	/** Create a new pipeline and register it.
+	 * @param name Label of the pipeline in exported metrics. If empty, a unique name like "pipeline-1" is chosen. */
+	SCW_EXPORT static std::shared_ptr<PipelineStats> create(std::string name = {});
+
+	/** Find a registered pipeline that is still alive by its name
+	 * @return the pipeline, or nullptr if there is none with this name */
+	SCW_EXPORT static std::shared_ptr<PipelineStats> find(std::string_view name);
+
+	SCW_EXPORT const std::string& getName() const noexcept { return name; }
+
+	SCW_EXPORT void drop(DropReason r) noexcept
+	{
+		framesDropped[static_cast<unsigned>(r)].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	SCW_EXPORT void addQueueDepth(Stage s, int64_t delta) noexcept
+	{
+		stages[static_cast<unsigned>(s)].queueDepth.fetch_add(delta, std::memory_order_relaxed);
+	}
+
+	SCW_EXPORT int64_t getQueueDepth(Stage s) const noexcept
+	{
+		return stages[static_cast<unsigned>(s)].queueDepth.load(std::memory_order_relaxed);
+	}
+
+	SCW_EXPORT uint64_t getDropped(DropReason r) const noexcept
+	{
+		return framesDropped[static_cast<unsigned>(r)].load(std::memory_order_relaxed);
+	}
+
+	SCW_EXPORT void addBusyTime(Stage s, std::chrono::nanoseconds t) noexcept
+	{
+		stages[static_cast<unsigned>(s)].busyNanoseconds.fetch_add(static_cast<uint64_t>(t.count()), std::memory_order_relaxed);
+	}
+
+	SCW_EXPORT void addCpuTime(Stage s, std::chrono::nanoseconds t) noexcept
+	{
+		stages[static_cast<unsigned>(s)].cpuNanoseconds.fetch_add(static_cast<uint64_t>(t.count()), std::memory_order_relaxed);
+	}
+
+	/** Count the time from dequeuing a PipeWire buffer until it was queued back */
+	SCW_EXPORT void recordHoldTime(std::chrono::nanoseconds t) noexcept
+	{
+		double ms = std::chrono::duration<double, std::milli>(t).count();
+		unsigned bucket = 0;
+		while (bucket < HOLD_TIME_BUCKET_COUNT - 1 && ms > HOLD_TIME_BUCKET_BOUNDS_MS[bucket])
+			++bucket;
+		holdTimeBuckets[bucket].fetch_add(1, std::memory_order_relaxed);
+		holdTimeSumNanoseconds.fetch_add(static_cast<uint64_t>(t.count()), std::memory_order_relaxed);
+	}
+
+	SCW_EXPORT Snapshot snapshot() const noexcept;
+};
+
+/** CPU time the calling thread has used so far (CLOCK_THREAD_CPUTIME_ID) */
+SCW_EXPORT std::chrono::nanoseconds currentThreadCpuTime() noexcept;
+
+/** Measures the time from construction to destruction as busy time of a stage,
+ * and the CPU time the current thread used in between as CPU time of that stage */
+class StageTimer
+{
+	PipelineStats* stats;
+	Stage stage;
+	std::chrono::steady_clock::time_point start;
+	std::chrono::nanoseconds cpuStart;
+
+public:
+	StageTimer(PipelineStats* stats, Stage stage) noexcept
+	: stats(stats),
+	  stage(stage),
+	  start(stats ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{}),
+	  cpuStart(stats ? currentThreadCpuTime() : std::chrono::nanoseconds{})
+	{}
+
+	~StageTimer() noexcept
+	{
+		if (stats)
+		{
+			stats->addBusyTime(stage, std::chrono::steady_clock::now() - start);
+			stats->addCpuTime(stage, currentThreadCpuTime() - cpuStart);
+		}
+	}
+};
+
+/** CPU time used by one internal thread of the library */
+struct ThreadCpuTime
+{
+	std::string name;
+	pid_t tid;
+	std::chrono::nanoseconds cpuTime;
+};
+
+/** Sample the CPU time of all threads of this process whose name starts with "scw-",
+ * see common::setCurrentThreadName() */
+SCW_EXPORT std::vector<ThreadCpuTime> internalThreadCpuTimes();
+
+/** Get snapshots of all registered pipelines that are still alive */
+SCW_EXPORT std::vector<Snapshot> allPipelines();
+
+/** Format the values of all pipelines in the OpenMetrics text format, including the terminating "# EOF" line */
+SCW_EXPORT std::string formatOpenMetrics();
+
+enum class ExportTarget
+{
+	/** rewrite a file periodically, e.g. for the node_exporter textfile collector */
+	FILE,
+	/** listen on a Unix socket and write the current metrics to every client that connects */
+	UNIX_SOCKET,
+};
+
+/** Exports the metrics of all pipelines in the OpenMetrics text format from a background thread */
+class Exporter
+{
+	ExportTarget target;
+	std::string path;
+	std::chrono::milliseconds interval;
+	int listenFd;
+	int stopFd;
+	std::thread thread;
+
+	void run() noexcept;
+	void writeFile() noexcept;
+
+public:
+	/** Start exporting.
+	 * @param target where to export to
+	 * @param path path of the file or Unix socket. A file is replaced atomically, an existing socket file is removed.
+	 * @param interval how often a file is rewritten, must be positive. Unused for sockets.
+	 * @throw std::runtime_error if the interval of a file is not positive, or the socket can't be created, e.g.
+	 *     because something else than a socket exists at the path */
+	SCW_EXPORT Exporter(ExportTarget target, std::string path,
+	                    std::chrono::milliseconds interval = std::chrono::seconds(5));
+
+	Exporter(const Exporter&) = delete;
+	Exporter& operator=(const Exporter&) = delete;
+
+	/** Stop the export thread. A file is written one last time, a socket is removed. */
+	SCW_EXPORT ~Exporter() noexcept;
+};
+
+}
+
+#endif //SCREENCAPTURE_STATS_HPP
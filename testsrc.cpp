@@ -0,0 +1,124 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#include <PipeWireModule/TestSource.hpp>
+#include <c_common.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <cerrno>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+
+
+static void printUsage(const char* argv0)
+{
+	printf("Usage: %s [-s <width>x<height>] [-r <framerate>] [-p static|text|noise] [-f BGRX|BGRA|RGBX|RGBA] [-D] [-c]\n", argv0);
+	puts("\t-D disables damage metadata, -c enables cursor metadata");
+	puts("\tThe node ID of the stream is printed on stdout once it is available, pass it to screencapture -n");
+}
+
+int main(int argc, char** argv)
+{
+	pw::TestSourceOptions options;
+	int c;
+	while ((c = getopt(argc, argv, "s:r:p:f:Dc")) != -1)
+	{
+		switch (c)
+		{
+			case 's':
+				if (sscanf(optarg, "%ux%u", &options.size.w, &options.size.h) != 2)
+				{
+					fprintf(stderr, "Invalid size: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'r':
+				options.framerate = static_cast<uint32_t>(strtoul(optarg, nullptr, 10));
+				break;
+			case 'p':
+				if (strcmp(optarg, "static") == 0)
+					options.pattern = pw::TestPattern::STATIC;
+				else if (strcmp(optarg, "text") == 0)
+					options.pattern = pw::TestPattern::SCROLLING_TEXT;
+				else if (strcmp(optarg, "noise") == 0)
+					options.pattern = pw::TestPattern::NOISE;
+				else
+				{
+					fprintf(stderr, "Unknown pattern: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'f':
+				if (strcmp(optarg, "BGRX") == 0)
+					options.format = common::PixelFormat::BGRX;
+				else if (strcmp(optarg, "BGRA") == 0)
+					options.format = common::PixelFormat::BGRA;
+				else if (strcmp(optarg, "RGBX") == 0)
+					options.format = common::PixelFormat::RGBX;
+				else if (strcmp(optarg, "RGBA") == 0)
+					options.format = common::PixelFormat::RGBA;
+				else
+				{
+					fprintf(stderr, "Unknown pixel format: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'D':
+				options.withDamage = false;
+				break;
+			case 'c':
+				options.withCursor = true;
+				break;
+			case '?':
+				fprintf(stderr, "Unrecognized option: '-%c'\n", optopt);
+				printUsage(argv[0]);
+				return 1;
+		}
+	}
+	if (options.framerate == 0)
+	{
+		fprintf(stderr, "Frame rate must be greater than zero\n");
+		return 1;
+	}
+
+	sigset_t procMask;
+	sigemptyset(&procMask);
+	sigaddset(&procMask, SIGINT);
+	sigaddset(&procMask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &procMask, nullptr);
+
+	int signalFd = signalfd(-1, &procMask, SFD_CLOEXEC);
+	if (signalFd == -1)
+	{
+		perror("creating signalfd failed");
+		return 1;
+	}
+
+	screencapture_wayland_init(&argc, &argv);
+
+	try
+	{
+		pw::TestSource source(options);
+		printf("%u\n", source.getNodeId());
+		fflush(stdout);
+
+		// run until we are told to stop, the source produces frames in its own thread
+		signalfd_siginfo siginfo;
+		while (read(signalFd, &siginfo, sizeof(siginfo)) == -1 && errno == EINTR)
+			;
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		screencapture_wayland_deinit();
+		return 1;
+	}
+	screencapture_wayland_deinit();
+	close(signalFd);
+	return 0;
+}
@@ -0,0 +1,266 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#include "trace.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <ctime>
+#include <pthread.h>
+#include <unistd.h>
+
+namespace trace
+{
+
+namespace
+{
+
+/** A slot of the ring buffer. The owning thread may overwrite it while it is read, so it is guarded like a seqlock:
+ * #sequence is 0 while the slot is written, and the index of the event plus one afterwards. */
+struct Event
+{
+	std::atomic<uint64_t> sequence{0};
+	std::atomic<const char*> name{nullptr};
+	std::atomic<int64_t> timestamp{0};
+	std::atomic<int64_t> frameId{0};
+	std::atomic<char> phase{0};
+};
+
+/** Events of a single thread. Only the owning thread writes, readers synchronize through the head index and the
+ * sequence of each event. The owning thread resets the buffer for a new trace under buffersMutex. */
+struct ThreadBuffer
+{
+	std::unique_ptr<Event[]> events;
+	size_t capacity;
+	std::atomic<uint64_t> head{0};
+	/** the trace the events belong to */
+	uint64_t generation;
+	/** cleared when the owning thread exits, so the buffer can be freed by the next start() */
+	std::atomic<bool> isAlive{true};
+	pid_t tid;
+	char threadName[16];
+};
+
+std::mutex buffersMutex;
+// buffers of exited threads are kept until the next start(), so those threads still show up in the trace
+std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+size_t bufferCapacity = 1 << 16;
+// incremented by start(), so threads notice that their buffer belongs to an old trace
+std::atomic<uint64_t> generation{0};
+
+/** The buffer of the current thread, which is marked as unused when the thread exits */
+struct BufferOwner
+{
+	ThreadBuffer* buffer = nullptr;
+
+	~BufferOwner() noexcept
+	{
+		if (buffer)
+			buffer->isAlive.store(false, std::memory_order_release);
+	}
+};
+
+thread_local BufferOwner currentBuffer;
+
+/** Give the current thread an empty buffer for the trace of the given generation, reusing its old buffer if possible
+ * @return false if no memory was left for the events */
+bool resetThreadBuffer(ThreadBuffer*& b, uint64_t g) noexcept
+{
+	try
+	{
+		std::lock_guard lock(buffersMutex);
+		if (!b)
+		{
+			auto newBuffer = std::make_unique<ThreadBuffer>();
+			newBuffer->tid = gettid();
+			buffers.push_back(std::move(newBuffer));
+			b = buffers.back().get();
+		}
+		if (!b->events || b->capacity != bufferCapacity)
+		{
+			b->events.reset();
+			b->capacity = bufferCapacity;
+			b->events = std::make_unique<Event[]>(b->capacity);
+		}
+		else
+		{
+			for (size_t i = 0; i < b->capacity; ++i)
+				b->events[i].sequence.store(0, std::memory_order_relaxed);
+		}
+		b->head.store(0, std::memory_order_relaxed);
+		b->generation = g;
+		// the thread might have been renamed since the last trace
+		if (pthread_getname_np(pthread_self(), b->threadName, sizeof(b->threadName)) != 0)
+			b->threadName[0] = '\0';
+		return true;
+	}
+	catch (const std::bad_alloc&)
+	{
+		// the buffer has no events then, and is reset again with the next event
+		if (b)
+			b->capacity = 0;
+		return false;
+	}
+}
+
+/** Write a string into a JSON document, with quotes */
+void writeJsonString(FILE* f, const char* str) noexcept
+{
+	fputc('"', f);
+	for (const char* c = str; *c; ++c)
+	{
+		if (*c == '"' || *c == '\\')
+			fprintf(f, "\\%c", *c);
+		else if (static_cast<unsigned char>(*c) < 0x20)
+			fprintf(f, "\\u%04x", *c);
+		else
+			fputc(*c, f);
+	}
+	fputc('"', f);
+}
+
+int64_t now() noexcept
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+}
+
+namespace detail
+{
+
+std::atomic<bool> enabled{false};
+
+void record(const char* name, char phase, int64_t frameId) noexcept
+{
+	uint64_t g = generation.load(std::memory_order_acquire);
+	ThreadBuffer*& b = currentBuffer.buffer;
+	if (!b || b->generation != g || b->capacity == 0)
+	{
+		if (!resetThreadBuffer(b, g))
+			return;
+	}
+	uint64_t h = b->head.load(std::memory_order_relaxed);
+	Event& e = b->events[h % b->capacity];
+	e.sequence.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	e.name.store(name, std::memory_order_relaxed);
+	e.timestamp.store(now(), std::memory_order_relaxed);
+	e.frameId.store(frameId, std::memory_order_relaxed);
+	e.phase.store(phase, std::memory_order_relaxed);
+	e.sequence.store(h + 1, std::memory_order_release);
+	b->head.store(h + 1, std::memory_order_release);
+}
+
+}
+
+void start(size_t eventsPerThread) noexcept
+{
+	{
+		std::lock_guard lock(buffersMutex);
+		// the buffers of running threads are reset by the threads themselves, as they might be writing to them
+		buffers.erase(std::remove_if(buffers.begin(), buffers.end(), [] (const std::unique_ptr<ThreadBuffer>& b)
+		{
+			return !b->isAlive.load(std::memory_order_acquire);
+		}), buffers.end());
+		bufferCapacity = std::max(eventsPerThread, size_t(16));
+	}
+	generation.fetch_add(1, std::memory_order_acq_rel);
+	detail::enabled.store(true, std::memory_order_relaxed);
+}
+
+void stop() noexcept
+{
+	detail::enabled.store(false, std::memory_order_relaxed);
+}
+
+bool writeChromeJson(const char* path) noexcept
+{
+	FILE* f = fopen(path, "we");
+	if (!f)
+	{
+		fprintf(stderr, "Writing trace to %s failed: %s\n", path, strerror(errno));
+		return false;
+	}
+	pid_t pid = getpid();
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	bool first = true;
+	uint64_t g = generation.load(std::memory_order_acquire);
+	std::lock_guard lock(buffersMutex);
+	for (auto& b : buffers)
+	{
+		// buffers of earlier traces belong to threads that have not recorded anything since
+		if (b->generation != g || b->capacity == 0)
+			continue;
+		fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+		        first ? "" : ",\n", pid, b->tid);
+		writeJsonString(f, b->threadName);
+		fprintf(f, "}}");
+		first = false;
+
+		uint64_t head = b->head.load(std::memory_order_acquire);
+		uint64_t begin = head > b->capacity ? head - b->capacity : 0;
+		for (uint64_t i = begin; i < head; ++i)
+		{
+			// the owning thread may overwrite the oldest events while we read, those are skipped
+			const Event& e = b->events[i % b->capacity];
+			if (e.sequence.load(std::memory_order_acquire) != i + 1)
+				continue;
+			const char* name = e.name.load(std::memory_order_relaxed);
+			int64_t timestamp = e.timestamp.load(std::memory_order_relaxed);
+			int64_t frameId = e.frameId.load(std::memory_order_relaxed);
+			char phase = e.phase.load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (e.sequence.load(std::memory_order_relaxed) != i + 1)
+				continue;
+			fprintf(f, ",\n{\"name\":");
+			writeJsonString(f, name);
+			fprintf(f, ",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d",
+			        phase, static_cast<double>(timestamp) / 1000, pid, b->tid);
+			if (phase == 'i')
+				fprintf(f, ",\"s\":\"t\"");
+			fprintf(f, ",\"args\":{\"frame\":%" PRIi64 "}}", frameId);
+		}
+	}
+	fprintf(f, "\n]}\n");
+	if (fclose(f) != 0)
+	{
+		fprintf(stderr, "Writing trace to %s failed: %s\n", path, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+}
+
+
+// C interface
+#include <c_common.h>
+
+void screencapture_wayland_startTrace(size_t eventsPerThread)
+{
+	if (eventsPerThread == 0)
+		trace::start();
+	else
+		trace::start(eventsPerThread);
+}
+
+void screencapture_wayland_stopTrace()
+{
+	trace::stop();
+}
+
+int screencapture_wayland_writeTrace(const char* path)
+{
+	return trace::writeChromeJson(path) ? 0 : -1;
+}
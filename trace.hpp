@@ -0,0 +1,83 @@
+/*******************************************************************************
+   Copyright © 2023 by DafabHoid <github@dafaboid.de>
+
+   SPDX-License-Identifier: GPL-3.0-or-later
+*******************************************************************************/
+#ifndef SCREENCAPTURE_TRACE_HPP
+#define SCREENCAPTURE_TRACE_HPP
+
+#include "common.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/** Recording of per-frame activity across the pipeline threads, for viewing in chrome://tracing or Perfetto.
+ *
+ * Events are written into a ring buffer owned by the calling thread, so recording never takes a lock.
+ * While tracing is stopped, recording an event is a single relaxed atomic load. Frames are identified by their
+ * presentation timestamp in microseconds, which stays the same from capture to the encoded packet. */
+namespace trace
+{
+
+namespace detail
+{
+SCW_EXPORT extern std::atomic<bool> enabled;
+SCW_EXPORT void record(const char* name, char phase, int64_t frameId) noexcept;
+}
+
+/** Start recording events.
+ * @param eventsPerThread capacity of each thread's ring buffer, older events are overwritten when it is full */
+SCW_EXPORT void start(size_t eventsPerThread = 1 << 16) noexcept;
+
+/** Stop recording events. The recorded events are kept until start() is called again. */
+SCW_EXPORT void stop() noexcept;
+
+/** Write all recorded events as Chrome trace JSON, which Perfetto can also open.
+ * This can be called while tracing is running.
+ * @return false if the file could not be written */
+SCW_EXPORT bool writeChromeJson(const char* path) noexcept;
+
+inline bool isEnabled() noexcept
+{
+	return detail::enabled.load(std::memory_order_relaxed);
+}
+
+/** Record a single point in time, like a dropped frame
+ * @param name must be a string literal or otherwise outlive the trace */
+inline void instant(const char* name, int64_t frameId) noexcept
+{
+	if (isEnabled()) [[unlikely]]
+		detail::record(name, 'i', frameId);
+}
+
+/** Records the lifetime of this object as a slice of work on a frame
+ * @param name must be a string literal or otherwise outlive the trace */
+class Scope
+{
+	const char* name;
+	int64_t frameId;
+	bool active;
+
+public:
+	Scope(const char* name, int64_t frameId) noexcept
+	: name(name),
+	  frameId(frameId),
+	  active(isEnabled())
+	{
+		if (active) [[unlikely]]
+			detail::record(name, 'B', frameId);
+	}
+
+	Scope(const Scope&) = delete;
+	Scope& operator=(const Scope&) = delete;
+
+	~Scope() noexcept
+	{
+		if (active) [[unlikely]]
+			detail::record(name, 'E', frameId);
+	}
+};
+
+}
+
+#endif //SCREENCAPTURE_TRACE_HPP